@@ -0,0 +1,51 @@
+--
+-- The bucket map for 'tnt_vshard' of nginx, it should be loaded on
+-- vshard routers, e.g.
+--
+--   vshard.router.cfg(cfg)
+--   dofile('vshard_router.lua')
+--
+-- nginx calls nginx_vshard_bucket_map() and gets
+--   [[first_bucket_id, last_bucket_id, "host:port"], ...]
+-- where "host:port" is an URI of a replicaset master.
+--
+
+local vshard = require('vshard')
+
+local function master_uri(replicaset)
+  if replicaset.master == nil then
+    return nil
+  end
+  -- 'user:password@host:port' -> 'host:port'
+  return (replicaset.master.uri:gsub('^.*@', ''))
+end
+
+function nginx_vshard_bucket_map()
+  local owners = {}
+  for uuid, replicaset in pairs(vshard.router.routeall()) do
+    owners[uuid] = master_uri(replicaset)
+  end
+
+  local buckets = vshard.router.buckets_info()
+  local map = {}
+  local first, last, uri
+
+  for bucket_id = 1, vshard.router.bucket_count() do
+    local info = buckets[bucket_id]
+    local owner = info and info.uuid and owners[info.uuid] or nil
+
+    if owner ~= uri then
+      if uri ~= nil then
+        table.insert(map, {first, last, uri})
+      end
+      first, uri = bucket_id, owner
+    end
+    last = bucket_id
+  end
+
+  if uri ~= nil then
+    table.insert(map, {first, last, uri})
+  end
+
+  return map
+end
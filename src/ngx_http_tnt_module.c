@@ -39,8 +39,13 @@
 #include <debug.h>
 #include <tp_ext.h>
 #include <tp_transcode.h>
+#include <tp_probes.h>
 #include <ngx_http_tnt_version.h>
 
+#if (__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 typedef enum ngx_tnt_conf_states {
     NGX_TNT_CONF_ON                  = 1,
@@ -78,6 +83,17 @@ typedef struct ngx_http_tnt_prepared_result {
     ngx_uint_t tuples_count;
     ngx_uint_t update_keys_count;
     ngx_uint_t upsert_tuples_count;
+
+    /** The keys of an IN-list value and the key which is being bound,
+     *  see ngx_http_tnt_format_prepare_in_list()
+     */
+    ngx_array_t *in_keys;
+    ngx_uint_t in_key;
+
+    /** The position of a select from the cursor of the previous page,
+     *  the data is NULL for the first page, see the format's '%%after'
+     */
+    ngx_str_t after;
 }  ngx_http_tnt_prepared_result_t;
 
 
@@ -87,14 +103,395 @@ typedef struct ngx_http_tnt_format_value {
     enum tp_type    type;
     ngx_int_t       update_key:1;
     ngx_int_t       upsert_op:1;
+    ngx_int_t       in_list:1;
+    ngx_int_t       nullable:1;
+    ngx_int_t       array:1;
+    ngx_uint_t      pos;
+    /** A value of a JSON or MsgPack body, which is not a string, see
+     *  ngx_http_tnt_format_prepare_body()
+     */
+    ngx_str_t       mp;
 } ngx_http_tnt_format_value_t;
 
 
+/** An entry of the compiled format index. The index is sorted by name (the
+ *  length first), the slot is the position of the value in format_values.
+ *  See ngx_http_tnt_format_lookup()
+ */
+typedef struct ngx_http_tnt_format_slot {
+    ngx_str_t       name;
+    ngx_uint_t      slot;
+} ngx_http_tnt_format_slot_t;
+
+
+/** The rows of a bulk body, see ngx_http_tnt_bulk_init()
+ */
+typedef struct ngx_http_tnt_bulk {
+    /** The rows transcoded to MsgPack, pos is the next row */
+    const char      *pos, *end;
+    ngx_uint_t      rows;
+    ngx_uint_t      row;
+
+    /** The size of the transcoded rows */
+    size_t          size;
+
+    /** The values and the counts, which are bound by the query args */
+    ngx_http_tnt_format_value_t *values;
+    ngx_uint_t      tuples_count;
+    ngx_uint_t      update_keys_count;
+    ngx_uint_t      upsert_tuples_count;
+} ngx_http_tnt_bulk_t;
+
+
+/** A row of a bulk which is failed, see ngx_http_tnt_bulk_reply()
+ */
+typedef struct ngx_http_tnt_bulk_error {
+    ngx_uint_t      row;
+    int64_t         code;
+    ngx_str_t       message;
+} ngx_http_tnt_bulk_error_t;
+
+
 typedef struct ngx_http_tnt_next_arg {
   u_char *it, *value;
 } ngx_http_tnt_next_arg_t;
 
 
+/** The key of a request for tnt_vshard_key, see ngx_http_tnt_vshard_route()
+ */
+typedef struct {
+    /** params[N] of a JSON body, -1 if not set */
+    ngx_int_t                param;
+
+    /** A name of the format value (tnt_select, tnt_insert, etc.) */
+    ngx_str_t                name;
+
+    ngx_http_complex_value_t *cv;
+
+    /** 'read' or 'write', it is passed to vshard.storage.call() */
+    ngx_str_t                mode;
+} ngx_http_tnt_vshard_key_t;
+
+
+/** A space and an index of tnt_select, tnt_insert, etc. by names, see
+ *  ngx_http_tnt_schema_resolve()
+ */
+typedef struct {
+    /** An empty name means the id of the directive */
+    ngx_str_t                space;
+    ngx_str_t                index;
+
+    /** The ids of the names in the schema of the generation */
+    ngx_uint_t               generation;
+    ngx_uint_t               space_id;
+    ngx_uint_t               index_id;
+} ngx_http_tnt_schema_ref_t;
+
+
+/** Tuples as objects, see tnt_objects and ngx_http_tnt_objects_get()
+ */
+typedef struct {
+    /** ngx_str_t, the fields of the objects, NULL means all fields of the
+     *  space format
+     */
+    ngx_array_t              *names;
+
+    /** The fields of the space in the schema of the generation, they are
+     *  allocated by the snapshot of the worker
+     */
+    ngx_uint_t               generation;
+    ngx_uint_t               space_id;
+    tp_transcode_field_t     *fields;
+    size_t                   nfields;
+
+    /** The maximal size of the keys of an object */
+    size_t                   keys_size;
+} ngx_http_tnt_objects_t;
+
+
+/** A header of tnt_pass_http_request_headers, see ngx_http_tnt_copy_headers()
+ */
+typedef struct {
+    /** The name in lower case and its ngx_hash_key() */
+    ngx_str_t                lowcase;
+    ngx_uint_t               hash;
+
+    /** The name as it's passed to Tarantool, encoded as MsgPack str */
+    ngx_str_t                key;
+} ngx_http_tnt_pass_header_t;
+
+
+/** tnt_fanout, see ngx_http_tnt_fanout_merge()
+ */
+typedef struct {
+    /** A field of rows for the k-way merge, a number (from 1) or a name */
+    ngx_uint_t               sort_field;
+    ngx_str_t                sort_name;
+    ngx_uint_t               desc;
+
+    /** Max number of rows in the reply, 0 - unlimited */
+    ngx_uint_t               limit;
+} ngx_http_tnt_fanout_conf_t;
+
+
+/** The statistics of tnt_stats_zone, see ngx_http_tnt_stats_record().
+ *  The counters are updated by atomics, a node is added under the mutex
+ *  of the zone.
+ */
+#define NGX_HTTP_TNT_STATS_NAME_LEN   64
+#define NGX_HTTP_TNT_STATS_CODES      8
+
+/** A histogram has 8 buckets per power of 2 of microseconds, i.e. the error
+ *  is 12.5%, the last bucket holds everything from about 250 seconds.
+ *  See ngx_http_tnt_stats_bucket().
+ */
+#define NGX_HTTP_TNT_STATS_SUB        8
+#define NGX_HTTP_TNT_STATS_BUCKETS    (NGX_HTTP_TNT_STATS_SUB * 26)
+
+enum ngx_http_tnt_stats_phase {
+    NGX_HTTP_TNT_STATS_CONNECT = 0,
+    NGX_HTTP_TNT_STATS_UPSTREAM,
+    NGX_HTTP_TNT_STATS_TRANSCODE,
+    NGX_HTTP_TNT_STATS_PHASES
+};
+
+enum ngx_http_tnt_stats_kind {
+    NGX_HTTP_TNT_STATS_LOCATION = 0,
+    NGX_HTTP_TNT_STATS_PEER
+};
+
+/** The events of an attempt of the upstream, see ngx_http_tnt_stats_timed()
+ */
+enum ngx_http_tnt_stats_event {
+    NGX_HTTP_TNT_STATS_RETRIED = 0,
+    NGX_HTTP_TNT_STATS_CONNECTED,
+    NGX_HTTP_TNT_STATS_FINISHED
+};
+
+/** The times of an attempt in usec of ngx_http_tnt_stats_clock(), 0 if
+ *  unknown. The attempts are in the order of r->upstream_states.
+ */
+typedef struct {
+    uint64_t                 start;
+    uint64_t                 connected;
+    uint64_t                 end;
+} ngx_http_tnt_stats_time_t;
+
+typedef struct {
+    ngx_atomic_t             count;
+    ngx_atomic_t             sum;
+    ngx_atomic_t             buckets[NGX_HTTP_TNT_STATS_BUCKETS];
+} ngx_http_tnt_stats_hist_t;
+
+typedef struct {
+    /** The code is set before 'used' */
+    ngx_atomic_t             used;
+    ngx_atomic_int_t         code;
+    ngx_atomic_t             count;
+} ngx_http_tnt_stats_code_t;
+
+/** The hot keys of tnt_hot_keys, a count-min sketch and the top keys of a
+ *  location. The sketch is updated by atomics, the top keys are updated and
+ *  read under the spinlock. The counts are halved every period, see
+ *  ngx_http_tnt_hot_add().
+ */
+#define NGX_HTTP_TNT_HOT_DEPTH        4
+#define NGX_HTTP_TNT_HOT_WIDTH        1024
+#define NGX_HTTP_TNT_HOT_TOP_MAX      64
+#define NGX_HTTP_TNT_HOT_PERIOD       60
+
+typedef struct {
+    ngx_uint_t               hash;
+    ngx_uint_t               count;
+    size_t                   len;
+    u_char                   key[NGX_HTTP_TNT_STATS_NAME_LEN];
+} ngx_http_tnt_hot_key_t;
+
+typedef struct {
+    ngx_atomic_t             lock;
+    time_t                   start;
+    time_t                   decayed;
+
+    /** The top has n of max keys, a key is added if it's counted more
+     *  than min
+     */
+    ngx_uint_t               n;
+    ngx_uint_t               max;
+    ngx_atomic_t             min;
+    ngx_http_tnt_hot_key_t   keys[NGX_HTTP_TNT_HOT_TOP_MAX];
+
+    ngx_atomic_t             sketch[NGX_HTTP_TNT_HOT_DEPTH]
+                                   [NGX_HTTP_TNT_HOT_WIDTH];
+} ngx_http_tnt_hot_t;
+
+typedef struct {
+    ngx_uint_t               kind;
+    ngx_uint_t               hash;
+    size_t                   len;
+    u_char                   name[NGX_HTTP_TNT_STATS_NAME_LEN];
+
+    ngx_atomic_t             requests;
+
+    /** 1xx, 2xx, 3xx, 4xx, 5xx */
+    ngx_atomic_t             responses[5];
+
+    /** JSON-RPC errors by their codes, the rest are counted by 'other' */
+    ngx_http_tnt_stats_code_t codes[NGX_HTTP_TNT_STATS_CODES];
+    ngx_atomic_t             other_codes;
+
+    ngx_atomic_t             bytes_in;
+    ngx_atomic_t             bytes_out;
+
+    /** The requests of more than one call and the calls of them */
+    ngx_atomic_t             batches;
+    ngx_atomic_t             batch_calls;
+
+    /** The requests stopped by tnt_max_reply_size, tnt_max_request_memory */
+    ngx_atomic_t             limited;
+
+    ngx_http_tnt_stats_hist_t hist[NGX_HTTP_TNT_STATS_PHASES];
+
+    /** tnt_hot_keys, it's allocated by the first request */
+    ngx_http_tnt_hot_t       *hot;
+} ngx_http_tnt_stats_node_t;
+
+typedef struct {
+    /** The nodes [0, n) are complete, n is incremented under the mutex */
+    ngx_atomic_t             n;
+    ngx_uint_t               max;
+    ngx_http_tnt_stats_node_t nodes[1];
+} ngx_http_tnt_stats_shctx_t;
+
+typedef struct {
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_tnt_stats_shctx_t     *sh;
+} ngx_http_tnt_stats_conf_t;
+
+
+/** The slow requests of tnt_slowlog_zone, a ring of the entries. An entry is
+ *  written and read under the mutex of the zone, see
+ *  ngx_http_tnt_slowlog_record().
+ */
+#define NGX_HTTP_TNT_SLOWLOG_URI_LEN  128
+
+typedef struct {
+    /** From 1, the entries are ordered by it */
+    ngx_uint_t               id;
+
+    time_t                   sec;
+    ngx_msec_t               msec;
+
+    /** In msec, -1 if unknown */
+    ngx_msec_int_t           request_time;
+    ngx_msec_int_t           connect_time;
+    ngx_msec_int_t           upstream_time;
+
+    /** In usec */
+    uint64_t                 transcode_in;
+    uint64_t                 transcode_out;
+
+    off_t                    request_length;
+    size_t                   payload_size;
+    size_t                   json_size;
+    size_t                   replies;
+
+    ngx_uint_t               status;
+    ngx_int_t                error_code;
+    ngx_uint_t               has_error;
+
+    size_t                   method_len;
+    u_char                   method[16];
+    size_t                   uri_len;
+    u_char                   uri[NGX_HTTP_TNT_SLOWLOG_URI_LEN];
+    size_t                   tnt_method_len;
+    u_char                   tnt_method[NGX_HTTP_TNT_STATS_NAME_LEN];
+    size_t                   peer_len;
+    u_char                   peer[NGX_HTTP_TNT_STATS_NAME_LEN];
+
+    /** body_len bytes of the body, then reply_len bytes of the first reply
+     *  of Tarantool
+     */
+    size_t                   body_len;
+    size_t                   reply_len;
+    u_char                   data[1];
+} ngx_http_tnt_slowlog_entry_t;
+
+typedef struct {
+    /** The number of the written entries */
+    ngx_uint_t               n;
+    ngx_uint_t               max;
+    size_t                   sample;
+    size_t                   entry_size;
+    u_char                   entries[1];
+} ngx_http_tnt_slowlog_shctx_t;
+
+typedef struct {
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_tnt_slowlog_shctx_t   *sh;
+    size_t                         sample;
+} ngx_http_tnt_slowlog_conf_t;
+
+
+/** The key of a bucket of tnt_limit is cut to this length */
+#define NGX_HTTP_TNT_RATE_KEY_LEN 64
+
+/** The number of the nodes checked for a key, the oldest of them is
+ *  replaced by a new key
+ */
+#define NGX_HTTP_TNT_RATE_PROBES 8
+
+/** NGX_HTTP_TOO_MANY_REQUESTS of nginx 1.11.13+ */
+#define NGX_HTTP_TNT_TOO_MANY_REQUESTS 429
+
+/** A bucket of tnt_limit, the key is the method and the key of the client
+ */
+typedef struct {
+    uint32_t                 hash;
+    ngx_uint_t               used;
+    ngx_msec_t               last;
+    /** In 1/1000 of a request */
+    ngx_uint_t               excess;
+    size_t                   len;
+    u_char                   key[NGX_HTTP_TNT_RATE_KEY_LEN];
+} ngx_http_tnt_rate_node_t;
+
+typedef struct {
+    ngx_uint_t               n;
+    ngx_http_tnt_rate_node_t nodes[1];
+} ngx_http_tnt_rate_shctx_t;
+
+typedef struct {
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_tnt_rate_shctx_t      *sh;
+    /** In 1/1000 of a request per second */
+    ngx_uint_t                     rate;
+} ngx_http_tnt_rate_conf_t;
+
+/** tnt_limit of a location */
+typedef struct {
+    ngx_shm_zone_t                 *shm_zone;
+    /** ngx_str_t, NULL is any method */
+    ngx_array_t                    *methods;
+    ngx_http_complex_value_t       *key;
+    /** In 1/1000 of a request */
+    ngx_uint_t                     burst;
+} ngx_http_tnt_rate_t;
+
+/** The calls of a bucket in a request, see ngx_http_tnt_rate_check() */
+typedef struct {
+    ngx_http_tnt_rate_t            *rate;
+    /** The method and the key of the client, they are split by '\0' */
+    u_char                         *key;
+    size_t                         len;
+    ngx_uint_t                     calls;
+    /** The excess of the bucket after the calls */
+    ngx_uint_t                     excess;
+} ngx_http_tnt_rate_account_t;
+
+
 /** The structure hold the nginx location variables, e.g. loc_conf.
  */
 typedef struct {
@@ -130,6 +527,11 @@ typedef struct {
      */
     ngx_uint_t               pass_http_request;
 
+    /** ngx_http_tnt_pass_header_t, the headers which are passed by
+     *  tnt_pass_http_request, NULL means all headers
+     */
+    ngx_array_t              *pass_headers;
+
     /** Http REST methods[default GET|PUT]
      *
      *  if incoming HTTP method is in this set, then
@@ -191,3929 +593,17808 @@ typedef struct {
     /** Max allowed select per request */
     ngx_uint_t  select_limit_max;
 
+    /** Max allowed rows of a bulk body per request */
+    ngx_uint_t  bulk_max_rows;
+
     /**  enum tp_iterator_type */
     ngx_uint_t  iter_type;
 
     ngx_array_t            *format_values;
+    ngx_http_tnt_format_slot_t *format_index;
 
     ngx_str_t              limit_name;
     ngx_str_t              offset_name;
     ngx_str_t              iter_type_name;
     ngx_str_t              space_id_name;
     ngx_str_t              index_id_name;
+    ngx_str_t              after_name;
 
     ngx_array_t            *allowed_spaces;
     ngx_array_t            *allowed_indexes;
 
-} ngx_http_tnt_loc_conf_t;
-
+    /** A field of the request which is used for computing a bucket_id,
+     *  see tnt_vshard_key
+     */
+    ngx_http_tnt_vshard_key_t *vshard_key;
 
-/** Upstream states
- */
-enum ctx_state {
-    OK = 0,
+    /** Send the request to each peer of the upstream and merge replies,
+     *  see tnt_fanout
+     */
+    ngx_http_tnt_fanout_conf_t *fanout;
 
-    INPUT_JSON_PARSE_FAILED,
-    INPUT_TO_LARGE,
-    INPUT_EMPTY,
-    INPUT_FMT_CANT_READ_INPUT,
+    /** enum ngx_http_tnt_export_format, see tnt_export */
+    ngx_uint_t             export_format;
 
-    READ_PAYLOAD,
-    READ_BODY,
-    SEND_REPLY
-};
+    /** The names of the space and the index, see tnt_schema */
+    ngx_http_tnt_schema_ref_t *schema_ref;
 
+    /** Tuples as objects, see tnt_objects */
+    ngx_http_tnt_objects_t *objects;
 
-typedef struct ngx_http_tnt_ctx {
+    /** A body of operations is a transaction, see tnt_transaction */
+    ngx_flag_t             transaction;
 
-    /** This is a reference to Tarantool payload data,
-     *  e.g. size of TP message
+    /** The zone of tnt_stats and the node of the location, the node is
+     *  found by a worker, see ngx_http_tnt_stats_location()
      */
-    struct {
-        u_char mem[6];
-        u_char *p, *e;
-    } payload;
+    ngx_shm_zone_t         *stats_zone;
+    ngx_http_tnt_stats_node_t *stats_node;
 
-    enum ctx_state     state;
+    /** The zone of tnt_status */
+    ngx_shm_zone_t         *status_zone;
 
-    /** in_err - the error buffer
-     *  tp_cache - the buffer for store parts of TP message
-     */
-    ngx_buf_t          *in_err, *tp_cache;
+    /** The number of the top keys of tnt_hot_keys, 0 is off */
+    ngx_uint_t             hot_keys;
 
-    /** rest - bytes, until transcoding is end
-     *  payload_size - the payload, as integer value
-     *  rest_batch_size - the number(count), until batch is end
-     *  batch_size - the number, parts in batch
-     */
-    ssize_t            rest, payload_size;
-    int                rest_batch_size, batch_size;
+    /** tnt_max_reply_size and tnt_max_request_memory, 0 is off */
+    size_t                 max_reply_size;
+    size_t                 max_request_memory;
 
-    /** The "Greeting" from the Tarantool
-     */
-    ngx_int_t          greeting:1;
+    /** tnt_limit, ngx_http_tnt_rate_t */
+    ngx_array_t            *rates;
 
-    /** The preset method and its length
-     */
-    u_char             preset_method[128];
-    u_char             preset_method_len;
+    /** The zone and the thresholds of tnt_slowlog, 0 is off */
+    ngx_shm_zone_t         *slowlog_zone;
+    ngx_msec_t             slowlog_time;
+    size_t                 slowlog_size;
 
-    /** User defined format and its values
-     */
-    ngx_array_t *format_values;
+    /** The zone of tnt_slowlog_status */
+    ngx_shm_zone_t         *slowlog_status_zone;
 
-} ngx_http_tnt_ctx_t;
+} ngx_http_tnt_loc_conf_t;
 
-/** Struct for stroring human-readable error message
- */
-typedef struct ngx_http_tnt_error {
-    const ngx_str_t msg;
-    int code;
-} ngx_http_tnt_error_t;
 
-/** ngx_http_tnt_error index
+typedef struct ngx_http_tnt_bg_call_s ngx_http_tnt_bg_call_t;
+
+typedef void (*ngx_http_tnt_bg_call_handler_pt)(ngx_http_tnt_bg_call_t *bc,
+    ngx_int_t rc);
+
+/** A call of a Tarantool function outside of a client request,
+ *  e.g. from a timer. See ngx_http_tnt_bg_call_create().
  */
-enum ngx_http_tnt_error_idx {
-    REQUEST_TOO_LARGE = 0,
-    UNKNOWN_PARSE_ERROR = 1,
-    HTTP_REQUEST_TOO_LARGE = 2,
-    DML_HANDLER_FMT_ERROR = 3,
-    DML_HANDLER_FMT_LIMIT_ERROR = 4,
-};
+struct ngx_http_tnt_bg_call_s {
+    ngx_peer_connection_t            peer;
+    ngx_pool_t                       *pool;
+    ngx_log_t                        *log;
 
-/** Filters */
-static ngx_int_t ngx_http_tnt_filter_init(void *data);
-static ngx_int_t ngx_http_tnt_send_reply(ngx_http_request_t *r,
-        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
-static ngx_int_t ngx_http_tnt_filter_reply(ngx_http_request_t *r,
-        ngx_http_upstream_t *u, ngx_buf_t *b);
-static ngx_int_t ngx_http_tnt_filter(void *data, ssize_t bytes);
+    /** out - an encoded request, in - a greeting and a reply */
+    ngx_buf_t                        *out, *in;
 
-/** Nginx handlers */
-static ngx_int_t ngx_http_tnt_preconfiguration(ngx_conf_t *cf);
-static void *ngx_http_tnt_create_loc_conf(ngx_conf_t *cf);
-static char *ngx_http_tnt_merge_loc_conf(ngx_conf_t *cf, void *parent,
-        void *child);
-static char * ngx_http_tnt_method(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char * ngx_http_tnt_headers_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static ngx_int_t ngx_http_tnt_add_header_in(ngx_http_request_t *r,
-    ngx_http_tnt_header_val_t *hv, ngx_str_t *value);
-static ngx_int_t ngx_http_tnt_process_headers(ngx_http_request_t *r,
-        ngx_http_tnt_loc_conf_t *tlcf);
-static char *ngx_http_tnt_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
-static char *ngx_http_tnt_insert_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static ngx_int_t ngx_http_tnt_set_iter_type(ngx_str_t *v,
-        ngx_uint_t *iter_type);
-static char *ngx_http_tnt_select_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char *ngx_http_tnt_replace_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char *ngx_http_tnt_delete_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char *ngx_http_tnt_update_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char *ngx_http_tnt_upsert_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf);
-static char *ngx_http_tnt_read_array_of_uint(ngx_pool_t *pool,
-        ngx_array_t *arr, ngx_str_t *str, u_char sep);
-static ngx_int_t ngx_http_tnt_test_allowed(ngx_array_t *arr, ngx_uint_t with);
-static char *ngx_http_tnt_allowed_spaces_add(ngx_conf_t *cf,
-        ngx_command_t *cmd, void *conf);
-static char *ngx_http_tnt_allowed_indexes_add(ngx_conf_t *cf,
-        ngx_command_t *cmd, void *conf);
+    ngx_msec_t                       timeout;
 
-/** Ctx */
-static ngx_http_tnt_ctx_t *ngx_http_tnt_create_ctx(ngx_http_request_t *r);
-static void ngx_http_tnt_reset_ctx(ngx_http_tnt_ctx_t *ctx);
+    ngx_http_tnt_bg_call_handler_pt  handler;
+    void                             *data;
 
-/** Input handlers */
-static ngx_int_t ngx_http_tnt_init_handlers(ngx_http_request_t *r,
-        ngx_http_upstream_t *u, ngx_http_tnt_loc_conf_t *tlcf);
-static ngx_int_t ngx_http_tnt_body_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_tnt_query_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_http_tnt_dml_handler(ngx_http_request_t *r);
+    /** A complete reply (including its size), it's valid in the handler
+     */
+    const char                       *reply;
+    size_t                           reply_len;
 
-/** Upstream handlers */
-static ngx_int_t ngx_http_tnt_reinit_request(ngx_http_request_t *r);
-static ngx_int_t ngx_http_tnt_process_header(ngx_http_request_t *r);
-static void ngx_http_tnt_abort_request(ngx_http_request_t *r);
-static void ngx_http_tnt_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
+    unsigned                         greeting:1;
 
-/** Some helpers */
-static ngx_int_t ngx_http_tnt_str_match(ngx_str_t *a, const char *b,
-        size_t len);
-static ngx_int_t ngx_http_tnt_set_err(ngx_http_request_t *r, int errcode,
-        const u_char *msg, size_t msglen);
-#define ngx_http_tnt_set_err_str(r, code, str) \
-    ngx_http_tnt_set_err((r), (code), (str).data, (str).len)
+    /** The handler keeps the connection for the next request, see
+     *  ngx_http_tnt_bg_call_next()
+     */
+    unsigned                         keep:1;
+};
 
-static const ngx_http_tnt_error_t *ngx_http_tnt_get_error_text(ngx_uint_t type);
 
-static ngx_str_t ngx_http_tnt_urldecode(ngx_http_request_t *r, ngx_str_t *src);
-static ngx_int_t ngx_http_tnt_unescape_uri(ngx_http_request_t *r,
-        ngx_str_t *dst, ngx_str_t *src);
+/** The bucket map of tnt_vshard, it's shared between workers
+ */
+typedef struct {
+    /** A time when the map should be refreshed, 0 means 'as soon as
+     *  possible'. A worker which has changed it refreshes the map.
+     */
+    ngx_atomic_t             refresh_at;
 
-static ngx_int_t ngx_http_tnt_encode_query_args(ngx_http_request_t *r,
-        ngx_http_tnt_loc_conf_t *tlcf, struct tp *tp, ngx_uint_t *args_items);
-static ngx_http_tnt_next_arg_t ngx_http_tnt_get_next_arg(u_char *it,
-        u_char *end);
+    /** bucket_id - 1 -> index of the storage peer + 1, 0 means unknown */
+    uint16_t                 buckets[1];
+} ngx_http_tnt_vshard_shctx_t;
 
-static ngx_int_t ngx_http_tnt_wakeup_dying_upstream(ngx_http_request_t *r,
-        ngx_chain_t *out_chain);
 
-static ngx_int_t ngx_http_tnt_send_once(ngx_http_request_t *r,
-        ngx_http_tnt_ctx_t *ctx, ngx_chain_t *out_chain, const u_char *buf,
-        size_t len);
+typedef struct {
+    /** The storage upstream and the router upstream */
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_srv_conf_t   *router;
 
-static ngx_int_t ngx_http_tnt_output_err(ngx_http_request_t *r,
-        ngx_http_tnt_ctx_t *ctx, ngx_int_t code);
+    ngx_uint_t                     buckets;
+    ngx_msec_t                     refresh;
 
-static size_t ngx_http_tnt_overhead(void);
+    /** A router's function which returns the bucket map */
+    ngx_str_t                      func;
 
-static ngx_buf_t *ngx_http_tnt_create_mem_buf(ngx_http_request_t *r,
-        ngx_http_upstream_t *u, size_t size);
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_tnt_vshard_shctx_t    *sh;
 
-static ngx_int_t ngx_http_tnt_output(ngx_http_request_t *r,
-        ngx_http_upstream_t *u, ngx_buf_t *b);
+    ngx_http_upstream_init_peer_pt original_init_peer;
 
-/** Format functions.
- *  Functions are existing for helping to conversation between HTTP
- *  and MsgPack.
- */
-static ngx_int_t ngx_http_tnt_format_read_input(ngx_http_request_t *r,
-        ngx_str_t *dst);
-static char *ngx_http_tnt_format_compile(ngx_conf_t *cf,
-        ngx_http_tnt_loc_conf_t *conf, ngx_str_t *format);
-static ngx_int_t ngx_http_tnt_format_init(ngx_http_tnt_loc_conf_t *conf,
-        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result);
-static ngx_int_t ngx_http_tnt_format_prepare(ngx_http_tnt_loc_conf_t *conf,
-        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result);
-static ngx_int_t ngx_http_tnt_format_prepare_kv(ngx_http_request_t *r,
-        ngx_http_tnt_prepared_result_t *prepared_result,
-        ngx_str_t *key, ngx_str_t *value);
-static u_char * ngx_http_tnt_read_next(ngx_str_t *str, u_char sep);
-static ngx_int_t ngx_http_tnt_format_bind_bad_request(ngx_http_request_t *r,
-        ngx_str_t *name, const char *msg);
-static ngx_int_t ngx_http_tnt_format_bind_operation(ngx_http_request_t *r,
-        struct tp *tp, ngx_str_t *name, ngx_str_t *val);
+    /** Round-robin over the routers */
+    ngx_uint_t                     router_next;
 
-static ngx_int_t ngx_http_tnt_format_bind(ngx_http_request_t *r,
-        ngx_http_tnt_prepared_result_t *prepared_result, struct tp *tp);
+    ngx_event_t                    refresh_ev;
+} ngx_http_tnt_vshard_conf_t;
 
-/** Module's objects {{{
+
+/** The schema of tnt_schema, it's shared between workers
  */
+typedef struct {
+    /** See ngx_http_tnt_vshard_shctx_t */
+    ngx_atomic_t             refresh_at;
 
-/** A set of allowed REST methods */
-static const ngx_uint_t ngx_http_tnt_allowed_methods =
-    (NGX_HTTP_POST|NGX_HTTP_GET|NGX_HTTP_PUT|NGX_HTTP_PATCH|NGX_HTTP_DELETE);
+    /** The newest schema version of replies, it's refreshed if it isn't
+     *  the version of the snapshot
+     */
+    ngx_atomic_t             wanted;
 
+    /** It's incremented by each snapshot, workers reload the snapshot if
+     *  it's changed
+     */
+    ngx_atomic_t             generation;
+    ngx_atomic_t             version;
 
-static ngx_conf_bitmask_t  ngx_http_tnt_next_upstream_masks[] = {
-    { ngx_string("error"), NGX_HTTP_UPSTREAM_FT_ERROR },
-    { ngx_string("timeout"), NGX_HTTP_UPSTREAM_FT_TIMEOUT },
-    { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
-    { ngx_string("off"), NGX_HTTP_UPSTREAM_FT_OFF },
-    { ngx_null_string, 0 }
-};
+    /** The tuples of _vspace and _vindex, two MsgPack arrays */
+    u_char                   *data;
+    size_t                   len;
+} ngx_http_tnt_schema_shctx_t;
 
 
-static ngx_conf_bitmask_t  ngx_http_tnt_pass_http_request_masks[] = {
-    { ngx_string("on"), NGX_TNT_CONF_ON },
-    { ngx_string("off"), NGX_TNT_CONF_OFF },
-    { ngx_string("parse_args"), NGX_TNT_CONF_PARSE_ARGS },
-    { ngx_string("unescape"), NGX_TNT_CONF_UNESCAPE },
-    { ngx_string("pass_body"), NGX_TNT_CONF_PASS_BODY },
-    { ngx_string("pass_headers_out"), NGX_TNT_CONF_PASS_HEADERS_OUT },
-    { ngx_string("parse_urlencoded"), NGX_TNT_CONF_PARSE_URLENCODED },
-    { ngx_string("pass_subrequest_uri"), NGX_TNT_CONF_PASS_SUBREQUEST_URI },
-    { ngx_null_string, 0 }
-};
+typedef struct {
+    ngx_uint_t               id;
+    ngx_str_t                name;
+} ngx_http_tnt_schema_index_t;
 
 
-static ngx_conf_bitmask_t  ngx_http_tnt_methods[] = {
-    { ngx_string("get"), NGX_HTTP_GET },
-    { ngx_string("post"), NGX_HTTP_POST },
-    { ngx_string("put"), NGX_HTTP_PUT },
-    { ngx_string("patch"), NGX_HTTP_PATCH },
-    { ngx_string("delete"), NGX_HTTP_DELETE },
-    { ngx_string("all"), (NGX_CONF_BITMASK_SET
-                          |NGX_HTTP_GET
-                          |NGX_HTTP_POST
-                          |NGX_HTTP_PUT
-                          |NGX_HTTP_PATCH
-                          |NGX_HTTP_DELETE) },
-    { ngx_null_string, 0 }
-};
+typedef struct {
+    ngx_uint_t               id;
+    ngx_str_t                name;
 
+    /** ngx_str_t, the names of the fields of the space format */
+    ngx_array_t              fields;
 
-static ngx_command_t  ngx_http_tnt_commands[] = {
+    /** ngx_http_tnt_schema_index_t */
+    ngx_array_t              indexes;
+} ngx_http_tnt_schema_space_t;
 
-    { ngx_string("tnt_pass"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
-      ngx_http_tnt_pass,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
 
-    { ngx_string("tnt_connect_timeout"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_msec_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.connect_timeout),
-      NULL },
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *uscf;
 
-    { ngx_string("tnt_send_timeout"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_msec_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.send_timeout),
-      NULL },
+    ngx_msec_t                     refresh;
 
-    { ngx_string("tnt_read_timeout"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_msec_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.read_timeout),
-      NULL },
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_tnt_schema_shctx_t    *sh;
 
-    { ngx_string("tnt_buffer_size"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.buffer_size),
-      NULL },
+    /** Round-robin over the peers */
+    ngx_uint_t                     peer_next;
 
-    { ngx_string("tnt_next_upstream"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
-      ngx_conf_set_bitmask_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream),
-      &ngx_http_tnt_next_upstream_masks },
+    ngx_event_t                    refresh_ev;
 
-    { ngx_string("tnt_next_upstream_timeout"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_msec_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream_timeout),
-      NULL },
+    /** The tuples of _vspace of a refresh and their schema version */
+    ngx_str_t                      fetched;
+    uint32_t                       fetched_version;
 
-    { ngx_string("tnt_next_upstream_tries"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_num_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream_tries),
-      NULL },
+    /** The snapshot of the worker, it's parsed from sh->data */
+    ngx_uint_t                     generation;
+    ngx_pool_t                     *pool;
+    ngx_array_t                    *spaces;
+} ngx_http_tnt_schema_conf_t;
 
-    { ngx_string("tnt_in_multiplier"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, in_multiplier),
-      NULL },
 
-    { ngx_string("tnt_out_multiplier"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, out_multiplier),
-      NULL },
+typedef struct ngx_http_tnt_mux_conf_s ngx_http_tnt_mux_conf_t;
 
-    { ngx_string("tnt_method"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
-      ngx_http_tnt_method,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+/** A connection of tnt_multiplex, it's shared by all requests of a worker
+ */
+typedef struct {
+    ngx_http_tnt_mux_conf_t        *conf;
 
-    { ngx_string("tnt_pass_http_request_buffer_size"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, pass_http_request_buffer_size),
-      NULL },
+    /** An index of the peer in the upstream */
+    ngx_uint_t                     index;
 
-    { ngx_string("tnt_pass_http_request"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF
-          |NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
-      ngx_conf_set_bitmask_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, pass_http_request),
-      &ngx_http_tnt_pass_http_request_masks },
+    ngx_peer_connection_t          peer;
 
-    { ngx_string("tnt_http_rest_methods"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
-      ngx_conf_set_bitmask_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, http_rest_methods),
-      &ngx_http_tnt_methods },
+    /** out - requests to write, in - replies to read */
+    ngx_buf_t                      out, in;
 
-    { ngx_string("tnt_pure_result"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_bitmask_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, pure_result),
-      &ngx_http_tnt_pass_http_request_masks },
+    /** Requests which wait for a reply, the key is the sync */
+    ngx_rbtree_t                   requests;
+    ngx_rbtree_node_t              sentinel;
 
-    { ngx_string("tnt_multireturn_skip_count"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF
-          |NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, multireturn_skip_count),
-      NULL },
+    unsigned                       greeting:1;
+} ngx_http_tnt_mux_conn_t;
 
-    { ngx_string("tnt_http_methods"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
-      ngx_conf_set_bitmask_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, http_methods),
-      &ngx_http_tnt_methods },
 
-    { ngx_string("tnt_set_header"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
-      ngx_http_tnt_headers_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+struct ngx_http_tnt_mux_conf_s {
+    ngx_http_upstream_srv_conf_t   *uscf;
 
-    { ngx_string("tnt_insert"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE2,
-      ngx_http_tnt_insert_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+    /** Connections per peer in each worker */
+    ngx_uint_t                     connections;
 
-    { ngx_string("tnt_select"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE6,
-      ngx_http_tnt_select_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+    /** peers * connections, a worker creates it on demand */
+    ngx_http_tnt_mux_conn_t        *conns;
+    ngx_uint_t                     nconns;
 
-    { ngx_string("tnt_replace"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE2,
-      ngx_http_tnt_replace_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+    ngx_uint_t                     next;
+    uint32_t                       sync;
+};
 
-    { ngx_string("tnt_delete"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
-      ngx_http_tnt_delete_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
 
-    { ngx_string("tnt_update"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
-      ngx_http_tnt_update_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+/** A request of tnt_multiplex
+ */
+typedef struct ngx_http_tnt_mux_req_s ngx_http_tnt_mux_req_t;
 
-    { ngx_string("tnt_upsert"),
-      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
-      ngx_http_tnt_upsert_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+struct ngx_http_tnt_mux_req_s {
+    /** node.key is the sync on the connection */
+    ngx_rbtree_node_t              node;
 
-    { ngx_string("tnt_select_limit_max"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_tnt_loc_conf_t, select_limit_max),
-      NULL },
+    ngx_http_request_t             *request;
+    ngx_http_tnt_mux_conn_t        *conn;
 
-    { ngx_string("tnt_allowed_spaces"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_http_tnt_allowed_spaces_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+    /** The sync of the client */
+    uint32_t                       sync;
 
-    { ngx_string("tnt_allowed_indexes"),
-      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_http_tnt_allowed_indexes_add,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      0,
-      NULL },
+    ngx_event_t                    timeout;
 
-      ngx_null_command
+    /** See ngx_http_tnt_mux_fail() */
+    ngx_http_tnt_mux_req_t         *next;
 };
 
 
-static ngx_http_module_t  ngx_http_tnt_module_ctx = {
-    ngx_http_tnt_preconfiguration,  /* preconfiguration */
-    NULL,                           /* postconfiguration */
+/** A pre-warmed connection of tnt_prewarm
+ */
+typedef struct {
+    ngx_connection_t               *connection;
 
-    NULL,                           /* create main configuration */
-    NULL,                           /* init main configuration */
+    struct sockaddr                *sockaddr;
+    socklen_t                      socklen;
+    ngx_str_t                      *name;
 
-    NULL,                           /* create server configuration */
-    NULL,                           /* merge server configuration */
+    /** An index of the peer in the upstream */
+    ngx_uint_t                     index;
 
-    ngx_http_tnt_create_loc_conf,   /* create location configuration */
-    ngx_http_tnt_merge_loc_conf     /* merge location configuration */
-};
+    u_char                         greeting[128];
+    size_t                         greeting_len;
 
+    /** The greeting has been read, the connection waits for a request */
+    unsigned                       ready:1;
+} ngx_http_tnt_prewarm_conn_t;
 
-ngx_module_t  ngx_http_tnt_module = {
-    NGX_MODULE_V1,
-    &ngx_http_tnt_module_ctx,   /* module context */
-    ngx_http_tnt_commands,      /* module directives */
-    NGX_HTTP_MODULE,            /* module type */
-    NULL,                       /* init master */
-    NULL,                       /* init module */
-    NULL,                       /* init process */
-    NULL,                       /* init thread */
-    NULL,                       /* exit thread */
-    NULL,                       /* exit process */
-    NULL,                       /* exit master */
-    NGX_MODULE_V1_PADDING
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *uscf;
+
+    /** Connections per peer in each worker */
+    ngx_uint_t                     connections;
+
+    /** peers * connections, a worker creates it on demand */
+    ngx_http_tnt_prewarm_conn_t    *conns;
+    ngx_uint_t                     nconns;
+
+    ngx_http_upstream_init_pt      original_init_upstream;
+    ngx_http_upstream_init_peer_pt original_init_peer;
+
+    ngx_event_t                    ev;
+} ngx_http_tnt_prewarm_conf_t;
+
+
+typedef struct {
+    ngx_http_tnt_prewarm_conf_t    *conf;
+
+    void                           *data;
+    ngx_event_get_peer_pt          original_get_peer;
+    ngx_event_free_peer_pt         original_free_peer;
+} ngx_http_tnt_prewarm_peer_data_t;
+
+
+/** The number of queues of tnt_concurrency, clients are hashed into them */
+#define NGX_HTTP_TNT_LIMIT_FLOWS 64
+
+/** tnt_concurrency, the state is per worker
+ */
+typedef struct {
+    ngx_uint_t                     min, max;
+    ngx_uint_t                     queue_max;
+    ngx_msec_t                     queue_timeout;
+    ngx_http_complex_value_t       *key;
+
+    /** The current limit, it's between min and max */
+    double                         limit;
+
+    ngx_uint_t                     inflight, queued;
+
+    /** The minimal RTT of the previous and the current windows */
+    ngx_msec_t                     rtt_min, window_min;
+    ngx_msec_t                     window_start, decreased_at;
+
+    ngx_uint_t                     next_flow;
+    ngx_queue_t                    flows[NGX_HTTP_TNT_LIMIT_FLOWS];
+
+    /** Starts queued requests, see ngx_http_tnt_limit_release() */
+    ngx_event_t                    ev;
+} ngx_http_tnt_limit_conf_t;
+
+
+typedef struct {
+    ngx_queue_t                    queue;
+
+    ngx_http_request_t             *request;
+    ngx_http_tnt_limit_conf_t      *conf;
+
+    ngx_msec_t                     start;
+    ngx_event_t                    timeout;
+
+    unsigned                       queued:1;
+    unsigned                       active:1;
+} ngx_http_tnt_limit_req_t;
+
+
+/** The features of IPROTO_ID which are required by tnt_transaction */
+#define NGX_HTTP_TNT_TX_FEATURES ((1ULL << 0) | (1ULL << 1))
+
+enum ngx_http_tnt_tx_streams {
+    NGX_HTTP_TNT_TX_UNKNOWN = 0,
+    NGX_HTTP_TNT_TX_ON,
+    NGX_HTTP_TNT_TX_OFF
+};
+
+/** tnt_transaction, the result of the IPROTO_ID negotiation is per worker
+ */
+typedef struct {
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_uint_t                     peer_next;
+
+    /** enum ngx_http_tnt_tx_streams */
+    ngx_uint_t                     streams;
+
+    /** Stream ids are unique per connection, these ones are per worker */
+    uint64_t                       stream_id;
+
+    ngx_event_t                    negotiate_ev;
+} ngx_http_tnt_tx_conf_t;
+
+
+typedef struct {
+    ngx_http_tnt_vshard_conf_t     *vshard;
+    ngx_http_tnt_schema_conf_t     *schema;
+    ngx_http_tnt_mux_conf_t        *mux;
+    ngx_http_tnt_prewarm_conf_t    *prewarm;
+    ngx_http_tnt_limit_conf_t      *limit;
+    ngx_http_tnt_tx_conf_t         *tx;
+} ngx_http_tnt_srv_conf_t;
+
+
+/** A reply of a peer in ngx_http_tnt_fanout_merge()
+ */
+typedef struct {
+    const char                     *p;
+    const char                     *key;
+    uint32_t                       left;
+} ngx_http_tnt_fanout_cur_t;
+
+
+/** A fan-out request, calls[i] and replies[i] are for i-th peer
+ */
+typedef struct {
+    ngx_http_request_t             *request;
+    ngx_http_tnt_fanout_conf_t     *conf;
+
+    ngx_uint_t                     n, pending;
+    ngx_http_tnt_bg_call_t         **calls;
+    ngx_str_t                      *replies;
+} ngx_http_tnt_fanout_t;
+
+
+/** tnt_export */
+enum ngx_http_tnt_export_format {
+    NGX_HTTP_TNT_EXPORT_OFF = 0,
+    NGX_HTTP_TNT_EXPORT_NDJSON,
+    NGX_HTTP_TNT_EXPORT_JSON
+};
+
+
+/** An export of a space, see ngx_http_tnt_export_init().
+ *
+ *  The select of the request is the template of the pages, each page is
+ *  selected after the position of the previous one.
+ */
+typedef struct {
+    ngx_http_request_t             *request;
+    ngx_http_tnt_bg_call_t         *call;
+
+    ngx_uint_t                     format;
+
+    /** The select, key is the encoded key of the select */
+    uint32_t                       space, index, offset, iterator, limit;
+    ngx_str_t                      key;
+
+    /** The next request and the page which is sent to the client */
+    ngx_buf_t                      *out;
+    ngx_buf_t                      *page;
+    ngx_chain_t                    cl;
+
+    ngx_uint_t                     pages, rows;
+    unsigned                       done:1;
+} ngx_http_tnt_export_t;
+
+
+/** An operation of a transaction, see ngx_http_tnt_tx_parse().
+ *  space, index - the names, they are resolved by tnt_schema
+ *  tuple, key, ops - MsgPack arrays of the body
+ */
+typedef struct {
+    ngx_uint_t                     type;
+    ngx_uint_t                     space_id, index_id;
+    ngx_uint_t                     limit, offset;
+    ngx_str_t                      space, index;
+    const char                     *tuple, *tuple_end;
+    const char                     *key, *key_end;
+    const char                     *ops, *ops_end;
+    unsigned                       has_space:1;
+} ngx_http_tnt_tx_op_t;
+
+
+typedef struct {
+    ngx_http_tnt_vshard_conf_t     *vcf;
+    ngx_http_request_t             *request;
+
+    /** Data of the original balancer, i.e. round-robin */
+    void                           *data;
+    ngx_event_get_peer_pt          original_get_peer;
+    ngx_event_free_peer_pt         original_free_peer;
+
+    /** The current peer is a router */
+    unsigned                       router:1;
+} ngx_http_tnt_vshard_peer_data_t;
+
+
+/** Upstream states
+ */
+enum ctx_state {
+    OK = 0,
+
+    INPUT_JSON_PARSE_FAILED,
+    INPUT_TO_LARGE,
+    INPUT_EMPTY,
+    INPUT_FMT_CANT_READ_INPUT,
+    INPUT_VSHARD_CANT_ROUTE,
+    INPUT_VSHARD_UNKNOWN_BUCKET,
+    INPUT_SCHEMA_UNKNOWN,
+    INPUT_TX_UNAVAILABLE,
+    INPUT_RATE_LIMITED,
+
+    READ_PAYLOAD,
+    READ_BODY,
+    SEND_REPLY
+};
+
+
+/** The body of a DML request, see ngx_http_tnt_dml_body_type()
+ */
+enum ngx_http_tnt_dml_body {
+    DML_BODY_URLENCODED = 0,
+    DML_BODY_JSON,
+    DML_BODY_MSGPACK,
+    DML_BODY_NDJSON
+};
+
+
+typedef struct ngx_http_tnt_ctx {
+
+    /** This is a reference to Tarantool payload data,
+     *  e.g. size of TP message
+     */
+    struct {
+        u_char mem[6];
+        u_char *p, *e;
+    } payload;
+
+    enum ctx_state     state;
+
+    /** in_err - the error buffer
+     *  tp_cache - the buffer for store parts of TP message
+     */
+    ngx_buf_t          *in_err, *tp_cache;
+
+    /** rest - bytes, until transcoding is end
+     *  payload_size - the payload, as integer value
+     *  rest_batch_size - the number(count), until batch is end
+     *  batch_size - the number, parts in batch
+     */
+    ssize_t            rest, payload_size;
+    int                rest_batch_size, batch_size;
+
+    /** The "Greeting" from the Tarantool
+     */
+    ngx_int_t          greeting:1;
+
+    /** The map of tnt_pass_http_request doesn't fit, see
+     *  ngx_http_tnt_encode_request_data()
+     */
+    unsigned           request_data_failed:1;
+
+    /** A reply of a transaction, an IN-list or a bulk is skipped, so the
+     *  rest of them is skipped too, see ngx_http_tnt_reply_limited()
+     */
+    unsigned           reply_limited:1;
+
+    /** The preset method and its length
+     */
+    u_char             preset_method[128];
+    u_char             preset_method_len;
+
+    /** User defined format and its values, a copy of the conf's
+     *  format_values made by ngx_http_tnt_format_init()
+     */
+    ngx_http_tnt_format_value_t *format_values;
+    ngx_uint_t                  format_nvalues;
+
+    /** enum ngx_http_tnt_dml_body */
+    ngx_uint_t                  dml_body;
+
+    /** An export of tnt_export, it's not reset by ngx_http_tnt_reset_ctx()
+     */
+    ngx_http_tnt_export_t       *export;
+
+    /** vshard routing, see ngx_http_tnt_vshard_route().
+     *
+     *  bucket_id - 0 if the request isn't routed
+     *  peer - the index of the storage peer, -1 means 'via a router'
+     *  func, args, sync - the original call, NULL for DML
+     *  router_bufs - the call wrapped by vshard.router.call()
+     *
+     *  NOTE These fields are not reset by ngx_http_tnt_reset_ctx()
+     */
+    struct {
+        ngx_uint_t      bucket_id;
+        ngx_int_t       peer;
+        const char      *func, *args;
+        uint32_t        func_len, args_len;
+        uint32_t        sync;
+        ngx_str_t       mode;
+        ngx_chain_t     *router_bufs;
+        unsigned        wrong_bucket:1;
+    } vshard;
+
+    /** A slot of tnt_concurrency, it's not reset by ngx_http_tnt_reset_ctx()
+     */
+    ngx_http_tnt_limit_req_t *limit;
+
+    /** The request encoded by ngx_http_tnt_rate_init(), it's not reset by
+     *  ngx_http_tnt_reset_ctx()
+     */
+    ngx_chain_t              *rate_bufs;
+
+    /** IN-list select, see ngx_http_tnt_in_list_reply().
+     *
+     *  n - the number of the selects, 0 if the request isn't an IN-list
+     *  replies - the replies by their sync, i.e. in the order of the keys
+     *  received - the number of the received replies
+     *
+     *  NOTE These fields are not reset by ngx_http_tnt_reset_ctx()
+     */
+    struct {
+        ngx_uint_t      n;
+        ngx_str_t       *replies;
+        ngx_uint_t      received;
+    } in_list;
+
+    /** Bulk insert, replace or upsert, see ngx_http_tnt_bulk_reply().
+     *
+     *  n - the number of the rows, 0 if the request isn't a bulk
+     *  received - the number of the received replies
+     *  ok - the number of the rows which are written
+     *  errors - ngx_http_tnt_bulk_error_t of the failed rows
+     *
+     *  NOTE These fields are not reset by ngx_http_tnt_reset_ctx()
+     */
+    struct {
+        ngx_uint_t      n;
+        ngx_uint_t      received;
+        ngx_uint_t      ok;
+        ngx_array_t     *errors;
+    } bulk;
+
+    /** The space of a DML request, see tnt_objects */
+    ngx_uint_t          space_id;
+
+    /** A transaction, see ngx_http_tnt_tx_reply().
+     *
+     *  n - the number of the operations, 0 if the request isn't
+     *      a transaction
+     *  replies - the replies by their sync, i.e. BEGIN and the operations
+     *  received - the number of the received replies
+     *  open - the transaction isn't committed, i.e. the connection
+     *         shouldn't be kept
+     *  commit - COMMIT has been sent
+     *
+     *  NOTE These fields are not reset by ngx_http_tnt_reset_ctx()
+     */
+    struct {
+        ngx_uint_t      n;
+        ngx_str_t       *replies;
+        ngx_uint_t      received;
+        uint64_t        stream_id;
+        unsigned        open:1;
+        unsigned        commit:1;
+    } tx;
+
+    /** tnt_stats and the $tnt_* variables. The times of transcoding are
+     *  in usec, see ngx_http_tnt_stats_transcoded(). The sizes are in bytes,
+     *  replies is a number of the replies of Tarantool, memory is the pool
+     *  memory of the buffers of the module, see tnt_max_request_memory.
+     *
+     *  NOTE These fields are not reset by ngx_http_tnt_reset_ctx()
+     */
+    struct {
+        uint64_t        transcode_in;
+        uint64_t        transcode_out;
+        size_t          payload_size;
+        size_t          json_size;
+        size_t          replies;
+        size_t          memory;
+        uint64_t        sync;
+        ngx_int_t       error_code;
+        /** The sample of the first reply for tnt_slowlog */
+        ngx_str_t       reply;
+        /** The attempts of the upstream, see ngx_http_tnt_stats_timed().
+         *  start is the time when the request has been created.
+         */
+        ngx_array_t     *times;
+        uint64_t        start;
+        ngx_int_t       (*create_request)(ngx_http_request_t *r);
+        unsigned        transcoded_in:1;
+        unsigned        transcoded_out:1;
+        unsigned        has_sync:1;
+        unsigned        has_error:1;
+    } stats;
+
+} ngx_http_tnt_ctx_t;
+
+/** Struct for stroring human-readable error message
+ */
+typedef struct ngx_http_tnt_error {
+    const ngx_str_t msg;
+    int code;
+} ngx_http_tnt_error_t;
+
+/** ngx_http_tnt_error index
+ */
+enum ngx_http_tnt_error_idx {
+    REQUEST_TOO_LARGE = 0,
+    UNKNOWN_PARSE_ERROR = 1,
+    HTTP_REQUEST_TOO_LARGE = 2,
+    DML_HANDLER_FMT_ERROR = 3,
+    DML_HANDLER_FMT_LIMIT_ERROR = 4,
+    VSHARD_NO_KEY = 5,
+    VSHARD_BATCH_ERROR = 6,
+    VSHARD_UNKNOWN_BUCKET = 7,
+    FANOUT_BATCH_ERROR = 8,
+    MUX_BATCH_ERROR = 9,
+    DML_BODY_ERROR = 10,
+    BULK_ROWS_ERROR = 11,
+    EXPORT_BATCH_ERROR = 12,
+    SCHEMA_UNKNOWN = 13,
+    TX_UNKNOWN = 14,
+    TX_UNSUPPORTED = 15,
+    TX_OPS_ERROR = 16,
+    REQUEST_MEMORY_LIMIT = 17,
+    REPLY_SIZE_LIMIT = 18,
+    RATE_LIMITED = 19,
+    CONCURRENCY_LIMIT = 20,
 };
+
+/** Filters */
+static ngx_int_t ngx_http_tnt_filter_init(void *data);
+static ngx_int_t ngx_http_tnt_set_cursor(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, tp_transcode_t *tc);
+static ngx_int_t ngx_http_tnt_send_reply(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+static ngx_int_t ngx_http_tnt_filter_reply(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_buf_t *b);
+static ngx_int_t ngx_http_tnt_filter(void *data, ssize_t bytes);
+
+/** Nginx handlers */
+static ngx_int_t ngx_http_tnt_preconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_tnt_postconfiguration(ngx_conf_t *cf);
+static void *ngx_http_tnt_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_tnt_merge_loc_conf(ngx_conf_t *cf, void *parent,
+        void *child);
+static char * ngx_http_tnt_method(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char * ngx_http_tnt_headers_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_pass_headers(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_add_header_in(ngx_http_request_t *r,
+    ngx_http_tnt_header_val_t *hv, ngx_str_t *value);
+static ngx_int_t ngx_http_tnt_process_headers(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf);
+static char *ngx_http_tnt_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_tnt_insert_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_set_iter_type(ngx_str_t *v,
+        ngx_uint_t *iter_type);
+static char *ngx_http_tnt_select_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_replace_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_delete_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_update_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_upsert_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_read_array_of_uint(ngx_pool_t *pool,
+        ngx_array_t *arr, ngx_str_t *str, u_char sep);
+static ngx_int_t ngx_http_tnt_test_allowed(ngx_array_t *arr, ngx_uint_t with);
+static char *ngx_http_tnt_allowed_spaces_add(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+static char *ngx_http_tnt_allowed_indexes_add(ngx_conf_t *cf,
+        ngx_command_t *cmd, void *conf);
+
+/** Ctx */
+static ngx_http_tnt_ctx_t *ngx_http_tnt_create_ctx(ngx_http_request_t *r);
+static void ngx_http_tnt_reset_ctx(ngx_http_tnt_ctx_t *ctx);
+
+/** Input handlers */
+static ngx_int_t ngx_http_tnt_init_handlers(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_loc_conf_t *tlcf);
+static ngx_int_t ngx_http_tnt_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tnt_query_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tnt_dml_handler(ngx_http_request_t *r);
+
+/** Upstream handlers */
+static ngx_int_t ngx_http_tnt_reinit_request(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tnt_process_header(ngx_http_request_t *r);
+static void ngx_http_tnt_abort_request(ngx_http_request_t *r);
+static void ngx_http_tnt_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
+
+/** Some helpers */
+static ngx_int_t ngx_http_tnt_str_match(ngx_str_t *a, const char *b,
+        size_t len);
+static ngx_int_t ngx_http_tnt_set_err(ngx_http_request_t *r, int errcode,
+        const u_char *msg, size_t msglen);
+#define ngx_http_tnt_set_err_str(r, code, str) \
+    ngx_http_tnt_set_err((r), (code), (str).data, (str).len)
+
+static const ngx_http_tnt_error_t *ngx_http_tnt_get_error_text(ngx_uint_t type);
+
+static u_char *ngx_http_tnt_find2(u_char *p, u_char *end, u_char c1,
+        u_char c2);
+static u_char *ngx_http_tnt_urldecode_to(u_char *dst, u_char *src,
+        u_char *end);
+static ngx_str_t ngx_http_tnt_urldecode(ngx_http_request_t *r, ngx_str_t *src);
+static ngx_int_t ngx_http_tnt_unescape_uri(ngx_http_request_t *r,
+        ngx_str_t *dst, ngx_str_t *src);
+static ngx_int_t ngx_http_tnt_encode_unescaped_str(struct tp *tp,
+        u_char *src, size_t len);
+
+static ngx_int_t ngx_http_tnt_encode_query_args(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, struct tp *tp, ngx_uint_t *args_items);
+static ngx_http_tnt_next_arg_t ngx_http_tnt_get_next_arg(u_char *it,
+        u_char *end);
+
+static ngx_int_t ngx_http_tnt_wakeup_dying_upstream(ngx_http_request_t *r,
+        ngx_chain_t *out_chain);
+
+static ngx_int_t ngx_http_tnt_send_once(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_chain_t *out_chain, const u_char *buf,
+        size_t len);
+
+static ngx_int_t ngx_http_tnt_output_err(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_int_t code);
+
+static size_t ngx_http_tnt_overhead(void);
+
+static ngx_buf_t *ngx_http_tnt_create_mem_buf(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, size_t size);
+
+static ngx_int_t ngx_http_tnt_output(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_buf_t *b);
+
+/** Format functions.
+ *  Functions are existing for helping to conversation between HTTP
+ *  and MsgPack.
+ */
+static ngx_int_t ngx_http_tnt_format_read_input(ngx_http_request_t *r,
+        ngx_str_t *dst);
+static char *ngx_http_tnt_format_compile(ngx_conf_t *cf,
+        ngx_http_tnt_loc_conf_t *conf, ngx_str_t *format);
+static char *ngx_http_tnt_format_compile_mods(
+        ngx_http_tnt_format_value_t *val, u_char *p, u_char *end);
+static ngx_int_t ngx_http_tnt_format_pos_cmp(const void *one,
+        const void *two);
+static char *ngx_http_tnt_format_compile_pos(ngx_http_tnt_loc_conf_t *conf,
+        ngx_uint_t first);
+static ngx_int_t ngx_http_tnt_format_index_cmp(const void *one,
+        const void *two);
+static char *ngx_http_tnt_format_compile_index(ngx_conf_t *cf,
+        ngx_http_tnt_loc_conf_t *conf);
+static ngx_http_tnt_format_value_t *ngx_http_tnt_format_lookup(
+        ngx_http_tnt_loc_conf_t *conf, ngx_http_tnt_ctx_t *ctx,
+        ngx_str_t *name);
+static ngx_int_t ngx_http_tnt_format_init(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result);
+static ngx_int_t ngx_http_tnt_format_prepare(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result);
+static ngx_int_t ngx_http_tnt_format_prepare_kv(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_str_t *key, ngx_str_t *value);
+static void ngx_http_tnt_format_set_value(
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value);
+static ngx_int_t ngx_http_tnt_format_read_body(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_str_t *doc);
+static ngx_int_t ngx_http_tnt_format_prepare_body(
+        ngx_http_tnt_loc_conf_t *conf, ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result);
+static ngx_int_t ngx_http_tnt_format_bind_mp_scalar(ngx_http_request_t *r,
+        struct tp *tp, ngx_http_tnt_format_value_t *fmt_val, const char **p);
+static ngx_int_t ngx_http_tnt_format_bind_mp(ngx_http_request_t *r,
+        struct tp *tp, ngx_http_tnt_format_value_t *fmt_val);
+static ngx_int_t ngx_http_tnt_format_prepare_doc(
+        ngx_http_tnt_loc_conf_t *conf, ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result, ngx_str_t *doc);
+static ngx_int_t ngx_http_tnt_format_prepare_after(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_str_t *key, ngx_str_t *value);
+static ngx_int_t ngx_http_tnt_format_prepare_in_list(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value);
+static u_char * ngx_http_tnt_read_next(ngx_str_t *str, u_char sep);
+static ngx_int_t ngx_http_tnt_format_bind_bad_request(ngx_http_request_t *r,
+        ngx_str_t *name, const char *msg);
+static ngx_int_t ngx_http_tnt_format_bind_operation(ngx_http_request_t *r,
+        struct tp *tp, ngx_str_t *name, ngx_str_t *val);
+
+static ngx_int_t ngx_http_tnt_format_bind_scalar(ngx_http_request_t *r,
+        struct tp *tp, ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value);
+static ngx_int_t ngx_http_tnt_format_bind_value(ngx_http_request_t *r,
+        struct tp *tp, ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value);
+static ngx_int_t ngx_http_tnt_format_bind(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result, struct tp *tp);
+
+/** Background calls */
+static ngx_http_tnt_bg_call_t *ngx_http_tnt_bg_call_create(ngx_log_t *log,
+        size_t out_size);
+static ngx_int_t ngx_http_tnt_bg_call_start(ngx_http_tnt_bg_call_t *bc,
+        struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name);
+static void ngx_http_tnt_bg_call_close(ngx_http_tnt_bg_call_t *bc);
+
+/** vshard */
+static void *ngx_http_tnt_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_tnt_init_process(ngx_cycle_t *cycle);
+static char *ngx_http_tnt_vshard(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_vshard_key(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_vshard_route(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_http_tnt_loc_conf_t *tlcf,
+        tp_transcode_t *tc, ngx_chain_t *out_chain);
+static ngx_int_t ngx_http_tnt_vshard_check_reply(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_buf_t *b);
+static ngx_http_upstream_rr_peer_t *ngx_http_tnt_live_peer(
+        ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *next);
+
+/** Schema */
+static char *ngx_http_tnt_schema(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_schema_set_name(ngx_conf_t *cf,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_str_t *name, ngx_uint_t index);
+static ngx_http_tnt_schema_conf_t *ngx_http_tnt_schema_get_conf(
+        ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_tnt_schema_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_tnt_schema_resolve(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result);
+static void ngx_http_tnt_schema_check_reply(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_buf_t *b);
+
+/** Objects */
+static char *ngx_http_tnt_objects(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_http_tnt_objects_t *ngx_http_tnt_objects_get(
+        ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_ctx_t *ctx);
+static size_t ngx_http_tnt_objects_size(ngx_http_tnt_objects_t *ob,
+        const char *reply, size_t len);
+
+/** Fan-out */
+static char *ngx_http_tnt_fanout(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static void ngx_http_tnt_fanout_init(ngx_http_request_t *r);
+
+/** Multiplexer */
+static char *ngx_http_tnt_multiplex(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_http_tnt_mux_conf_t *ngx_http_tnt_mux_get_conf(
+        ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_tnt_mux_init(ngx_http_request_t *r);
+
+/** Pre-warmed connections */
+static char *ngx_http_tnt_prewarm(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static void ngx_http_tnt_prewarm_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf);
+
+/** Concurrency limit */
+static char *ngx_http_tnt_concurrency(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_http_tnt_limit_conf_t *ngx_http_tnt_limit_get_conf(
+        ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_tnt_limit_init(ngx_http_request_t *r);
+static void ngx_http_tnt_limit_done(ngx_http_request_t *r, ngx_int_t rc);
+
+/** IN-list */
+static ngx_int_t ngx_http_tnt_in_list_reply(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+
+/** Export */
+static void ngx_http_tnt_export_init(ngx_http_request_t *r);
+
+/** Transactions */
+static char *ngx_http_tnt_tx_conf(ngx_conf_t *cf,
+        ngx_http_tnt_loc_conf_t *tlcf);
+static void ngx_http_tnt_tx_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_tnt_tx_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_tnt_tx_reply(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+
+/** Bulk */
+static ngx_int_t ngx_http_tnt_bulk_init(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_bulk_t *bulk);
+static ngx_int_t ngx_http_tnt_bulk_next(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_bulk_t *bulk);
+static ngx_int_t ngx_http_tnt_bulk_reply(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+
+/** Statistics */
+static char *ngx_http_tnt_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_stats(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_status(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_stats_init(ngx_http_request_t *r);
+static void ngx_http_tnt_stats_hook(ngx_http_request_t *r,
+        ngx_http_upstream_t *u);
+static void ngx_http_tnt_stats_timed(ngx_http_request_t *r,
+        ngx_uint_t event);
+static uint64_t ngx_http_tnt_stats_clock(ngx_http_tnt_loc_conf_t *tlcf);
+static void ngx_http_tnt_stats_transcoded(ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_ctx_t *ctx, uint64_t start, ngx_uint_t out);
+static void ngx_http_tnt_stats_error(ngx_http_request_t *r,
+        ngx_int_t code);
+static ngx_int_t ngx_http_tnt_time_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tnt_size_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tnt_sync_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_tnt_error_code_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data);
+
+/** Hot keys */
+static char *ngx_http_tnt_hot_keys(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static size_t ngx_http_tnt_hot_key(ngx_http_request_t *r, u_char *key);
+static void ngx_http_tnt_hot_add(ngx_http_tnt_stats_conf_t *sc,
+        ngx_http_tnt_stats_node_t *node, ngx_uint_t max, u_char *key,
+        size_t len);
+static u_char *ngx_http_tnt_hot_json(u_char *p, u_char *end,
+        ngx_http_tnt_hot_t *hot);
+static u_char *ngx_http_tnt_hot_prometheus(u_char *p, u_char *end,
+        ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t n);
+static ngx_int_t ngx_http_tnt_hot_key_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data);
+
+/** Slow log */
+static char *ngx_http_tnt_slowlog_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_slowlog(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_slowlog_status(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_slowlog_init(ngx_http_request_t *r);
+static void ngx_http_tnt_slowlog_sample(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_http_tnt_ctx_t *ctx);
+
+/** Limits */
+static ngx_int_t ngx_http_tnt_request_limited(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_chain_t *out_chain);
+static ngx_int_t ngx_http_tnt_reply_limited(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_http_tnt_ctx_t *ctx, ngx_buf_t *b);
+static ngx_int_t ngx_http_tnt_send_limited(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+static ngx_int_t ngx_http_tnt_merged_limited(ngx_http_request_t *r,
+        ngx_http_upstream_t *u, ngx_http_tnt_ctx_t *ctx);
+
+/** Rate limits */
+static char *ngx_http_tnt_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_tnt_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_tnt_rate_check(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_buf_t *b);
+static void ngx_http_tnt_rate_init(ngx_http_request_t *r);
+
+/** Module's objects {{{
+ */
+
+/** A set of allowed REST methods */
+static const ngx_uint_t ngx_http_tnt_allowed_methods =
+    (NGX_HTTP_POST|NGX_HTTP_GET|NGX_HTTP_PUT|NGX_HTTP_PATCH|NGX_HTTP_DELETE);
+
+
+/** The transcoding is timed if any $tnt_transcode_*_time is used, see
+ *  ngx_http_tnt_postconfiguration()
+ */
+static ngx_uint_t  ngx_http_tnt_timing;
+
+
+/** A quarter of tnt_stats_zone is kept for the sketches if tnt_hot_keys is
+ *  used, see ngx_http_tnt_stats_init_zone()
+ */
+static ngx_uint_t  ngx_http_tnt_hot_keys_used;
+
+
+static ngx_http_variable_t  ngx_http_tnt_vars[] = {
+
+    { ngx_string("tnt_transcode_in_time"), NULL,
+      ngx_http_tnt_time_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.transcode_in),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_transcode_out_time"), NULL,
+      ngx_http_tnt_time_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.transcode_out),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_upstream_payload_size"), NULL,
+      ngx_http_tnt_size_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.payload_size),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_reply_json_size"), NULL,
+      ngx_http_tnt_size_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.json_size),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_batch_size"), NULL,
+      ngx_http_tnt_size_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.replies),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_sync"), NULL,
+      ngx_http_tnt_sync_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_error_code"), NULL,
+      ngx_http_tnt_error_code_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_hot_key"), NULL,
+      ngx_http_tnt_hot_key_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tnt_request_memory"), NULL,
+      ngx_http_tnt_size_variable,
+      offsetof(ngx_http_tnt_ctx_t, stats.memory),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
+static ngx_conf_bitmask_t  ngx_http_tnt_next_upstream_masks[] = {
+    { ngx_string("error"), NGX_HTTP_UPSTREAM_FT_ERROR },
+    { ngx_string("timeout"), NGX_HTTP_UPSTREAM_FT_TIMEOUT },
+    { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
+    { ngx_string("off"), NGX_HTTP_UPSTREAM_FT_OFF },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_bitmask_t  ngx_http_tnt_pass_http_request_masks[] = {
+    { ngx_string("on"), NGX_TNT_CONF_ON },
+    { ngx_string("off"), NGX_TNT_CONF_OFF },
+    { ngx_string("parse_args"), NGX_TNT_CONF_PARSE_ARGS },
+    { ngx_string("unescape"), NGX_TNT_CONF_UNESCAPE },
+    { ngx_string("pass_body"), NGX_TNT_CONF_PASS_BODY },
+    { ngx_string("pass_headers_out"), NGX_TNT_CONF_PASS_HEADERS_OUT },
+    { ngx_string("parse_urlencoded"), NGX_TNT_CONF_PARSE_URLENCODED },
+    { ngx_string("pass_subrequest_uri"), NGX_TNT_CONF_PASS_SUBREQUEST_URI },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_enum_t  ngx_http_tnt_export_formats[] = {
+    { ngx_string("off"), NGX_HTTP_TNT_EXPORT_OFF },
+    { ngx_string("ndjson"), NGX_HTTP_TNT_EXPORT_NDJSON },
+    { ngx_string("json"), NGX_HTTP_TNT_EXPORT_JSON },
+    { ngx_null_string, 0 }
+};
+
+
+/** The operations of tnt_transaction */
+static ngx_conf_enum_t  ngx_http_tnt_tx_ops[] = {
+    { ngx_string("insert"), TP_INSERT },
+    { ngx_string("replace"), TP_REPLACE },
+    { ngx_string("delete"), TP_DELETE },
+    { ngx_string("update"), TP_UPDATE },
+    { ngx_string("upsert"), TP_UPSERT },
+    { ngx_string("select"), TP_SELECT },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_bitmask_t  ngx_http_tnt_methods[] = {
+    { ngx_string("get"), NGX_HTTP_GET },
+    { ngx_string("post"), NGX_HTTP_POST },
+    { ngx_string("put"), NGX_HTTP_PUT },
+    { ngx_string("patch"), NGX_HTTP_PATCH },
+    { ngx_string("delete"), NGX_HTTP_DELETE },
+    { ngx_string("all"), (NGX_CONF_BITMASK_SET
+                          |NGX_HTTP_GET
+                          |NGX_HTTP_POST
+                          |NGX_HTTP_PUT
+                          |NGX_HTTP_PATCH
+                          |NGX_HTTP_DELETE) },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_http_tnt_commands[] = {
+
+    { ngx_string("tnt_pass"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_pass,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_connect_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.connect_timeout),
+      NULL },
+
+    { ngx_string("tnt_send_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.send_timeout),
+      NULL },
+
+    { ngx_string("tnt_read_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.read_timeout),
+      NULL },
+
+    { ngx_string("tnt_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.buffer_size),
+      NULL },
+
+    { ngx_string("tnt_next_upstream"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream),
+      &ngx_http_tnt_next_upstream_masks },
+
+    { ngx_string("tnt_next_upstream_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream_timeout),
+      NULL },
+
+    { ngx_string("tnt_next_upstream_tries"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, upstream.next_upstream_tries),
+      NULL },
+
+    { ngx_string("tnt_in_multiplier"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, in_multiplier),
+      NULL },
+
+    { ngx_string("tnt_out_multiplier"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, out_multiplier),
+      NULL },
+
+    { ngx_string("tnt_method"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_method,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_pass_http_request_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, pass_http_request_buffer_size),
+      NULL },
+
+    { ngx_string("tnt_pass_http_request"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF
+          |NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, pass_http_request),
+      &ngx_http_tnt_pass_http_request_masks },
+
+    { ngx_string("tnt_pass_http_request_headers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF
+          |NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
+      ngx_http_tnt_pass_headers,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_http_rest_methods"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, http_rest_methods),
+      &ngx_http_tnt_methods },
+
+    { ngx_string("tnt_pure_result"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, pure_result),
+      &ngx_http_tnt_pass_http_request_masks },
+
+    { ngx_string("tnt_multireturn_skip_count"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF
+          |NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, multireturn_skip_count),
+      NULL },
+
+    { ngx_string("tnt_http_methods"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, http_methods),
+      &ngx_http_tnt_methods },
+
+    { ngx_string("tnt_set_header"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_tnt_headers_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_insert"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE2,
+      ngx_http_tnt_insert_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_select"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE6,
+      ngx_http_tnt_select_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_replace"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE2,
+      ngx_http_tnt_replace_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_delete"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
+      ngx_http_tnt_delete_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_update"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
+      ngx_http_tnt_update_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_upsert"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE3,
+      ngx_http_tnt_upsert_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_select_limit_max"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, select_limit_max),
+      NULL },
+
+    { ngx_string("tnt_allowed_spaces"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_allowed_spaces_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_allowed_indexes"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_allowed_indexes_add,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_vshard"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_tnt_vshard,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_vshard_key"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE12,
+      ngx_http_tnt_vshard_key,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_schema"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_tnt_schema,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_objects"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_objects,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_multiplex"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_multiplex,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_prewarm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_prewarm,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_concurrency"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_http_tnt_concurrency,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_fanout"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_1MORE,
+      ngx_http_tnt_fanout,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_export"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, export_format),
+      &ngx_http_tnt_export_formats },
+
+    { ngx_string("tnt_bulk_max_rows"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, bulk_max_rows),
+      NULL },
+
+    { ngx_string("tnt_transaction"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, transaction),
+      NULL },
+
+    { ngx_string("tnt_stats_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_stats_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("tnt_stats"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_stats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_hot_keys"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_hot_keys,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_slowlog_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_tnt_slowlog_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("tnt_slowlog"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_tnt_slowlog,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_slowlog_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_tnt_slowlog_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("tnt_max_reply_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, max_reply_size),
+      NULL },
+
+    { ngx_string("tnt_max_request_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_tnt_loc_conf_t, max_request_memory),
+      NULL },
+
+    { ngx_string("tnt_limit_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_tnt_limit_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("tnt_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
+      ngx_http_tnt_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_tnt_module_ctx = {
+    ngx_http_tnt_preconfiguration,  /* preconfiguration */
+    ngx_http_tnt_postconfiguration, /* postconfiguration */
+
+    NULL,                           /* create main configuration */
+    NULL,                           /* init main configuration */
+
+    ngx_http_tnt_create_srv_conf,   /* create server configuration */
+    NULL,                           /* merge server configuration */
+
+    ngx_http_tnt_create_loc_conf,   /* create location configuration */
+    ngx_http_tnt_merge_loc_conf     /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_tnt_module = {
+    NGX_MODULE_V1,
+    &ngx_http_tnt_module_ctx,   /* module context */
+    ngx_http_tnt_commands,      /* module directives */
+    NGX_HTTP_MODULE,            /* module type */
+    NULL,                       /* init master */
+    NULL,                       /* init module */
+    ngx_http_tnt_init_process,  /* init process */
+    NULL,                       /* init thread */
+    NULL,                       /* exit thread */
+    NULL,                       /* exit process */
+    NULL,                       /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+/** }}}
+ */
+
+
+/** Entry point {{{
+ */
+static ngx_int_t
+ngx_http_tnt_handler(ngx_http_request_t *r)
+{
+    ngx_int_t               rc;
+    ngx_http_upstream_t     *u;
+    ngx_http_tnt_loc_conf_t *tlcf;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    TNT_PROBE2(request__start, r, r->headers_in.content_length_n);
+
+    if (tlcf->stats_zone != NULL && ngx_http_tnt_stats_init(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (tlcf->slowlog_zone != NULL && ngx_http_tnt_slowlog_init(r) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (tlcf->method_ccv != NULL) {
+
+        if (ngx_http_complex_value(r, tlcf->method_ccv, &tlcf->method)
+                    != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_tnt_process_headers(r, tlcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if ((!tlcf->method.len && r->uri.len <= 1 /* i.e '/' */) ||
+        !(r->method & ngx_http_tnt_allowed_methods))
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (
+      /* NOTE https://github.com/tarantool/nginx_upstream_module/issues/43
+       */
+      !(r->method & tlcf->http_methods) &&
+      !(r->method & tlcf->http_rest_methods)
+      )
+    {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK
+        || ngx_http_upstream_create(r) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    u = r->upstream;
+
+    ngx_str_set(&u->schema, "tnt://");
+    u->output.tag = (ngx_buf_tag_t) &ngx_http_tnt_module;
+
+    u->conf = &tlcf->upstream;
+
+    rc = ngx_http_tnt_init_handlers(r, u, tlcf);
+    if (rc != NGX_OK){
+        return rc;
+    }
+
+    if (tlcf->stats_zone != NULL) {
+        ngx_http_tnt_stats_hook(r, u);
+    }
+
+    /** The pages are selected outside of the upstream, see tnt_export.
+     *  It's not limited by tnt_concurrency, the export is as long as the
+     *  client reads it.
+     */
+    if (tlcf->export_format != NGX_HTTP_TNT_EXPORT_OFF) {
+
+        rc = ngx_http_read_client_request_body(r, ngx_http_tnt_export_init);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        return NGX_DONE;
+    }
+
+    /** The request is not passed to the upstream, see tnt_fanout */
+    if (tlcf->fanout != NULL) {
+
+        rc = ngx_http_read_client_request_body(r, ngx_http_tnt_fanout_init);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        return NGX_DONE;
+    }
+
+    /** The request is written to a shared connection, see tnt_multiplex.
+     *  A transaction needs a connection of its own.
+     */
+    if (!tlcf->transaction
+        && ngx_http_tnt_mux_get_conf(tlcf->upstream.upstream) != NULL)
+    {
+
+        rc = ngx_http_read_client_request_body(r, ngx_http_tnt_mux_init);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        return NGX_DONE;
+    }
+
+    u->input_filter_init = ngx_http_tnt_filter_init;
+    u->input_filter = ngx_http_tnt_filter;
+    u->input_filter_ctx = r;
+
+    u->length = 0;
+    u->state = 0;
+
+    /** A limited request is replied before the upstream, see tnt_limit */
+    if (tlcf->rates != NULL) {
+        rc = ngx_http_read_client_request_body(r, ngx_http_tnt_rate_init);
+
+    /** The request could wait for a slot, see tnt_concurrency */
+    } else if (ngx_http_tnt_limit_get_conf(tlcf->upstream.upstream) != NULL) {
+        rc = ngx_http_read_client_request_body(r, ngx_http_tnt_limit_init);
+
+    } else {
+        rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
+    }
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+/** }}}
+ */
+
+/** Confs {{{
+ */
+static ngx_int_t
+ngx_http_tnt_preconfiguration(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                    "Tarantool upstream module, version: '%s'",
+                    NGX_HTTP_TNT_MODULE_VERSION_STRING);
+
+    ngx_http_tnt_hot_keys_used = 0;
+
+    for (v = ngx_http_tnt_vars; v->name.len; v++) {
+
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+/** The variables of the configuration are indexed by now, so the clock is
+ *  read only if a $tnt_transcode_*_time is used somewhere
+ */
+static ngx_int_t
+ngx_http_tnt_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                 i;
+    ngx_http_variable_t        *v;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    ngx_http_tnt_timing = 0;
+
+    v = cmcf->variables.elts;
+
+    for (i = 0; i < cmcf->variables.nelts; i++) {
+
+        if (v[i].name.len > sizeof("tnt_transcode_") - 1
+            && ngx_strncmp(v[i].name.data, "tnt_transcode_",
+                           sizeof("tnt_transcode_") - 1) == 0)
+        {
+            ngx_http_tnt_timing = 1;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_tnt_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_tnt_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream.bufs.num = 0;
+     *     conf->upstream.next_upstream = 0;
+     *     conf->upstream.temp_path = NULL;
+     *     conf->upstream.uri = { 0, NULL };
+     *     conf->upstream.location = NULL;
+     *     conf->method = { 0, NULL };
+     *     conf->queries = NULL;
+     *     ...
+     */
+
+    conf->upstream.local = NGX_CONF_UNSET_PTR;
+
+    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.next_upstream_tries = NGX_CONF_UNSET;
+
+    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->in_multiplier = NGX_CONF_UNSET_SIZE;
+    conf->out_multiplier = NGX_CONF_UNSET_SIZE;
+    conf->multireturn_skip_count = NGX_CONF_UNSET_SIZE;
+    conf->pass_http_request_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->pass_headers = NGX_CONF_UNSET_PTR;
+    conf->stats_zone = NGX_CONF_UNSET_PTR;
+    conf->slowlog_zone = NGX_CONF_UNSET_PTR;
+    conf->hot_keys = NGX_CONF_UNSET_UINT;
+    conf->max_reply_size = NGX_CONF_UNSET_SIZE;
+    conf->max_request_memory = NGX_CONF_UNSET_SIZE;
+    conf->rates = NGX_CONF_UNSET_PTR;
+
+    conf->req_type = NGX_CONF_UNSET_SIZE;
+    conf->iter_type = NGX_CONF_UNSET_SIZE;
+    conf->select_limit = NGX_CONF_UNSET_SIZE;
+    conf->select_limit_max = NGX_CONF_UNSET_SIZE;
+    conf->bulk_max_rows = NGX_CONF_UNSET_UINT;
+    conf->export_format = NGX_CONF_UNSET_UINT;
+    conf->select_offset = NGX_CONF_UNSET_SIZE;
+    conf->space_id = NGX_CONF_UNSET_SIZE;
+    conf->index_id = NGX_CONF_UNSET_SIZE;
+
+    /*
+     * Hardcoded values
+     */
+    conf->upstream.cyclic_temp_file = 0;
+    conf->upstream.buffering = 0;
+    conf->upstream.ignore_client_abort = 0;
+    conf->upstream.send_lowat = 0;
+    conf->upstream.bufs.num = 0;
+    conf->upstream.busy_buffers_size = 0;
+    conf->upstream.max_temp_file_size = 0;
+    conf->upstream.temp_file_write_size = 0;
+    conf->upstream.intercept_errors = 1;
+    conf->upstream.intercept_404 = 1;
+
+    conf->upstream.pass_request_headers = 0;
+    conf->upstream.pass_request_body = 0;
+
+    conf->index = NGX_CONF_UNSET;
+
+    conf->vshard_key = NGX_CONF_UNSET_PTR;
+    conf->fanout = NGX_CONF_UNSET_PTR;
+    conf->schema_ref = NGX_CONF_UNSET_PTR;
+    conf->objects = NGX_CONF_UNSET_PTR;
+    conf->transaction = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_tnt_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_tnt_loc_conf_t *prev = parent;
+    ngx_http_tnt_loc_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->upstream.local,
+                  prev->upstream.local, NULL);
+    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
+                  prev->upstream.connect_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
+                  prev->upstream.send_timeout, 60000);
+
+    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
+                  prev->upstream.read_timeout, 60000);
+
+    ngx_conf_merge_size_value(conf->upstream.buffer_size,
+                  prev->upstream.buffer_size,
+                  (size_t) ngx_pagesize);
+
+    ngx_conf_merge_bitmask_value(conf->upstream.next_upstream,
+                  prev->upstream.next_upstream,
+                              (NGX_CONF_BITMASK_SET
+                               |NGX_HTTP_UPSTREAM_FT_ERROR
+                               |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+
+    if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
+        conf->upstream.next_upstream = NGX_CONF_BITMASK_SET
+                                       |NGX_HTTP_UPSTREAM_FT_OFF;
+    }
+
+    if (conf->upstream.upstream == NULL) {
+        conf->upstream.upstream = prev->upstream.upstream;
+    }
+
+    ngx_conf_merge_size_value(conf->in_multiplier, prev->in_multiplier, 2);
+
+    ngx_conf_merge_size_value(conf->out_multiplier, prev->out_multiplier, 2);
+
+    if (conf->method_ccv == NULL) {
+        conf->method_ccv = prev->method_ccv;
+    }
+
+    ngx_conf_merge_size_value(conf->pass_http_request_buffer_size,
+                  prev->pass_http_request_buffer_size, 4096*2);
+
+    ngx_conf_merge_ptr_value(conf->pass_headers, prev->pass_headers, NULL);
+
+    ngx_conf_merge_ptr_value(conf->stats_zone, prev->stats_zone, NULL);
+    ngx_conf_merge_uint_value(conf->hot_keys, prev->hot_keys, 0);
+
+    ngx_conf_merge_size_value(conf->max_reply_size, prev->max_reply_size, 0);
+    ngx_conf_merge_size_value(conf->max_request_memory,
+                              prev->max_request_memory, 0);
+
+    ngx_conf_merge_ptr_value(conf->rates, prev->rates, NULL);
+
+    /** The thresholds are set with the zone */
+    if (conf->slowlog_zone == NGX_CONF_UNSET_PTR) {
+        conf->slowlog_zone = prev->slowlog_zone;
+        conf->slowlog_time = prev->slowlog_time;
+        conf->slowlog_size = prev->slowlog_size;
+    }
+
+    ngx_conf_merge_ptr_value(conf->slowlog_zone, prev->slowlog_zone, NULL);
+
+    ngx_conf_merge_bitmask_value(conf->pass_http_request,
+                  prev->pass_http_request, NGX_TNT_CONF_OFF);
+
+    ngx_conf_merge_bitmask_value(conf->http_rest_methods,
+                  prev->http_rest_methods,
+                              (NGX_HTTP_GET
+                               |NGX_HTTP_PUT));
+
+    ngx_conf_merge_bitmask_value(conf->http_methods,
+                  prev->http_methods,
+                              (NGX_HTTP_POST
+                               |NGX_HTTP_DELETE));
+
+    ngx_conf_merge_bitmask_value(conf->pure_result, prev->pure_result,
+                NGX_TNT_CONF_OFF);
+
+    ngx_conf_merge_size_value(conf->multireturn_skip_count,
+                  prev->multireturn_skip_count, 0);
+
+    if (conf->headers == NULL) {
+        conf->headers = prev->headers;
+    }
+
+    ngx_conf_merge_uint_value(conf->req_type, prev->req_type, 0);
+    ngx_conf_merge_uint_value(conf->space_id, prev->space_id, 513);
+    ngx_conf_merge_uint_value(conf->index_id, prev->index_id, 0);
+    ngx_conf_merge_uint_value(conf->select_offset, prev->select_offset, 0);
+    ngx_conf_merge_uint_value(conf->select_limit, prev->select_limit, 0);
+    ngx_conf_merge_uint_value(conf->select_limit_max, prev->select_limit_max,
+            100);
+    ngx_conf_merge_uint_value(conf->bulk_max_rows, prev->bulk_max_rows,
+            1000);
+    ngx_conf_merge_uint_value(conf->iter_type, prev->iter_type,
+            (ngx_uint_t) TP_ITERATOR_EQ);
+
+    if (conf->allowed_spaces == NULL) {
+        conf->allowed_spaces = prev->allowed_spaces;
+    }
+
+    if (conf->allowed_indexes == NULL) {
+        conf->allowed_indexes = prev->allowed_indexes;
+    }
+
+    if (conf->format_values == NULL) {
+        conf->format_values = prev->format_values;
+        conf->format_index = prev->format_index;
+    }
+
+    ngx_conf_merge_ptr_value(conf->vshard_key, prev->vshard_key, NULL);
+    ngx_conf_merge_ptr_value(conf->fanout, prev->fanout, NULL);
+    ngx_conf_merge_ptr_value(conf->schema_ref, prev->schema_ref, NULL);
+    ngx_conf_merge_ptr_value(conf->objects, prev->objects, NULL);
+
+    ngx_conf_merge_uint_value(conf->export_format, prev->export_format,
+            NGX_HTTP_TNT_EXPORT_OFF);
+
+    if (conf->export_format != NGX_HTTP_TNT_EXPORT_OFF
+        && conf->req_type != TP_SELECT)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"tnt_export\" requires \"tnt_select\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->objects != NULL && conf->req_type == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"tnt_objects\" requires \"tnt_select\", \"tnt_insert\", "
+                "etc.");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_value(conf->transaction, prev->transaction, 0);
+
+    if (conf->transaction) {
+        return ngx_http_tnt_tx_conf(cf, conf);
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_tnt_method(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_http_compile_complex_value_t   ccv;
+    ngx_str_t                          *value;
+    ngx_http_complex_value_t           cv;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    value = cf->args->elts;
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    tlcf->method_ccv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (tlcf->method_ccv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *tlcf->method_ccv = cv;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_tnt_headers_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t                          *value;
+    ngx_http_tnt_header_val_t          *hv;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    if (tlcf->headers == NULL) {
+
+        tlcf->headers = ngx_array_create(cf->pool, 1,
+                                        sizeof(ngx_http_tnt_header_val_t));
+        if (tlcf->headers == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    hv = ngx_array_push(tlcf->headers);
+    if (hv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hv->key = value[1];
+    hv->handler = ngx_http_tnt_add_header_in;
+
+    if (value[2].len == 0) {
+        ngx_memzero(&hv->value, sizeof(ngx_http_complex_value_t));
+
+    } else {
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[2];
+        ccv.complex_value = &hv->value;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (cf->args->nelts == 3) {
+        return NGX_CONF_OK;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_tnt_pass_headers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    u_char                      *p;
+    ngx_str_t                   *value;
+    ngx_uint_t                  i;
+    ngx_http_tnt_pass_header_t  *ph;
+
+    if (tlcf->pass_headers != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->pass_headers = NULL;
+        return NGX_CONF_OK;
+    }
+
+    tlcf->pass_headers = ngx_array_create(cf->pool, cf->args->nelts - 1,
+                                          sizeof(ngx_http_tnt_pass_header_t));
+    if (tlcf->pass_headers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (value[i].len == 0 || value[i].len > UINT32_MAX) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid header name \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        ph = ngx_array_push(tlcf->pass_headers);
+        if (ph == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ph->lowcase.len = value[i].len;
+        ph->lowcase.data = ngx_pnalloc(cf->pool, value[i].len);
+        if (ph->lowcase.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ph->hash = ngx_hash_strlow(ph->lowcase.data, value[i].data,
+                                   value[i].len);
+
+        /** The key is copied into a request as is */
+        ph->key.len = mp_sizeof_str(value[i].len);
+        ph->key.data = ngx_pnalloc(cf->pool, ph->key.len);
+        if (ph->key.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        p = (u_char *) mp_encode_str((char *) ph->key.data,
+                                     (const char *) value[i].data,
+                                     value[i].len);
+        if ((size_t) (p - ph->key.data) != ph->key.len) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/** A space or an index is set by a name if the value doesn't start with
+ *  a digit, see tnt_schema
+ */
+static ngx_flag_t
+ngx_http_tnt_is_name(ngx_str_t *v)
+{
+    return v->len > 0 && (v->data[0] < '0' || v->data[0] > '9');
+}
+
+
+static char *
+ngx_http_tnt_insert_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t *value;
+    ngx_int_t tmp;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_INSERT;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
+}
+
+
+static ngx_int_t
+ngx_http_tnt_set_iter_type(ngx_str_t *v, ngx_uint_t *iter_type)
+{
+    if (ngx_strncmp(v->data, "eq", sizeof("eq") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_EQ;
+    } else if (ngx_strncmp(v->data, "req", sizeof("req") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_REQ;
+    } else if (ngx_strncmp(v->data, "all", sizeof("all") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_ALL;
+    } else if (ngx_strncmp(v->data, "lt", sizeof("lt") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_LT;
+    } else if (ngx_strncmp(v->data, "le", sizeof("le") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_LE;
+    } else if (ngx_strncmp(v->data, "ge", sizeof("ge") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_GE;
+    } else if (ngx_strncmp(v->data, "gt", sizeof("gt") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_GT;
+    } else if (ngx_strncmp(v->data, "all_set", sizeof("all_set") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ALL_SET;
+    } else if (ngx_strncmp(v->data, "any_set", sizeof("any_set") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ANY_SET;
+    } else if (ngx_strncmp(v->data, "all_non_set",
+                    sizeof("all_non_set") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ALL_NON_SET;
+    } else if (ngx_strncmp(v->data, "overlaps", sizeof("overlaps") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_OVERLAPS;
+    } else if (ngx_strncmp(v->data, "neighbor", sizeof("neighbor") - 1) == 0) {
+        *iter_type = (ngx_uint_t) TP_ITERATOR_NEIGHBOR;
+    } else {
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_tnt_select_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_int_t tmp;
+    ngx_str_t *value;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_SELECT;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+
+    if (ngx_strcmp(value[2].data, "off") == 0) {
+        tlcf->index_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[2])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[2], 1)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[2].data, value[2].len);
+        if (tmp < 0) {
+            return "index id should be non negative number";
+        }
+        tlcf->index_id = (ngx_uint_t) tmp;
+    }
+
+    tmp = ngx_atoi(value[3].data, value[3].len);
+    if (tmp < 0) {
+        return "select offset should be non negative number";
+    }
+    tlcf->select_offset = (ngx_uint_t) tmp;
+
+
+    tmp = ngx_atoi(value[4].data, value[4].len);
+    if (tmp < 0) {
+        return "select limit should be non negative number";
+    }
+    tlcf->select_limit = (ngx_uint_t) tmp;
+
+    if (ngx_http_tnt_set_iter_type(&value[5], &tlcf->iter_type) != NGX_OK) {
+        return "unknown iterator type, allowed "
+                "eq,req,all,lt,le,ge,gt,all_set,any_set,"
+                "all_non_set,overlaps,neighbor";
+    }
+
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[6]);
+
+}
+
+
+static char *
+ngx_http_tnt_replace_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_int_t tmp;
+    ngx_str_t *value;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_REPLACE;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
+}
+
+
+static char *
+ngx_http_tnt_delete_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_int_t tmp;
+    ngx_str_t *value;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_DELETE;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+
+    if (ngx_strcmp(value[2].data, "off") == 0) {
+        tlcf->index_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[2])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[2], 1)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[2].data, value[2].len);
+        if (tmp < 0) {
+            return "index id should be non negative number";
+        }
+        tlcf->index_id = (ngx_uint_t) tmp;
+    }
+
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
+}
+
+
+static char *
+ngx_http_tnt_update_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_int_t tmp;
+    ngx_str_t *value;
+    char      *ok;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_UPDATE;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+
+    /** Keys  */
+    ok = ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
+    if (ok != NGX_CONF_OK) {
+        return ok;
+    }
+
+    /** Tuples */
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
+}
+
+
+static char *
+ngx_http_tnt_upsert_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_int_t tmp;
+    ngx_str_t *value;
+    char      *ok;
+
+    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    tlcf->req_type = (ngx_uint_t) TP_UPSERT;
+    tlcf->schema_ref = NULL;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->space_id = 0;
+    } else if (ngx_http_tnt_is_name(&value[1])) {
+
+        if (ngx_http_tnt_schema_set_name(cf, tlcf, &value[1], 0)
+                != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    } else {
+
+        tmp = ngx_atoi(value[1].data, value[1].len);
+        if (tmp < 0) {
+            return "space id should be non negative number";
+        }
+        tlcf->space_id = (ngx_uint_t) tmp;
+    }
+
+    /** Tuples */
+    ok = ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
+    if (ok != NGX_CONF_OK) {
+        return ok;
+    }
+
+    /** Operations */
+    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
+}
+
+
+static char *
+ngx_http_tnt_read_array_of_uint(ngx_pool_t *pool, ngx_array_t *arr,
+        ngx_str_t *str, u_char sep)
+{
+    ngx_uint_t  *val;
+    u_char      *p, *e, *it;
+
+    p = str->data;
+    e = str->data + str->len;
+
+    for (it = p; p < e; ++p) {
+
+        if (*p == ',') {
+            val = ngx_array_push(arr);
+            if (val == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            *val = (ngx_uint_t) atoi((const char *) it);
+            it = p + 1;
+        }
+    }
+
+    if (it && it > e) {
+        val = ngx_array_push(arr);
+        if (val == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *val = (ngx_uint_t) atoi((const char *) it);
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_test_allowed(ngx_array_t *arr, ngx_uint_t val)
+{
+    ngx_uint_t  i;
+    ngx_uint_t  *arr_val;
+
+    if (arr == NULL) {
+        return NGX_OK;
+    }
+
+    arr_val = arr->elts;
+
+    for (i = 0; i < arr->nelts; i++) {
+
+        if (arr_val[i] == val) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_HTTP_NOT_ALLOWED;
+}
+
+
+static char *
+ngx_http_tnt_allowed_spaces_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (tlcf->allowed_spaces == NULL) {
+        tlcf->allowed_spaces = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
+        if (tlcf->allowed_spaces == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return ngx_http_tnt_read_array_of_uint(cf->pool, tlcf->allowed_spaces,
+            &value[1], ',');
+}
+
+
+static char *
+ngx_http_tnt_allowed_indexes_add(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (tlcf->allowed_indexes == NULL) {
+        tlcf->allowed_indexes = ngx_array_create(cf->pool, 1,
+                sizeof(ngx_uint_t));
+        if (tlcf->allowed_indexes == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return ngx_http_tnt_read_array_of_uint(cf->pool, tlcf->allowed_indexes,
+            &value[1], ',');
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_read_input(ngx_http_request_t *r, ngx_str_t *dst)
+{
+    ngx_int_t           rc;
+    ngx_buf_t           *b;
+    ngx_chain_t         *body;
+    ngx_buf_t           unparsed_body;
+    ngx_str_t           tmp;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tmp = r->args;
+
+    /** JSON and MsgPack are read by ngx_http_tnt_format_prepare_body() */
+    if (r->headers_in.content_length_n > 0
+        && ctx->dml_body == DML_BODY_URLENCODED)
+    {
+
+        unparsed_body.pos = ngx_pnalloc(r->pool,
+            sizeof(u_char) * r->headers_in.content_length_n + 1);
+
+        if (unparsed_body.pos == NULL) {
+            return NGX_ERROR;
+        }
+
+        unparsed_body.last = unparsed_body.pos;
+        unparsed_body.start = unparsed_body.pos;
+        unparsed_body.end = unparsed_body.pos + r->headers_in.content_length_n + 1;
+
+        for (body = r->upstream->request_bufs; body; body = body->next) {
+
+            b = body->buf;
+
+                if (b->in_file) {
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "in-file buffer found. aborted. "
+                        "consider increasing your 'client_body_buffer_size' "
+                        "setting");
+                    return NGX_ERROR;
+                }
+
+            unparsed_body.last = ngx_copy(unparsed_body.last,
+                b->pos, b->last - b->pos);
+        }
+
+        /** The body is a copy, so it's decoded in place */
+        dst->data = unparsed_body.start;
+        dst->len = ngx_http_tnt_urldecode_to(unparsed_body.start,
+                                             unparsed_body.start,
+                                             unparsed_body.last)
+                   - unparsed_body.start;
+        return NGX_OK;
+    }
+
+    rc = ngx_http_tnt_unescape_uri(r, dst, &tmp);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_tnt_format_compile(ngx_conf_t *cf, ngx_http_tnt_loc_conf_t *conf,
+        ngx_str_t *format)
+{
+    u_char                      *name, *type, *end;
+    char                        *rv;
+    ngx_uint_t                  i, n, first;
+    ngx_http_tnt_format_value_t fmt_val, *val;
+
+    if (conf->format_values == NULL) {
+
+        conf->format_values = ngx_array_create(cf->pool, 1,
+                sizeof(ngx_http_tnt_format_value_t));
+
+        if (conf->format_values == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    first = conf->format_values->nelts;
+
+    name = NULL;
+    type = NULL;
+
+    for (i = 0; i < format->len; ++i) {
+
+        if (name == NULL) {
+            name = format->data + i;
+        }
+
+        if (format->data[i] == '=' && type == NULL) {
+            type = format->data + i + 1;
+        }
+
+        if (format->data[i] == '&' || format->data[i] == ','
+                || i == format->len - 1)
+        {
+            fmt_val.name.data = name;
+            fmt_val.name.len = (ngx_uint_t) (type - name);
+
+            name = NULL;
+
+            /** Spec. values */
+            if (ngx_strncmp(type, "%%lim", sizeof("%%lim") - 1) == 0) {
+                conf->limit_name = fmt_val.name;
+            } else if (
+                    ngx_strncmp(type, "%%off", sizeof("%%off") - 1) == 0) {
+
+                conf->offset_name = fmt_val.name;
+            } else if (ngx_strncmp(type, "%%it", sizeof("%%it") - 1) == 0) {
+
+                conf->iter_type_name = fmt_val.name;
+            } else if (
+                ngx_strncmp(type, "%%space_id", sizeof("%%space_id") - 1) == 0) {
+                conf->space_id_name = fmt_val.name;
+            } else if (
+                ngx_strncmp(type, "%%idx_id", sizeof("%%idx_id") - 1) == 0) {
+
+                conf->index_id_name = fmt_val.name;
+            } else if (
+                ngx_strncmp(type, "%%after", sizeof("%%after") - 1) == 0) {
+
+                if (conf->req_type != TP_SELECT) {
+                    return "%%after is allowed only for tnt_select";
+                }
+
+                conf->after_name = fmt_val.name;
+            /** Tuple */
+            } else {
+
+                val = ngx_array_push(conf->format_values);
+                if (val == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
+                ngx_memzero(val, sizeof(ngx_http_tnt_format_value_t));
+
+                val->name = fmt_val.name;
+
+                if (ngx_strncmp(type, "%n", sizeof("%n") - 1) == 0) {
+                    val->type = TP_INT;
+                } else if (ngx_strncmp(type, "%u", sizeof("%u") - 1) == 0) {
+                    val->type = TP_UINT;
+                } else if (ngx_strncmp(type, "%d", sizeof("%d") - 1) == 0) {
+                    val->type = TP_DOUBLE;
+                } else if (ngx_strncmp(type, "%f", sizeof("%f") - 1) == 0) {
+                    val->type = TP_FLOAT;
+                } else if (ngx_strncmp(type, "%s", sizeof("%s") - 1) == 0) {
+                    val->type = TP_STR;
+                } else if (ngx_strncmp(type, "%b", sizeof("%b") - 1) == 0) {
+                    val->type = TP_BOOL;
+
+                /* If a type has a prefix '%k' then it is a key for TP_UPDATE
+                 */
+                } else if (conf->req_type == TP_UPDATE) {
+
+                    if (ngx_strncmp(type, "%kn", sizeof("%kn") - 1) == 0) {
+                        val->type = TP_INT;
+                        val->update_key = 1;
+                    } else if (ngx_strncmp(type, "%ku", sizeof("%ku") - 1) == 0) {
+                        val->type = TP_UINT;
+                        val->update_key = 1;
+                    } else if (ngx_strncmp(type, "%kd", sizeof("%kd") - 1) == 0) {
+                        val->type = TP_DOUBLE;
+                        val->update_key = 1;
+                    } else if (ngx_strncmp(type, "%kf", sizeof("%kf") - 1) == 0) {
+                        val->type = TP_FLOAT;
+                        val->update_key = 1;
+                    } else if (ngx_strncmp(type, "%ks", sizeof("%ks") - 1) == 0) {
+                        val->type = TP_STR;
+                        val->update_key = 1;
+                    } else if (ngx_strncmp(type, "%kb", sizeof("%kb") - 1) == 0) {
+                        val->type = TP_BOOL;
+                        val->update_key = 1;
+                    } else {
+                        goto unknown_format_error;
+                    }
+                }
+                /* If a type has a prefix '%o' then it is an operation for
+                 * TP_UPDATE
+                 */
+                else if (conf->req_type == TP_UPSERT) {
+
+                    if (ngx_strncmp(type, "%on", sizeof("%on") - 1) == 0) {
+                        val->type = TP_INT;
+                        val->upsert_op = 1;
+                    } else if (ngx_strncmp(type, "%ou", sizeof("%ou") - 1) == 0) {
+                        val->type = TP_UINT;
+                        val->upsert_op = 1;
+                    } else if (ngx_strncmp(type, "%od", sizeof("%od") - 1) == 0) {
+                        val->type = TP_DOUBLE;
+                        val->upsert_op = 1;
+                    } else if (ngx_strncmp(type, "%of", sizeof("%of") - 1) == 0) {
+                        val->type = TP_FLOAT;
+                        val->upsert_op = 1;
+                    } else if (ngx_strncmp(type, "%os", sizeof("%os") - 1) == 0) {
+                        val->type = TP_STR;
+                        val->upsert_op = 1;
+                    } else if (ngx_strncmp(type, "%ob", sizeof("%ob") - 1) == 0) {
+                        val->type = TP_BOOL;
+                        val->upsert_op = 1;
+                    } else {
+                        goto unknown_format_error;
+                    }
+
+                }
+                /* If a type has a prefix '%i' then it is a list of keys for
+                 * TP_SELECT, see ngx_http_tnt_format_prepare_in_list()
+                 */
+                else if (conf->req_type == TP_SELECT) {
+
+                    if (ngx_strncmp(type, "%in", sizeof("%in") - 1) == 0) {
+                        val->type = TP_INT;
+                    } else if (ngx_strncmp(type, "%iu", sizeof("%iu") - 1) == 0) {
+                        val->type = TP_UINT;
+                    } else if (ngx_strncmp(type, "%id", sizeof("%id") - 1) == 0) {
+                        val->type = TP_DOUBLE;
+                    } else if (ngx_strncmp(type, "%if", sizeof("%if") - 1) == 0) {
+                        val->type = TP_FLOAT;
+                    } else if (ngx_strncmp(type, "%is", sizeof("%is") - 1) == 0) {
+                        val->type = TP_STR;
+                    } else if (ngx_strncmp(type, "%ib", sizeof("%ib") - 1) == 0) {
+                        val->type = TP_BOOL;
+                    } else {
+                        goto unknown_format_error;
+                    }
+
+                    for (n = 0; n < conf->format_values->nelts - 1; n++) {
+                        if (((ngx_http_tnt_format_value_t *)
+                                conf->format_values->elts)[n].in_list)
+                        {
+                            return "only one list of keys (%i) is allowed";
+                        }
+                    }
+
+                    val->in_list = 1;
+
+                } else {
+                    goto unknown_format_error;
+                }
+
+                /** Modifiers follow the type, e.g. '%n?@2' */
+                end = format->data + i;
+                if (format->data[i] != '&' && format->data[i] != ',') {
+                    ++end;
+                }
+
+                rv = ngx_http_tnt_format_compile_mods(val,
+                        type + ((val->update_key || val->upsert_op
+                                || val->in_list) ? 3 : 2), end);
+                if (rv != NGX_CONF_OK) {
+                    return rv;
+                }
+            }
+
+            type = NULL;
+        }
+    }
+
+    rv = ngx_http_tnt_format_compile_pos(conf, first);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    return ngx_http_tnt_format_compile_index(cf, conf);
+
+unknown_format_error:
+    return "unknown format has been found, "
+        "allowed %n,%d,%f,%s,%b,%lim,%off,%it,"
+        "%space_id,%idx_id,%after,%u,%kn,%ku,%kd,%kf,%ks,"
+        "%in,%iu,%id,%if,%is,%ib";
+}
+
+
+/** Parse the modifiers of a type:
+ *
+ *  '?' - the value is nullable, i.e. 'null' is encoded as nil
+ *  '[]' - the value is an array of comma separated elements
+ *  '@N' - the position of the value in the tuple or the key, from 1
+ */
+static char *
+ngx_http_tnt_format_compile_mods(ngx_http_tnt_format_value_t *val,
+        u_char *p, u_char *end)
+{
+    u_char     *digits;
+    ngx_int_t  pos;
+
+    while (p < end) {
+
+        switch (*p) {
+
+        case '?':
+            val->nullable = 1;
+            ++p;
+            break;
+
+        case '[':
+            if (p + 1 == end || p[1] != ']' || val->in_list) {
+                return "'[]' is expecting after a type, "
+                       "lists of keys can't be arrays";
+            }
+
+            val->array = 1;
+            p += 2;
+            break;
+
+        case '@':
+            digits = ++p;
+
+            while (p < end && *p >= '0' && *p <= '9') {
+                ++p;
+            }
+
+            pos = ngx_atoi(digits, p - digits);
+            if (pos <= 0) {
+                return "a position is expecting after '@', e.g. '%n@2'";
+            }
+
+            val->pos = (ngx_uint_t) pos;
+            break;
+
+        default:
+            return NGX_CONF_OK;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_pos_cmp(const void *one, const void *two)
+{
+    const ngx_http_tnt_format_value_t  *a = one, *b = two;
+
+    /** Operations of upsert follow the tuple */
+    if (a->upsert_op != b->upsert_op) {
+        return a->upsert_op ? 1 : -1;
+    }
+
+    if (a->pos != b->pos) {
+        return a->pos < b->pos ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/** Order the values of a format by their positions. A value without '@N'
+ *  takes the next position after the previous value, so the values are
+ *  bound in the order of the format, if there are no positions.
+ *
+ *  Only the values of this format are ordered, i.e. from the first one,
+ *  since tnt_update has one format for the key and one for the operations.
+ */
+static char *
+ngx_http_tnt_format_compile_pos(ngx_http_tnt_loc_conf_t *conf,
+        ngx_uint_t first)
+{
+    ngx_uint_t                   i, k, n;
+    ngx_http_tnt_format_value_t  *val;
+
+    val = (ngx_http_tnt_format_value_t *) conf->format_values->elts + first;
+    n = conf->format_values->nelts - first;
+
+    for (i = 0, k = 0; i < n; i++) {
+
+        if (val[i].pos == 0) {
+            val[i].pos = k + 1;
+        }
+
+        k = val[i].pos;
+    }
+
+    ngx_sort(val, n, sizeof(ngx_http_tnt_format_value_t),
+            ngx_http_tnt_format_pos_cmp);
+
+    for (i = 1; i < n; i++) {
+        if (ngx_http_tnt_format_pos_cmp(&val[i - 1], &val[i]) == 0) {
+            return "a position is used twice in the format";
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_index_cmp(const void *one, const void *two)
+{
+    const ngx_http_tnt_format_slot_t  *a = one, *b = two;
+
+    if (a->name.len != b->name.len) {
+        return a->name.len < b->name.len ? -1 : 1;
+    }
+
+    return ngx_memcmp(a->name.data, b->name.data, a->name.len);
+}
+
+
+/** Build the sorted index over conf->format_values, so an argument is bound
+ *  to its slot by a binary search instead of a scan over all the values.
+ *  The format can be given by several directives, hence the index is rebuilt
+ *  by each ngx_http_tnt_format_compile().
+ */
+static char *
+ngx_http_tnt_format_compile_index(ngx_conf_t *cf,
+        ngx_http_tnt_loc_conf_t *conf)
+{
+    ngx_uint_t                   i;
+    ngx_http_tnt_format_slot_t   *index;
+    ngx_http_tnt_format_value_t  *val;
+
+    conf->format_index = NULL;
+
+    if (conf->format_values->nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    index = ngx_palloc(cf->pool,
+            sizeof(ngx_http_tnt_format_slot_t) * conf->format_values->nelts);
+    if (index == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    val = conf->format_values->elts;
+
+    for (i = 0; i < conf->format_values->nelts; i++) {
+        index[i].name = val[i].name;
+        index[i].slot = i;
+    }
+
+    /** ngx_sort() is stable, so the same names keep the order of the slots
+     */
+    ngx_sort(index, conf->format_values->nelts,
+            sizeof(ngx_http_tnt_format_slot_t), ngx_http_tnt_format_index_cmp);
+
+    conf->format_index = index;
+
+    return NGX_CONF_OK;
+}
+
+
+/** Find the first unbound value of the request which is named by name,
+ *  a list of keys is bound by each its argument.
+ *
+ *  Returns NULL if the format has no such value or all of them are bound.
+ */
+static ngx_http_tnt_format_value_t *
+ngx_http_tnt_format_lookup(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_tnt_ctx_t *ctx, ngx_str_t *name)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   lo, hi, mid;
+    ngx_http_tnt_format_slot_t   key, *index;
+    ngx_http_tnt_format_value_t  *val;
+
+    index = conf->format_index;
+    if (index == NULL) {
+        return NULL;
+    }
+
+    key.name = *name;
+
+    lo = 0;
+    hi = ctx->format_nvalues;
+
+    while (lo < hi) {
+
+        mid = lo + (hi - lo) / 2;
+
+        rc = ngx_http_tnt_format_index_cmp(&index[mid], &key);
+        if (rc < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < ctx->format_nvalues; lo++) {
+
+        if (ngx_http_tnt_format_index_cmp(&index[lo], &key) != 0) {
+            break;
+        }
+
+        val = &ctx->format_values[index[lo].slot];
+
+        if (val->value.len == 0 || val->in_list) {
+            return val;
+        }
+    }
+
+    return NULL;
+}
+
+
+/** Returns the first c1 or c2 in [p, end), or end. The input is scanned by
+ *  16 bytes with SSE2, or by machine words otherwise.
+ */
+static u_char *
+ngx_http_tnt_find2(u_char *p, u_char *end, u_char c1, u_char c2)
+{
+#if (__SSE2__)
+    int       mask;
+    __m128i   v1, v2, b;
+
+    v1 = _mm_set1_epi8((char) c1);
+    v2 = _mm_set1_epi8((char) c2);
+
+    for ( ; end - p >= 16; p += 16) {
+
+        b = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, v1),
+                                              _mm_cmpeq_epi8(b, v2)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#else
+    uint64_t  w, x1, x2;
+
+    static const uint64_t  lo = 0x0101010101010101ULL;
+    static const uint64_t  hi = 0x8080808080808080ULL;
+
+    /** A word has a zero byte, if (x - lo) & ~x & hi isn't 0 */
+    for ( ; end - p >= 8; p += 8) {
+
+        ngx_memcpy(&w, p, sizeof(w));
+
+        x1 = w ^ (lo * c1);
+        x2 = w ^ (lo * c2);
+
+        if ((((x1 - lo) & ~x1) | ((x2 - lo) & ~x2)) & hi) {
+            break;
+        }
+    }
+#endif
+
+    for ( ; p < end; p++) {
+        if (*p == c1 || *p == c2) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_hex(u_char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    c |= 0x20;
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return -1;
+}
+
+
+/** Decodes [src, end) into dst, the runs without '%' and '+' are copied as
+ *  is. The decoded data is never longer than the source, so dst may be src.
+ */
+static u_char *
+ngx_http_tnt_urldecode_to(u_char *dst, u_char *src, u_char *end)
+{
+    u_char     *p;
+    ngx_int_t  c2, c3;
+
+    for ( ;; ) {
+
+        p = ngx_http_tnt_find2(src, end, '%', '+');
+
+        if (dst != src) {
+            dst = ngx_movemem(dst, src, p - src);
+        } else {
+            dst = p;
+        }
+
+        if (p == end) {
+            return dst;
+        }
+
+        if (*p == '+') {
+            *dst++ = ' ';
+            src = p + 1;
+            continue;
+        }
+
+        if (end - p < 3) {
+            *dst++ = '%';
+            src = p + 1;
+            continue;
+        }
+
+        c2 = ngx_http_tnt_hex(p[1]);
+        c3 = ngx_http_tnt_hex(p[2]);
+
+        if (c2 >= 0 && c3 >= 0) {
+            *dst++ = (u_char) (16 * c2 + c3);
+
+        } else { /* %zz or something other invalid */
+            dst = ngx_movemem(dst, p, 3);
+        }
+
+        src = p + 3;
+    }
+}
+
+
+/** Returns src itself if there is nothing to decode, e.g. src is empty
+ */
+static ngx_str_t /* dst */
+ngx_http_tnt_urldecode(ngx_http_request_t *r, ngx_str_t *src)
+{
+    u_char     *end;
+    ngx_str_t  dst;
+
+    /** r->args.data is NULL if there is no query string */
+    if (src->data == NULL || src->len == 0) {
+        return *src;
+    }
+
+    end = src->data + src->len;
+
+    if (ngx_http_tnt_find2(src->data, end, '%', '+') == end) {
+        return *src;
+    }
+
+    dst.len = 0;
+    dst.data = ngx_pnalloc(r->pool, src->len);
+    if (dst.data == NULL) {
+        return dst;
+    }
+
+    dst.len = ngx_http_tnt_urldecode_to(dst.data, src->data, end) - dst.data;
+
+    return dst;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_unescape_uri(ngx_http_request_t *r, ngx_str_t *dst,
+        ngx_str_t *src)
+{
+    if (src->data == NULL || src->len == 0) {
+        *dst = *src;
+        return NGX_OK;
+    }
+
+    dst->data = NULL;
+    dst->len = 0;
+
+    *dst = ngx_http_tnt_urldecode(r, src);
+
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/** Encodes [src, src + len) as str, the data is decoded straight into tp
+ */
+static ngx_int_t
+ngx_http_tnt_encode_unescaped_str(struct tp *tp, u_char *src, size_t len)
+{
+    size_t  hsz, n;
+    u_char  *p, *end;
+
+    end = src + len;
+
+    if (ngx_http_tnt_find2(src, end, '%', '+') == end) {
+        return tp_encode_str(tp, (const char *) src, len) == NULL ?
+                NGX_ERROR : NGX_OK;
+    }
+
+    /** The header is reserved for len, it's moved if the decoded data is
+     *  shorter
+     */
+    hsz = mp_sizeof_str(len) - len;
+
+    if (tp_ensure(tp, hsz + len) == -1) {
+        return NGX_ERROR;
+    }
+
+    p = (u_char *) tp->p + hsz;
+    n = ngx_http_tnt_urldecode_to(p, src, end) - p;
+
+    if (mp_sizeof_str(n) - n != hsz) {
+        ngx_memmove(tp->p + mp_sizeof_str(n) - n, p, n);
+    }
+
+    mp_encode_strl(tp->p, n);
+
+    if (tp_add(tp, mp_sizeof_str(n)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_init(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result)
+{
+    ngx_int_t                   rc;
+    ngx_http_tnt_ctx_t          *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    memset(prepared_result, 0, sizeof(ngx_http_tnt_prepared_result_t));
+
+    prepared_result->space_id = conf->space_id;
+    prepared_result->index_id = conf->index_id;
+    prepared_result->limit = conf->select_limit;
+    prepared_result->offset = conf->select_offset;
+    prepared_result->iter_type = conf->iter_type;
+
+    if (conf->format_values == NULL) {
+        ctx->format_values = NULL;
+        ctx->format_nvalues = 0;
+        return NGX_OK;
+    }
+
+    /** The values are copied into the flat array of the request, the
+     *  slots are the same as in the conf's format_values
+     */
+    ctx->format_nvalues = conf->format_values->nelts;
+    ctx->format_values = ngx_palloc(r->pool,
+            sizeof(ngx_http_tnt_format_value_t) * ctx->format_nvalues);
+    if (ctx->format_values == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(ctx->format_values, conf->format_values->elts,
+            sizeof(ngx_http_tnt_format_value_t) * ctx->format_nvalues);
+
+    rc = ngx_http_tnt_format_read_input(r, &prepared_result->in);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_prepare(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result)
+{
+    enum {
+        NOTHING = 0,
+        EXPECTS_LIMIT = 2,
+        EXPECTS_OFFSET = 4,
+        EXPECTS_ITER_TYPE = 8,
+        EXPECTS_SPACE_ID = 16,
+        EXPECTS_INDEX_ID = 32,
+    };
+
+    u_char                     *arg_begin, *end;
+    ngx_http_tnt_next_arg_t    arg;
+    ngx_str_t                  key, value;
+    ngx_int_t                  tmp;
+    ngx_int_t                  expects;
+    ngx_int_t                  rc;
+    ngx_http_tnt_ctx_t         *ctx;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+
+    expects = NOTHING;
+    arg.it = prepared_result->in.data;
+    arg_begin = arg.it;
+    end = arg.it + prepared_result->in.len;
+    arg.value = NULL;
+
+    if (conf->limit_name.len != 0) {
+        expects |= EXPECTS_LIMIT;
+    }
+
+    if (conf->offset_name.len != 0) {
+        expects |= EXPECTS_OFFSET;
+    }
+
+    if (conf->iter_type_name.len != 0) {
+        expects |= EXPECTS_ITER_TYPE;
+    }
+
+    if (conf->space_id_name.len != 0) {
+        expects |= EXPECTS_SPACE_ID;
+    }
+
+    if (conf->index_id_name.len != 0) {
+        expects |= EXPECTS_INDEX_ID;
+    }
+
+    for (; arg.it < end; ) {
+
+
+        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+
+        if (arg.value != NULL) {
+
+            key.data = arg_begin;
+            key.len = arg.value - arg_begin;
+
+            value.data = arg.value;
+            value.len = arg.it - arg.value;
+
+            if (expects & EXPECTS_LIMIT &&
+                    key.len == conf->limit_name.len &&
+                    ngx_strncmp(key.data, conf->limit_name.data,
+                                conf->limit_name.len) == 0)
+            {
+                prepared_result->limit = conf->select_limit_max;
+                tmp = ngx_atoi(value.data, value.len);
+
+                if (tmp >= 0) {
+
+                    if ((ngx_uint_t) tmp > conf->select_limit_max) {
+                        goto not_allowed;
+                    }
+
+                    prepared_result->limit = (ngx_uint_t) tmp;
+
+                    expects &= ~EXPECTS_LIMIT;
+                }
+            }
+            else if (expects & EXPECTS_OFFSET &&
+                    key.len == conf->offset_name.len &&
+                    ngx_strncmp(key.data, conf->offset_name.data,
+                                conf->offset_name.len) == 0)
+            {
+                tmp = ngx_atoi(value.data, value.len);
+                if (tmp >= 0) {
+                    prepared_result->offset = (ngx_uint_t) tmp;
+                    expects &= ~EXPECTS_OFFSET;
+                }
+            }
+            else if (expects & EXPECTS_ITER_TYPE &&
+                    key.len == conf->iter_type_name.len &&
+                    ngx_strncmp(key.data, conf->iter_type_name.data,
+                                conf->iter_type_name.len) == 0)
+            {
+                if (ngx_http_tnt_set_iter_type(&value, (ngx_uint_t *) &tmp) == NGX_OK) {
+                    prepared_result->iter_type = (ngx_uint_t) tmp;
+                    expects &= ~EXPECTS_ITER_TYPE;
+                }
+            }
+            else if (expects & EXPECTS_SPACE_ID &&
+                    key.len == conf->space_id_name.len &&
+                    ngx_strncmp(key.data, conf->space_id_name.data,
+                                conf->space_id_name.len) == 0)
+            {
+                tmp = ngx_atoi(value.data, value.len);
+                if (tmp >= 0) {
+                    prepared_result->space_id = (ngx_uint_t) tmp;
+                    expects &= ~EXPECTS_SPACE_ID;
+                }
+            }
+            else if (conf->after_name.len != 0 &&
+                    key.len == conf->after_name.len &&
+                    ngx_strncmp(key.data, conf->after_name.data,
+                                conf->after_name.len) == 0)
+            {
+                rc = ngx_http_tnt_format_prepare_after(r, prepared_result,
+                        &key, &value);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+            else if (expects & EXPECTS_INDEX_ID &&
+                    key.len == conf->index_id_name.len &&
+                    ngx_strncmp(key.data, conf->index_id_name.data,
+                                conf->index_id_name.len) == 0)
+            {
+                tmp = ngx_atoi(value.data, value.len);
+                if (tmp >= 0) {
+                    prepared_result->index_id = (ngx_uint_t) tmp;
+                    expects &= ~EXPECTS_INDEX_ID;
+                }
+            }
+            else {
+
+                rc = ngx_http_tnt_format_prepare_kv(conf, r, prepared_result,
+                        &key, &value);
+
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+
+        }
+
+        arg_begin = ++arg.it;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    /** The rows of a bulk body are bound by ngx_http_tnt_bulk_next() */
+    if ((ctx->dml_body == DML_BODY_JSON || ctx->dml_body == DML_BODY_MSGPACK)
+        && r->headers_in.content_length_n > 0)
+    {
+        rc = ngx_http_tnt_format_prepare_body(conf, r, prepared_result);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    rc = ngx_http_tnt_test_allowed(tlcf->allowed_spaces,
+            prepared_result->space_id);
+    if (rc != NGX_OK) {
+        goto not_allowed;
+    }
+
+    rc = ngx_http_tnt_test_allowed(tlcf->allowed_indexes,
+            prepared_result->index_id);
+    if (rc != NGX_OK) {
+        goto not_allowed;
+    }
+
+    if (expects == NOTHING) {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_BAD_REQUEST,
+                ngx_http_tnt_get_error_text(DML_HANDLER_FMT_ERROR)->msg);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_HTTP_BAD_REQUEST;
+
+not_allowed:
+
+    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_NOT_ALLOWED,
+                ngx_http_tnt_get_error_text(
+                        DML_HANDLER_FMT_LIMIT_ERROR)->msg);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_HTTP_NOT_ALLOWED;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_prepare_kv(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_http_tnt_format_value_t  *fmt_val;
+    ngx_http_tnt_ctx_t           *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    if (ctx->format_values == NULL) {
+        return NGX_OK;
+    }
+    if (value->len == 0 && value->data == NULL) {
+        return NGX_OK;
+    }
+
+    fmt_val = ngx_http_tnt_format_lookup(conf, ctx, key);
+    if (fmt_val == NULL) {
+        return NGX_OK;
+    }
+
+    if (fmt_val->in_list) {
+        return ngx_http_tnt_format_prepare_in_list(r, prepared_result,
+                fmt_val, value);
+    }
+
+    ngx_http_tnt_format_set_value(prepared_result, fmt_val, value);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_format_set_value(ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value)
+{
+    if (fmt_val->value.data == NULL) {
+
+        if (fmt_val->update_key) {
+            ++prepared_result->update_keys_count;
+
+        } else if (fmt_val->upsert_op) {
+            ++prepared_result->upsert_tuples_count;
+
+        } else {
+
+            ++prepared_result->tuples_count;
+        }
+    }
+
+    fmt_val->value = *value;
+}
+
+
+/** Read the JSON or MsgPack body as one MsgPack document. A JSON body is
+ *  transcoded from the buffers of the body, a MsgPack body is used as is,
+ *  if it has one buffer. An NDJSON body is transcoded into a sequence of
+ *  MsgPack documents.
+ */
+static ngx_int_t
+ngx_http_tnt_format_read_body(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_str_t *doc)
+{
+    size_t          size;
+    u_char          *p;
+    ngx_chain_t     *body;
+    tp_transcode_t  tc;
+
+    for (body = r->upstream->request_bufs; body; body = body->next) {
+
+        if (body->buf->in_file) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "in-file buffer found. aborted. "
+                "consider increasing your 'client_body_buffer_size' "
+                "setting");
+            return NGX_ERROR;
+        }
+    }
+
+    body = r->upstream->request_bufs;
+
+    if (ctx->dml_body == DML_BODY_MSGPACK) {
+
+        if (body != NULL && body->next == NULL) {
+            doc->data = body->buf->pos;
+            doc->len = body->buf->last - body->buf->pos;
+            return NGX_OK;
+        }
+
+        doc->data = ngx_pnalloc(r->pool, r->headers_in.content_length_n);
+        if (doc->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = doc->data;
+
+        for (; body; body = body->next) {
+            p = ngx_cpymem(p, body->buf->pos, body->buf->last - body->buf->pos);
+        }
+
+        doc->len = p - doc->data;
+
+        return NGX_OK;
+    }
+
+    /** '[]' of JSON is 5 bytes of MsgPack */
+    size = r->headers_in.content_length_n * 5 / 2 + 16;
+
+    doc->data = ngx_pnalloc(r->pool, size);
+    if (doc->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    tp_transcode_init_args_t args = {
+        .output = (char *) doc->data,
+        .output_size = size,
+        .method = NULL, .method_len = 0,
+        .codec = YAJL_JSON_TO_MP,
+        .mf = NULL
+    };
+
+    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "[BUG] failed to call tp_transcode_init(json body)");
+        return NGX_ERROR;
+    }
+
+    if (ctx->dml_body == DML_BODY_NDJSON) {
+        tp_json_to_mp_allow_multiple_values(&tc);
+    }
+
+    for (; body; body = body->next) {
+
+        if (tp_transcode(&tc, (char *) body->buf->pos,
+                    body->buf->last - body->buf->pos) == TP_TRANSCODE_ERROR)
+        {
+            goto bad_request;
+        }
+    }
+
+    if (tp_transcode_complete(&tc, &size) == TP_TRANSCODE_ERROR) {
+        goto bad_request;
+    }
+
+    tp_transcode_free(&tc);
+
+    doc->len = size;
+
+    return NGX_OK;
+
+bad_request:
+
+    doc->len = 0;
+
+    if (ngx_http_tnt_set_err(r, NGX_HTTP_BAD_REQUEST, (u_char *) tc.errmsg,
+                tc.errmsg != NULL ? ngx_strlen(tc.errmsg) : 0) != NGX_OK)
+    {
+        tp_transcode_free(&tc);
+        return NGX_ERROR;
+    }
+
+    tp_transcode_free(&tc);
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+/** Bind the values of a JSON or MsgPack body. The body is an object, which
+ *  is matched by the names of the format, or an array, which is matched by
+ *  the positions of the format: {"id": 1, "name": "x"} or [1, "x"].
+ *
+ *  Strings are bound like query args. Other values are bound as they are,
+ *  so numbers, booleans, nulls and arrays keep their types.
+ */
+static ngx_int_t
+ngx_http_tnt_format_prepare_body(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result)
+{
+    ngx_int_t           rc;
+    ngx_str_t           doc;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    if (ctx->format_values == NULL) {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_tnt_format_read_body(r, ctx, &doc);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return ngx_http_tnt_format_prepare_doc(conf, r, prepared_result, &doc);
+}
+
+
+/** Bind the values of a MsgPack document, i.e. of a body or of a row of
+ *  a bulk body, see ngx_http_tnt_format_prepare_body()
+ */
+static ngx_int_t
+ngx_http_tnt_format_prepare_doc(ngx_http_tnt_loc_conf_t *conf,
+        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_str_t *doc)
+{
+    uint32_t                     i, n, len;
+    ngx_int_t                    rc, map;
+    ngx_str_t                    key, value;
+    const char                   *p, *end, *val;
+    ngx_http_tnt_ctx_t           *ctx;
+    ngx_http_tnt_format_value_t  *fmt_val;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    p = (const char *) doc->data;
+    end = p + doc->len;
+
+    if (doc->len == 0 || mp_check(&p, end) != 0 || p != end) {
+        goto bad_body;
+    }
+
+    p = (const char *) doc->data;
+
+    switch (mp_typeof(*p)) {
+    case MP_MAP:
+        map = 1;
+        n = mp_decode_map(&p);
+        break;
+    case MP_ARRAY:
+        map = 0;
+        n = mp_decode_array(&p);
+        break;
+    default:
+        goto bad_body;
+    }
+
+    for (i = 0; i < n; i++) {
+
+        fmt_val = NULL;
+
+        if (map) {
+
+            if (mp_typeof(*p) != MP_STR) {
+                mp_next(&p);
+                mp_next(&p);
+                continue;
+            }
+
+            key.data = (u_char *) mp_decode_str(&p, &len);
+            key.len = len;
+
+            fmt_val = ngx_http_tnt_format_lookup(conf, ctx, &key);
+
+        } else if (i < ctx->format_nvalues) {
+            fmt_val = &ctx->format_values[i];
+
+            /** Query args are bound first */
+            if (fmt_val->value.len != 0 && !fmt_val->in_list) {
+                fmt_val = NULL;
+            }
+        }
+
+        val = p;
+        mp_next(&p);
+
+        if (fmt_val == NULL) {
+            continue;
+        }
+
+        if (mp_typeof(*val) == MP_STR) {
+
+            value.data = (u_char *) mp_decode_str(&val, &len);
+            value.len = len;
+
+            if (fmt_val->in_list) {
+
+                rc = ngx_http_tnt_format_prepare_in_list(r, prepared_result,
+                        fmt_val, &value);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                continue;
+            }
+
+            ngx_str_null(&fmt_val->mp);
+
+        } else {
+
+            /** A list of keys is a string */
+            if (fmt_val->in_list) {
+                return ngx_http_tnt_format_bind_bad_request(r,
+                        &fmt_val->name, "A string is expecting.");
+            }
+
+            value.data = (u_char *) val;
+            value.len = p - val;
+
+            fmt_val->mp = value;
+        }
+
+        ngx_http_tnt_format_set_value(prepared_result, fmt_val, &value);
+    }
+
+    return NGX_OK;
+
+bad_body:
+
+    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_BAD_REQUEST,
+                ngx_http_tnt_get_error_text(DML_BODY_ERROR)->msg);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+/** Decode the cursor of the previous page, a cursor is the position of the
+ *  last tuple in base64url, see ngx_http_tnt_send_reply(). An empty cursor
+ *  means the first page.
+ */
+static ngx_int_t
+ngx_http_tnt_format_prepare_after(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_str_t  *after;
+
+    if (value->len == 0) {
+        return NGX_OK;
+    }
+
+    after = &prepared_result->after;
+
+    after->data = ngx_pnalloc(r->pool, ngx_base64_decoded_length(value->len));
+    if (after->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_decode_base64url(after, value) != NGX_OK) {
+        return ngx_http_tnt_format_bind_bad_request(r, key,
+                "Cursor is expecting.");
+    }
+
+    return NGX_OK;
+}
+
+
+/** Add the keys of an argument to the IN-list, an argument is a key or
+ *  a comma separated list of keys, the argument also can be repeated:
+ *  '?id=1,2&id=3'. Each key is bound by its own select, see
+ *  ngx_http_tnt_dml_handler().
+ */
+static ngx_int_t
+ngx_http_tnt_format_prepare_in_list(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value)
+{
+    u_char     *p, *last, *next;
+    ngx_str_t  *k;
+
+    if (prepared_result->in_keys == NULL) {
+
+        prepared_result->in_keys = ngx_array_create(r->pool, 4,
+                sizeof(ngx_str_t));
+        if (prepared_result->in_keys == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    p = value->data;
+    last = value->data + value->len;
+
+    for (; p < last; p = next + 1) {
+
+        next = ngx_strlchr(p, last, ',');
+        if (next == NULL) {
+            next = last;
+        }
+
+        if (next == p) {
+            continue;
+        }
+
+        k = ngx_array_push(prepared_result->in_keys);
+        if (k == NULL) {
+            return NGX_ERROR;
+        }
+
+        k->data = p;
+        k->len = next - p;
+    }
+
+    if (fmt_val->value.len == 0 && prepared_result->in_keys->nelts > 0) {
+        fmt_val->value = *value;
+        ++prepared_result->tuples_count;
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_tnt_read_next(ngx_str_t *str, u_char sep)
+{
+    u_char *beg = str->data;
+    u_char *end = str->data + str->len;
+
+    for (; str->data < end; ++str->data, --str->len) {
+
+        if (*str->data == sep) {
+            ++str->data;
+            --str->len;
+            return beg;
+        }
+    }
+
+    return NULL;
+}
+
+static ngx_int_t
+ngx_http_tnt_format_bind_bad_request(ngx_http_request_t *r, ngx_str_t *name,
+        const char *msg)
+{
+    ngx_int_t  rc;
+    u_char     err_msg[64];
+
+    if (msg == NULL) {
+        snprintf((char *) err_msg, sizeof(err_msg), "'%.*s' is invalid",
+                (int) name->len, (char *) name->data);
+    } else {
+         snprintf((char *) err_msg, sizeof(err_msg), "'%.*s' is invalid. %s",
+                (int) name->len, (char *) name->data, msg);
+    }
+
+    rc = ngx_http_tnt_set_err(r, NGX_HTTP_BAD_REQUEST, err_msg,
+            ngx_strlen(err_msg));
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_bind_operation(ngx_http_request_t *r, struct tp *tp,
+        ngx_str_t *name, ngx_str_t *val)
+{
+    u_char      *update_operation, *filedno_pt, *filedno_pt_end;
+    ngx_int_t   filedno;
+
+    update_operation = ngx_http_tnt_read_next(val, ',');
+
+    if (update_operation == NULL) {
+        goto no_operation_type;
+    }
+
+    switch (*update_operation) {
+    case '=':
+    case '!':
+    case '+':
+    case '-':
+    case '&':
+    case '^':
+    case '|':
+    case '#':
+        break;
+    default:
+        goto no_operation_type;
+    }
+
+    filedno_pt = ngx_http_tnt_read_next(val, ',');
+    filedno_pt_end = (val->data - 1);
+
+    if (filedno_pt == NULL || (size_t) (filedno_pt_end - filedno_pt) == 0) {
+        goto no_fieldno;
+    }
+
+    filedno = ngx_atoi(filedno_pt, (size_t) (filedno_pt_end - filedno_pt));
+    if (filedno < 0 || filedno - 1 < 0) {
+        goto no_fieldno;
+    }
+    filedno -= 1;
+
+    if (tp_op(tp, *update_operation, (uint32_t) filedno) == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+no_operation_type:
+    return ngx_http_tnt_format_bind_bad_request( r, name,
+            "Operation type is expecting");
+
+no_fieldno:
+    return ngx_http_tnt_format_bind_bad_request( r, name,
+            "Fieldno is expecting");
+}
+
+
+/** Encode one scalar value of the type of fmt_val.
+ *
+ *  Returns NGX_OK, NGX_ERROR if the tp buffer is full or an HTTP status.
+ */
+static ngx_int_t
+ngx_http_tnt_format_bind_scalar(ngx_http_request_t *r, struct tp *tp,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value)
+{
+    u_char      *p;
+    char        num_buf[32];
+
+    if (fmt_val->nullable
+        && value->len == sizeof("null") - 1
+        && ngx_strncmp(value->data, "null", sizeof("null") - 1) == 0)
+    {
+        return tp_encode_nil(tp) == NULL ? NGX_ERROR : NGX_OK;
+    }
+
+    switch (fmt_val->type) {
+    case TP_BOOL:
+        if (value->len == sizeof("true") - 1 &&
+                ngx_strncasecmp(value->data,
+                    (u_char *) "true", sizeof("true") - 1) == 0)
+        {
+            if (tp_encode_bool(tp, true) == NULL) {
+                return NGX_ERROR;
+            }
+        } else if (value->len == sizeof("false") - 1 &&
+            ngx_strncasecmp(value->data,
+                        (u_char *) "false", sizeof("false") - 1) == 0)
+        {
+            if (tp_encode_bool(tp, false) == NULL) {
+                return NGX_ERROR;
+            }
+        }
+        else {
+            return ngx_http_tnt_format_bind_bad_request(
+                    r, &fmt_val->name, "True/False is expecting.");
+        }
+
+        break;
+    case TP_INT:
+
+        snprintf(num_buf, sizeof(num_buf), "%.*s",
+                (int) value->len, (char *) value->data);
+
+        if (*value->data == '-') {
+
+            if (tp_encode_int(tp, (int64_t) atoll(num_buf)) == NULL) {
+                return NGX_ERROR;
+            }
+
+        } else if (tp_encode_uint(tp, (int64_t) atoll(num_buf)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        break;
+    case TP_UINT:
+
+        if (value->len == 0 || value->len >= sizeof(num_buf)) {
+            goto not_unsigned;
+        }
+
+        for (p = value->data; p < value->data + value->len; p++) {
+            if (*p < '0' || *p > '9') {
+                goto not_unsigned;
+            }
+        }
+
+        snprintf(num_buf, sizeof(num_buf), "%.*s",
+                (int) value->len, (char *) value->data);
+
+        if (tp_encode_uint(tp, (uint64_t) strtoull(num_buf, NULL, 10))
+                == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        break;
+    case TP_DOUBLE:
+
+        snprintf((char *) num_buf, sizeof(num_buf), "%.*s",
+                (int) value->len, (char *) value->data);
+
+        if (tp_encode_double(tp, atof(num_buf)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        break;
+    case TP_FLOAT:
+
+        snprintf((char *) num_buf, sizeof(num_buf), "%.*s",
+                (int) value->len, (char *) value->data);
+
+        if (tp_encode_double(tp, (float) atof(num_buf)) == NULL) {
+            return NGX_ERROR;
+        }
+
+        break;
+    case TP_STR:
+        if (tp_encode_str(tp, (const char *) value->data,
+                    value->len) == NULL)
+        {
+            return NGX_ERROR;
+        }
+        break;
+    default:
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Can't issue the query, error = 'unknown type %d'",
+            (int) fmt_val->type);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+not_unsigned:
+    return ngx_http_tnt_format_bind_bad_request(r, &fmt_val->name,
+            "Unsigned is expecting.");
+}
+
+
+/** Check the type of a value of a JSON or MsgPack body and encode it as is.
+ */
+static ngx_int_t
+ngx_http_tnt_format_bind_mp_scalar(ngx_http_request_t *r, struct tp *tp,
+        ngx_http_tnt_format_value_t *fmt_val, const char **p)
+{
+    const char  *begin;
+
+    begin = *p;
+
+    switch (mp_typeof(**p)) {
+    case MP_NIL:
+        if (!fmt_val->nullable) {
+            goto bad_type;
+        }
+        break;
+    case MP_UINT:
+        if (fmt_val->type == TP_DOUBLE || fmt_val->type == TP_FLOAT) {
+            return tp_encode_double(tp, (double) mp_decode_uint(p)) == NULL ?
+                NGX_ERROR : NGX_OK;
+        }
+
+        if (fmt_val->type != TP_INT && fmt_val->type != TP_UINT) {
+            goto bad_type;
+        }
+        break;
+    case MP_INT:
+        if (fmt_val->type == TP_DOUBLE || fmt_val->type == TP_FLOAT) {
+            return tp_encode_double(tp, (double) mp_decode_int(p)) == NULL ?
+                NGX_ERROR : NGX_OK;
+        }
+
+        if (fmt_val->type != TP_INT) {
+            goto bad_type;
+        }
+        break;
+    case MP_FLOAT:
+    case MP_DOUBLE:
+        if (fmt_val->type != TP_DOUBLE && fmt_val->type != TP_FLOAT) {
+            goto bad_type;
+        }
+        break;
+    case MP_BOOL:
+        if (fmt_val->type != TP_BOOL) {
+            goto bad_type;
+        }
+        break;
+    case MP_STR:
+        if (fmt_val->type != TP_STR) {
+            goto bad_type;
+        }
+        break;
+    default:
+        goto bad_type;
+    }
+
+    mp_next(p);
+
+    return tp_encode_raw(tp, begin, *p - begin) == NULL ? NGX_ERROR : NGX_OK;
+
+bad_type:
+    return ngx_http_tnt_format_bind_bad_request(r, &fmt_val->name,
+            "Wrong type.");
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_bind_mp(ngx_http_request_t *r, struct tp *tp,
+        ngx_http_tnt_format_value_t *fmt_val)
+{
+    uint32_t    n;
+    ngx_int_t   rc;
+    const char  *p;
+
+    p = (const char *) fmt_val->mp.data;
+
+    if (!fmt_val->array || mp_typeof(*p) != MP_ARRAY) {
+
+        if (fmt_val->array && !(fmt_val->nullable && mp_typeof(*p) == MP_NIL))
+        {
+            return ngx_http_tnt_format_bind_bad_request(r, &fmt_val->name,
+                    "An array is expecting.");
+        }
+
+        return ngx_http_tnt_format_bind_mp_scalar(r, tp, fmt_val, &p);
+    }
+
+    n = mp_decode_array(&p);
+
+    if (tp_encode_array(tp, n) == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (; n > 0; n--) {
+
+        rc = ngx_http_tnt_format_bind_mp_scalar(r, tp, fmt_val, &p);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/** Encode a value, an array is a comma separated list of the elements:
+ *  'tags=a,b,c' is ["a", "b", "c"] for 'tags=%s[]'.
+ */
+static ngx_int_t
+ngx_http_tnt_format_bind_value(ngx_http_request_t *r, struct tp *tp,
+        ngx_http_tnt_format_value_t *fmt_val, ngx_str_t *value)
+{
+    u_char      *p, *last, *next;
+    uint32_t    n;
+    ngx_int_t   rc;
+    ngx_str_t   elem;
+
+    if (fmt_val->mp.data != NULL) {
+        return ngx_http_tnt_format_bind_mp(r, tp, fmt_val);
+    }
+
+    if (!fmt_val->array) {
+        return ngx_http_tnt_format_bind_scalar(r, tp, fmt_val, value);
+    }
+
+    last = value->data + value->len;
+    n = 0;
+
+    if (value->len > 0) {
+        for (n = 1, p = value->data; p < last; p++) {
+            if (*p == ',') {
+                ++n;
+            }
+        }
+    }
+
+    if (tp_encode_array(tp, n) == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (p = value->data; n > 0; n--, p = next + 1) {
+
+        next = ngx_strlchr(p, last, ',');
+        if (next == NULL) {
+            next = last;
+        }
+
+        elem.data = p;
+        elem.len = next - p;
+
+        rc = ngx_http_tnt_format_bind_scalar(r, tp, fmt_val, &elem);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_format_bind(ngx_http_request_t *r,
+        ngx_http_tnt_prepared_result_t *prepared_result, struct tp *tp)
+{
+    ngx_int_t                    rc;
+    ngx_str_t                    *value;
+    ngx_uint_t                   i;
+    ngx_http_tnt_format_value_t  *fmt_val;
+    ngx_http_tnt_ctx_t           *ctx;
+    ngx_http_tnt_loc_conf_t      *tlcf;
+    ngx_int_t                    update_started;
+    ngx_int_t                    upsert_add_ops_started;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    if (ctx->format_values == NULL) {
+        return NGX_OK;
+    }
+
+    update_started = 0;
+    upsert_add_ops_started = 0;
+
+    fmt_val = ctx->format_values;
+
+    for (i = 0; i < ctx->format_nvalues; i++) {
+
+        value = &fmt_val[i].value;
+
+        if (value->len == 0 && value->data == NULL) {
+            continue;
+        }
+
+        if (fmt_val[i].in_list) {
+            value = (ngx_str_t *) prepared_result->in_keys->elts
+                        + prepared_result->in_key;
+        }
+
+        /** The operations are strings: '=,2,value' */
+        if (fmt_val[i].mp.data != NULL
+            && ((tlcf->req_type == TP_UPDATE && !fmt_val[i].update_key)
+                || (tlcf->req_type == TP_UPSERT && fmt_val[i].upsert_op)))
+        {
+            return ngx_http_tnt_format_bind_bad_request(r, &fmt_val[i].name,
+                    "A string is expecting.");
+        }
+
+        /** Update {{{ */
+        if (tlcf->req_type == TP_UPDATE) {
+
+            if (!update_started && !fmt_val[i].update_key) {
+
+                if (tp_updatebegin(tp,
+                        (uint32_t) prepared_result->tuples_count)
+                            == NULL)
+                {
+                    goto oom;
+                }
+
+                update_started = 1;
+            }
+
+            if (update_started) {
+
+                rc = ngx_http_tnt_format_bind_operation(r, tp,
+                        &fmt_val[i].name, value);
+                if (rc == NGX_ERROR) {
+                    goto oom;
+                } else if (rc != NGX_OK) {
+                    return rc;
+                }
+            }
+        }
+        /* }}} */
+
+        /** Upsert {{{ */
+        if (tlcf->req_type == TP_UPSERT && fmt_val[i].upsert_op) {
+
+            if (!upsert_add_ops_started) {
+
+                if (tp_upsertbegin_add_ops(tp,
+                        (uint32_t) prepared_result->upsert_tuples_count)
+                            == NULL)
+                {
+                    goto oom;
+                }
+
+                upsert_add_ops_started = 1;
+            }
+
+                rc = ngx_http_tnt_format_bind_operation(r, tp,
+                    &fmt_val[i].name, value);
+            if (rc == NGX_ERROR) {
+                goto oom;
+            } else if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+        /* }}} */
+
+        rc = ngx_http_tnt_format_bind_value(r, tp, &fmt_val[i], value);
+        if (rc == NGX_ERROR) {
+            goto oom;
+        } else if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+
+oom:
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Can't issue the query, error = '%V'",
+            &ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE)->msg);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_add_header_in(ngx_http_request_t *r,
+        ngx_http_tnt_header_val_t *hv, ngx_str_t *value)
+{
+    ngx_table_elt_t  *h;
+
+    if (value->len) {
+
+        h = ngx_list_push(&r->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = 1;
+        h->key = hv->key;
+        h->value = *value;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_process_headers(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf)
+{
+    ngx_uint_t                i;
+    ngx_str_t                 value;
+    ngx_http_tnt_header_val_t *h;
+
+    if (tlcf->headers == NULL) {
+        return NGX_OK;
+    }
+
+    h = tlcf->headers->elts;
+
+    for (i = 0; i < tlcf->headers->nelts; i++) {
+
+        if (ngx_http_complex_value(r, &h[i].value, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (h[i].handler(r, &h[i], &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_tnt_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t                 *value;
+    ngx_url_t                 u;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (tlcf->upstream.upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    tlcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
+    if (tlcf->upstream.upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_tnt_handler;
+
+    if (clcf->name.data[clcf->name.len - 1] == '/') {
+        clcf->auto_redirect = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+/** }}}
+ */
+
+
+/** Filters {{{
+ */
+static ngx_int_t
+ngx_http_tnt_filter_init(void *data)
+{
+    dd("init filter");
+
+    ngx_http_request_t  *r = data;
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_http_tnt_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    ctx->state = READ_PAYLOAD;
+    ctx->payload_size = ctx->rest = 0;
+
+    if (u->headers_in.status_n != 200) {
+        u->length = 0;
+    } else {
+        u->length = -1;
+    }
+
+    return NGX_OK;
+}
+
+
+/** Pass the position of the last tuple of a select to the reply as
+ *  the cursor of the next page, the position is opaque, so it's just
+ *  encoded in base64url.
+ */
+static ngx_int_t
+ngx_http_tnt_set_cursor(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        tp_transcode_t *tc)
+{
+    ngx_str_t          pos, cursor;
+    struct tpresponse  resp;
+
+    if (tp_reply(&resp, (const char *) ctx->tp_cache->start,
+                ctx->tp_cache->end - ctx->tp_cache->start) <= 0
+        || resp.position == NULL)
+    {
+        return NGX_OK;
+    }
+
+    pos.data = (u_char *) resp.position;
+    pos.len = resp.position_end - resp.position;
+
+    cursor.data = ngx_pnalloc(r->pool, ngx_base64_encoded_length(pos.len));
+    if (cursor.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_encode_base64url(&cursor, &pos);
+
+    tp_reply_to_json_set_cursor(tc, (const char *) cursor.data, cursor.len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_send_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
+{
+    tp_transcode_t          tc;
+    ngx_int_t               rc;
+    ngx_http_tnt_loc_conf_t *tlcf;
+    ngx_buf_t               *output;
+    size_t                  output_size;
+    uint64_t                start;
+    ngx_http_tnt_objects_t  *ob;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    start = ngx_http_tnt_stats_clock(tlcf);
+
+    TNT_PROBE2(tp2json__begin, r, ctx->payload_size);
+
+    output_size =
+        (ctx->tp_cache->end - ctx->tp_cache->start + ngx_http_tnt_overhead())
+        * tlcf->out_multiplier;
+
+    /** vshard.storage.call() replies aren't tuples */
+    ob = NULL;
+    if (tlcf->objects != NULL && ctx->vshard.func == NULL) {
+
+        ob = ngx_http_tnt_objects_get(r, tlcf, ctx);
+
+        if (ob != NULL) {
+            output_size += ngx_http_tnt_objects_size(ob,
+                    (const char *) ctx->tp_cache->start,
+                    ctx->tp_cache->end - ctx->tp_cache->start);
+        }
+    }
+    output = ngx_http_tnt_create_mem_buf(r, u, output_size);
+    if (output == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->stats.memory += output_size;
+
+    if (ctx->batch_size > 0
+        && ctx->rest_batch_size == ctx->batch_size)
+    {
+        *output->pos = '[';
+        ++output->pos;
+    }
+
+    tp_transcode_init_args_t args = {
+        .output = (char *) output->pos,
+        .output_size = output->end - output->pos,
+        .method = NULL, .method_len = 0,
+        .codec = TP_REPLY_TO_JSON,
+        .mf = NULL
+    };
+
+    rc = tp_transcode_init(&tc, &args);
+    if (rc == TP_TRANSCODE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "[BUG] failed to call tp_transcode_init(output)");
+        return NGX_ERROR;
+    }
+
+    tp_reply_to_json_set_options(&tc, tlcf->pure_result == NGX_TNT_CONF_ON,
+            tlcf->multireturn_skip_count);
+
+    /** vshard.storage.call() returns 'true, result...' */
+    tp_reply_to_json_set_unwrap_status(&tc,
+            ctx->vshard.func != NULL && ctx->vshard.peer >= 0);
+
+    if (ob != NULL) {
+        tp_reply_to_json_set_fields(&tc, ob->fields, ob->nfields,
+                                    ob->names == NULL);
+    }
+
+    if (tlcf->after_name.len != 0) {
+        rc = ngx_http_tnt_set_cursor(r, ctx, &tc);
+        if (rc != NGX_OK) {
+            goto error_exit;
+        }
+    }
+
+    rc = tp_transcode(&tc, (char *)ctx->tp_cache->start,
+                      ctx->tp_cache->end - ctx->tp_cache->start);
+    if (rc != TP_TRANSCODE_ERROR) {
+
+        /* Finishing */
+        size_t complete_msg_size = 0;
+        rc = tp_transcode_complete(&tc, &complete_msg_size);
+        if (rc == TP_TRANSCODE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "[BUG] failed to complete output transcoding. "
+                    "UNKNOWN ERROR");
+            goto error_exit;
+        }
+
+        /* Send an error to the client */
+        if (rc == TP_TNT_ERROR) {
+            ngx_pfree(r->pool, output);
+
+            if (ngx_http_tnt_set_err(r, tc.errcode,
+                    (u_char *) tc.errmsg, ngx_strlen(tc.errmsg)) != NGX_OK)
+            {
+                goto error_exit;
+            }
+        } else {
+            output->last = output->pos + complete_msg_size;
+        }
+    }
+    /** Transcoder down */
+    else {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "[BUG] failed to transcode output. errcode: '%d', errmsg: '%s'",
+            tc.errcode, get_str_safe((const u_char *) tc.errmsg));
+        goto error_exit;
+    }
+
+    /** Transcoding - OK */
+    tp_transcode_free(&tc);
+
+    ngx_http_tnt_stats_transcoded(tlcf, ctx, start, 1);
+
+    TNT_PROBE2(tp2json__end, r, output->last - output->pos);
+
+    if (ctx->batch_size > 0) {
+
+        if (ctx->rest_batch_size == 1)
+        {
+            *output->last = ']';
+            ++output->last;
+        }
+        else if (ctx->rest_batch_size <= ctx->batch_size)
+        {
+            *output->last = ',';
+            ++output->last;
+        }
+    }
+
+    /** Reply was created in the ngx_http_tnt_output_err.
+     *  That means we don't need the 'output' buffer.
+     */
+    if (ctx->in_err != NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_http_tnt_output(r, u, output);
+
+error_exit:
+
+    if (output) {
+        ngx_pfree(r->pool, output);
+    }
+
+    tp_transcode_free(&tc);
+
+    return NGX_ERROR;
+}
+
+
+/** Reads the sync of a reply for $tnt_sync, [p, end) is the reply after
+ *  its size
+ */
+static void
+ngx_http_tnt_read_sync(ngx_http_tnt_ctx_t *ctx, const char *p,
+        const char *end)
+{
+    const char  *h;
+    uint32_t    n;
+
+    h = p;
+    if (p >= end || mp_typeof(*p) != MP_MAP || mp_check(&h, end) != 0) {
+        return;
+    }
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_UINT) {
+            mp_next(&p);
+
+        } else if (mp_decode_uint(&p) == TP_SYNC && mp_typeof(*p) == MP_UINT) {
+            ctx->stats.sync = mp_decode_uint(&p);
+            ctx->stats.has_sync = 1;
+            return;
+        }
+
+        mp_next(&p);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_tnt_filter_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_buf_t *b)
+{
+    ngx_int_t               rc;
+    ngx_http_tnt_loc_conf_t *tlcf;
+
+    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    ssize_t            bytes = b->last - b->pos;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    dd("filter_reply -> recv bytes: %i, rest: %i",
+            (int) bytes, (int) ctx->rest);
+
+    if (ctx->state == READ_PAYLOAD) {
+
+        ssize_t payload_rest = ngx_min(ctx->payload.e - ctx->payload.p, bytes);
+
+        if (payload_rest > 0) {
+
+            ctx->payload.p = ngx_copy(ctx->payload.p, b->pos, payload_rest);
+            bytes -= payload_rest;
+            b->pos += payload_rest;
+            payload_rest = ctx->payload.e - ctx->payload.p;
+
+            dd("filter_reply -> payload rest:%i", (int) payload_rest);
+        }
+
+        if (payload_rest == 0) {
+
+            ctx->payload_size = tp_read_payload((char *) &ctx->payload.mem[0],
+                                                (char *) ctx->payload.e);
+            if (ctx->payload_size <= 0) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "[BUG] tp_read_payload failed, ret:%i",
+                        (int) ctx->payload_size);
+                return NGX_ERROR;
+            }
+
+            ctx->rest = ctx->payload_size - 5 /* - header size */;
+
+            dd("filter_reply -> got header payload:%i, rest:%i",
+                    (int) ctx->payload_size,
+                    (int) ctx->rest);
+
+            /** A skipped reply has no tp_cache, see
+             *  ngx_http_tnt_send_limited()
+             */
+            rc = ngx_http_tnt_reply_limited(r, tlcf, ctx, b);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            if (rc == NGX_OK) {
+
+                ctx->tp_cache = ngx_create_temp_buf(r->pool,
+                                                    ctx->payload_size);
+                if (ctx->tp_cache == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ctx->stats.memory += ctx->payload_size;
+
+                ctx->tp_cache->pos = ctx->tp_cache->start;
+                ctx->tp_cache->memory = 1;
+
+                ctx->tp_cache->pos = ngx_copy(ctx->tp_cache->pos,
+                                              &ctx->payload.mem[0],
+                                              sizeof(ctx->payload.mem) - 1);
+            }
+
+            ctx->payload.p = &ctx->payload.mem[0];
+
+            ctx->state = READ_BODY;
+
+        } else {
+            return NGX_OK;
+        }
+    }
+
+    rc = NGX_OK;
+
+    if (ctx->state == READ_BODY) {
+
+        ssize_t rest = ctx->rest - bytes, read_on = bytes;
+        if (rest < 0) {
+            rest *= -1;
+            read_on = bytes - rest;
+            ctx->rest = 0;
+            ctx->state = SEND_REPLY;
+            rc = NGX_AGAIN;
+        } else if (rest == 0) {
+            ctx->state = SEND_REPLY;
+            ctx->rest = 0;
+        } else {
+            ctx->rest -= bytes;
+        }
+
+        if (ctx->tp_cache != NULL) {
+            ctx->tp_cache->pos = ngx_copy(ctx->tp_cache->pos, b->pos, read_on);
+        }
+
+        b->pos += read_on;
+
+        dd("filter_reply -> read_on:%i, rest:%i, buf size:%i",
+                (int) read_on,
+                (int) ctx->rest,
+                (int) (b->last - b->pos));
+    }
+
+    if (ctx->state == SEND_REPLY) {
+
+        ctx->stats.payload_size += ctx->payload_size;
+        ++ctx->stats.replies;
+
+        if (ctx->tp_cache != NULL) {
+            ngx_http_tnt_read_sync(ctx,
+                    (const char *) ctx->tp_cache->start + 5 /* size */,
+                    (const char *) ctx->tp_cache->pos);
+        }
+
+        TNT_PROBE3(reply__header, r, ctx->stats.sync, ctx->payload_size);
+
+        if (tlcf->slowlog_zone != NULL && ctx->stats.reply.data == NULL
+            && ctx->tp_cache != NULL)
+        {
+            ngx_http_tnt_slowlog_sample(r, tlcf, ctx);
+        }
+
+        if (tlcf->schema_ref != NULL && ctx->tp_cache != NULL) {
+            ngx_http_tnt_schema_check_reply(r, tlcf, ctx->tp_cache);
+        }
+
+        if (ctx->tp_cache == NULL
+            && (ctx->tx.n > 0 || ctx->in_list.n > 0 || ctx->bulk.n > 0))
+        {
+            rc = ngx_http_tnt_merged_limited(r, u, ctx);
+        } else if (ctx->tp_cache == NULL) {
+            rc = ngx_http_tnt_send_limited(r, u, ctx);
+        } else if (ctx->tx.n > 0) {
+            rc = ngx_http_tnt_tx_reply(r, u, ctx);
+        } else if (ctx->in_list.n > 0) {
+            rc = ngx_http_tnt_in_list_reply(r, u, ctx);
+        } else if (ctx->bulk.n > 0) {
+            rc = ngx_http_tnt_bulk_reply(r, u, ctx);
+        } else {
+            rc = ngx_http_tnt_send_reply(r, u, ctx);
+        }
+
+        ctx->state = READ_PAYLOAD;
+        ctx->rest = ctx->payload_size = 0;
+
+        --ctx->rest_batch_size;
+
+        if (ctx->rest_batch_size <= 0) {
+            u->length = 0;
+            ctx->rest_batch_size = 0;
+            ctx->batch_size = 0;
+        }
+
+        ngx_pfree(r->pool, ctx->tp_cache);
+        ctx->tp_cache = NULL;
+
+        if (b->last - b->pos > 0) {
+            rc = NGX_AGAIN;
+        }
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_tnt_filter(void *data, ssize_t bytes)
+{
+    dd("filter");
+
+    ngx_http_request_t   *r = data;
+    ngx_http_upstream_t  *u = r->upstream;
+    ngx_buf_t            *b = &u->buffer;
+    ngx_http_tnt_ctx_t   *ctx;
+
+    b->last = b->last + bytes;
+
+    ngx_int_t rc = NGX_OK;
+    for (;;) {
+        rc = ngx_http_tnt_filter_reply(r, u, b);
+        if (rc != NGX_AGAIN)
+            break;
+        dd("Next message in same input buffer -- merge");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    /** Closing the connection rolls back an open transaction */
+    if (rc != NGX_ERROR && !ctx->tx.open) {
+      u->keepalive = 1;
+    }
+
+    return rc;
+}
+/** }}}
+ */
+
+
+/** Other functions and utils {{{
+ */
+static ngx_buf_t *
+ngx_http_tnt_create_mem_buf(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        size_t size)
+{
+    ngx_buf_t *b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->pos = b->start;
+
+    b->memory = 1;
+    b->flush = 1;
+    b->tag = u->output.tag;
+    b->last = b->end;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_output(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_buf_t *b)
+{
+    ngx_chain_t         *cl, **ll;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = b->start;
+    b->flush = 1;
+    b->last_in_chain = 1;
+    b->tag = u->output.tag;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    ctx->stats.json_size += b->last - b->pos;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *ll = cl;
+
+    return NGX_OK;
+}
+/** }}}
+ */
+
+
+/** Encodes the headers as map items, if pass_headers isn't NULL then only
+ *  the headers of tnt_pass_http_request_headers are encoded
+ */
+static ngx_int_t
+ngx_http_tnt_copy_headers(struct tp *tp, ngx_list_t *headers,
+        ngx_array_t *pass_headers, size_t *map_items)
+{
+    size_t                      i = 0;
+    ngx_uint_t                  k;
+    ngx_table_elt_t             *h;
+    ngx_list_part_t             *part;
+    ngx_http_tnt_pass_header_t  *ph;
+
+    if (headers->size > 0) {
+
+        part = &headers->part;
+        h = part->elts;
+
+        for (;; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+                part = part->next;
+                h = part->elts;
+                i = 0;
+            }
+
+            if (pass_headers == NULL) {
+
+                if (!tp_encode_str_map_item(tp,
+                                            (const char *) h[i].key.data,
+                                            h[i].key.len,
+                                            (const char *) h[i].value.data,
+                                            h[i].value.len) )
+                {
+                    return NGX_ERROR;
+                }
+
+                ++(*map_items);
+                continue;
+            }
+
+            ph = pass_headers->elts;
+
+            for (k = 0; k < pass_headers->nelts; k++) {
+
+                if (ph[k].lowcase.len != h[i].key.len) {
+                    continue;
+                }
+
+                /** The headers of a request have their lowcase_key, the
+                 *  headers of a reply may not have it
+                 */
+                if (h[i].lowcase_key != NULL) {
+
+                    if (h[i].hash != 0 && h[i].hash != ph[k].hash) {
+                        continue;
+                    }
+
+                    if (ngx_strncmp(h[i].lowcase_key, ph[k].lowcase.data,
+                                    ph[k].lowcase.len) != 0)
+                    {
+                        continue;
+                    }
+
+                } else if (ngx_strncasecmp(h[i].key.data, ph[k].lowcase.data,
+                                           ph[k].lowcase.len) != 0)
+                {
+                    continue;
+                }
+
+                if (tp_ensure(tp, ph[k].key.len
+                                  + mp_sizeof_str(h[i].value.len)) == -1)
+                {
+                    return NGX_ERROR;
+                }
+
+                ngx_memcpy(tp->p, ph[k].key.data, ph[k].key.len);
+
+                if (tp_add(tp, ph[k].key.len) == NULL
+                    || tp_encode_str(tp, (const char *) h[i].value.data,
+                                     h[i].value.len) == NULL)
+                {
+                    return NGX_ERROR;
+                }
+
+                ++(*map_items);
+                break;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_tnt_get_output_size(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_http_tnt_loc_conf_t *tlcf)
+{
+    (void) ctx;
+
+    size_t output_size = ngx_http_tnt_overhead();
+
+    if (r->headers_in.content_length_n > 0) {
+      output_size += r->headers_in.content_length_n;
+    }
+
+    if (tlcf->method.len) {
+      output_size += tlcf->method.len;
+    }
+
+    output_size *= tlcf->in_multiplier + 20 /* header overhead */;
+
+    /** The request data is encoded into the output, see
+     *  ngx_http_tnt_encode_request_data()
+     */
+    if (tlcf->pass_http_request & NGX_TNT_CONF_ON) {
+        output_size += tlcf->pass_http_request_buffer_size;
+    }
+
+    return output_size;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_output_err(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_int_t code)
+{
+    ngx_http_upstream_t  *u;
+    ngx_chain_t          *cl, **ll;
+
+    u = r->upstream;
+
+    if (ctx->in_err == NULL) {
+        u->headers_in.status_n = 500;
+        u->state->status = 500;
+        u->headers_in.content_length_n = 0;
+        return NGX_OK;
+    }
+
+    u->headers_in.status_n = code;
+    u->state->status = code;
+    u->headers_in.content_length_n = ctx->in_err->last - ctx->in_err->pos;
+    u->length = 0;
+
+    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    *ll = cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = ctx->in_err;
+    cl->next = NULL;
+
+    cl->buf->pos = cl->buf->start;
+    cl->buf->end = cl->buf->last;
+
+    ctx->stats.json_size += cl->buf->last - cl->buf->pos;
+
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+    cl->buf->tag = u->output.tag;
+    cl->buf->last_in_chain = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_read_greeting(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_buf_t *b)
+{
+    /** The greeting belongs to the connection, a cached connection (e.g.
+     *  from 'keepalive' or 'tnt_prewarm') has sent it already.
+     */
+    if (r->upstream->peer.cached) {
+        ctx->greeting = 1;
+        return NGX_OK;
+    }
+
+    /** Wait for the whole greeting, it could come by parts */
+    if (b->last - b->pos < (ptrdiff_t) sizeof("Tarantool") - 1) {
+        return NGX_AGAIN;
+    }
+
+    if (b->pos[0] == 'T'
+        && b->pos[1] == 'a'
+        && b->pos[2] == 'r'
+        && b->pos[3] == 'a'
+        && b->pos[4] == 'n'
+        && b->pos[5] == 't'
+        && b->pos[6] == 'o'
+        && b->pos[7] == 'o'
+        && b->pos[8] == 'l')
+    {
+        if (b->last - b->pos < 128) {
+            return NGX_AGAIN;
+        }
+
+        b->pos = b->pos + 128;
+        /**
+         *  Nginx should read only "greeting" (128 bytes).
+         *  If tarantool sent the only one message (i.e. greeting),
+         *  then we have to tell to nginx, that it needs read more bytes.
+         */
+        if (b->pos == b->last) {
+            return NGX_AGAIN;
+        }
+    }
+
+    ctx->greeting = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_wakeup_dying_upstream(ngx_http_request_t *r,
+        ngx_chain_t *out_chain)
+{
+    static const u_char fd_event[] =
+              "{\"method\":\"__nginx_tnt_event\",\"params\":[]}";
+
+    ngx_http_tnt_ctx_t          *ctx;
+    ngx_http_tnt_loc_conf_t     *tlcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    out_chain->buf = ngx_create_temp_buf(r->pool,
+                                sizeof(fd_event) * tlcf->in_multiplier);
+    if (out_chain->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    out_chain->next = NULL;
+    out_chain->buf->memory = 1;
+    out_chain->buf->flush = 1;
+
+    out_chain->buf->pos = out_chain->buf->start;
+    out_chain->buf->last = out_chain->buf->pos;
+    out_chain->buf->last_in_chain = 1;
+
+    /** Write some data to the upstream socket.
+     *  This is need for runing handlers in right way.
+     */
+    if (ngx_http_tnt_send_once(r, ctx, out_chain, fd_event,
+                ngx_strlen(fd_event)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_send_once(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+    ngx_chain_t *out_chain, const u_char *buf, size_t len)
+{
+    tp_transcode_t           tc;
+    size_t                   complete_msg_size;
+
+    tp_transcode_init_args_t args = {
+        .output = (char *) out_chain->buf->start,
+        .output_size = out_chain->buf->end - out_chain->buf->start,
+        .method = NULL,
+        .method_len = 0,
+        .codec = YAJL_JSON_TO_TP,
+        .mf = NULL
+    };
+
+    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
+        goto error_exit;
+    }
+
+    if (tp_transcode(&tc, (char *) buf, len) == TP_TRANSCODE_ERROR) {
+        dd("ngx_http_tnt_send:tp_transcode error: %s, code:%d",
+                tc.errmsg, tc.errcode);
+        goto error_exit;
+    }
+
+    if (tp_transcode_complete(&tc, &complete_msg_size) == TP_TRANSCODE_OK) {
+
+        out_chain->buf->last = out_chain->buf->start + complete_msg_size;
+
+        if (tc.batch_size > 1) {
+            ctx->rest_batch_size = ctx->batch_size = tc.batch_size;
+        }
+    } else {
+        goto error_exit;
+    }
+
+    tp_transcode_free(&tc);
+    return NGX_OK;
+
+error_exit:
+    tp_transcode_free(&tc);
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_tnt_cleanup(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (ctx->tp_cache != NULL) {
+        ngx_pfree(r->pool, ctx->tp_cache);
+        ctx->tp_cache = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_tnt_set_method(ngx_http_tnt_ctx_t *ctx,
+        ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf)
+{
+    u_char *start, *pos, *end;
+
+    if (tlcf->method.data && tlcf->method.len) {
+
+        ctx->preset_method_len = ngx_min(tlcf->method.len,
+                                         sizeof(ctx->preset_method)-1);
+        ngx_memcpy(ctx->preset_method,
+                   tlcf->method.data,
+                   ctx->preset_method_len);
+
+    } else if (tlcf->http_rest_methods & r->method) {
+
+        if (r->uri.data == NULL || !r->uri.len) {
+            goto error;
+        }
+
+        start = pos = (*r->uri.data == '/' ? r->uri.data + 1 : r->uri.data);
+        end = r->uri.data + r->uri.len;
+
+        for (;pos != end; ++pos) {
+            if (*pos == '/') {
+                ctx->preset_method_len = ngx_min(sizeof(ctx->preset_method)-1,
+                                                 (size_t)(pos - start));
+                ngx_memcpy(ctx->preset_method, start, ctx->preset_method_len);
+                break;
+            }
+        }
+
+        if (!ctx->preset_method[0]) {
+
+            if (start == end) {
+                goto error;
+            }
+
+            ctx->preset_method_len = ngx_min(sizeof(ctx->preset_method)-1,
+                                            (size_t)(end - start));
+            ngx_memcpy(ctx->preset_method, start, ctx->preset_method_len);
+        }
+    }
+    /* Else -- expect the method in the body */
+
+    return NGX_OK;
+
+error:
+    ctx->preset_method[0] = 0;
+    ctx->preset_method_len = 0;
+    return NGX_ERROR;
+}
+
+
+static ngx_http_tnt_next_arg_t
+ngx_http_tnt_get_next_arg(u_char *it, u_char *end)
+{
+    ngx_http_tnt_next_arg_t next_arg = { .it = end, .value = NULL };
+
+    it = ngx_http_tnt_find2(it, end, '=', '&');
+
+    /* CASE: ARG==.. */
+    if (it != end && *it == '=') {
+        next_arg.value = it + 1;
+        it = ngx_http_tnt_find2(it + 1, end, '&', '&');
+    }
+
+    next_arg.it = it;
+
+    return next_arg;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_encode_str_map_item(ngx_http_request_t *r,
+                                 ngx_http_tnt_loc_conf_t *tlcf,
+                                 struct tp *tp,
+                                 u_char *key, size_t key_len,
+                                 u_char *value, size_t value_len)
+{
+    if (tlcf->pass_http_request & NGX_TNT_CONF_UNESCAPE) {
+
+        if (tp_encode_str(tp, (const char *) key, key_len) == NULL
+            || ngx_http_tnt_encode_unescaped_str(tp, value, value_len)
+                != NGX_OK)
+        {
+            goto oom;
+        }
+
+        return NGX_OK;
+    }
+
+    if (tp_encode_str_map_item(tp, (const char *) key, key_len,
+                (const char *) value, value_len) == NULL)
+    {
+        goto oom;
+    }
+
+    return NGX_OK;
+
+oom:
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+        "ngx_http_tnt_encode_str_map_item: tp_encode failed, "
+        " it looks like OOM happened");
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_encode_query_args(ngx_http_request_t *r,
+    ngx_http_tnt_loc_conf_t *tlcf, struct tp *tp, ngx_uint_t *args_items)
+{
+    u_char                  *arg_begin, *end;
+    ngx_http_tnt_next_arg_t arg;
+    ngx_str_t               *args;
+
+    args = &r->args;
+
+    if (args->len == 0) {
+        return NGX_OK;
+    }
+
+    arg_begin = args->data;
+    end = arg_begin + args->len;
+
+    arg.it = arg_begin;
+    arg.value = NULL;
+
+    for (; arg.it < end; ) {
+
+        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+
+        const size_t value_len = arg.it - arg.value;
+        if (arg.value && value_len > 0) {
+
+            ++(*args_items);
+
+            if (ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
+                                                 arg_begin,
+                                                 arg.value - arg_begin - 1,
+                                                 arg.value,
+                                                 value_len) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+        }
+        arg_begin = ++arg.it;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_encode_urlencoded_body(ngx_http_request_t *r,
+                                    ngx_http_tnt_loc_conf_t *tlcf,
+                                    struct tp *tp,
+                                    ngx_buf_t *b,
+                                    ngx_uint_t *args_items)
+{
+    u_char                  *arg_begin, *end;
+    ngx_http_tnt_next_arg_t arg;
+    size_t                  value_len;
+
+    if (b->start == b->last) {
+        return NGX_OK;
+    }
+
+    arg_begin = b->start;
+    end = b->last;
+
+    arg.it = arg_begin;
+    arg.value = NULL;
+
+    for (; arg.it < end; ) {
+
+        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+
+        value_len = (size_t) (arg.it - arg.value);
+
+        if (arg.value && value_len > 0) {
+
+            if (tp_encode_map(tp, 1) &&
+                ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
+                                                 arg_begin,
+                                                 arg.value - arg_begin - 1,
+                                                 arg.value,
+                                                 value_len) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ++(*args_items);
+        }
+        arg_begin = ++arg.it;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_get_request_data(ngx_http_request_t *r,
+                              ngx_http_tnt_loc_conf_t *tlcf,
+                              struct tp *tp)
+{
+    /** TODO:
+     *      This function should be a part of tp_transcode.{c,h}. It's very
+     *      strange have this function here, so the best way is piece by piece
+     *      move this functionality ...
+     *
+     *      Also it would be nice to have tied nginx structures
+     *      with tp_transcode
+     */
+    char                *root_map_place;
+    char                *map_place;
+    size_t              root_items;
+    size_t              map_items;
+    ngx_buf_t           *b;
+    ngx_chain_t         *body;
+    char                *p;
+    ngx_buf_t           unparsed_body;
+    ngx_int_t           rc;
+
+    root_items = 0;
+    root_map_place = tp->p;
+
+    if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
+        goto oom_cant_encode;
+    }
+
+    /** Encode protocol */
+    ++root_items;
+
+    if (tp_encode_str_map_item(tp,
+                                "proto", sizeof("proto") - 1,
+                                (const char*) r->http_protocol.data,
+                                r->http_protocol.len) == NULL)
+    {
+        goto oom_cant_encode;
+    }
+
+    /** Encode method */
+    ++root_items;
+
+    if (tp_encode_str_map_item(tp,
+                                "method", sizeof("method") - 1,
+                                (const char *) r->method_name.data,
+                                r->method_name.len) == NULL)
+    {
+        goto oom_cant_encode;
+    }
+
+    /** Encode uri:
+     *      whether NGX_TNT_CONF_PASS_SUBREQUEST_URI is not set then raw uri
+     *      will be chosen, otherwise preprocessed value will be used
+     */
+    ++root_items;
+
+    ngx_str_t uri = tlcf->pass_http_request & NGX_TNT_CONF_PASS_SUBREQUEST_URI
+        ? r->uri : r->unparsed_uri;
+
+    if (ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
+                                         (u_char *) "uri", sizeof("uri") - 1,
+                                         uri.data, uri.len) == NGX_ERROR)
+    {
+        goto oom_cant_encode;
+    }
+
+    /** Encode query args */
+    if (tlcf->pass_http_request & NGX_TNT_CONF_PARSE_ARGS) {
+
+        ++root_items;
+
+        if (tp_encode_str(tp, "args", sizeof("args") - 1) == NULL) {
+            goto oom_cant_encode;
+        }
+
+        map_place = tp->p;
+        if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
+            goto oom_cant_encode;
+        }
+
+        map_items = 0;
+
+        rc = ngx_http_tnt_encode_query_args(r, tlcf, tp, &map_items);
+        if (rc == NGX_ERROR) {
+            goto oom_cant_encode;
+        }
+
+        *(map_place++) = 0xdf;
+        *(uint32_t *) map_place = mp_bswap_u32(map_items);
+    }
+
+    /** Encode http headers */
+    ++root_items;
+
+    if (tp_encode_str(tp, "headers", sizeof("headers") - 1) == NULL) {
+        goto oom_cant_encode_headers;
+    }
+
+    map_items = 0;
+    map_place = tp->p;
+
+    if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
+        goto oom_cant_encode_headers;
+    }
+
+    if (ngx_http_tnt_copy_headers(tp, &r->headers_in.headers,
+                                  tlcf->pass_headers, &map_items) == NGX_ERROR)
+    {
+        goto oom_cant_encode_headers;
+    }
+
+    if ((tlcf->pass_http_request & NGX_TNT_CONF_PASS_HEADERS_OUT) &&
+        (ngx_http_tnt_copy_headers(tp, &r->headers_out.headers,
+                                   tlcf->pass_headers, &map_items) ==
+            NGX_ERROR) )
+    {
+        goto oom_cant_encode_headers;
+    }
+
+    *(map_place++) = 0xdf;
+    *(uint32_t *) map_place = mp_bswap_u32(map_items);
+
+    /** Encode body */
+    if ((tlcf->pass_http_request & NGX_TNT_CONF_PARSE_URLENCODED) &&
+            r->headers_in.content_length_n > 0 &&
+            r->upstream->request_bufs)
+    {
+        ++root_items;
+
+        if (tp_encode_str(tp, "args_urlencoded", sizeof("args_urlencoded") - 1) == NULL) {
+            goto oom_cant_encode_body;
+        }
+
+        /** Encode urlencoded body as map - body = { K = V, .. } */
+        map_place = tp->p;
+
+        if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
+            goto oom_cant_encode_body;
+        }
+
+        ngx_memset(&unparsed_body, 0, sizeof(ngx_buf_t));
+
+        body = r->upstream->request_bufs;
+
+        /** A body of one buffer is parsed in place */
+        if (body->next == NULL && !body->buf->in_file) {
+            unparsed_body.start = body->buf->pos;
+            unparsed_body.last = body->buf->last;
+            body = NULL;
+
+        } else {
+            unparsed_body.pos = ngx_pnalloc(r->pool,
+                        sizeof(u_char) * r->headers_in.content_length_n + 1);
+            if (unparsed_body.pos == NULL) {
+                return NGX_ERROR;
+            }
+            unparsed_body.last = unparsed_body.pos;
+            unparsed_body.start = unparsed_body.pos;
+            unparsed_body.end = unparsed_body.pos +
+                    r->headers_in.content_length_n + 1;
+        }
+
+        for (; body; body = body->next) {
+
+            b = body->buf;
+
+            if (b->in_file) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "in-file buffer found. aborted. "
+                    "consider increasing your 'client_body_buffer_size' "
+                    "setting");
+                return NGX_ERROR;
+            }
+
+            unparsed_body.last = ngx_copy(unparsed_body.last,
+                        b->pos, b->last - b->pos);
+        }
+
+        /** Actually this is an array not a map, I used this variable
+         * since it's avaliable in this scope
+         */
+        map_items = 0;
+
+        if (ngx_http_tnt_encode_urlencoded_body(r, tlcf, tp,
+                    &unparsed_body, &map_items) != NGX_OK)
+        {
+            goto oom_cant_encode_body;
+        }
+
+        *(map_place++) = 0xdd;
+        *(uint32_t *) map_place = mp_bswap_u32(map_items);
+    }
+    
+    /** Unknown body type - encode as mp string
+     */
+    if ((tlcf->pass_http_request & NGX_TNT_CONF_PASS_BODY) &&
+            r->headers_in.content_length_n > 0 &&
+            r->upstream->request_bufs)
+    {
+        ++root_items;
+
+        if (tp_encode_str(tp, "body", sizeof("body") - 1) == NULL) {
+            goto oom_cant_encode_body;
+        }
+
+
+        int sz = mp_sizeof_str(r->headers_in.content_length_n);
+        if (tp_ensure(tp, sz) == -1) {
+            goto oom_cant_encode_body;
+        }
+
+        p = mp_encode_strl(tp->p, r->headers_in.content_length_n);
+
+        for (body = r->upstream->request_bufs; body; body = body->next) {
+
+            b = body->buf;
+
+            if (b->in_file) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "in-file buffer found. aborted. "
+                    "consider increasing your 'client_body_buffer_size' "
+                    "setting");
+                return NGX_ERROR;
+            }
+
+            p = (char *) ngx_copy(p, b->pos, b->last - b->pos);
+        }
+
+        if (tp_add(tp, sz) == NULL) {
+            goto oom_cant_encode_body;
+        }
+    }
+
+    *(root_map_place++) = 0xdf;
+    *(uint32_t *) root_map_place = mp_bswap_u32(root_items);
+
+    return NGX_OK;
+
+oom_cant_encode:
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "can't encode uri, schema etc. "
+            "aborted. consider increasing your "
+            "'tnt_pass_http_request_buffer_size' setting");
+    return NGX_ERROR;
+
+oom_cant_encode_headers:
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "can't encode HTTP headers. "
+            "aborted. consider increasing your "
+            "'tnt_pass_http_request_buffer_size' setting");
+    return NGX_ERROR;
+
+oom_cant_encode_body:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "can't encode body. aborted. consider increasing your "
+            "'tnt_pass_http_request_buffer_size' setting");
+    return NGX_ERROR;
+}
+
+
+/** Called by the transcoder, the request data is encoded straight into
+ *  the params of a call, see tp_transcode_bind_encoder()
+ */
+static char *
+ngx_http_tnt_encode_request_data(void *arg, char *p, char *end)
+{
+    ngx_http_request_t       *r = arg;
+
+    struct tp                tp;
+    ngx_http_tnt_ctx_t       *ctx;
+    ngx_http_tnt_loc_conf_t  *tlcf;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    /** The size of tp_add() is overwritten by the root map */
+    tp_init(&tp, p, end - p, NULL, NULL);
+    tp.size = tp.p;
+
+    if (ngx_http_tnt_get_request_data(r, tlcf, &tp) != NGX_OK) {
+        ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+        ctx->request_data_failed = 1;
+        return NULL;
+    }
+
+    return tp.p;
+}
+
+
+static ngx_http_tnt_ctx_t *
+ngx_http_tnt_create_ctx(ngx_http_request_t *r)
+{
+    ngx_http_tnt_ctx_t      *ctx;
+
+    ctx = ngx_palloc(r->pool, sizeof(ngx_http_tnt_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ngx_http_tnt_reset_ctx(ctx);
+
+    ngx_memzero(&ctx->vshard, sizeof(ctx->vshard));
+    ctx->vshard.peer = -1;
+
+    ctx->limit = NULL;
+    ctx->rate_bufs = NULL;
+
+    ngx_memzero(&ctx->in_list, sizeof(ctx->in_list));
+    ngx_memzero(&ctx->bulk, sizeof(ctx->bulk));
+    ngx_memzero(&ctx->tx, sizeof(ctx->tx));
+    ngx_memzero(&ctx->stats, sizeof(ctx->stats));
+    ctx->export = NULL;
+
+    ctx->dml_body = DML_BODY_URLENCODED;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_tnt_module);
+
+    ctx->state = OK;
+
+    return ctx;
+}
+
+
+static void
+ngx_http_tnt_reset_ctx(ngx_http_tnt_ctx_t *ctx)
+{
+    ctx->payload.p = &ctx->payload.mem[0];
+    ctx->payload.e = &ctx->payload.mem[sizeof(ctx->payload.mem) - 1];
+
+    ctx->state = OK;
+
+    ctx->in_err = ctx->tp_cache = NULL;
+
+    ctx->rest = 0;
+    ctx->payload_size = 0;
+
+    ctx->rest_batch_size = 0;
+    ctx->batch_size = 0;
+
+    ctx->greeting = 0;
+    ctx->request_data_failed = 0;
+    ctx->reply_limited = 0;
+
+    ctx->preset_method[0] = 0;
+    ctx->preset_method_len = 0;
+}
+
+
+/** Returns enum ngx_http_tnt_dml_body by the Content-Type of a request,
+ *  or NGX_ERROR, if the body can't be used by DML.
+ */
+static ngx_int_t
+ngx_http_tnt_dml_body_type(ngx_http_request_t *r)
+{
+    u_char     *p;
+    ngx_str_t  type;
+
+    if (r->headers_in.content_type == NULL
+        || r->headers_in.content_type->value.len == 0)
+    {
+        return DML_BODY_URLENCODED;
+    }
+
+    /** The parameters, e.g. '; charset=utf-8', are skipped */
+    type = r->headers_in.content_type->value;
+
+    p = ngx_strlchr(type.data, type.data + type.len, ';');
+    if (p != NULL) {
+        type.len = p - type.data;
+    }
+
+    while (type.len > 0 && type.data[type.len - 1] == ' ') {
+        --type.len;
+    }
+
+    if (ngx_http_tnt_str_match(&type, "application/x-www-form-urlencoded",
+                sizeof("application/x-www-form-urlencoded") - 1))
+    {
+        return DML_BODY_URLENCODED;
+    }
+
+    if (ngx_http_tnt_str_match(&type, "application/json",
+                sizeof("application/json") - 1))
+    {
+        return DML_BODY_JSON;
+    }
+
+    if (ngx_http_tnt_str_match(&type, "application/x-ndjson",
+                sizeof("application/x-ndjson") - 1))
+    {
+        return DML_BODY_NDJSON;
+    }
+
+    if (ngx_http_tnt_str_match(&type, "application/msgpack",
+                sizeof("application/msgpack") - 1)
+        || ngx_http_tnt_str_match(&type, "application/x-msgpack",
+                sizeof("application/x-msgpack") - 1))
+    {
+        return DML_BODY_MSGPACK;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_init_handlers(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_loc_conf_t *tlcf)
+{
+    ngx_int_t           rc;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_tnt_create_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_tnt_set_method(ctx, r, tlcf) == NGX_ERROR) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    u->reinit_request = ngx_http_tnt_reinit_request;
+    u->process_header = ngx_http_tnt_process_header;
+    u->abort_request = ngx_http_tnt_abort_request;
+    u->finalize_request = ngx_http_tnt_finalize_request;
+
+    u->create_request = ngx_http_tnt_query_handler;
+
+    /** A transaction is a JSON or a MsgPack array of operations */
+    if (tlcf->transaction) {
+
+        rc = ngx_http_tnt_dml_body_type(r);
+        if (rc != DML_BODY_JSON && rc != DML_BODY_MSGPACK) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        ctx->dml_body = (ngx_uint_t) rc;
+
+        u->create_request = ngx_http_tnt_tx_handler;
+        return NGX_OK;
+    }
+
+    if (tlcf->req_type > 0) {
+
+        rc = ngx_http_tnt_dml_body_type(r);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        /** A bulk body is a set of tuples */
+        if (rc == DML_BODY_NDJSON
+            && tlcf->req_type != TP_INSERT
+            && tlcf->req_type != TP_REPLACE
+            && tlcf->req_type != TP_UPSERT)
+        {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        ctx->dml_body = (ngx_uint_t) rc;
+
+        u->create_request = ngx_http_tnt_dml_handler;
+        return NGX_OK;
+    }
+
+    if (tlcf->pass_http_request & NGX_TNT_CONF_PASS_BODY) {
+        /* This is default and already set */
+        return NGX_OK;
+    }
+
+    if (r->headers_in.content_length_n > 0) {
+        u->create_request = ngx_http_tnt_body_handler;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_body_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                   rc;
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *body;
+    size_t                      complete_msg_size;
+    tp_transcode_t              tc;
+    ngx_http_tnt_ctx_t          *ctx;
+    ngx_chain_t                 *out_chain;
+    ngx_http_tnt_loc_conf_t     *tlcf;
+    uint64_t                    start;
+    size_t                      size;
+    const ngx_http_tnt_error_t  *e;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    start = ngx_http_tnt_stats_clock(tlcf);
+
+    TNT_PROBE2(json2tp__begin, r, r->headers_in.content_length_n);
+
+    out_chain = ngx_alloc_chain_link(r->pool);
+
+    if (out_chain == NULL) {
+        return NGX_ERROR;
+    }
+
+    size = ngx_http_tnt_get_output_size(r, ctx, tlcf);
+
+    if (tlcf->max_request_memory != 0 && size > tlcf->max_request_memory) {
+        return ngx_http_tnt_request_limited(r, ctx, out_chain);
+    }
+
+    ctx->stats.memory += size;
+
+    out_chain->buf = ngx_create_temp_buf(r->pool, size);
+
+    if (out_chain->buf == NULL) {
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "ngx_http_tnt_body_handler "
+                "failed to allocate output buffer, size %ui",
+                (r->headers_in.content_length_n + 1) * tlcf->in_multiplier);
+        return NGX_ERROR;
+    }
+
+    out_chain->next = NULL;
+    out_chain->buf->memory = 1;
+    out_chain->buf->flush = 1;
+
+    out_chain->buf->pos = out_chain->buf->start;
+    out_chain->buf->last = out_chain->buf->pos;
+    out_chain->buf->last_in_chain = 1;
+
+    /**  Conv. input (json, x-url-encoded) into upstream format message {{{
+     */
+    tp_transcode_init_args_t args = {
+        .output = (char *) out_chain->buf->start,
+        .output_size = out_chain->buf->end - out_chain->buf->start,
+        .method = (char *) ctx->preset_method,
+        .method_len = ctx->preset_method_len,
+        .codec = YAJL_JSON_TO_TP,
+        .mf = NULL
+    };
+
+    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "[BUG] failed to call tp_transcode_init(input)");
+        return NGX_ERROR;
+    }
+
+    /** Bind extra data e.g. http headers, uri etc */
+    if (tlcf->pass_http_request & NGX_TNT_CONF_ON) {
+        tp_transcode_bind_encoder(&tc, ngx_http_tnt_encode_request_data, r);
+    }
+
+    /** Capture the vshard key, see ngx_http_tnt_vshard_route() */
+    if (tlcf->vshard_key != NULL && tlcf->vshard_key->param >= 0) {
+        tp_transcode_capture_param(&tc, (int) tlcf->vshard_key->param);
+    }
+
+    /** Parse url-encoded.
+     *
+     * urlencoded data saved into the first argument. The following code is
+     * making a trancoder happy :)
+     */
+    if (tlcf->pass_http_request & NGX_TNT_CONF_PARSE_URLENCODED) {
+
+        if (tp_transcode(&tc, "{\"params\":[]}", sizeof("{\"params\":[]}") - 1)
+                == TP_TRANSCODE_ERROR)
+        {
+            ctx->state = INPUT_JSON_PARSE_FAILED;
+            goto read_input_done;
+        }
+    }
+
+    /** Parse JSON*/
+    else {
+
+        for (body = r->upstream->request_bufs; body; body = body->next) {
+
+
+            if (body->buf->in_file) {
+
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "in-file buffer found. aborted. "
+                    "consider increasing your 'client_body_buffer_size' "
+                    "setting");
+
+                e = ngx_http_tnt_get_error_text(REQUEST_TOO_LARGE);
+                if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+                    goto error_exit;
+                }
+
+                ctx->state = INPUT_TO_LARGE;
+                goto read_input_done;
+
+            } else {
+                b = body->buf;
+            }
+
+            if (tp_transcode(&tc, (char *) b->pos, b->last - b->pos)
+                    == TP_TRANSCODE_ERROR)
+            {
+                ctx->state = INPUT_JSON_PARSE_FAILED;
+                goto read_input_done;
+            }
+        }
+    }
+
+    if (tp_transcode_complete(&tc, &complete_msg_size) == TP_TRANSCODE_OK) {
+
+        out_chain->buf->last = out_chain->buf->start + complete_msg_size;
+
+        if (tc.batch_size > 1) {
+            ctx->rest_batch_size = ctx->batch_size = tc.batch_size;
+        }
+
+        dd("ctx->batch_size:%i, tc.batch_size:%i, complete_msg_size:%i",
+            ctx->batch_size, tc.batch_size, (int) complete_msg_size);
+
+        rc = ngx_http_tnt_rate_check(r, tlcf, out_chain->buf);
+        if (rc == NGX_ERROR) {
+            goto error_exit;
+        }
+
+        if (rc != NGX_OK) {
+            ctx->state = INPUT_RATE_LIMITED;
+            goto read_input_done;
+        }
+
+        rc = ngx_http_tnt_vshard_route(r, ctx, tlcf, &tc, out_chain);
+        if (rc == NGX_ERROR) {
+            goto error_exit;
+        }
+
+        if (rc != NGX_OK) {
+            ctx->state = (rc == NGX_HTTP_SERVICE_UNAVAILABLE ?
+                    INPUT_VSHARD_UNKNOWN_BUCKET : INPUT_VSHARD_CANT_ROUTE);
+            goto read_input_done;
+        }
+
+    } else {
+        ctx->state = INPUT_JSON_PARSE_FAILED;
+        goto read_input_done;
+    }
+    /** }}} */
+read_input_done:
+
+    ngx_http_tnt_stats_transcoded(tlcf, ctx, start, 0);
+
+    TNT_PROBE3(json2tp__end, r, out_chain->buf->last - out_chain->buf->pos,
+               ctx->state);
+
+    /** The request data doesn't fit, it's an error of the configuration */
+    if (ctx->request_data_failed) {
+        goto error_exit;
+    }
+
+    if (ctx->state != OK) {
+
+        if (ctx->in_err == NULL &&
+                ngx_http_tnt_set_err(r, tc.errcode, (u_char *) tc.errmsg,
+                        ngx_strlen(tc.errmsg)) != NGX_OK)
+        {
+            goto error_exit;
+        }
+
+        if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+            goto error_exit;
+        }
+    }
+
+    /** Hooking output chain*/
+    r->upstream->request_bufs = out_chain;
+
+    TNT_PROBE2(upstream__request, r,
+               out_chain->buf->last - out_chain->buf->pos);
+
+    tp_transcode_free(&tc);
+
+    return NGX_OK;
+
+error_exit:
+
+    tp_transcode_free(&tc);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_query_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_buf_t                  *buf;
+    ngx_http_tnt_ctx_t         *ctx;
+    ngx_chain_t                *out_chain;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    struct tp                  tp;
+    uint64_t                   start;
+    const ngx_http_tnt_error_t *err = NULL;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    start = ngx_http_tnt_stats_clock(tlcf);
+
+    TNT_PROBE2(json2tp__begin, r, r->args.len);
+
+    out_chain = ngx_alloc_chain_link(r->pool);
+    if (out_chain == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (tlcf->max_request_memory != 0
+        && tlcf->pass_http_request_buffer_size > tlcf->max_request_memory)
+    {
+        return ngx_http_tnt_request_limited(r, ctx, out_chain);
+    }
+
+    ctx->stats.memory += tlcf->pass_http_request_buffer_size;
+
+    out_chain->buf = ngx_create_temp_buf(r->pool,
+                                         tlcf->pass_http_request_buffer_size);
+    if (out_chain->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    out_chain->next = NULL;
+    out_chain->buf->memory = 1;
+    out_chain->buf->flush = 1;
+
+    out_chain->buf->pos = out_chain->buf->start;
+    out_chain->buf->last = out_chain->buf->pos;
+    out_chain->buf->last_in_chain = 1;
+
+    /**
+     *  Conv. GET/PUT/PATCH/DELETE to Tarantool message [
+     */
+    buf = out_chain->buf;
+    tp_init(&tp, (char *) buf->start, buf->end - buf->start, NULL, NULL);
+
+    if (!tp_call_nargs(&tp, (const char *) ctx->preset_method,
+                            (size_t) ctx->preset_method_len, 1))
+    {
+        err = ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE);
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_tnt_query_handler - %s",
+                get_str_safe(err->msg.data));
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_tnt_get_request_data(r, tlcf, &tp);
+    if (rc != NGX_OK) {
+        err = ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE);
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "ngx_http_tnt_query_handler - %s",
+                get_str_safe(err->msg.data));
+        return rc;
+    }
+
+    out_chain->buf->last = (u_char *) tp.p;
+    /** ]
+     */
+
+    ngx_http_tnt_stats_transcoded(tlcf, ctx, start, 0);
+
+    TNT_PROBE3(json2tp__end, r, out_chain->buf->last - out_chain->buf->pos,
+               ctx->state);
+
+    rc = ngx_http_tnt_rate_check(r, tlcf, out_chain->buf);
+    if (rc == NGX_OK) {
+        rc = ngx_http_tnt_vshard_route(r, ctx, tlcf, NULL, out_chain);
+    }
+
+    if (rc != NGX_OK) {
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_HTTP_TNT_TOO_MANY_REQUESTS) {
+            ctx->state = INPUT_RATE_LIMITED;
+
+        } else {
+            ctx->state = (rc == NGX_HTTP_SERVICE_UNAVAILABLE ?
+                    INPUT_VSHARD_UNKNOWN_BUCKET : INPUT_VSHARD_CANT_ROUTE);
+        }
+    }
+
+    /**
+     * Hooking output chain
+     */
+    r->upstream->request_bufs = out_chain;
+
+    TNT_PROBE2(upstream__request, r,
+               out_chain->buf->last - out_chain->buf->pos);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_dml_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                       *buf;
+    ngx_http_tnt_ctx_t              *ctx;
+    ngx_chain_t                     *out_chain;
+    ngx_http_tnt_loc_conf_t         *tlcf;
+    struct tp                       tp;
+    size_t                          size;
+    ngx_uint_t                      n;
+    ngx_http_tnt_bulk_t             bulk;
+    ngx_http_tnt_prepared_result_t   prepared_result;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    rc = ngx_http_tnt_format_init(tlcf, r, &prepared_result);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    out_chain = ngx_alloc_chain_link(r->pool);
+    if (out_chain == NULL) {
+        return NGX_ERROR;
+    }
+
+    /** The ids of names, see tnt_schema */
+    rc = ngx_http_tnt_schema_resolve(r, tlcf, &prepared_result);
+    if (rc != NGX_OK) {
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->state = INPUT_SCHEMA_UNKNOWN;
+
+        /** Hooking output chain */
+        r->upstream->request_bufs = out_chain;
+
+        return NGX_OK;
+    }
+
+    /** Preapre */
+    rc = ngx_http_tnt_format_prepare(tlcf, r, &prepared_result);
+
+    size = tlcf->pass_http_request_buffer_size;
+
+    if (rc == NGX_OK && ctx->dml_body == DML_BODY_NDJSON) {
+        rc = ngx_http_tnt_bulk_init(r, tlcf, &prepared_result, &bulk);
+
+        /** The rows and the headers of their requests */
+        size += bulk.size * 2 + bulk.rows * 64;
+    }
+
+    if (rc != NGX_OK) {
+
+        if (rc == NGX_HTTP_BAD_REQUEST || rc == NGX_HTTP_NOT_ALLOWED) {
+
+            rc = ngx_http_tnt_wakeup_dying_upstream(r, out_chain);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            ctx->state = INPUT_FMT_CANT_READ_INPUT;
+
+            /** Hooking output chain */
+            r->upstream->request_bufs = out_chain;
+
+            return NGX_OK;
+        }
+
+        return rc;
+    }
+
+    if (tlcf->max_request_memory != 0 && size > tlcf->max_request_memory) {
+        return ngx_http_tnt_request_limited(r, ctx, out_chain);
+    }
+
+    ctx->stats.memory += size;
+
+    /** Init output chain */
+    out_chain->buf = ngx_create_temp_buf(r->pool, size);
+    if (out_chain->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    out_chain->next = NULL;
+    out_chain->buf->memory = 1;
+    out_chain->buf->flush = 1;
+
+    out_chain->buf->pos = out_chain->buf->start;
+    out_chain->buf->last = out_chain->buf->pos;
+    out_chain->buf->last_in_chain = 1;
+
+    buf = out_chain->buf;
+
+    /** Here is starting a convertation from an HTTP request
+     *  to a Tarantool request
+     */
+    tp_init(&tp, (char *) buf->start, buf->end - buf->start, NULL, NULL);
+
+    /** Each key of an IN-list is selected by its own request, the requests
+     *  are pipelined and their sync is the index of the key.
+     *  The rows of a bulk are pipelined the same way.
+     */
+    n = 1;
+
+    if (prepared_result.in_keys != NULL
+        && prepared_result.in_keys->nelts > 0)
+    {
+        n = prepared_result.in_keys->nelts;
+    }
+
+    if (ctx->dml_body == DML_BODY_NDJSON) {
+        n = bulk.rows;
+    }
+
+    ctx->space_id = prepared_result.space_id;
+
+    for (prepared_result.in_key = 0; prepared_result.in_key < n;
+         prepared_result.in_key++)
+    {
+        if (ctx->dml_body == DML_BODY_NDJSON) {
+            rc = ngx_http_tnt_bulk_next(r, tlcf, &prepared_result, &bulk);
+            if (rc != NGX_OK) {
+                goto bind_failed;
+            }
+        }
+
+        /** Handle request type */
+        switch (tlcf->req_type) {
+        case TP_INSERT:
+            if (tp_insert(&tp, (uint32_t) prepared_result.space_id) == NULL ||
+                tp_tuple(&tp, prepared_result.tuples_count) == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        case TP_DELETE:
+
+            if (tp_delete(&tp, (uint32_t) prepared_result.space_id,
+                        (uint32_t) prepared_result.index_id) == NULL ||
+                tp_key(&tp, prepared_result.tuples_count) == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        case TP_REPLACE:
+            if (tp_replace(&tp, (uint32_t) prepared_result.space_id) == NULL ||
+                    tp_tuple(&tp, prepared_result.tuples_count) == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        case TP_SELECT:
+            if ((tlcf->after_name.len != 0
+                 || tlcf->export_format != NGX_HTTP_TNT_EXPORT_OFF)
+                && n == 1)
+            {
+                if (tp_select_after(&tp, (uint32_t) prepared_result.space_id,
+                            (uint32_t) prepared_result.index_id,
+                            prepared_result.offset, prepared_result.iter_type,
+                            prepared_result.limit,
+                            (const char *) prepared_result.after.data,
+                            (uint32_t) prepared_result.after.len) == NULL ||
+                        tp_key(&tp, prepared_result.tuples_count) == NULL)
+                {
+                    goto cant_issue_request;
+                }
+                break;
+            }
+
+            if (tp_select(&tp, (uint32_t) prepared_result.space_id,
+                        (uint32_t) prepared_result.index_id,
+                        prepared_result.offset, prepared_result.iter_type,
+                        prepared_result.limit) == NULL ||
+                    tp_key(&tp, prepared_result.tuples_count) == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        case TP_UPDATE:
+            if (tp_update(&tp, (uint32_t) prepared_result.space_id,
+                        (uint32_t) prepared_result.index_id) == NULL ||
+                tp_key(&tp, (uint32_t) prepared_result.update_keys_count)
+                    == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        case TP_UPSERT:
+            if (tp_upsert(&tp, (uint32_t) prepared_result.space_id) == NULL ||
+                    tp_tuple(&tp, (uint32_t) prepared_result.tuples_count)
+                        == NULL)
+            {
+                goto cant_issue_request;
+            }
+            break;
+        default:
+            goto cant_issue_request;
+        }
+
+        /** Bind values */
+        rc = ngx_http_tnt_format_bind(r, &prepared_result, &tp);
+        if (rc != NGX_OK) {
+            goto bind_failed;
+        }
+
+        tp_reqid(&tp, (uint32_t) prepared_result.in_key);
+    }
+
+    if (ctx->dml_body == DML_BODY_NDJSON) {
+
+        ctx->bulk.n = n;
+        ctx->bulk.received = ctx->bulk.ok = 0;
+        ctx->rest_batch_size = ctx->batch_size = (int) n;
+
+    } else if (n > 1) {
+
+        ctx->in_list.replies = ngx_pcalloc(r->pool, sizeof(ngx_str_t) * n);
+        if (ctx->in_list.replies == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->in_list.n = n;
+        ctx->in_list.received = 0;
+        ctx->rest_batch_size = ctx->batch_size = (int) n;
+    }
+
+    out_chain->buf->last = (u_char *) tp.p;
+
+    rc = ngx_http_tnt_vshard_route(r, ctx, tlcf, NULL, out_chain);
+    if (rc != NGX_OK) {
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+
+        if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->state = (rc == NGX_HTTP_SERVICE_UNAVAILABLE ?
+                INPUT_VSHARD_UNKNOWN_BUCKET : INPUT_VSHARD_CANT_ROUTE);
+    }
+
+    /** Hooking output chain */
+    r->upstream->request_bufs = out_chain;
+
+    return NGX_OK;
+
+bind_failed:
+
+    if (rc == NGX_HTTP_BAD_REQUEST) {
+
+        rc = ngx_http_tnt_wakeup_dying_upstream(r, out_chain);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        ctx->state = INPUT_FMT_CANT_READ_INPUT;
+
+        /** Hooking output chain */
+        r->upstream->request_bufs = out_chain;
+
+        return NGX_OK;
+    }
+
+    return rc;
+
+cant_issue_request:
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Can't issue the query; It could be one of the following errors: "
+            "1) %V; "
+            "2) unknown request type.",
+            &ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE)->msg);
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_reinit_request(ngx_http_request_t *r)
+{
+    dd("reinit request");
+
+    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_tnt_stats_timed(r, NGX_HTTP_TNT_STATS_RETRIED);
+
+    ngx_http_tnt_cleanup(r, ctx);
+    ngx_http_tnt_reset_ctx(ctx);
+
+    /** The selects of an IN-list are sent again as is */
+    if (ctx->in_list.n > 0) {
+        ngx_memzero(ctx->in_list.replies,
+                sizeof(ngx_str_t) * ctx->in_list.n);
+        ctx->in_list.received = 0;
+        ctx->rest_batch_size = ctx->batch_size = (int) ctx->in_list.n;
+    }
+
+    /** The rows of a bulk are sent again as is */
+    if (ctx->bulk.n > 0) {
+        ctx->bulk.received = ctx->bulk.ok = 0;
+
+        if (ctx->bulk.errors != NULL) {
+            ctx->bulk.errors->nelts = 0;
+        }
+
+        ctx->rest_batch_size = ctx->batch_size = (int) ctx->bulk.n;
+    }
+
+    /** A transaction could be committed already, so it's not retried */
+    if (ctx->tx.n > 0) {
+
+        if (ctx->tx.commit) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "transaction: COMMIT has been sent, it isn't retried");
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(ctx->tx.replies, sizeof(ngx_str_t) * (ctx->tx.n + 1));
+        ctx->tx.received = 0;
+        ctx->tx.open = 1;
+        ctx->rest_batch_size = ctx->batch_size = (int) ctx->tx.n + 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_process_header(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t *u = r->upstream;
+    ngx_buf_t           *b = &r->upstream->buffer;
+    ngx_http_tnt_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    ngx_int_t rc;
+
+    dd("process_header-> greeting:%s, recv:%i",
+            ctx->greeting ? "yes" : "no", (int) (b->last - b->pos));
+
+    if (!ctx->greeting) {
+
+        rc = ngx_http_tnt_read_greeting(r, ctx, b);
+        if (rc == NGX_ERROR) {
+            return rc;
+
+        /** If ctx->state is not OK, then we did'nt sent a request,
+         *  and we should stop work with this upstream.
+         *
+         *  So I found that the most good what we can is stop work.
+         */
+        } else if (rc == NGX_AGAIN && ctx->state == OK) {
+            return rc;
+        }
+    }
+
+    /** A storage could reply WRONG_BUCKET, if so then the request is
+     *  retried through the router.
+     */
+    if (ctx->state == OK && ctx->vshard.func != NULL && ctx->vshard.peer >= 0)
+    {
+        rc = ngx_http_tnt_vshard_check_reply(r, ctx, b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    switch (ctx->state) {
+    case OK:
+        break;
+    case INPUT_TO_LARGE:
+    case INPUT_JSON_PARSE_FAILED:
+    case INPUT_EMPTY:
+    case INPUT_FMT_CANT_READ_INPUT:
+    case INPUT_VSHARD_CANT_ROUTE:
+        return ngx_http_tnt_output_err(r, ctx, NGX_HTTP_BAD_REQUEST);
+    case INPUT_VSHARD_UNKNOWN_BUCKET:
+    case INPUT_SCHEMA_UNKNOWN:
+    case INPUT_TX_UNAVAILABLE:
+        return ngx_http_tnt_output_err(r, ctx, NGX_HTTP_SERVICE_UNAVAILABLE);
+    case INPUT_RATE_LIMITED:
+        return ngx_http_tnt_output_err(r, ctx,
+                                       NGX_HTTP_TNT_TOO_MANY_REQUESTS);
+    default:
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "[BUG] unexpected ctx->stage(%i)", ctx->state);
+        return NGX_ERROR;
+    }
+
+   /*
+    *   At this stage we can't get full upstream size,
+    *   since Tarantool could send to us 1 upto N messages
+    *   where each of messages could have X size.
+    *
+    *   As fix -- just set each upstream mode to chunked.
+    */
+    u->headers_in.chunked = 1;
+    u->headers_in.status_n = 200;
+    u->state->status = 200;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_abort_request(ngx_http_request_t *r)
+{
+    dd("abort request");
+    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    ngx_http_tnt_cleanup(r, ctx);
+}
+
+
+static void
+ngx_http_tnt_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
+{
+    dd("finalize request");
+    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    ngx_http_tnt_cleanup(r, ctx);
+
+    ngx_http_tnt_stats_timed(r, NGX_HTTP_TNT_STATS_FINISHED);
+
+    if (ctx != NULL && ctx->limit != NULL) {
+        ngx_http_tnt_limit_done(r, rc);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_tnt_str_match(ngx_str_t *a, const char *b,
+        size_t len)
+{
+    if (a->len != len) {
+        return 0;
+    }
+    if (ngx_strncmp(a->data, (const u_char *) b, len) == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_set_err(ngx_http_request_t *r, int errcode, const u_char *msg,
+        size_t len)
+{
+    const size_t msglen = len + sizeof("{"
+                        "'error':{"
+                            "'message':'',"
+                            "'code':-XXXXX"
+                        "}"
+                    "}");
+
+    u_char              escaped_msg[len * 2];
+    u_char              *p;
+    ngx_http_tnt_ctx_t  *ctx;
+    ngx_buf_t           *b;
+
+    b = ngx_create_temp_buf(r->pool, msglen);
+
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    ctx->stats.memory += msglen;
+
+    b->memory = 1;
+    b->pos = b->start;
+
+    p = &escaped_msg[0];
+    memset(escaped_msg, 0, sizeof(escaped_msg));
+    const char *x;
+    if ((x = json_encode_string((char **) &p, sizeof(escaped_msg) - 1,
+                (const char *) msg, (size_t) len, true))
+                    != NULL)
+    {
+        escaped_msg[0] = 0;
+    }
+
+    b->last = ngx_snprintf(b->start, msglen, "{"
+                        "\"error\":{"
+                            "\"code\":%d,"
+                            "\"message\":%s"
+                        "}"
+                    "}",
+                     errcode,
+                     (escaped_msg[0] == 0 ? (u_char *) "\"\"" : escaped_msg));
+
+    ctx->in_err = b;
+
+    ctx->stats.error_code = errcode;
+    ctx->stats.has_error = 1;
+
+    TNT_PROBE2(error__reply, r, errcode);
+
+    ngx_http_tnt_stats_error(r, errcode);
+
+    return NGX_OK;
+}
+
+
+static const ngx_http_tnt_error_t *
+ngx_http_tnt_get_error_text(ngx_uint_t type)
+{
+    static const ngx_http_tnt_error_t errors[] = {
+
+        {   ngx_string(
+                "Request is too large, consider increasing your "
+                "server's setting 'client_body_buffer_size'"),
+            -32001
+        },
+
+        {   ngx_string("Unknown parse error"),
+            -32002
+        },
+
+        {   ngx_string(
+                "Request is too large, consider increasing your "
+                "server's setting 'tnt_pass_http_request_buffer_size'"),
+            -32001
+        },
+
+        {   ngx_string("The input has been mismatched by the format"),
+            400
+        },
+
+        {   ngx_string(
+                "The input has been reached limits, consider increasing "
+                "server's settings 'tnt_select_limit_max', "
+                "'tnt_allowed_spaces', 'tnt_allowed_indexes'"),
+            405
+        },
+
+        {   ngx_string("The request has no key for 'tnt_vshard_key'"),
+            400
+        },
+
+        {   ngx_string("Batches can't be routed by 'tnt_vshard_key'"),
+            400
+        },
+
+        {   ngx_string("The bucket is unknown yet, try again later"),
+            503
+        },
+
+        {   ngx_string("Batches are not supported by 'tnt_fanout'"),
+            400
+        },
+
+        {   ngx_string("Batches are not supported by 'tnt_multiplex'"),
+            400
+        },
+
+        {   ngx_string("The body must be an object or an array"),
+            400
+        },
+
+        {   ngx_string("The number of rows must be from 1 to "
+                       "'tnt_bulk_max_rows'"),
+            400
+        },
+
+        {   ngx_string("Batches are not supported by 'tnt_export'"),
+            400
+        },
+
+        {   ngx_string("The space or the index is unknown yet, "
+                       "try again later"),
+            503
+        },
+
+        {   ngx_string("Transactions aren't negotiated yet, "
+                       "try again later"),
+            503
+        },
+
+        {   ngx_string("Tarantool doesn't support streams, "
+                       "'tnt_transaction' requires Tarantool 2.10+"),
+            503
+        },
+
+        {   ngx_string("The body should be an array of operations, "
+                       "see 'tnt_transaction'"),
+            400
+        },
+
+        {   ngx_string("Request is too large, consider increasing your "
+                       "server's setting 'tnt_max_request_memory'"),
+            -32001
+        },
+
+        {   ngx_string("Reply is too large, consider increasing your "
+                       "server's settings 'tnt_max_reply_size', "
+                       "'tnt_max_request_memory'"),
+            -32003
+        },
+
+        {   ngx_string("Too many requests of the method, "
+                       "try again later"),
+            429
+        },
+
+        {   ngx_string("Too many requests to the upstream, "
+                       "try again later"),
+            503
+        }
+
+    };
+
+    return &errors[type];
+}
+
+static size_t
+ngx_http_tnt_overhead(void)
+{
+    return sizeof("[{"
+        "'error': {"
+            "'code':-XXXXX,"
+            "'message':''"
+        "},"
+        "{ 'result': [[]],"
+        "'id': 1867996680 }"
+    "}");
+}
+
+
+
+/** Background calls {{{
+ */
+static void ngx_http_tnt_bg_call_write_handler(ngx_event_t *wev);
+static void ngx_http_tnt_bg_call_read_handler(ngx_event_t *rev);
+
+
+/** Create a call. A caller should encode a request into bc->out and set
+ *  bc->handler, then call ngx_http_tnt_bg_call_start().
+ */
+static ngx_http_tnt_bg_call_t *
+ngx_http_tnt_bg_call_create(ngx_log_t *log, size_t out_size)
+{
+    ngx_pool_t              *pool;
+    ngx_http_tnt_bg_call_t  *bc;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    bc = ngx_pcalloc(pool, sizeof(ngx_http_tnt_bg_call_t));
+    if (bc == NULL) {
+        goto error_exit;
+    }
+
+    bc->pool = pool;
+    bc->log = log;
+
+    /** If out_size is 0, then bc->out should point to a caller's memory */
+    if (out_size) {
+        bc->out = ngx_create_temp_buf(pool, out_size);
+    } else {
+        bc->out = ngx_calloc_buf(pool);
+    }
+
+    if (bc->out == NULL) {
+        goto error_exit;
+    }
+
+    /** A greeting and a small reply */
+    bc->in = ngx_create_temp_buf(pool, 1024);
+    if (bc->in == NULL) {
+        goto error_exit;
+    }
+
+    bc->timeout = 60000;
+
+    return bc;
+
+error_exit:
+    ngx_destroy_pool(pool);
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_bg_call_start(ngx_http_tnt_bg_call_t *bc,
+        struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name)
+{
+    ngx_int_t         rc;
+    ngx_connection_t  *c;
+
+    bc->peer.sockaddr = sockaddr;
+    bc->peer.socklen = socklen;
+    bc->peer.name = name;
+    bc->peer.get = ngx_event_get_peer;
+    bc->peer.log = bc->log;
+    bc->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&bc->peer);
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt: can't connect to \"%V\"", name);
+        ngx_destroy_pool(bc->pool);
+        return NGX_ERROR;
+    }
+
+    c = bc->peer.connection;
+    c->data = bc;
+    c->pool = bc->pool;
+
+    c->read->handler = ngx_http_tnt_bg_call_read_handler;
+    c->write->handler = ngx_http_tnt_bg_call_write_handler;
+
+    /** The timeout is for the whole call */
+    ngx_add_timer(c->read, bc->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_bg_call_close(ngx_http_tnt_bg_call_t *bc)
+{
+    if (bc->peer.connection != NULL) {
+        ngx_close_connection(bc->peer.connection);
+        bc->peer.connection = NULL;
+    }
+
+    ngx_destroy_pool(bc->pool);
+}
+
+
+static void
+ngx_http_tnt_bg_call_finish(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    ngx_connection_t  *c;
+
+    c = bc->peer.connection;
+
+    bc->keep = 0;
+
+    if (c != NULL && c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    bc->handler(bc, rc);
+
+    if (rc == NGX_OK && bc->keep) {
+        return;
+    }
+
+    ngx_http_tnt_bg_call_close(bc);
+}
+
+
+/** Write the next request to the connection of a finished call, the handler
+ *  should have set bc->keep. A caller should encode the request into bc->out.
+ */
+static void
+ngx_http_tnt_bg_call_next(ngx_http_tnt_bg_call_t *bc)
+{
+    ngx_connection_t  *c;
+
+    c = bc->peer.connection;
+
+    bc->in->pos = bc->in->last = bc->in->start;
+    bc->reply = NULL;
+    bc->reply_len = 0;
+
+    ngx_add_timer(c->read, bc->timeout);
+
+    ngx_post_event(c->write, &ngx_posted_events);
+}
+
+
+static void
+ngx_http_tnt_bg_call_write_handler(ngx_event_t *wev)
+{
+    ssize_t                 n;
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+    ngx_http_tnt_bg_call_t  *bc;
+
+    c = wev->data;
+    bc = c->data;
+    b = bc->out;
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_tnt_bg_call_finish(bc, NGX_ERROR);
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_tnt_bg_call_finish(bc, NGX_ERROR);
+    }
+}
+
+
+/** Returns NGX_OK if a whole reply has been read
+ */
+static ngx_int_t
+ngx_http_tnt_bg_call_parse(ngx_http_tnt_bg_call_t *bc)
+{
+    ssize_t    size;
+    ngx_buf_t  *b, *nb;
+
+    b = bc->in;
+
+    if (!bc->greeting) {
+
+        if (b->last - b->pos < 128) {
+            return NGX_AGAIN;
+        }
+
+        if (ngx_strncmp(b->pos, "Tarantool", sizeof("Tarantool") - 1) != 0) {
+            ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                    "tnt: \"%V\" sent an invalid greeting", bc->peer.name);
+            return NGX_ERROR;
+        }
+
+        b->pos += 128;
+        bc->greeting = 1;
+    }
+
+    if (b->last - b->pos < 5) {
+        return NGX_AGAIN;
+    }
+
+    size = tp_read_payload((const char *) b->pos, (const char *) b->last);
+    if (size <= 0) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt: \"%V\" sent an invalid reply", bc->peer.name);
+        return NGX_ERROR;
+    }
+
+    if (b->last - b->pos >= size) {
+        bc->reply = (const char *) b->pos;
+        bc->reply_len = (size_t) size;
+        return NGX_OK;
+    }
+
+    if (b->end - b->pos < size) {
+
+        nb = ngx_create_temp_buf(bc->pool, size);
+        if (nb == NULL) {
+            return NGX_ERROR;
+        }
+
+        nb->last = ngx_cpymem(nb->pos, b->pos, b->last - b->pos);
+        bc->in = nb;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_tnt_bg_call_read_handler(ngx_event_t *rev)
+{
+    ssize_t                 n;
+    ngx_int_t               rc;
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+    ngx_http_tnt_bg_call_t  *bc;
+
+    c = rev->data;
+    bc = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, NGX_ETIMEDOUT,
+                "tnt: \"%V\" timed out", bc->peer.name);
+        ngx_http_tnt_bg_call_finish(bc, NGX_ERROR);
+        return;
+    }
+
+    for ( ;; ) {
+
+        b = bc->in;
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                    "tnt: \"%V\" closed the connection", bc->peer.name);
+            ngx_http_tnt_bg_call_finish(bc, NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        rc = ngx_http_tnt_bg_call_parse(bc);
+        if (rc != NGX_AGAIN) {
+            ngx_http_tnt_bg_call_finish(bc, rc);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_tnt_bg_call_finish(bc, NGX_ERROR);
+    }
+}
+/** }}}
+ */
+
+
+/** vshard {{{
+ */
+
+/** How often workers check if the bucket map should be refreshed */
+#define NGX_HTTP_TNT_VSHARD_POLL 1000
+
+/** WRONG_BUCKET is expected to be smaller than this */
+#define NGX_HTTP_TNT_VSHARD_ERROR_MAX 1024
+
+
+static uint32_t  ngx_http_tnt_crc32c_table[256];
+
+
+static void
+ngx_http_tnt_crc32c_init(void)
+{
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    if (ngx_http_tnt_crc32c_table[1] != 0) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        }
+        ngx_http_tnt_crc32c_table[i] = c;
+    }
+}
+
+
+/** CRC32-C as digest.crc32() of Tarantool does it, i.e. there is
+ *  no final XOR. vshard.router.bucket_id_strcrc32() uses it.
+ */
+static uint32_t
+ngx_http_tnt_crc32c(const u_char *p, size_t len)
+{
+    uint32_t  crc = 0xFFFFFFFF;
+
+    while (len--) {
+        crc = ngx_http_tnt_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+static void *
+ngx_http_tnt_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_tnt_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->vshard = NULL;
+     *     conf->schema = NULL;
+     *     conf->mux = NULL;
+     *     conf->prewarm = NULL;
+     *     conf->limit = NULL;
+     *     conf->tx = NULL;
+     */
+
+    return conf;
+}
+
+
+static ngx_http_tnt_vshard_conf_t *
+ngx_http_tnt_vshard_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->vshard;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_vshard_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_tnt_vshard_conf_t  *ovcf = data;
+
+    size_t                      len;
+    ngx_http_tnt_vshard_conf_t  *vcf;
+
+    vcf = shm_zone->data;
+
+    if (ovcf) {
+
+        if (ovcf->buckets != vcf->buckets) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                    "tnt_vshard \"%V\" uses %ui buckets "
+                    "while previously it used %ui buckets",
+                    &shm_zone->shm.name, vcf->buckets, ovcf->buckets);
+            return NGX_ERROR;
+        }
+
+        vcf->shpool = ovcf->shpool;
+        vcf->sh = ovcf->sh;
+
+        return NGX_OK;
+    }
+
+    vcf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        vcf->sh = vcf->shpool->data;
+        return NGX_OK;
+    }
+
+    len = sizeof(ngx_http_tnt_vshard_shctx_t)
+          + vcf->buckets * sizeof(uint16_t);
+
+    vcf->sh = ngx_slab_calloc(vcf->shpool, len);
+    if (vcf->sh == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                "tnt_vshard zone \"%V\" is too small for %ui buckets",
+                &shm_zone->shm.name, vcf->buckets);
+        return NGX_ERROR;
+    }
+
+    vcf->shpool->data = vcf->sh;
+
+    len = sizeof(" in tnt_vshard zone \"\"") + shm_zone->shm.name.len;
+
+    vcf->shpool->log_ctx = ngx_slab_alloc(vcf->shpool, len);
+    if (vcf->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(vcf->shpool->log_ctx, " in tnt_vshard zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_tnt_vshard_init_upstream(ngx_conf_t *cf,
+        ngx_http_upstream_srv_conf_t *us);
+
+
+static char *
+ngx_http_tnt_vshard(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_srv_conf_t *tscf = conf;
+
+    u_char                        *p;
+    ssize_t                       size;
+    ngx_int_t                     n;
+    ngx_str_t                     *value, s, name;
+    ngx_url_t                     u;
+    ngx_uint_t                    i;
+    ngx_http_tnt_vshard_conf_t    *vcf;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (tscf->vshard != NULL) {
+        return "is duplicate";
+    }
+
+    if (tscf->mux != NULL) {
+        return "can't be used with 'tnt_multiplex'";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    /** The balancer reads peers of the round-robin */
+    if (uscf->peer.init_upstream != NULL) {
+        return "must be specified before other balancing directives, "
+               "e.g. 'keepalive'";
+    }
+
+    vcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_vshard_conf_t));
+    if (vcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    vcf->uscf = uscf;
+    vcf->buckets = 3000;
+    vcf->refresh = 10000;
+    ngx_str_set(&vcf->func, "nginx_vshard_bucket_map");
+
+    ngx_str_null(&name);
+    size = 0;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "router=", 7) == 0) {
+
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url.data = value[i].data + 7;
+            u.url.len = value[i].len - 7;
+            u.no_resolve = 1;
+
+            vcf->router = ngx_http_upstream_add(cf, &u, 0);
+            if (vcf->router == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "buckets=", 8) == 0) {
+
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (n <= 0 || n > 65535) {
+                goto invalid;
+            }
+
+            vcf->buckets = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            vcf->refresh = ngx_parse_time(&s, 0);
+            if (vcf->refresh == (ngx_msec_t) NGX_ERROR || vcf->refresh == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "function=", 9) == 0) {
+
+            vcf->func.data = value[i].data + 9;
+            vcf->func.len = value[i].len - 9;
+
+            if (vcf->func.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                goto invalid;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || name.len == 0) {
+                goto invalid;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (vcf->router == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"router\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    vcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                          &ngx_http_tnt_module);
+    if (vcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (vcf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    vcf->shm_zone->init = ngx_http_tnt_vshard_init_zone;
+    vcf->shm_zone->data = vcf;
+
+    uscf->peer.init_upstream = ngx_http_tnt_vshard_init_upstream;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    ngx_http_tnt_crc32c_init();
+
+    tscf->vshard = vcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_tnt_vshard_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t                          *value;
+    ngx_int_t                          n;
+    ngx_http_tnt_vshard_key_t          *vk;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (tlcf->vshard_key != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    vk = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_vshard_key_t));
+    if (vk == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    vk->param = -1;
+    ngx_str_set(&vk->mode, "write");
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "read") != 0
+            && ngx_strcmp(value[2].data, "write") != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid mode \"%V\", "
+                               "it must be \"read\" or \"write\"",
+                               &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        vk->mode = value[2];
+    }
+
+    /** params[N] */
+    if (value[1].len > sizeof("params[]") - 1
+        && ngx_strncmp(value[1].data, "params[", sizeof("params[") - 1) == 0
+        && value[1].data[value[1].len - 1] == ']')
+    {
+        n = ngx_atoi(value[1].data + sizeof("params[") - 1,
+                     value[1].len - sizeof("params[]") + 1);
+        if (n == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid key \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        vk->param = n;
+
+    /** $var */
+    } else if (ngx_strchr(value[1].data, '$') != NULL) {
+
+        vk->cv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (vk->cv == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[1];
+        ccv.complex_value = vk->cv;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+    /** A name of the format value */
+    } else {
+        vk->name = value[1];
+    }
+
+    tlcf->vshard_key = vk;
+
+    return NGX_CONF_OK;
+}
+
+
+static void ngx_http_tnt_vshard_refresh_handler(ngx_event_t *ev);
+
+
+static ngx_int_t
+ngx_http_tnt_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                     i;
+    ngx_http_tnt_vshard_conf_t     *vcf;
+    ngx_http_upstream_main_conf_t  *umcf;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        ngx_http_tnt_prewarm_init_process(cycle, uscfp[i]);
+        ngx_http_tnt_schema_init_process(cycle, uscfp[i]);
+        ngx_http_tnt_tx_init_process(cycle, uscfp[i]);
+
+        vcf = ngx_http_tnt_vshard_get_conf(uscfp[i]);
+        if (vcf == NULL) {
+            continue;
+        }
+
+        vcf->refresh_ev.handler = ngx_http_tnt_vshard_refresh_handler;
+        vcf->refresh_ev.data = vcf;
+        vcf->refresh_ev.log = cycle->log;
+        vcf->refresh_ev.cancelable = 1;
+
+        ngx_add_timer(&vcf->refresh_ev, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+/** Round-robin over the live peers of an upstream for background calls
+ */
+static ngx_http_upstream_rr_peer_t *
+ngx_http_tnt_live_peer(ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *next)
+{
+    ngx_uint_t                    i, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = uscf->peer.data;
+    if (peers == NULL || peers->number == 0) {
+        return NULL;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (i = 0; i < peers->number; i++) {
+
+        n = (*next)++ % peers->number;
+
+        for (peer = peers->peer; peer && n; peer = peer->next, n--) {
+            /* void */
+        }
+
+        if (peer != NULL && !peer->down) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return peer;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NULL;
+}
+
+
+/** Returns the index of the storage peer by a replicaset master URI
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_find_peer(ngx_http_tnt_vshard_conf_t *vcf,
+        const char *uri, uint32_t len)
+{
+    const char                    *p;
+    ngx_int_t                     i;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    /** user:password@host:port */
+    for (p = uri + len; p > uri; p--) {
+        if (p[-1] == '@') {
+            len -= p - uri;
+            uri = p;
+            break;
+        }
+    }
+
+    peers = vcf->uscf->peer.data;
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+        if (peer->name.len == len
+            && ngx_strncmp(peer->name.data, uri, len) == 0)
+        {
+            return i;
+        }
+
+#if (nginx_version >= 1013000)
+        if (peer->server.len == len
+            && ngx_strncmp(peer->server.data, uri, len) == 0)
+        {
+            return i;
+        }
+#endif
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/** The map is [[first_bucket_id, last_bucket_id, "host:port"], ...]
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_parse_map(ngx_http_tnt_vshard_conf_t *vcf,
+        const char *data, const char *end, uint16_t *map, ngx_log_t *log)
+{
+    const char  *p, *uri;
+    uint32_t    i, n, fields, len;
+    uint64_t    first, last, bucket;
+    ngx_int_t   peer;
+
+    p = data;
+    if (data == NULL || mp_check(&p, end)) {
+        goto invalid;
+    }
+
+    p = data;
+
+    /** The function's returns */
+    if (mp_typeof(*p) != MP_ARRAY || mp_decode_array(&p) == 0
+        || mp_typeof(*p) != MP_ARRAY)
+    {
+        goto invalid;
+    }
+
+    n = mp_decode_array(&p);
+
+    for (i = 0; i < n; i++) {
+
+        if (mp_typeof(*p) != MP_ARRAY) {
+            goto invalid;
+        }
+
+        fields = mp_decode_array(&p);
+
+        if (fields < 3
+            || mp_typeof(*p) != MP_UINT)
+        {
+            goto invalid;
+        }
+
+        first = mp_decode_uint(&p);
+
+        if (mp_typeof(*p) != MP_UINT) {
+            goto invalid;
+        }
+
+        last = mp_decode_uint(&p);
+
+        if (mp_typeof(*p) != MP_STR) {
+            goto invalid;
+        }
+
+        uri = mp_decode_str(&p, &len);
+
+        for (fields -= 3; fields > 0; fields--) {
+            mp_next(&p);
+        }
+
+        peer = ngx_http_tnt_vshard_find_peer(vcf, uri, len);
+        if (peer == NGX_DECLINED || peer >= 65535) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                    "tnt_vshard: replicaset \"%*s\" isn't in the upstream",
+                    (size_t) len, uri);
+            continue;
+        }
+
+        if (first < 1) {
+            first = 1;
+        }
+
+        if (last > vcf->buckets) {
+            last = vcf->buckets;
+        }
+
+        for (bucket = first; bucket <= last; bucket++) {
+            map[bucket - 1] = (uint16_t) (peer + 1);
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+            "tnt_vshard: function \"%V\" returned an invalid map",
+            &vcf->func);
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_tnt_vshard_refresh_done(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    uint16_t                    *map;
+    struct tpresponse           reply;
+    ngx_http_tnt_vshard_conf_t  *vcf;
+
+    vcf = bc->data;
+
+    if (rc != NGX_OK) {
+        goto failed;
+    }
+
+    if (tp_reply(&reply, bc->reply, bc->reply_len) <= 0) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt_vshard: router sent an invalid reply");
+        goto failed;
+    }
+
+    if (reply.code != 0) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt_vshard: function \"%V\" failed, code: %ui",
+                &vcf->func, (ngx_uint_t) reply.code);
+        goto failed;
+    }
+
+    map = ngx_pcalloc(bc->pool, vcf->buckets * sizeof(uint16_t));
+    if (map == NULL) {
+        goto failed;
+    }
+
+    if (ngx_http_tnt_vshard_parse_map(vcf, reply.data, reply.data_end, map,
+                bc->log) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    ngx_shmtx_lock(&vcf->shpool->mutex);
+    ngx_memcpy(vcf->sh->buckets, map, vcf->buckets * sizeof(uint16_t));
+    ngx_shmtx_unlock(&vcf->shpool->mutex);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, bc->log, 0,
+            "tnt_vshard: bucket map refreshed");
+
+    return;
+
+failed:
+    /** Let any worker try it again */
+    vcf->sh->refresh_at = 0;
+}
+
+
+static void
+ngx_http_tnt_vshard_refresh_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_vshard_conf_t   *vcf = ev->data;
+
+    ngx_msec_t                   now, at;
+    struct tp                    tp;
+    ngx_http_tnt_bg_call_t       *bc;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, ngx_min(vcf->refresh, NGX_HTTP_TNT_VSHARD_POLL));
+
+    now = ngx_current_msec;
+    at = (ngx_msec_t) vcf->sh->refresh_at;
+
+    if (at != 0 && (ngx_msec_int_t) (at - now) > 0) {
+        return;
+    }
+
+    /** Only one worker refreshes the map */
+    if (!ngx_atomic_cmp_set(&vcf->sh->refresh_at, at, now + vcf->refresh)) {
+        return;
+    }
+
+    peer = ngx_http_tnt_live_peer(vcf->router, &vcf->router_next);
+    if (peer == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                "tnt_vshard: no live routers");
+        goto failed;
+    }
+
+    bc = ngx_http_tnt_bg_call_create(ev->log, vcf->func.len + 64);
+    if (bc == NULL) {
+        goto failed;
+    }
+
+    tp_init(&tp, (char *) bc->out->start, bc->out->end - bc->out->start,
+            NULL, NULL);
+
+    if (!tp_call_nargs(&tp, (const char *) vcf->func.data, vcf->func.len, 0)) {
+        ngx_http_tnt_bg_call_close(bc);
+        goto failed;
+    }
+
+    bc->out->last = (u_char *) tp.p;
+
+    bc->handler = ngx_http_tnt_vshard_refresh_done;
+    bc->data = vcf;
+    bc->timeout = vcf->refresh;
+
+    if (ngx_http_tnt_bg_call_start(bc, peer->sockaddr, peer->socklen,
+                &peer->name) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    return;
+
+failed:
+    vcf->sh->refresh_at = 0;
+}
+
+
+static ngx_int_t ngx_http_tnt_vshard_get_peer(ngx_peer_connection_t *pc,
+        void *data);
+static void ngx_http_tnt_vshard_free_peer(ngx_peer_connection_t *pc,
+        void *data, ngx_uint_t state);
+
+
+static ngx_int_t
+ngx_http_tnt_vshard_init_peer(ngx_http_request_t *r,
+        ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_tnt_vshard_conf_t       *vcf;
+    ngx_http_tnt_vshard_peer_data_t  *vp;
+
+    vcf = ngx_http_tnt_vshard_get_conf(us);
+
+    if (vcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    vp = ngx_palloc(r->pool, sizeof(ngx_http_tnt_vshard_peer_data_t));
+    if (vp == NULL) {
+        return NGX_ERROR;
+    }
+
+    vp->vcf = vcf;
+    vp->request = r;
+    vp->router = 0;
+
+    vp->data = r->upstream->peer.data;
+    vp->original_get_peer = r->upstream->peer.get;
+    vp->original_free_peer = r->upstream->peer.free;
+
+    r->upstream->peer.data = vp;
+    r->upstream->peer.get = ngx_http_tnt_vshard_get_peer;
+    r->upstream->peer.free = ngx_http_tnt_vshard_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_vshard_init_upstream(ngx_conf_t *cf,
+        ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_tnt_vshard_conf_t  *vcf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    vcf = ngx_http_tnt_vshard_get_conf(us);
+
+    vcf->original_init_peer = us->peer.init;
+    us->peer.init = ngx_http_tnt_vshard_init_peer;
+
+    return NGX_OK;
+}
+
+
+/** Take the peer which owns the bucket, the checks are same as the
+ *  round-robin does.
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_get_storage(ngx_peer_connection_t *pc,
+        ngx_http_tnt_vshard_peer_data_t *vp, ngx_uint_t index)
+{
+    time_t                            now;
+    uintptr_t                         m;
+    ngx_uint_t                        i;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = vp->data;
+    peers = rrp->peers;
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (peer = peers->peer, i = 0; peer && i < index; peer = peer->next, i++)
+    {
+        /* void */
+    }
+
+    if (peer == NULL || peer->down) {
+        goto busy;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        goto busy;
+    }
+
+#if (nginx_version >= 1011005)
+    if (peer->max_conns && peer->conns >= peer->max_conns) {
+        goto busy;
+    }
+#endif
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    rrp->current = peer;
+
+    m = (uintptr_t) 1 << index % (8 * sizeof(uintptr_t));
+    rrp->tried[index / (8 * sizeof(uintptr_t))] |= m;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+busy:
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_BUSY;
+}
+
+
+static ngx_buf_t *ngx_http_tnt_vshard_encode_call(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_uint_t router);
+
+
+static ngx_int_t
+ngx_http_tnt_vshard_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_tnt_vshard_peer_data_t *vp = data;
+
+    ngx_buf_t                    *b;
+    ngx_http_request_t           *r;
+    ngx_http_tnt_ctx_t           *ctx;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    r = vp->request;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    vp->router = 0;
+
+    if (ctx == NULL || ctx->vshard.bucket_id == 0) {
+        return vp->original_get_peer(pc, vp->data);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    if (ctx->vshard.peer >= 0) {
+
+        if (ngx_http_tnt_vshard_get_storage(pc, vp,
+                    (ngx_uint_t) ctx->vshard.peer) == NGX_OK)
+        {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                "tnt_vshard: storage of bucket %ui is unavailable",
+                ctx->vshard.bucket_id);
+
+        ctx->vshard.peer = -1;
+    }
+
+    /** DML can't be sent to a router */
+    if (ctx->vshard.func == NULL) {
+        return NGX_BUSY;
+    }
+
+    if (ctx->vshard.router_bufs == NULL) {
+
+        ctx->vshard.router_bufs = ngx_alloc_chain_link(r->pool);
+        if (ctx->vshard.router_bufs == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ngx_http_tnt_vshard_encode_call(r, ctx, 1);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->vshard.router_bufs->buf = b;
+        ctx->vshard.router_bufs->next = NULL;
+    }
+
+    r->upstream->request_bufs = ctx->vshard.router_bufs;
+
+    peer = ngx_http_tnt_live_peer(vp->vcf->router, &vp->vcf->router_next);
+    if (peer == NULL) {
+        return NGX_BUSY;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    vp->router = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_vshard_free_peer(ngx_peer_connection_t *pc, void *data,
+        ngx_uint_t state)
+{
+    ngx_http_tnt_vshard_peer_data_t *vp = data;
+
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(vp->request, ngx_http_tnt_module);
+
+    /** WRONG_BUCKET is not a failure of the peer */
+    if (ctx != NULL && ctx->vshard.wrong_bucket) {
+        state &= ~NGX_PEER_FAILED;
+    }
+
+    if (vp->router) {
+        vp->router = 0;
+
+        if (pc->tries) {
+            pc->tries--;
+        }
+
+    } else {
+        vp->original_free_peer(pc, vp->data, state);
+    }
+
+    /** One more try through the router */
+    if (ctx != NULL && ctx->vshard.wrong_bucket) {
+        ctx->vshard.wrong_bucket = 0;
+        pc->tries++;
+    }
+}
+
+
+/** Read the function, the arguments and the sync of an encoded call
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_parse_call(ngx_http_tnt_ctx_t *ctx, ngx_buf_t *b)
+{
+    const char  *p, *end, *args;
+    uint32_t    n, key;
+
+    p = (const char *) b->start + 5 /* size */;
+    end = (const char *) b->last;
+
+    if (p >= end || mp_typeof(*p) != MP_MAP) {
+        return NGX_ERROR;
+    }
+
+    /** Header */
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        key = mp_decode_uint(&p);
+
+        if (key == TP_SYNC) {
+            ctx->vshard.sync = (uint32_t) mp_decode_uint(&p);
+        } else {
+            mp_next(&p);
+        }
+    }
+
+    if (p >= end || mp_typeof(*p) != MP_MAP) {
+        return NGX_ERROR;
+    }
+
+    /** Body */
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        key = mp_decode_uint(&p);
+
+        if (key == TP_FUNCTION) {
+            ctx->vshard.func = mp_decode_str(&p, &ctx->vshard.func_len);
+
+        } else if (key == TP_TUPLE) {
+            args = p;
+            mp_next(&p);
+            ctx->vshard.args = args;
+            ctx->vshard.args_len = (uint32_t) (p - args);
+
+        } else {
+            mp_next(&p);
+        }
+    }
+
+    if (ctx->vshard.func == NULL || ctx->vshard.args == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/** func(args) -> vshard.storage|router.call(bucket_id, mode, func, args)
+ */
+static ngx_buf_t *
+ngx_http_tnt_vshard_encode_call(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_uint_t router)
+{
+    size_t     size;
+    ngx_str_t  name;
+    ngx_buf_t  *b;
+    struct tp  tp;
+
+    if (router) {
+        ngx_str_set(&name, "vshard.router.call");
+    } else {
+        ngx_str_set(&name, "vshard.storage.call");
+    }
+
+    size = 64 + name.len + ctx->vshard.mode.len + ctx->vshard.func_len
+           + ctx->vshard.args_len;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->memory = 1;
+    b->flush = 1;
+    b->last_in_chain = 1;
+
+    tp_init(&tp, (char *) b->start, size, NULL, NULL);
+
+    if (!tp_call_nargs(&tp, (const char *) name.data, name.len, 4)
+        || !tp_encode_uint(&tp, ctx->vshard.bucket_id)
+        || !tp_encode_str(&tp, (const char *) ctx->vshard.mode.data,
+                          ctx->vshard.mode.len)
+        || !tp_encode_str(&tp, ctx->vshard.func, ctx->vshard.func_len)
+        || tp_ensure(&tp, ctx->vshard.args_len) == -1)
+    {
+        return NULL;
+    }
+
+    ngx_memcpy(tp.p, ctx->vshard.args, ctx->vshard.args_len);
+    tp_add(&tp, ctx->vshard.args_len);
+
+    tp_reqid(&tp, ctx->vshard.sync);
+
+    b->last = (u_char *) tp.p;
+
+    return b;
+}
+
+
+static ngx_str_t
+ngx_http_tnt_vshard_format_key(ngx_http_tnt_ctx_t *ctx, ngx_str_t *name)
+{
+    ngx_uint_t                   i;
+    ngx_str_t                    key = ngx_null_string;
+    ngx_http_tnt_format_value_t  *fmt_val;
+
+    if (ctx->format_values == NULL) {
+        return key;
+    }
+
+    fmt_val = ctx->format_values;
+
+    for (i = 0; i < ctx->format_nvalues; i++) {
+
+        if (fmt_val[i].name.len == name->len
+            && ngx_strncmp(fmt_val[i].name.data, name->data, name->len) == 0)
+        {
+            return fmt_val[i].value;
+        }
+    }
+
+    return key;
+}
+
+
+/** Compute bucket_id of the request and choose its destination.
+ *
+ *  A call is wrapped by vshard.storage.call() if the owner of the bucket
+ *  is known, otherwise by vshard.router.call(). DML is sent only to the
+ *  owner.
+ *
+ *  Returns NGX_OK, NGX_ERROR or an HTTP status, in the last case the
+ *  error message has been set.
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_route(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_http_tnt_loc_conf_t *tlcf, tp_transcode_t *tc,
+        ngx_chain_t *out_chain)
+{
+    ngx_str_t                   key;
+    ngx_buf_t                   *b;
+    ngx_http_tnt_vshard_key_t   *vk;
+    ngx_http_tnt_vshard_conf_t  *vcf;
+    const ngx_http_tnt_error_t  *e;
+
+    vk = tlcf->vshard_key;
+    if (vk == NULL || tlcf->fanout != NULL) {
+        return NGX_OK;
+    }
+
+    vcf = ngx_http_tnt_vshard_get_conf(tlcf->upstream.upstream);
+    if (vcf == NULL || vcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    if (ctx->batch_size > 1) {
+        e = ngx_http_tnt_get_error_text(VSHARD_BATCH_ERROR);
+        goto bad_request;
+    }
+
+    ngx_str_null(&key);
+
+    if (vk->cv != NULL) {
+
+        if (ngx_http_complex_value(r, vk->cv, &key) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (vk->param >= 0) {
+
+        if (tc != NULL && tc->capture.value != NULL) {
+            key.data = (u_char *) tc->capture.value;
+            key.len = tc->capture.len;
+        }
+
+    } else {
+        key = ngx_http_tnt_vshard_format_key(ctx, &vk->name);
+    }
+
+    if (key.len == 0) {
+        e = ngx_http_tnt_get_error_text(VSHARD_NO_KEY);
+        goto bad_request;
+    }
+
+    ctx->vshard.bucket_id =
+        ngx_http_tnt_crc32c(key.data, key.len) % vcf->buckets + 1;
+    ctx->vshard.peer =
+        (ngx_int_t) vcf->sh->buckets[ctx->vshard.bucket_id - 1] - 1;
+    ctx->vshard.mode = vk->mode;
+
+    dd("vshard: key:'%.*s', bucket_id:%i, peer:%i", (int) key.len, key.data,
+            (int) ctx->vshard.bucket_id, (int) ctx->vshard.peer);
+
+    if (tlcf->req_type > 0) {
+
+        if (ctx->vshard.peer < 0) {
+
+            e = ngx_http_tnt_get_error_text(VSHARD_UNKNOWN_BUCKET);
+            if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_http_tnt_vshard_parse_call(ctx, out_chain->buf) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "[BUG] tnt_vshard: can't parse the call");
+        return NGX_ERROR;
+    }
+
+    b = ngx_http_tnt_vshard_encode_call(r, ctx, ctx->vshard.peer < 0);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    out_chain->buf = b;
+
+    if (ctx->vshard.peer < 0) {
+        ctx->vshard.router_bufs = out_chain;
+    }
+
+    return NGX_OK;
+
+bad_request:
+
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+/** Returns 1 if the data is [nil, WRONG_BUCKET]
+ */
+static ngx_int_t
+ngx_http_tnt_vshard_is_wrong_bucket(const char *data, const char *end)
+{
+    const char  *p, *k, *v;
+    uint32_t    n, k_len, v_len;
+    ngx_int_t   wrong_bucket, sharding_error, code;
+
+    p = data;
+    if (data == NULL || mp_check(&p, end)) {
+        return 0;
+    }
+
+    p = data;
+
+    if (mp_typeof(*p) != MP_ARRAY || mp_decode_array(&p) < 2
+        || mp_typeof(*p) != MP_NIL)
+    {
+        return 0;
+    }
+
+    mp_next(&p);
+
+    if (mp_typeof(*p) != MP_MAP) {
+        return 0;
+    }
+
+    wrong_bucket = sharding_error = 0;
+    code = -1;
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_STR) {
+            mp_next(&p);
+            mp_next(&p);
+            continue;
+        }
+
+        k = mp_decode_str(&p, &k_len);
+
+        if (k_len == 4 && ngx_strncmp(k, "code", 4) == 0
+            && mp_typeof(*p) == MP_UINT)
+        {
+            code = (ngx_int_t) mp_decode_uint(&p);
+
+        } else if (mp_typeof(*p) == MP_STR) {
+
+            v = mp_decode_str(&p, &v_len);
+
+            if (k_len == 4 && ngx_strncmp(k, "name", 4) == 0) {
+                wrong_bucket = (v_len == sizeof("WRONG_BUCKET") - 1
+                    && ngx_strncmp(v, "WRONG_BUCKET", v_len) == 0);
+
+            } else if (k_len == 4 && ngx_strncmp(k, "type", 4) == 0) {
+                sharding_error = (v_len == sizeof("ShardingError") - 1
+                    && ngx_strncmp(v, "ShardingError", v_len) == 0);
+            }
+
+        } else {
+            mp_next(&p);
+        }
+    }
+
+    return wrong_bucket || (sharding_error && code == 1);
+}
+
+
+static ngx_int_t
+ngx_http_tnt_vshard_check_reply(ngx_http_request_t *r,
+        ngx_http_tnt_ctx_t *ctx, ngx_buf_t *b)
+{
+    ssize_t                     size;
+    struct tpresponse           reply;
+    ngx_http_upstream_t         *u;
+    ngx_http_upstream_conf_t    *conf;
+    ngx_http_tnt_vshard_conf_t  *vcf;
+
+    if (b->last - b->pos < 5) {
+        return b->end - b->pos < 5 ? NGX_OK : NGX_AGAIN;
+    }
+
+    size = tp_read_payload((const char *) b->pos, (const char *) b->last);
+
+    /** Big replies are not errors */
+    if (size <= 0
+        || size > NGX_HTTP_TNT_VSHARD_ERROR_MAX
+        || size > b->end - b->pos)
+    {
+        return NGX_OK;
+    }
+
+    if (b->last - b->pos < size) {
+        return NGX_AGAIN;
+    }
+
+    if (tp_reply(&reply, (const char *) b->pos, (size_t) size) <= 0
+        || reply.code != 0
+        || !ngx_http_tnt_vshard_is_wrong_bucket(reply.data, reply.data_end))
+    {
+        return NGX_OK;
+    }
+
+    u = r->upstream;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "tnt_vshard: WRONG_BUCKET for bucket %ui from \"%V\", "
+            "retrying through the router",
+            ctx->vshard.bucket_id, u->peer.name);
+
+    /** Forget the owner and refresh the map soon */
+    vcf = ngx_http_tnt_vshard_get_conf(u->upstream);
+    if (vcf != NULL && vcf->sh != NULL) {
+        ngx_shmtx_lock(&vcf->shpool->mutex);
+        vcf->sh->buckets[ctx->vshard.bucket_id - 1] = 0;
+        ngx_shmtx_unlock(&vcf->shpool->mutex);
+
+        vcf->sh->refresh_at = 0;
+    }
+
+    ctx->vshard.peer = -1;
+    ctx->vshard.wrong_bucket = 1;
+
+    /** The storage didn't execute the call, so the retry is safe */
+    conf = ngx_palloc(r->pool, sizeof(ngx_http_upstream_conf_t));
+    if (conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    *conf = *u->conf;
+    conf->next_upstream |= NGX_HTTP_UPSTREAM_FT_INVALID_HEADER;
+#ifdef NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT
+    conf->next_upstream |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
+#endif
+    u->conf = conf;
+
+    return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+}
+/** }}}
+ */
+
+
+/** Direct requests {{{
+ *
+ *  Requests which are not passed through the nginx upstream, see
+ *  tnt_fanout and tnt_multiplex.
+ */
+static ngx_int_t
+ngx_http_tnt_direct_output(ngx_http_request_t *r, ngx_uint_t status,
+        ngx_buf_t *b)
+{
+    ngx_int_t    rc;
+    ngx_chain_t  out;
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/** Transcodes an IPROTO reply into JSON and sends it to the client.
+ *  Returns a code for ngx_http_finalize_request().
+ */
+static ngx_int_t
+ngx_http_tnt_direct_reply(ngx_http_request_t *r, ngx_buf_t *b)
+{
+    tp_transcode_t           tc;
+    ngx_int_t                rc;
+    ngx_buf_t                *output;
+    size_t                   complete_msg_size;
+    ngx_http_tnt_ctx_t       *ctx;
+    ngx_http_tnt_loc_conf_t  *tlcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    output = ngx_create_temp_buf(r->pool,
+            (b->last - b->pos + ngx_http_tnt_overhead()) * tlcf->out_multiplier);
+    if (output == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tp_transcode_init_args_t args = {
+        .output = (char *) output->pos,
+        .output_size = output->end - output->pos,
+        .method = NULL, .method_len = 0,
+        .codec = TP_REPLY_TO_JSON,
+        .mf = NULL
+    };
+
+    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "[BUG] failed to call tp_transcode_init(output)");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    tp_reply_to_json_set_options(&tc, tlcf->pure_result == NGX_TNT_CONF_ON,
+            tlcf->multireturn_skip_count);
+
+    rc = tp_transcode(&tc, (char *) b->pos, b->last - b->pos);
+    if (rc != TP_TRANSCODE_ERROR) {
+        rc = tp_transcode_complete(&tc, &complete_msg_size);
+    }
+
+    if (rc == TP_TRANSCODE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "[BUG] failed to transcode output. errcode: '%d', errmsg: '%s'",
+            tc.errcode, get_str_safe((const u_char *) tc.errmsg));
+        tp_transcode_free(&tc);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Send an error to the client */
+    if (rc == TP_TNT_ERROR) {
+
+        rc = ngx_http_tnt_set_err(r, tc.errcode, (u_char *) tc.errmsg,
+                ngx_strlen(tc.errmsg));
+
+        tp_transcode_free(&tc);
+
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        return ngx_http_tnt_direct_output(r, NGX_HTTP_OK, ctx->in_err);
+    }
+
+    tp_transcode_free(&tc);
+
+    output->last = output->pos + complete_msg_size;
+
+    return ngx_http_tnt_direct_output(r, NGX_HTTP_OK, output);
+}
+
+
+/** Encodes the request by u->create_request, i.e. in the same way as for
+ *  the upstream. Returns the encoded request in one buffer or NULL, if so
+ *  then the request is finalized.
+ */
+static ngx_buf_t *
+ngx_http_tnt_direct_request(ngx_http_request_t *r, ngx_uint_t batch_err)
+{
+    size_t                      size;
+    ngx_int_t                   status;
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl;
+    ngx_http_upstream_t         *u;
+    ngx_http_tnt_ctx_t          *ctx;
+    const ngx_http_tnt_error_t  *e;
+
+    u = r->upstream;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    if (r->request_body != NULL) {
+        u->request_bufs = r->request_body->bufs;
+    }
+
+    if (u->create_request(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NULL;
+    }
+
+    if (ctx->state == OK && ctx->batch_size > 1) {
+
+        e = ngx_http_tnt_get_error_text(batch_err);
+        if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NULL;
+        }
+
+        ctx->state = INPUT_FMT_CANT_READ_INPUT;
+    }
+
+    if (ctx->state != OK) {
+
+        if (ctx->in_err == NULL) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NULL;
+        }
+
+        if (ctx->state == INPUT_RATE_LIMITED) {
+            status = NGX_HTTP_TNT_TOO_MANY_REQUESTS;
+
+        } else if (ctx->state == INPUT_SCHEMA_UNKNOWN) {
+            status = NGX_HTTP_SERVICE_UNAVAILABLE;
+
+        } else {
+            status = NGX_HTTP_BAD_REQUEST;
+        }
+
+        ngx_http_finalize_request(r,
+                ngx_http_tnt_direct_output(r, status, ctx->in_err));
+        return NULL;
+    }
+
+    cl = u->request_bufs;
+    b = cl->buf;
+
+    if (cl->next != NULL) {
+
+        for (size = 0; cl; cl = cl->next) {
+            size += cl->buf->last - cl->buf->pos;
+        }
+
+        b = ngx_create_temp_buf(r->pool, size);
+        if (b == NULL) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NULL;
+        }
+
+        for (cl = u->request_bufs; cl; cl = cl->next) {
+            b->last = ngx_cpymem(b->last, cl->buf->pos,
+                                 cl->buf->last - cl->buf->pos);
+        }
+    }
+
+    return b;
+}
+/** }}}
+ */
+
+
+/** Fan-out {{{
+ */
+static char *
+ngx_http_tnt_fanout(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    ngx_str_t                   *value, v;
+    ngx_int_t                   n;
+    ngx_uint_t                  i;
+    ngx_http_tnt_fanout_conf_t  *fc;
+
+    if (tlcf->fanout != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts > 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        tlcf->fanout = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\", it must be \"on\" or \"off\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    fc = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_fanout_conf_t));
+    if (fc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "sort=", sizeof("sort=") - 1) == 0) {
+
+            v.data = value[i].data + sizeof("sort=") - 1;
+            v.len = value[i].len - (sizeof("sort=") - 1);
+
+            if (v.len == 0) {
+                goto invalid;
+            }
+
+            /** A number of the field (from 1) or a name of the map key */
+            n = ngx_atoi(v.data, v.len);
+            if (n == 0) {
+                goto invalid;
+            }
+
+            if (n == NGX_ERROR) {
+                fc->sort_name = v;
+            } else {
+                fc->sort_field = (ngx_uint_t) n;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "order=asc") == 0) {
+            fc->desc = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "order=desc") == 0) {
+            fc->desc = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "limit=", sizeof("limit=") - 1) == 0) {
+
+            n = ngx_atoi(value[i].data + sizeof("limit=") - 1,
+                         value[i].len - (sizeof("limit=") - 1));
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            fc->limit = (ngx_uint_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    tlcf->fanout = fc;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_tnt_fanout_cleanup(void *data)
+{
+    ngx_http_tnt_fanout_t *fo = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < fo->n; i++) {
+
+        if (fo->calls[i] != NULL) {
+            ngx_http_tnt_bg_call_close(fo->calls[i]);
+            fo->calls[i] = NULL;
+        }
+    }
+
+    fo->pending = 0;
+}
+
+
+/** nil < boolean < number < string < binary < the rest
+ */
+static ngx_uint_t
+ngx_http_tnt_mp_rank(const char *p)
+{
+    if (p == NULL) {
+        return 0;
+    }
+
+    switch (mp_typeof(*p)) {
+    case MP_NIL:
+        return 0;
+    case MP_BOOL:
+        return 1;
+    case MP_UINT:
+    case MP_INT:
+    case MP_FLOAT:
+    case MP_DOUBLE:
+        return 2;
+    case MP_STR:
+        return 3;
+    case MP_BIN:
+        return 4;
+    default:
+        return 5;
+    }
+}
+
+
+static double
+ngx_http_tnt_mp_to_double(const char *p)
+{
+    switch (mp_typeof(*p)) {
+    case MP_UINT:
+        return (double) mp_decode_uint(&p);
+    case MP_INT:
+        return (double) mp_decode_int(&p);
+    case MP_FLOAT:
+        return (double) mp_decode_float(&p);
+    default:
+        return mp_decode_double(&p);
+    }
+}
+
+
+/** Returns <0, 0, >0 like memcmp(), a NULL is the same as nil
+ */
+static ngx_int_t
+ngx_http_tnt_mp_compare(const char *a, const char *b)
+{
+    int          an, bn;
+    bool         ab, bb;
+    double       ad, bd;
+    int64_t      ai, bi;
+    uint64_t     au, bu;
+    uint32_t     alen, blen;
+    ngx_int_t    rc;
+    ngx_uint_t   ar, br;
+    const char   *as, *bs;
+
+    ar = ngx_http_tnt_mp_rank(a);
+    br = ngx_http_tnt_mp_rank(b);
+
+    if (ar != br) {
+        return ar < br ? -1 : 1;
+    }
+
+    switch (ar) {
+
+    case 1:
+        ab = mp_decode_bool(&a);
+        bb = mp_decode_bool(&b);
+        return (ngx_int_t) ab - (ngx_int_t) bb;
+
+    case 2:
+
+        /** Integers are compared exactly, the rest as doubles */
+        if ((mp_typeof(*a) == MP_UINT || mp_typeof(*a) == MP_INT)
+            && (mp_typeof(*b) == MP_UINT || mp_typeof(*b) == MP_INT))
+        {
+            an = (mp_typeof(*a) == MP_INT);
+            bn = (mp_typeof(*b) == MP_INT);
+
+            ai = bi = 0;
+            au = bu = 0;
+
+            if (an) {
+                ai = mp_decode_int(&a);
+                if (ai >= 0) {
+                    au = (uint64_t) ai;
+                    an = 0;
+                }
+            } else {
+                au = mp_decode_uint(&a);
+            }
+
+            if (bn) {
+                bi = mp_decode_int(&b);
+                if (bi >= 0) {
+                    bu = (uint64_t) bi;
+                    bn = 0;
+                }
+            } else {
+                bu = mp_decode_uint(&b);
+            }
+
+            if (an != bn) {
+                return an ? -1 : 1;
+            }
+
+            if (an) {
+                return ai < bi ? -1 : (ai > bi);
+            }
+
+            return au < bu ? -1 : (au > bu);
+        }
+
+        ad = ngx_http_tnt_mp_to_double(a);
+        bd = ngx_http_tnt_mp_to_double(b);
+
+        return ad < bd ? -1 : (ad > bd);
+
+    case 3:
+    case 4:
+
+        if (ar == 3) {
+            as = mp_decode_str(&a, &alen);
+            bs = mp_decode_str(&b, &blen);
+        } else {
+            as = mp_decode_bin(&a, &alen);
+            bs = mp_decode_bin(&b, &blen);
+        }
+
+        rc = ngx_memcmp(as, bs, ngx_min(alen, blen));
+        if (rc != 0) {
+            return rc;
+        }
+
+        return alen < blen ? -1 : (alen > blen);
+
+    default:
+        return 0;
+    }
+}
+
+
+/** Returns the sort key of the row or NULL if there is no such field
+ */
+static const char *
+ngx_http_tnt_fanout_key(ngx_http_tnt_fanout_conf_t *fc, const char *row)
+{
+    uint32_t    n, len;
+    const char  *key;
+
+    if (fc->sort_field) {
+
+        if (mp_typeof(*row) != MP_ARRAY) {
+            return NULL;
+        }
+
+        n = mp_decode_array(&row);
+        if (fc->sort_field > n) {
+            return NULL;
+        }
+
+        for (n = fc->sort_field - 1; n > 0; n--) {
+            mp_next(&row);
+        }
+
+        return row;
+    }
+
+    if (mp_typeof(*row) != MP_MAP) {
+        return NULL;
+    }
+
+    for (n = mp_decode_map(&row); n > 0; n--) {
+
+        if (mp_typeof(*row) == MP_STR) {
+
+            key = mp_decode_str(&row, &len);
+
+            if (len == fc->sort_name.len
+                && ngx_strncmp(key, fc->sort_name.data, len) == 0)
+            {
+                return row;
+            }
+
+        } else {
+            mp_next(&row);
+        }
+
+        mp_next(&row);
+    }
+
+    return NULL;
+}
+
+
+/** Merges the replies of the peers into one IPROTO reply.
+ *
+ *  A function returns rows as its first value, so the merged reply is
+ *  DATA = [[rows...]], for DML requests it's DATA = [tuples...].
+ *  If tnt_fanout has 'sort=', then each peer should return rows sorted in
+ *  the same order; the k-way merge keeps that order.
+ *  If some peer has returned an error, then the error is the reply.
+ */
+static ngx_buf_t *
+ngx_http_tnt_fanout_merge(ngx_http_request_t *r, ngx_http_tnt_fanout_t *fo,
+        ngx_uint_t call)
+{
+    char                        *p;
+    size_t                      size;
+    uint32_t                    n, sync;
+    ngx_int_t                   rc;
+    ngx_buf_t                   *b;
+    ngx_uint_t                  i, k, best, sorted, rows;
+    const char                  *row;
+    struct tpresponse           resp;
+    ngx_http_tnt_fanout_conf_t  *fc;
+    ngx_http_tnt_fanout_cur_t   *cur;
+
+    fc = fo->conf;
+    sorted = (fc->sort_field || fc->sort_name.len);
+
+    cur = ngx_pcalloc(r->pool, fo->n * sizeof(ngx_http_tnt_fanout_cur_t));
+    if (cur == NULL) {
+        return NULL;
+    }
+
+    size = 64;
+    sync = 0;
+    rows = 0;
+
+    for (i = 0; i < fo->n; i++) {
+
+        if (fo->replies[i].data == NULL) {
+            continue;
+        }
+
+        if (tp_reply(&resp, (const char *) fo->replies[i].data,
+                    fo->replies[i].len) <= 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "tnt_fanout: peer #%ui sent an invalid reply", i);
+            return NULL;
+        }
+
+        if (resp.code != 0) {
+
+            b = ngx_calloc_buf(r->pool);
+            if (b == NULL) {
+                return NULL;
+            }
+
+            b->start = b->pos = fo->replies[i].data;
+            b->end = b->last = fo->replies[i].data + fo->replies[i].len;
+
+            return b;
+        }
+
+        sync = resp.sync;
+        size += fo->replies[i].len;
+
+        if (resp.data == NULL) {
+            continue;
+        }
+
+        row = resp.data;
+        n = mp_decode_array(&row);
+
+        if (call && n > 0) {
+
+            if (mp_typeof(*row) != MP_ARRAY) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "tnt_fanout: peer #%ui returned not an array of rows",
+                        i);
+                return NULL;
+            }
+
+            n = mp_decode_array(&row);
+        }
+
+        cur[i].p = row;
+        cur[i].left = n;
+        rows += n;
+
+        if (sorted && n > 0) {
+            cur[i].key = ngx_http_tnt_fanout_key(fc, row);
+        }
+    }
+
+    if (fc->limit && rows > fc->limit) {
+        rows = fc->limit;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    p = (char *) b->last + 5;
+
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, 0);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, sync);
+
+    p = mp_encode_map(p, 1);
+    p = mp_encode_uint(p, TP_DATA);
+
+    if (call) {
+        p = mp_encode_array(p, 1);
+    }
+
+    p = mp_encode_array(p, rows);
+
+    for (k = 0; k < rows; k++) {
+
+        best = fo->n;
+
+        for (i = 0; i < fo->n; i++) {
+
+            if (cur[i].left == 0) {
+                continue;
+            }
+
+            if (best == fo->n) {
+                best = i;
+
+                if (!sorted) {
+                    break;
+                }
+
+                continue;
+            }
+
+            rc = ngx_http_tnt_mp_compare(cur[i].key, cur[best].key);
+            if (fc->desc) {
+                rc = -rc;
+            }
+
+            if (rc < 0) {
+                best = i;
+            }
+        }
+
+        row = cur[best].p;
+        mp_next(&cur[best].p);
+
+        p = (char *) ngx_cpymem(p, row, cur[best].p - row);
+
+        if (--cur[best].left > 0 && sorted) {
+            cur[best].key = ngx_http_tnt_fanout_key(fc, cur[best].p);
+        }
+    }
+
+    *b->last = 0xce;
+    *(uint32_t *) (b->last + 1) = mp_bswap_u32(p - (char *) b->last - 5);
+
+    b->last = (u_char *) p;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_fanout_send(ngx_http_request_t *r, ngx_http_tnt_fanout_t *fo)
+{
+    ngx_buf_t                *b;
+    ngx_http_tnt_loc_conf_t  *tlcf;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    b = ngx_http_tnt_fanout_merge(r, fo, !(tlcf->req_type > 0));
+    if (b == NULL) {
+        return NGX_HTTP_BAD_GATEWAY;
+    }
+
+    return ngx_http_tnt_direct_reply(r, b);
+}
+
+
+static void
+ngx_http_tnt_fanout_done(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    ngx_http_tnt_fanout_t *fo = bc->data;
+
+    ngx_uint_t          i;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = fo->request;
+    c = r->connection;
+
+    for (i = 0; i < fo->n; i++) {
+        if (fo->calls[i] == bc) {
+            break;
+        }
+    }
+
+    if (i == fo->n) {
+        return;
+    }
+
+    /** bc is closed by the caller */
+    fo->calls[i] = NULL;
+    fo->pending--;
+
+    if (rc == NGX_OK) {
+
+        fo->replies[i].data = ngx_pnalloc(r->pool, bc->reply_len);
+        if (fo->replies[i].data == NULL) {
+            rc = NGX_ERROR;
+
+        } else {
+            ngx_memcpy(fo->replies[i].data, bc->reply, bc->reply_len);
+            fo->replies[i].len = bc->reply_len;
+        }
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_tnt_fanout_cleanup(fo);
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (fo->pending > 0) {
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_tnt_fanout_send(r, fo));
+    ngx_http_run_posted_requests(c);
+}
+
+
+/** Encodes the request once and writes it to each live peer of the
+ *  upstream, see ngx_http_tnt_fanout_done()
+ */
+static void
+ngx_http_tnt_fanout_init(ngx_http_request_t *r)
+{
+    ngx_uint_t                    i;
+    ngx_buf_t                     *b;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_tnt_fanout_t         *fo;
+    ngx_http_tnt_bg_call_t        *bc;
+    ngx_http_tnt_loc_conf_t       *tlcf;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    /** The request is written to each peer from the same memory */
+    b = ngx_http_tnt_direct_request(r, FANOUT_BATCH_ERROR);
+    if (b == NULL) {
+        return;
+    }
+
+    peers = NULL;
+    if (tlcf->upstream.upstream != NULL) {
+        peers = tlcf->upstream.upstream->peer.data;
+    }
+
+    if (peers == NULL || peers->number == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt_fanout: no peers, \"tnt_pass\" should be an upstream");
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    fo = ngx_pcalloc(r->pool, sizeof(ngx_http_tnt_fanout_t));
+    if (fo == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    fo->request = r;
+    fo->conf = tlcf->fanout;
+    fo->n = peers->number;
+
+    fo->calls = ngx_pcalloc(r->pool, fo->n * sizeof(ngx_http_tnt_bg_call_t *));
+    fo->replies = ngx_pcalloc(r->pool, fo->n * sizeof(ngx_str_t));
+    if (fo->calls == NULL || fo->replies == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln->handler = ngx_http_tnt_fanout_cleanup;
+    cln->data = fo;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer, i = 0;
+         peer != NULL && i < fo->n;
+         peer = peer->next, i++)
+    {
+        if (peer->down) {
+            continue;
+        }
+
+        /** The call can outlive the client connection's log */
+        bc = ngx_http_tnt_bg_call_create(ngx_cycle->log, 0);
+        if (bc == NULL) {
+            break;
+        }
+
+        bc->out->start = bc->out->pos = b->pos;
+        bc->out->end = bc->out->last = b->last;
+
+        bc->handler = ngx_http_tnt_fanout_done;
+        bc->data = fo;
+        bc->timeout = tlcf->upstream.connect_timeout
+                      + tlcf->upstream.read_timeout;
+
+        if (ngx_http_tnt_bg_call_start(bc, peer->sockaddr, peer->socklen,
+                    &peer->name) != NGX_OK)
+        {
+            break;
+        }
+
+        fo->calls[i] = bc;
+        fo->pending++;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (peer != NULL || fo->pending == 0) {
+        ngx_http_tnt_fanout_cleanup(fo);
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+    }
+}
+/** }}}
+ */
+
+
+/** Multiplexer {{{
+ *
+ *  Requests of all clients of a worker are written to a few connections
+ *  per peer, each request gets an unique sync on the connection. Requests
+ *  which are encoded in the same event loop iteration are sent by one
+ *  write.
+ */
+static char *
+ngx_http_tnt_multiplex(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_srv_conf_t *tscf = conf;
+
+    ngx_int_t                n;
+    ngx_str_t                *value;
+    ngx_http_tnt_mux_conf_t  *mcf;
+
+    if (tscf->mux != NULL) {
+        return "is duplicate";
+    }
+
+    if (tscf->vshard != NULL) {
+        return "can't be used with 'tnt_vshard'";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_mux_conf_t));
+    if (mcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    mcf->connections = (ngx_uint_t) n;
+
+    tscf->mux = mcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_tnt_mux_conf_t *
+ngx_http_tnt_mux_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->mux;
+}
+
+
+/** Ensures that b has size free bytes after b->last. The buffers of
+ *  connections live as long as a worker, so they are not from a pool.
+ */
+static ngx_int_t
+ngx_http_tnt_mux_reserve(ngx_buf_t *b, size_t size)
+{
+    size_t  len, cap;
+    u_char  *p;
+
+    if ((size_t) (b->end - b->last) >= size) {
+        return NGX_OK;
+    }
+
+    len = b->last - b->pos;
+
+    if (b->pos != b->start) {
+
+        ngx_memmove(b->start, b->pos, len);
+
+        b->pos = b->start;
+        b->last = b->start + len;
+
+        if ((size_t) (b->end - b->last) >= size) {
+            return NGX_OK;
+        }
+    }
+
+    cap = ngx_max((size_t) (b->end - b->start) * 2, len + size);
+    cap = ngx_max(cap, 4096);
+
+    p = ngx_alloc(cap, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (len) {
+        ngx_memcpy(p, b->pos, len);
+    }
+
+    if (b->start != NULL) {
+        ngx_free(b->start);
+    }
+
+    b->start = b->pos = p;
+    b->last = p + len;
+    b->end = p + cap;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_mux_detach(ngx_http_tnt_mux_req_t *mr)
+{
+    if (mr->conn == NULL) {
+        return;
+    }
+
+    ngx_rbtree_delete(&mr->conn->requests, &mr->node);
+    mr->conn = NULL;
+
+    if (mr->timeout.timer_set) {
+        ngx_del_timer(&mr->timeout);
+    }
+}
+
+
+static void
+ngx_http_tnt_mux_cleanup(void *data)
+{
+    ngx_http_tnt_mux_detach(data);
+}
+
+
+static void
+ngx_http_tnt_mux_close(ngx_http_tnt_mux_conn_t *mc)
+{
+    if (mc->peer.connection != NULL) {
+        ngx_close_connection(mc->peer.connection);
+        mc->peer.connection = NULL;
+    }
+
+    mc->out.pos = mc->out.last = mc->out.start;
+    mc->in.pos = mc->in.last = mc->in.start;
+    mc->greeting = 0;
+}
+
+
+/** Closes the connection and finalizes its requests with 502
+ */
+static void
+ngx_http_tnt_mux_fail(ngx_http_tnt_mux_conn_t *mc)
+{
+    ngx_connection_t        *c;
+    ngx_rbtree_node_t       *node;
+    ngx_http_request_t      *r;
+    ngx_http_tnt_mux_req_t  *mr, *list;
+
+    ngx_http_tnt_mux_close(mc);
+
+    /** Requests are detached first, since a finalization could add new
+     *  ones to the connection.
+     */
+    list = NULL;
+
+    while (mc->requests.root != mc->requests.sentinel) {
+
+        node = mc->requests.root;
+
+        mr = (ngx_http_tnt_mux_req_t *) node;
+        ngx_http_tnt_mux_detach(mr);
+
+        mr->next = list;
+        list = mr;
+    }
+
+    while (list != NULL) {
+
+        mr = list;
+        list = mr->next;
+
+        r = mr->request;
+        c = r->connection;
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+static ngx_http_tnt_mux_req_t *
+ngx_http_tnt_mux_lookup(ngx_http_tnt_mux_conn_t *mc, uint32_t sync)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = mc->requests.root;
+    sentinel = mc->requests.sentinel;
+
+    while (node != sentinel) {
+
+        if (sync < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (sync > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_http_tnt_mux_req_t *) node;
+    }
+
+    return NULL;
+}
+
+
+/** Tarantool encodes the sync with the minimal size, so the header is
+ *  encoded again with the sync of the client.
+ */
+static ngx_buf_t *
+ngx_http_tnt_mux_restore_sync(ngx_http_request_t *r, struct tpresponse *resp,
+        size_t size, uint32_t sync)
+{
+    char        *p;
+    uint32_t    n;
+    ngx_buf_t   *b;
+    const char  *body;
+
+    body = resp->buf + 5;
+
+    for (n = mp_decode_map(&body); n > 0; n--) {
+        mp_next(&body);
+        mp_next(&body);
+    }
+
+    size -= body - resp->buf;
+
+    b = ngx_create_temp_buf(r->pool, size + 32);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    p = (char *) b->last + 5;
+
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, resp->code);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, sync);
+
+    p = (char *) ngx_cpymem(p, body, size);
+
+    *b->last = 0xce;
+    *(uint32_t *) (b->last + 1) = mp_bswap_u32(p - (char *) b->last - 5);
+
+    b->last = (u_char *) p;
+
+    return b;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_mux_reply(ngx_http_tnt_mux_conn_t *mc, const char *reply,
+        size_t size)
+{
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+    struct tpresponse       resp;
+    ngx_http_request_t      *r;
+    ngx_http_tnt_mux_req_t  *mr;
+
+    if (tp_reply(&resp, reply, size) <= 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "tnt_multiplex: \"%V\" sent an invalid reply",
+                mc->peer.name);
+        return NGX_ERROR;
+    }
+
+    /** The request has timed out or it has been finalized */
+    mr = ngx_http_tnt_mux_lookup(mc, resp.sync);
+    if (mr == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_tnt_mux_detach(mr);
+
+    r = mr->request;
+    c = r->connection;
+
+    b = ngx_http_tnt_mux_restore_sync(r, &resp, size, mr->sync);
+    if (b == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    } else {
+        ngx_http_finalize_request(r, ngx_http_tnt_direct_reply(r, b));
+    }
+
+    ngx_http_run_posted_requests(c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_mux_parse(ngx_http_tnt_mux_conn_t *mc)
+{
+    ssize_t    size;
+    ngx_buf_t  *b;
+
+    b = &mc->in;
+
+    if (!mc->greeting) {
+
+        if (b->last - b->pos < 128) {
+            return NGX_OK;
+        }
+
+        if (ngx_strncmp(b->pos, "Tarantool", sizeof("Tarantool") - 1) != 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "tnt_multiplex: \"%V\" sent an invalid greeting",
+                    mc->peer.name);
+            return NGX_ERROR;
+        }
+
+        b->pos += 128;
+        mc->greeting = 1;
+    }
+
+    while (b->last - b->pos >= 5) {
+
+        size = tp_read_payload((const char *) b->pos, (const char *) b->last);
+        if (size <= 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "tnt_multiplex: \"%V\" sent an invalid reply",
+                    mc->peer.name);
+            return NGX_ERROR;
+        }
+
+        if (b->last - b->pos < size) {
+            break;
+        }
+
+        if (ngx_http_tnt_mux_reply(mc, (const char *) b->pos, (size_t) size)
+                != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        b->pos += size;
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->last = b->start;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_mux_write_handler(ngx_event_t *wev)
+{
+    ssize_t                  n;
+    ngx_buf_t                *b;
+    ngx_connection_t         *c;
+    ngx_http_tnt_mux_conn_t  *mc;
+
+    c = wev->data;
+    mc = c->data;
+    b = &mc->out;
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_tnt_mux_fail(mc);
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->last = b->start;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_tnt_mux_fail(mc);
+    }
+}
+
+
+static void
+ngx_http_tnt_mux_read_handler(ngx_event_t *rev)
+{
+    ssize_t                  n;
+    ngx_buf_t                *b;
+    ngx_connection_t         *c;
+    ngx_http_tnt_mux_conn_t  *mc;
+
+    c = rev->data;
+    mc = c->data;
+    b = &mc->in;
+
+    for ( ;; ) {
+
+        if (ngx_http_tnt_mux_reserve(b, 4096) != NGX_OK) {
+            ngx_http_tnt_mux_fail(mc);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "tnt_multiplex: \"%V\" closed the connection",
+                    mc->peer.name);
+            ngx_http_tnt_mux_fail(mc);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_tnt_mux_parse(mc) != NGX_OK) {
+            ngx_http_tnt_mux_fail(mc);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_tnt_mux_fail(mc);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_tnt_mux_connect(ngx_http_tnt_mux_conn_t *mc,
+        ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t         rc;
+    ngx_connection_t  *c;
+
+    ngx_memzero(&mc->peer, sizeof(ngx_peer_connection_t));
+
+    mc->peer.sockaddr = peer->sockaddr;
+    mc->peer.socklen = peer->socklen;
+    mc->peer.name = &peer->name;
+    mc->peer.get = ngx_event_get_peer;
+    mc->peer.log = ngx_cycle->log;
+    mc->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&mc->peer);
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "tnt_multiplex: can't connect to \"%V\"", &peer->name);
+        mc->peer.connection = NULL;
+        return NGX_ERROR;
+    }
+
+    c = mc->peer.connection;
+    c->data = mc;
+
+    c->read->handler = ngx_http_tnt_mux_read_handler;
+    c->write->handler = ngx_http_tnt_mux_write_handler;
+
+    return NGX_OK;
+}
+
+
+/** Returns a connection to a live peer, round-robin
+ */
+static ngx_http_tnt_mux_conn_t *
+ngx_http_tnt_mux_get_conn(ngx_http_tnt_mux_conf_t *mcf)
+{
+    ngx_uint_t                    i, n;
+    ngx_http_tnt_mux_conn_t       *mc;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = mcf->uscf->peer.data;
+    if (peers == NULL || peers->number == 0) {
+        return NULL;
+    }
+
+    if (mcf->conns == NULL) {
+
+        mcf->nconns = peers->number * mcf->connections;
+
+        mcf->conns = ngx_pcalloc(ngx_cycle->pool,
+                mcf->nconns * sizeof(ngx_http_tnt_mux_conn_t));
+        if (mcf->conns == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < mcf->nconns; i++) {
+            mc = &mcf->conns[i];
+            mc->conf = mcf;
+            mc->index = i / mcf->connections;
+            ngx_rbtree_init(&mc->requests, &mc->sentinel,
+                            ngx_rbtree_insert_value);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (i = 0; i < mcf->nconns; i++) {
+
+        mc = &mcf->conns[mcf->next++ % mcf->nconns];
+
+        for (peer = peers->peer, n = mc->index; peer && n; peer = peer->next, n--)
+        {
+            /* void */
+        }
+
+        if (peer == NULL || peer->down) {
+            continue;
+        }
+
+        if (mc->peer.connection == NULL
+            && ngx_http_tnt_mux_connect(mc, peer) != NGX_OK)
+        {
+            continue;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        return mc;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_tnt_mux_timeout_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_mux_req_t *mr = ev->data;
+
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = mr->request;
+    c = r->connection;
+
+    ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT,
+            "tnt_multiplex: \"%V\" timed out", mr->conn->peer.name);
+
+    ngx_http_tnt_mux_detach(mr);
+
+    ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_tnt_mux_init(ngx_http_request_t *r)
+{
+    u_char                   *p;
+    size_t                   len;
+    uint32_t                 sync;
+    ngx_buf_t                *b;
+    ngx_connection_t         *c;
+    ngx_pool_cleanup_t       *cln;
+    ngx_http_tnt_mux_req_t   *mr;
+    ngx_http_tnt_mux_conn_t  *mc;
+    ngx_http_tnt_mux_conf_t  *mcf;
+    ngx_http_tnt_loc_conf_t  *tlcf;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    mcf = ngx_http_tnt_mux_get_conf(tlcf->upstream.upstream);
+
+    b = ngx_http_tnt_direct_request(r, MUX_BATCH_ERROR);
+    if (b == NULL) {
+        return;
+    }
+
+    len = b->last - b->pos;
+
+    /** tpi_encode_header() puts the sync as 0xce right after the code */
+    if (len < 14 || b->pos[8] != TP_SYNC || b->pos[9] != 0xce) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                "[BUG] tnt_multiplex: unexpected request header");
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    mc = ngx_http_tnt_mux_get_conn(mcf);
+    if (mc == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt_multiplex: no live peers");
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    mr = ngx_pcalloc(r->pool, sizeof(ngx_http_tnt_mux_req_t));
+    if (mr == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (ngx_http_tnt_mux_reserve(&mc->out, len) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_memcpy(&sync, b->pos + 10, sizeof(uint32_t));
+    mr->sync = mp_bswap_u32(sync);
+
+    sync = ++mcf->sync;
+
+    p = mc->out.last;
+    mc->out.last = ngx_cpymem(p, b->pos, len);
+
+    *(uint32_t *) (p + 10) = mp_bswap_u32(sync);
+
+    mr->node.key = sync;
+    mr->request = r;
+    mr->conn = mc;
+
+    ngx_rbtree_insert(&mc->requests, &mr->node);
+
+    mr->timeout.handler = ngx_http_tnt_mux_timeout_handler;
+    mr->timeout.data = mr;
+    mr->timeout.log = r->connection->log;
+
+    ngx_add_timer(&mr->timeout, tlcf->upstream.read_timeout);
+
+    cln->handler = ngx_http_tnt_mux_cleanup;
+    cln->data = mr;
+
+    /** Requests of this iteration of the event loop are sent together */
+    c = mc->peer.connection;
+    if (c->write->ready) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+}
+/** }}}
+ */
+
+
+/** Pre-warmed connections {{{
+ *
+ *  Each worker opens connections to each peer and reads their greetings
+ *  before any request. A request takes a ready connection of the peer which
+ *  is chosen by the balancer, see ngx_http_tnt_prewarm_get_peer().
+ *
+ *  The directive wraps the other balancers, so 'keepalive' looks into its
+ *  cache first and used connections are cached by it.
+ */
+
+/** How often workers reopen closed connections */
+#define NGX_HTTP_TNT_PREWARM_RETRY 1000
+
+/** A timeout of connecting and reading the greeting */
+#define NGX_HTTP_TNT_PREWARM_TIMEOUT 10000
+
+
+static ngx_int_t ngx_http_tnt_prewarm_init_upstream(ngx_conf_t *cf,
+        ngx_http_upstream_srv_conf_t *us);
+
+
+static char *
+ngx_http_tnt_prewarm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_srv_conf_t *tscf = conf;
+
+    ngx_int_t                     n;
+    ngx_str_t                     *value;
+    ngx_http_tnt_prewarm_conf_t   *pcf;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (tscf->prewarm != NULL) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    pcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_prewarm_conf_t));
+    if (pcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    pcf->uscf = uscf;
+    pcf->connections = (ngx_uint_t) n;
+
+    /** Wraps the balancer like 'keepalive' does */
+    pcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_tnt_prewarm_init_upstream;
+
+    tscf->prewarm = pcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_tnt_prewarm_conf_t *
+ngx_http_tnt_prewarm_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->prewarm;
+}
+
+
+static void
+ngx_http_tnt_prewarm_close(ngx_http_tnt_prewarm_conn_t *pc)
+{
+    ngx_close_connection(pc->connection);
+
+    pc->connection = NULL;
+    pc->ready = 0;
+}
+
+
+static void
+ngx_http_tnt_prewarm_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+            "tnt_prewarm: dummy handler");
+}
+
+
+/** Reads the greeting, then it closes the connection if the peer sends
+ *  something or closes it.
+ */
+static void
+ngx_http_tnt_prewarm_read_handler(ngx_event_t *rev)
+{
+    u_char                       buf[1];
+    ssize_t                      n;
+    ngx_connection_t             *c;
+    ngx_http_tnt_prewarm_conn_t  *pc;
+
+    c = rev->data;
+    pc = c->data;
+
+    if (c->close) {
+        goto close;
+    }
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT,
+                "tnt_prewarm: \"%V\" timed out", pc->name);
+        goto close;
+    }
+
+    if (pc->ready) {
+
+        n = c->recv(c, buf, 1);
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                goto close;
+            }
+
+            return;
+        }
+
+        goto close;
+    }
+
+    while (pc->greeting_len < sizeof(pc->greeting)) {
+
+        n = c->recv(c, pc->greeting + pc->greeting_len,
+                    sizeof(pc->greeting) - pc->greeting_len);
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                goto close;
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_ERR, rev->log, 0,
+                    "tnt_prewarm: \"%V\" closed the connection", pc->name);
+            goto close;
+        }
+
+        pc->greeting_len += n;
+    }
+
+    if (ngx_strncmp(pc->greeting, "Tarantool", sizeof("Tarantool") - 1) != 0) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, 0,
+                "tnt_prewarm: \"%V\" sent an invalid greeting", pc->name);
+        goto close;
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    pc->ready = 1;
+
+    /** Idle connections are closed when a worker is shutting down */
+    c->idle = 1;
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        goto close;
+    }
+
+    return;
+
+close:
+
+    ngx_http_tnt_prewarm_close(pc);
+}
+
+
+static void
+ngx_http_tnt_prewarm_connect(ngx_http_tnt_prewarm_conf_t *pcf,
+        ngx_http_tnt_prewarm_conn_t *pc, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t              rc;
+    ngx_connection_t       *c;
+    ngx_peer_connection_t  p;
+
+    ngx_memzero(&p, sizeof(ngx_peer_connection_t));
+
+    p.sockaddr = peer->sockaddr;
+    p.socklen = peer->socklen;
+    p.name = &peer->name;
+    p.get = ngx_event_get_peer;
+    p.log = pcf->ev.log;
+    p.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&p);
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        return;
+    }
+
+    c = p.connection;
+    c->data = pc;
+
+    c->read->handler = ngx_http_tnt_prewarm_read_handler;
+    c->write->handler = ngx_http_tnt_prewarm_dummy_handler;
+
+    pc->connection = c;
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+    pc->greeting_len = 0;
+    pc->ready = 0;
+
+    ngx_add_timer(c->read, NGX_HTTP_TNT_PREWARM_TIMEOUT);
+}
+
+
+/** Opens the missing connections
+ */
+static void
+ngx_http_tnt_prewarm_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_prewarm_conf_t *pcf = ev->data;
+
+    ngx_uint_t                    i, n;
+    ngx_http_tnt_prewarm_conn_t   *pc;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_TNT_PREWARM_RETRY);
+
+    peers = pcf->uscf->peer.data;
+    if (peers == NULL || peers->number == 0) {
+        return;
+    }
+
+    if (pcf->conns == NULL) {
+
+        pcf->nconns = peers->number * pcf->connections;
+
+        pcf->conns = ngx_pcalloc(ngx_cycle->pool,
+                pcf->nconns * sizeof(ngx_http_tnt_prewarm_conn_t));
+        if (pcf->conns == NULL) {
+            return;
+        }
+
+        for (i = 0; i < pcf->nconns; i++) {
+            pcf->conns[i].index = i / pcf->connections;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (i = 0; i < pcf->nconns; i++) {
+
+        pc = &pcf->conns[i];
+
+        if (pc->connection != NULL) {
+            continue;
+        }
+
+        for (peer = peers->peer, n = pc->index; peer && n; peer = peer->next, n--)
+        {
+            /* void */
+        }
+
+        if (peer == NULL || peer->down) {
+            continue;
+        }
+
+        ngx_http_tnt_prewarm_connect(pcf, pc, peer);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static void
+ngx_http_tnt_prewarm_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_prewarm_conf_t  *pcf;
+
+    pcf = ngx_http_tnt_prewarm_get_conf(uscf);
+    if (pcf == NULL) {
+        return;
+    }
+
+    pcf->ev.handler = ngx_http_tnt_prewarm_handler;
+    pcf->ev.data = pcf;
+    pcf->ev.log = cycle->log;
+    pcf->ev.cancelable = 1;
+
+    ngx_add_timer(&pcf->ev, 1);
+}
+
+
+/** Takes a ready connection to the peer which has been chosen by the
+ *  original balancer, if the balancer (e.g. 'keepalive') has no cached one.
+ */
+static ngx_int_t
+ngx_http_tnt_prewarm_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_tnt_prewarm_peer_data_t *pd = data;
+
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_connection_t             *c;
+    ngx_http_tnt_prewarm_conf_t  *pcf;
+    ngx_http_tnt_prewarm_conn_t  *conn;
+
+    rc = pd->original_get_peer(pc, pd->data);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    pcf = pd->conf;
+
+    for (i = 0; i < pcf->nconns; i++) {
+
+        conn = &pcf->conns[i];
+
+        if (!conn->ready
+            || ngx_memn2cmp((u_char *) conn->sockaddr, (u_char *) pc->sockaddr,
+                            conn->socklen, pc->socklen) != 0)
+        {
+            continue;
+        }
+
+        c = conn->connection;
+
+        conn->connection = NULL;
+        conn->ready = 0;
+
+        c->idle = 0;
+        c->log = pc->log;
+        c->read->log = pc->log;
+        c->write->log = pc->log;
+
+        if (c->pool != NULL) {
+            c->pool->log = pc->log;
+        }
+
+        pc->connection = c;
+        pc->cached = 1;
+
+        /** Open a new one soon */
+        ngx_post_event(&pcf->ev, &ngx_posted_events);
+
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_prewarm_free_peer(ngx_peer_connection_t *pc, void *data,
+        ngx_uint_t state)
+{
+    ngx_http_tnt_prewarm_peer_data_t *pd = data;
+
+    pd->original_free_peer(pc, pd->data, state);
+}
+
+
+static ngx_int_t
+ngx_http_tnt_prewarm_init_peer(ngx_http_request_t *r,
+        ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_tnt_prewarm_conf_t       *pcf;
+    ngx_http_tnt_prewarm_peer_data_t  *pd;
+
+    pcf = ngx_http_tnt_prewarm_get_conf(us);
+
+    if (pcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_tnt_prewarm_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->conf = pcf;
+
+    pd->data = r->upstream->peer.data;
+    pd->original_get_peer = r->upstream->peer.get;
+    pd->original_free_peer = r->upstream->peer.free;
+
+    r->upstream->peer.data = pd;
+    r->upstream->peer.get = ngx_http_tnt_prewarm_get_peer;
+    r->upstream->peer.free = ngx_http_tnt_prewarm_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_prewarm_init_upstream(ngx_conf_t *cf,
+        ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_tnt_prewarm_conf_t  *pcf;
+
+    pcf = ngx_http_tnt_prewarm_get_conf(us);
+
+    /** Otherwise ready connections are taken before the keepalive cache */
+    if (us->peer.init_upstream != ngx_http_tnt_prewarm_init_upstream) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"tnt_prewarm\" must be specified after other "
+                      "balancing directives, e.g. \"keepalive\", "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    if (pcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    pcf->original_init_peer = us->peer.init;
+    us->peer.init = ngx_http_tnt_prewarm_init_peer;
+
+    return NGX_OK;
+}
+/** }}}
+ */
+
+
+/** Concurrency limit {{{
+ *
+ *  The limit of requests in flight is adapted by AIMD: it's decreased if
+ *  a request has failed or its RTT is much more than the minimal one, and
+ *  it's increased while at least half of it is used. Excess requests wait
+ *  in queues, a client key is hashed into a queue, the queues are served
+ *  round-robin.
+ */
+
+/** The minimal RTT is taken from the last window */
+#define NGX_HTTP_TNT_LIMIT_WINDOW 10000
+
+/** RTT is high if it's more than 2 * minimal RTT + this */
+#define NGX_HTTP_TNT_LIMIT_SLACK 5
+
+
+static void ngx_http_tnt_limit_dispatch(ngx_event_t *ev);
+
+
+static char *
+ngx_http_tnt_concurrency(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_srv_conf_t *tscf = conf;
+
+    ngx_int_t                          n;
+    ngx_str_t                          *value, v;
+    ngx_uint_t                         i, queue_set;
+    ngx_msec_t                         t;
+    ngx_http_tnt_limit_conf_t          *lcf;
+    ngx_http_compile_complex_value_t   ccv;
+
+    if (tscf->limit != NULL) {
+        return "is duplicate";
+    }
+
+    lcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_limit_conf_t));
+    if (lcf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->min = 1;
+    lcf->queue_timeout = 1000;
+    queue_set = 0;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", sizeof("max=") - 1) == 0) {
+
+            n = ngx_atoi(value[i].data + sizeof("max=") - 1,
+                         value[i].len - (sizeof("max=") - 1));
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            lcf->max = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min=", sizeof("min=") - 1) == 0) {
+
+            n = ngx_atoi(value[i].data + sizeof("min=") - 1,
+                         value[i].len - (sizeof("min=") - 1));
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            lcf->min = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "queue=", sizeof("queue=") - 1) == 0) {
+
+            n = ngx_atoi(value[i].data + sizeof("queue=") - 1,
+                         value[i].len - (sizeof("queue=") - 1));
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            lcf->queue_max = (ngx_uint_t) n;
+            queue_set = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "queue_timeout=",
+                        sizeof("queue_timeout=") - 1) == 0)
+        {
+            v.data = value[i].data + sizeof("queue_timeout=") - 1;
+            v.len = value[i].len - (sizeof("queue_timeout=") - 1);
+
+            t = ngx_parse_time(&v, 0);
+            if (t == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            lcf->queue_timeout = t;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", sizeof("key=") - 1) == 0) {
+
+            v.data = value[i].data + sizeof("key=") - 1;
+            v.len = value[i].len - (sizeof("key=") - 1);
+
+            lcf->key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (lcf->key == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &v;
+            ccv.complex_value = lcf->key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (lcf->max == 0) {
+        return "requires \"max=\"";
+    }
+
+    if (lcf->min > lcf->max) {
+        return "has \"min=\" more than \"max=\"";
+    }
+
+    if (!queue_set) {
+        lcf->queue_max = lcf->max;
+    }
+
+    lcf->limit = (double) lcf->max;
+    lcf->rtt_min = (ngx_msec_t) -1;
+    lcf->window_min = (ngx_msec_t) -1;
+
+    for (i = 0; i < NGX_HTTP_TNT_LIMIT_FLOWS; i++) {
+        ngx_queue_init(&lcf->flows[i]);
+    }
+
+    lcf->ev.handler = ngx_http_tnt_limit_dispatch;
+    lcf->ev.data = lcf;
+    lcf->ev.log = cf->log;
+
+    tscf->limit = lcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_http_tnt_limit_conf_t *
+ngx_http_tnt_limit_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->limit;
+}
+
+
+static void
+ngx_http_tnt_limit_adapt(ngx_http_tnt_limit_conf_t *lcf, ngx_msec_t rtt,
+        ngx_uint_t drop)
+{
+    ngx_msec_t  now, interval;
+
+    now = ngx_current_msec;
+
+    if (now - lcf->window_start >= NGX_HTTP_TNT_LIMIT_WINDOW) {
+
+        if (lcf->window_min != (ngx_msec_t) -1) {
+            lcf->rtt_min = lcf->window_min;
+        }
+
+        lcf->window_min = (ngx_msec_t) -1;
+        lcf->window_start = now;
+    }
+
+    if (!drop) {
+        lcf->window_min = ngx_min(lcf->window_min, rtt);
+        lcf->rtt_min = ngx_min(lcf->rtt_min, rtt);
+    }
+
+    if (drop || rtt > lcf->rtt_min * 2 + NGX_HTTP_TNT_LIMIT_SLACK) {
+
+        interval = NGX_HTTP_TNT_LIMIT_SLACK;
+        if (lcf->rtt_min != (ngx_msec_t) -1) {
+            interval += lcf->rtt_min;
+        }
+
+        /** Replies of a burst are slow all together, so the limit is
+         *  decreased once per RTT.
+         */
+        if (now - lcf->decreased_at >= interval) {
+            lcf->limit = ngx_max(lcf->limit * 0.9, (double) lcf->min);
+            lcf->decreased_at = now;
+        }
+
+        return;
+    }
+
+    /** Increase only if at least half of the limit is used, a limit which
+     *  is never reached says nothing about Tarantool
+     */
+    if ((lcf->inflight + 1) * 2 >= (ngx_uint_t) lcf->limit) {
+        lcf->limit = ngx_min(lcf->limit + 1 / lcf->limit, (double) lcf->max);
+    }
+}
+
+
+static void
+ngx_http_tnt_limit_start(ngx_http_tnt_limit_req_t *lr)
+{
+    lr->active = 1;
+    lr->start = ngx_current_msec;
+    lr->conf->inflight++;
+}
+
+
+static void
+ngx_http_tnt_limit_release(ngx_http_tnt_limit_req_t *lr, ngx_uint_t sample,
+        ngx_uint_t drop)
+{
+    ngx_http_tnt_limit_conf_t  *lcf;
+
+    if (!lr->active) {
+        return;
+    }
+
+    lcf = lr->conf;
+
+    lr->active = 0;
+    lcf->inflight--;
+
+    if (sample) {
+        ngx_http_tnt_limit_adapt(lcf, ngx_current_msec - lr->start, drop);
+    }
+
+    /** Queued requests are started out of the finalization of this one */
+    if (lcf->queued > 0) {
+        ngx_post_event(&lcf->ev, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_tnt_limit_unqueue(ngx_http_tnt_limit_req_t *lr)
+{
+    if (!lr->queued) {
+        return;
+    }
+
+    ngx_queue_remove(&lr->queue);
+
+    lr->queued = 0;
+    lr->conf->queued--;
+
+    if (lr->timeout.timer_set) {
+        ngx_del_timer(&lr->timeout);
+    }
+}
+
+
+static ngx_http_tnt_limit_req_t *
+ngx_http_tnt_limit_dequeue(ngx_http_tnt_limit_conf_t *lcf)
+{
+    ngx_uint_t                i;
+    ngx_queue_t               *q;
+    ngx_http_tnt_limit_req_t  *lr;
+
+    for (i = 0; i < NGX_HTTP_TNT_LIMIT_FLOWS; i++) {
+
+        q = &lcf->flows[lcf->next_flow++ % NGX_HTTP_TNT_LIMIT_FLOWS];
+
+        if (ngx_queue_empty(q)) {
+            continue;
+        }
+
+        lr = ngx_queue_data(ngx_queue_head(q), ngx_http_tnt_limit_req_t,
+                            queue);
+
+        ngx_http_tnt_limit_unqueue(lr);
+
+        return lr;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_tnt_limit_dispatch(ngx_event_t *ev)
+{
+    ngx_http_tnt_limit_conf_t *lcf = ev->data;
+
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_tnt_limit_req_t  *lr;
+
+    while (lcf->queued > 0 && lcf->inflight < (ngx_uint_t) lcf->limit) {
+
+        lr = ngx_http_tnt_limit_dequeue(lcf);
+        if (lr == NULL) {
+            break;
+        }
+
+        r = lr->request;
+        c = r->connection;
+
+        ngx_http_tnt_limit_start(lr);
+
+        ngx_http_upstream_init(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+
+/** Replies HTTP code 503 with a JSON-RPC error, the request isn't sent
+ */
+static void
+ngx_http_tnt_limit_reject(ngx_http_request_t *r)
+{
+    ngx_http_tnt_ctx_t          *ctx;
+    const ngx_http_tnt_error_t  *e;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    e = ngx_http_tnt_get_error_text(CONCURRENCY_LIMIT);
+
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_http_finalize_request(r,
+            ngx_http_tnt_direct_output(r, NGX_HTTP_SERVICE_UNAVAILABLE,
+                                       ctx->in_err));
+}
+
+
+static void
+ngx_http_tnt_limit_timeout_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_limit_req_t *lr = ev->data;
+
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = lr->request;
+    c = r->connection;
+
+    ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+            "tnt_concurrency: the request has waited too long, limit: %ui",
+            (ngx_uint_t) lr->conf->limit);
+
+    ngx_http_tnt_limit_unqueue(lr);
+
+    ngx_http_tnt_limit_reject(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_tnt_limit_cleanup(void *data)
+{
+    ngx_http_tnt_limit_req_t *lr = data;
+
+    ngx_http_tnt_limit_unqueue(lr);
+    ngx_http_tnt_limit_release(lr, 0, 0);
+}
+
+
+/** Starts the upstream request if there is a free slot, otherwise the
+ *  request waits in the queue.
+ */
+static void
+ngx_http_tnt_limit_init(ngx_http_request_t *r)
+{
+    ngx_str_t                  key;
+    ngx_uint_t                 flow;
+    ngx_pool_cleanup_t         *cln;
+    ngx_http_tnt_ctx_t         *ctx;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_limit_req_t   *lr;
+    ngx_http_tnt_limit_conf_t  *lcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    lcf = ngx_http_tnt_limit_get_conf(tlcf->upstream.upstream);
+
+    lr = ngx_pcalloc(r->pool, sizeof(ngx_http_tnt_limit_req_t));
+    if (lr == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    lr->request = r;
+    lr->conf = lcf;
+
+    cln->handler = ngx_http_tnt_limit_cleanup;
+    cln->data = lr;
+
+    ctx->limit = lr;
+
+    if (lcf->queued == 0 && lcf->inflight < (ngx_uint_t) lcf->limit) {
+        ngx_http_tnt_limit_start(lr);
+        ngx_http_upstream_init(r);
+        return;
+    }
+
+    if (lcf->queued >= lcf->queue_max) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "tnt_concurrency: the queue is full, limit: %ui",
+                (ngx_uint_t) lcf->limit);
+        ngx_http_tnt_limit_reject(r);
+        return;
+    }
+
+    flow = 0;
+
+    if (lcf->key != NULL) {
+
+        if (ngx_http_complex_value(r, lcf->key, &key) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        flow = ngx_crc32_short(key.data, key.len) % NGX_HTTP_TNT_LIMIT_FLOWS;
+    }
+
+    ngx_queue_insert_tail(&lcf->flows[flow], &lr->queue);
+
+    lr->queued = 1;
+    lcf->queued++;
+
+    lr->timeout.handler = ngx_http_tnt_limit_timeout_handler;
+    lr->timeout.data = lr;
+    lr->timeout.log = r->connection->log;
+
+    ngx_add_timer(&lr->timeout, lcf->queue_timeout);
+}
+
+
+/** Called when the upstream request is finalized, rc is a code of
+ *  ngx_http_upstream_finalize_request().
+ */
+static void
+ngx_http_tnt_limit_done(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    switch (rc) {
+
+    /** A client is gone, it says nothing about Tarantool */
+    case NGX_HTTP_CLIENT_CLOSED_REQUEST:
+        ngx_http_tnt_limit_release(ctx->limit, 0, 0);
+        break;
+
+    case NGX_HTTP_BAD_GATEWAY:
+    case NGX_HTTP_GATEWAY_TIME_OUT:
+        ngx_http_tnt_limit_release(ctx->limit, 1, 1);
+        break;
+
+    default:
+        ngx_http_tnt_limit_release(ctx->limit, 1, 0);
+        break;
+    }
+}
+/** }}}
+ */
+
+
+/** IN-list {{{
+ */
+
+/** Merges the replies of the selects of an IN-list into one IPROTO reply,
+ *  the tuples are in the order of the keys.
+ *  If some select has failed, then the first error is the reply.
+ */
+static ngx_buf_t *
+ngx_http_tnt_in_list_merge(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx)
+{
+    char               *p;
+    size_t             size;
+    uint32_t           n, rows;
+    ngx_buf_t          *b;
+    ngx_uint_t         i;
+    ngx_str_t          *reply;
+    const char         *data, *end;
+    struct tpresponse  resp;
+
+    size = 64;
+    rows = 0;
+
+    for (i = 0; i < ctx->in_list.n; i++) {
+
+        reply = &ctx->in_list.replies[i];
+
+        if (tp_reply(&resp, (const char *) reply->data, reply->len) <= 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "IN-list: the reply of the key #%ui is invalid", i);
+            return NULL;
+        }
+
+        if (resp.code != 0) {
+
+            b = ngx_calloc_buf(r->pool);
+            if (b == NULL) {
+                return NULL;
+            }
+
+            b->start = b->pos = reply->data;
+            b->end = b->last = reply->data + reply->len;
+
+            return b;
+        }
+
+        size += reply->len;
+
+        if (resp.data != NULL) {
+            data = resp.data;
+            rows += mp_decode_array(&data);
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    p = (char *) b->last + 5;
+
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, 0);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, 0);
+
+    p = mp_encode_map(p, 1);
+    p = mp_encode_uint(p, TP_DATA);
+    p = mp_encode_array(p, rows);
+
+    for (i = 0; i < ctx->in_list.n; i++) {
+
+        reply = &ctx->in_list.replies[i];
+
+        if (tp_reply(&resp, (const char *) reply->data, reply->len) <= 0
+            || resp.data == NULL)
+        {
+            continue;
+        }
+
+        data = resp.data;
+        n = mp_decode_array(&data);
+
+        end = data;
+        while (n-- > 0) {
+            mp_next(&end);
+        }
+
+        p = (char *) ngx_cpymem(p, data, end - data);
+    }
+
+    *b->last = 0xce;
+    *(uint32_t *) (b->last + 1) = mp_bswap_u32(p - (char *) b->last - 5);
+
+    b->last = (u_char *) p;
+    b->end = b->last;
+
+    return b;
+}
+
+
+/** Called by ngx_http_tnt_filter_reply() for each reply of an IN-list.
+ *
+ *  Tarantool could reply out of order, so a reply is kept by its sync,
+ *  i.e. by the index of its key. The merged reply is sent, when the last
+ *  one is received.
+ */
+static ngx_int_t
+ngx_http_tnt_in_list_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
+{
+    ngx_int_t          rc;
+    ngx_buf_t          *b;
+    struct tpresponse  resp;
+
+    if (tp_reply(&resp, (const char *) ctx->tp_cache->start,
+                ctx->tp_cache->end - ctx->tp_cache->start) <= 0
+        || resp.sync >= ctx->in_list.n
+        || ctx->in_list.replies[resp.sync].data != NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "IN-list: Tarantool sent an unexpected reply");
+        return NGX_ERROR;
+    }
+
+    ctx->in_list.replies[resp.sync].data = ctx->tp_cache->start;
+    ctx->in_list.replies[resp.sync].len =
+        ctx->tp_cache->end - ctx->tp_cache->start;
+
+    if (++ctx->in_list.received < ctx->in_list.n) {
+        return NGX_OK;
+    }
+
+    b = ngx_http_tnt_in_list_merge(r, ctx);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    /** The merged reply is sent as the reply of one select */
+    ctx->tp_cache = b;
+    ctx->batch_size = 0;
+
+    rc = ngx_http_tnt_send_reply(r, u, ctx);
+
+    ctx->batch_size = (int) ctx->in_list.n;
+
+    return rc;
+}
+/** }}}
+ */
+
+
+/** Bulk {{{
+ */
+
+/** Read the rows of a bulk body, i.e. of an NDJSON body. The rows are
+ *  transcoded into a sequence of MsgPack documents straight from the buffers
+ *  of the body. The values, which are bound by the query args, are saved,
+ *  since they are shared by all rows.
+ */
+static ngx_int_t
+ngx_http_tnt_bulk_init(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_bulk_t *bulk)
+{
+    size_t              size;
+    ngx_int_t           rc;
+    ngx_str_t           doc;
+    const char          *p;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ngx_memzero(bulk, sizeof(ngx_http_tnt_bulk_t));
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    if (ctx->format_values == NULL || r->headers_in.content_length_n <= 0) {
+        goto bad_rows;
+    }
+
+    rc = ngx_http_tnt_format_read_body(r, ctx, &doc);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    p = (const char *) doc.data;
+
+    bulk->pos = p;
+    bulk->end = p + doc.len;
+    bulk->size = doc.len;
+
+    while (p < bulk->end) {
+
+        if (mp_check(&p, bulk->end) != 0) {
+            goto bad_rows;
+        }
+
+        if (++bulk->rows > tlcf->bulk_max_rows) {
+            goto bad_rows;
+        }
+    }
+
+    if (bulk->rows == 0) {
+        goto bad_rows;
+    }
+
+    size = sizeof(ngx_http_tnt_format_value_t) * ctx->format_nvalues;
+
+    bulk->values = ngx_palloc(r->pool, size);
+    if (bulk->values == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(bulk->values, ctx->format_values, size);
+
+    bulk->tuples_count = prepared_result->tuples_count;
+    bulk->update_keys_count = prepared_result->update_keys_count;
+    bulk->upsert_tuples_count = prepared_result->upsert_tuples_count;
+
+    if (ctx->bulk.errors == NULL) {
+        ctx->bulk.errors = ngx_array_create(r->pool, 4,
+                sizeof(ngx_http_tnt_bulk_error_t));
+        if (ctx->bulk.errors == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+
+bad_rows:
+
+    bulk->rows = bulk->size = 0;
+
+    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_BAD_REQUEST,
+                ngx_http_tnt_get_error_text(BULK_ROWS_ERROR)->msg);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    return NGX_HTTP_BAD_REQUEST;
+}
+
+
+/** Bind the values of the next row, the row is bound like a JSON body
+ */
+static ngx_int_t
+ngx_http_tnt_bulk_next(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result,
+        ngx_http_tnt_bulk_t *bulk)
+{
+    ngx_str_t           row;
+    ngx_http_tnt_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    ngx_memcpy(ctx->format_values, bulk->values,
+            sizeof(ngx_http_tnt_format_value_t) * ctx->format_nvalues);
+
+    prepared_result->tuples_count = bulk->tuples_count;
+    prepared_result->update_keys_count = bulk->update_keys_count;
+    prepared_result->upsert_tuples_count = bulk->upsert_tuples_count;
+
+    row.data = (u_char *) bulk->pos;
+    mp_next(&bulk->pos);
+    row.len = (u_char *) bulk->pos - row.data;
+
+    ++bulk->row;
+
+    return ngx_http_tnt_format_prepare_doc(tlcf, r, prepared_result, &row);
+}
+
+
+/** Called by ngx_http_tnt_filter_reply() for each reply of a bulk.
+ *
+ *  Only the failed rows are kept, the summary is sent, when the last reply
+ *  is received: {"rows": N, "ok": N, "errors": [{"row": N, "code": N,
+ *  "message": STR}]}, a row is a number of a row from 1.
+ */
+static ngx_int_t
+ngx_http_tnt_bulk_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
+{
+    char                       *p;
+    size_t                     size;
+    ngx_int_t                  rc;
+    ngx_buf_t                  *b;
+    ngx_uint_t                 i;
+    struct tpresponse          resp;
+    ngx_http_tnt_bulk_error_t  *e;
+
+    if (tp_reply(&resp, (const char *) ctx->tp_cache->start,
+                ctx->tp_cache->end - ctx->tp_cache->start) <= 0
+        || resp.sync >= ctx->bulk.n)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "bulk: Tarantool sent an unexpected reply");
+        return NGX_ERROR;
+    }
+
+    if (resp.code == 0) {
+        ++ctx->bulk.ok;
+
+    } else {
+
+        e = ngx_array_push(ctx->bulk.errors);
+        if (e == NULL) {
+            return NGX_ERROR;
+        }
+
+        e->row = resp.sync + 1;
+        e->code = -(int64_t) resp.code;
+        ngx_str_null(&e->message);
+
+        if (resp.error != NULL) {
+
+            e->message.len = resp.error_end - resp.error;
+            e->message.data = ngx_pnalloc(r->pool, e->message.len);
+            if (e->message.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(e->message.data, resp.error, e->message.len);
+        }
+    }
+
+    if (++ctx->bulk.received < ctx->bulk.n) {
+        return NGX_OK;
+    }
+
+    e = ctx->bulk.errors->elts;
+
+    size = 128;
+    for (i = 0; i < ctx->bulk.errors->nelts; i++) {
+        size += 64 + e[i].message.len;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = (char *) b->last + 5;
+
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, 0);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, 0);
+
+    p = mp_encode_map(p, 1);
+    p = mp_encode_uint(p, TP_DATA);
+    p = mp_encode_array(p, 1);
+
+    p = mp_encode_map(p, 3);
+    p = mp_encode_str(p, "rows", sizeof("rows") - 1);
+    p = mp_encode_uint(p, ctx->bulk.n);
+    p = mp_encode_str(p, "ok", sizeof("ok") - 1);
+    p = mp_encode_uint(p, ctx->bulk.ok);
+    p = mp_encode_str(p, "errors", sizeof("errors") - 1);
+    p = mp_encode_array(p, ctx->bulk.errors->nelts);
+
+    for (i = 0; i < ctx->bulk.errors->nelts; i++) {
+        p = mp_encode_map(p, 3);
+        p = mp_encode_str(p, "row", sizeof("row") - 1);
+        p = mp_encode_uint(p, e[i].row);
+        p = mp_encode_str(p, "code", sizeof("code") - 1);
+        p = mp_encode_int(p, e[i].code);
+        p = mp_encode_str(p, "message", sizeof("message") - 1);
+        p = mp_encode_str(p, (const char *) e[i].message.data,
+                e[i].message.len);
+    }
+
+    *b->last = 0xce;
+    *(uint32_t *) (b->last + 1) = mp_bswap_u32(p - (char *) b->last - 5);
+
+    b->last = (u_char *) p;
+    b->end = b->last;
+
+    /** The summary is sent as the reply of one request */
+    ctx->tp_cache = b;
+    ctx->batch_size = 0;
+
+    rc = ngx_http_tnt_send_reply(r, u, ctx);
+
+    ctx->batch_size = (int) ctx->bulk.n;
+
+    return rc;
+}
+/** }}}
+ */
+
+
+/** Export {{{
+ */
+static void
+ngx_http_tnt_export_cleanup(void *data)
+{
+    ngx_http_tnt_export_t *ex = data;
+
+    if (ex->call != NULL) {
+        ngx_http_tnt_bg_call_close(ex->call);
+        ex->call = NULL;
+    }
+}
+
+
+/** Reads the select of the request, i.e. the template of the pages
+ */
+static ngx_int_t
+ngx_http_tnt_export_parse(ngx_http_tnt_export_t *ex, ngx_buf_t *b,
+        ngx_str_t *after)
+{
+    uint32_t    n, key, len;
+    const char  *p, *end, *it;
+
+    p = (const char *) b->pos;
+    end = (const char *) b->last;
+
+    if (end - p < 5) {
+        return NGX_ERROR;
+    }
+
+    p += 5;
+
+    /** The header and the body */
+    it = p;
+    if (mp_check(&it, end) != 0 || mp_check(&it, end) != 0) {
+        return NGX_ERROR;
+    }
+
+    mp_next(&p);
+
+    if (p >= end || mp_typeof(*p) != MP_MAP) {
+        return NGX_ERROR;
+    }
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_UINT) {
+            return NGX_ERROR;
+        }
+
+        key = (uint32_t) mp_decode_uint(&p);
+
+        switch (key) {
+        case TP_SPACE:
+            ex->space = (uint32_t) mp_decode_uint(&p);
+            break;
+        case TP_INDEX:
+            ex->index = (uint32_t) mp_decode_uint(&p);
+            break;
+        case TP_OFFSET:
+            ex->offset = (uint32_t) mp_decode_uint(&p);
+            break;
+        case TP_LIMIT:
+            ex->limit = (uint32_t) mp_decode_uint(&p);
+            break;
+        case TP_ITERATOR:
+            ex->iterator = (uint32_t) mp_decode_uint(&p);
+            break;
+        case TP_AFTER_POSITION:
+            after->data = (u_char *) mp_decode_str(&p, &len);
+            after->len = len;
+            break;
+        case TP_KEY:
+            ex->key.data = (u_char *) p;
+            mp_next(&p);
+            ex->key.len = (u_char *) p - ex->key.data;
+            break;
+        default:
+            mp_next(&p);
+            break;
+        }
+    }
+
+    return ex->key.data != NULL ? NGX_OK : NGX_ERROR;
+}
+
+
+/** Encodes the select of the next page into ex->out, the page starts
+ *  after the position
+ */
+static ngx_int_t
+ngx_http_tnt_export_request(ngx_http_tnt_export_t *ex, const char *after,
+        uint32_t after_len)
+{
+    size_t              size;
+    struct tp           tp;
+    ngx_http_request_t  *r;
+
+    r = ex->request;
+
+    size = 64 + ex->key.len + after_len;
+
+    if ((size_t) (ex->out->end - ex->out->start) < size) {
+
+        if (ex->out->start != NULL) {
+            ngx_pfree(r->pool, ex->out->start);
+        }
+
+        ex->out->start = ngx_palloc(r->pool, size);
+        if (ex->out->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        ex->out->end = ex->out->start + size;
+    }
+
+    tp_init(&tp, (char *) ex->out->start, ex->out->end - ex->out->start,
+            NULL, NULL);
+
+    if (tp_select_after(&tp, ex->space, ex->index, ex->offset, ex->iterator,
+                ex->limit, after, after_len) == NULL
+        || tp_encode_raw(&tp, (const char *) ex->key.data, ex->key.len)
+            == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    tp_reqid(&tp, (uint32_t) ex->pages);
+
+    /** The offset is for the first page only */
+    ex->offset = 0;
+
+    ex->out->pos = ex->out->start;
+    ex->out->last = (u_char *) tp.p;
+
+    *ex->call->out = *ex->out;
+
+    return NGX_OK;
+}
+
+
+/** Sends a page to the client, also encodes the select of the next page.
+ *
+ *  Returns NGX_OK if the client has got the page, NGX_AGAIN if the page is
+ *  being sent. If ex->done is set, then the result is a code for
+ *  ngx_http_finalize_request().
+ */
+static ngx_int_t
+ngx_http_tnt_export_page(ngx_http_tnt_export_t *ex)
+{
+    u_char                    *p;
+    size_t                    size, complete_msg_size;
+    uint32_t                  rows;
+    ngx_int_t                 rc, last;
+    ngx_buf_t                 *b;
+    const char                *data;
+    tp_transcode_t            tc;
+    struct tpresponse         resp;
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_tnt_bg_call_t    *bc;
+    ngx_http_tnt_objects_t    *ob;
+    ngx_http_tnt_loc_conf_t   *tlcf;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = ex->request;
+    c = r->connection;
+    bc = ex->call;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    ex->done = 1;
+
+    if (tp_reply(&resp, bc->reply, bc->reply_len) <= 0) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                "tnt_export: \"%V\" sent an invalid reply", bc->peer.name);
+        return ex->pages ? NGX_ERROR : NGX_HTTP_BAD_GATEWAY;
+    }
+
+    if (resp.code != 0) {
+
+        /** The error is the reply, if nothing has been sent */
+        if (ex->pages == 0) {
+
+            b = ngx_calloc_buf(r->pool);
+            if (b == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            b->start = b->pos = (u_char *) bc->reply;
+            b->end = b->last = (u_char *) bc->reply + bc->reply_len;
+
+            return ngx_http_tnt_direct_reply(r, b);
+        }
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                "tnt_export: the page #%ui is failed: \"%*s\"", ex->pages,
+                (size_t) (resp.error_end - resp.error), resp.error);
+
+        /** The connection is closed, so the client sees a broken reply */
+        return NGX_ERROR;
+    }
+
+    rows = 0;
+
+    if (resp.data != NULL) {
+        data = resp.data;
+        rows = mp_decode_array(&data);
+    }
+
+    last = (rows < ex->limit || rows == 0 || resp.position == NULL);
+
+    if (rows == ex->limit && rows > 0 && resp.position == NULL) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                "tnt_export: \"%V\" doesn't return positions, the export is "
+                "stopped after the page #%ui, Tarantool 2.11+ is required",
+                bc->peer.name, ex->pages);
+    }
+
+    /** resp.position is in bc->in, which is reused by the next page */
+    if (!last
+        && ngx_http_tnt_export_request(ex, resp.position,
+                (uint32_t) (resp.position_end - resp.position)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /** The page: '[' or ',' rows '\n' or ']' */
+    size = (bc->reply_len + ngx_http_tnt_overhead()) * tlcf->out_multiplier
+           + 3;
+
+    ob = NULL;
+    if (tlcf->objects != NULL) {
+
+        ob = ngx_http_tnt_objects_get(r, tlcf,
+                ngx_http_get_module_ctx(r, ngx_http_tnt_module));
+
+        if (ob != NULL) {
+            size += ngx_http_tnt_objects_size(ob, bc->reply, bc->reply_len);
+        }
+    }
+
+    if ((size_t) (ex->page->end - ex->page->start) < size) {
+
+        if (ex->page->start != NULL) {
+            ngx_pfree(r->pool, ex->page->start);
+        }
+
+        ex->page->start = ngx_palloc(r->pool, size);
+        if (ex->page->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        ex->page->end = ex->page->start + size;
+    }
+
+    p = ex->page->start;
+
+    if (ex->format == NGX_HTTP_TNT_EXPORT_JSON) {
+
+        if (ex->pages == 0) {
+            *p++ = '[';
+        }
+
+        if (ex->rows > 0 && rows > 0) {
+            *p++ = ',';
+        }
+    }
+
+    if (rows > 0) {
+
+        tp_transcode_init_args_t args = {
+            .output = (char *) p,
+            .output_size = ex->page->end - p - 2,
+            .method = NULL, .method_len = 0,
+            .codec = TP_REPLY_TO_JSON,
+            .mf = NULL
+        };
+
+        if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, 0,
+                    "[BUG] failed to call tp_transcode_init(export)");
+            return NGX_ERROR;
+        }
+
+        tp_reply_to_json_set_rows(&tc,
+                ex->format == NGX_HTTP_TNT_EXPORT_JSON ? ',' : '\n');
+
+        if (ob != NULL) {
+            tp_reply_to_json_set_fields(&tc, ob->fields, ob->nfields,
+                                        ob->names == NULL);
+        }
+
+        complete_msg_size = 0;
+
+        rc = tp_transcode(&tc, bc->reply, bc->reply_len);
+        if (rc != TP_TRANSCODE_ERROR) {
+            rc = tp_transcode_complete(&tc, &complete_msg_size);
+        }
+
+        tp_transcode_free(&tc);
+
+        if (rc != TP_TRANSCODE_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "tnt_export: failed to transcode the page #%ui",
+                    ex->pages);
+            return NGX_ERROR;
+        }
+
+        p += complete_msg_size;
+
+        if (ex->format == NGX_HTTP_TNT_EXPORT_NDJSON) {
+            *p++ = '\n';
+        }
+    }
+
+    if (last && ex->format == NGX_HTTP_TNT_EXPORT_JSON) {
+        *p++ = ']';
+    }
+
+    /** The headers are sent with the first page, so an error of the first
+     *  page is a usual reply
+     */
+    if (ex->pages == 0) {
+
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = -1;
+
+        if (ex->format == NGX_HTTP_TNT_EXPORT_JSON) {
+            ngx_str_set(&r->headers_out.content_type, "application/json");
+        } else {
+            ngx_str_set(&r->headers_out.content_type, "application/x-ndjson");
+        }
+
+        r->headers_out.content_type_len = r->headers_out.content_type.len;
+        r->headers_out.content_type_lowcase = NULL;
+
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    ++ex->pages;
+    ex->rows += rows;
+
+    b = ex->page;
+
+    b->pos = b->start;
+    b->last = p;
+    b->memory = (b->pos != b->last);
+    b->flush = 1;
+    b->last_buf = (last && r == r->main) ? 1 : 0;
+    b->last_in_chain = last ? 1 : 0;
+
+    ex->cl.buf = b;
+    ex->cl.next = NULL;
+
+    rc = ngx_http_output_filter(r, &ex->cl);
+
+    if (last || rc == NGX_ERROR) {
+        return rc;
+    }
+
+    ex->done = 0;
+
+    if (!c->buffered) {
+        return NGX_OK;
+    }
+
+    /** The next page is selected, when the client has got this one */
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!c->write->delayed) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+    }
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        ex->done = 1;
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_tnt_export_write_handler(ngx_http_request_t *r)
+{
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_tnt_ctx_t        *ctx;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    wev = c->write;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                "tnt_export: client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (c->buffered) {
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (ctx->export->call == NULL) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    ngx_http_tnt_bg_call_next(ctx->export->call);
+}
+
+
+static void
+ngx_http_tnt_export_done(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    ngx_http_tnt_export_t *ex = bc->data;
+
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ex->request;
+    c = r->connection;
+
+    if (rc != NGX_OK) {
+
+        /** bc is closed by the caller */
+        ex->call = NULL;
+
+        ngx_http_finalize_request(r,
+                ex->pages ? NGX_ERROR : NGX_HTTP_BAD_GATEWAY);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    rc = ngx_http_tnt_export_page(ex);
+
+    if (ex->done) {
+        ex->call = NULL;
+        ngx_http_finalize_request(r, rc);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    bc->keep = 1;
+
+    if (rc == NGX_AGAIN) {
+        r->write_event_handler = ngx_http_tnt_export_write_handler;
+        return;
+    }
+
+    ngx_http_tnt_bg_call_next(bc);
+}
+
+
+/** Selects the space page by page after the position of the previous page
+ *  and streams the tuples to the client. The next page is selected, when
+ *  the client has got the previous one, so an export of any size takes
+ *  the memory of one page. See tnt_export.
+ */
+static void
+ngx_http_tnt_export_init(ngx_http_request_t *r)
+{
+    ngx_buf_t                     *b;
+    ngx_str_t                     after;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_tnt_ctx_t            *ctx;
+    ngx_http_tnt_export_t         *ex;
+    ngx_http_tnt_bg_call_t        *bc;
+    ngx_http_tnt_loc_conf_t       *tlcf;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    b = ngx_http_tnt_direct_request(r, EXPORT_BATCH_ERROR);
+    if (b == NULL) {
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    peers = NULL;
+    if (tlcf->upstream.upstream != NULL) {
+        peers = tlcf->upstream.upstream->peer.data;
+    }
+
+    if (peers == NULL || peers->number == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt_export: no peers, \"tnt_pass\" should be an upstream");
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ex = ngx_pcalloc(r->pool, sizeof(ngx_http_tnt_export_t));
+    if (ex == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ex->request = r;
+    ex->format = tlcf->export_format;
+
+    ngx_str_null(&after);
+
+    if (ngx_http_tnt_export_parse(ex, b, &after) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "[BUG] tnt_export: the select is invalid");
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ex->out = ngx_calloc_buf(r->pool);
+    ex->page = ngx_calloc_buf(r->pool);
+    if (ex->out == NULL || ex->page == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln->handler = ngx_http_tnt_export_cleanup;
+    cln->data = ex;
+
+    ctx->export = ex;
+
+    /** The call can outlive the client connection's log */
+    bc = ngx_http_tnt_bg_call_create(ngx_cycle->log, 0);
+    if (bc == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    bc->handler = ngx_http_tnt_export_done;
+    bc->data = ex;
+    bc->timeout = tlcf->upstream.connect_timeout
+                  + tlcf->upstream.read_timeout;
+
+    ex->call = bc;
+
+    if (ngx_http_tnt_export_request(ex, (const char *) after.data,
+                (uint32_t) after.len) != NGX_OK)
+    {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    /** The pages are selected from one peer */
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer; peer != NULL; peer = peer->next) {
+        if (!peer->down) {
+            break;
+        }
+    }
+
+    if (peer == NULL
+        || ngx_http_tnt_bg_call_start(bc, peer->sockaddr, peer->socklen,
+                &peer->name) != NGX_OK)
+    {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        /** bc is destroyed by ngx_http_tnt_bg_call_start() */
+        if (peer != NULL) {
+            ex->call = NULL;
+        }
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+/** }}}
+ */
+
+
+/** Schema {{{
+ */
+
+/** _vspace and _vindex */
+#define NGX_HTTP_TNT_SCHEMA_VSPACE 281
+#define NGX_HTTP_TNT_SCHEMA_VINDEX 289
+
+/** How often workers check if the schema should be refreshed */
+#define NGX_HTTP_TNT_SCHEMA_POLL 1000
+
+
+static ngx_http_tnt_schema_conf_t *
+ngx_http_tnt_schema_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->schema;
+}
+
+
+static ngx_int_t
+ngx_http_tnt_schema_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_tnt_schema_conf_t  *oscf = data;
+
+    size_t                      len;
+    ngx_http_tnt_schema_conf_t  *scf;
+
+    scf = shm_zone->data;
+
+    if (oscf) {
+        scf->shpool = oscf->shpool;
+        scf->sh = oscf->sh;
+        return NGX_OK;
+    }
+
+    scf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        scf->sh = scf->shpool->data;
+        return NGX_OK;
+    }
+
+    scf->sh = ngx_slab_calloc(scf->shpool,
+                              sizeof(ngx_http_tnt_schema_shctx_t));
+    if (scf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    scf->shpool->data = scf->sh;
+
+    len = sizeof(" in tnt_schema zone \"\"") + shm_zone->shm.name.len;
+
+    scf->shpool->log_ctx = ngx_slab_alloc(scf->shpool, len);
+    if (scf->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(scf->shpool->log_ctx, " in tnt_schema zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_tnt_schema(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_srv_conf_t *tscf = conf;
+
+    u_char                      *p;
+    ssize_t                     size;
+    ngx_str_t                   *value, s, name;
+    ngx_uint_t                  i;
+    ngx_http_tnt_schema_conf_t  *scf;
+
+    if (tscf->schema != NULL) {
+        return "is duplicate";
+    }
+
+    scf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_schema_conf_t));
+    if (scf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    scf->uscf = ngx_http_conf_get_module_srv_conf(cf,
+                                                  ngx_http_upstream_module);
+    scf->refresh = 60000;
+
+    ngx_str_null(&name);
+    size = 0;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
+
+            scf->refresh = ngx_parse_time(&s, 0);
+            if (scf->refresh == (ngx_msec_t) NGX_ERROR || scf->refresh == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                goto invalid;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || name.len == 0) {
+                goto invalid;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    scf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                          &ngx_http_tnt_module);
+    if (scf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (scf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    scf->shm_zone->init = ngx_http_tnt_schema_init_zone;
+    scf->shm_zone->data = scf;
+
+    tscf->schema = scf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_tnt_schema_set_name(ngx_conf_t *cf, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_str_t *name, ngx_uint_t index)
+{
+    ngx_http_tnt_schema_ref_t  *ref;
+
+    ref = tlcf->schema_ref;
+
+    if (ref == NULL || ref == NGX_CONF_UNSET_PTR) {
+
+        ref = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_schema_ref_t));
+        if (ref == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        tlcf->schema_ref = ref;
+    }
+
+    if (index) {
+        ref->index = *name;
+        tlcf->index_id = 0;
+    } else {
+        ref->space = *name;
+        tlcf->space_id = 0;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void ngx_http_tnt_schema_refresh_handler(ngx_event_t *ev);
+
+
+static void
+ngx_http_tnt_schema_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_schema_conf_t  *scf;
+
+    scf = ngx_http_tnt_schema_get_conf(uscf);
+    if (scf == NULL) {
+        return;
+    }
+
+    scf->refresh_ev.handler = ngx_http_tnt_schema_refresh_handler;
+    scf->refresh_ev.data = scf;
+    scf->refresh_ev.log = cycle->log;
+    scf->refresh_ev.cancelable = 1;
+
+    ngx_add_timer(&scf->refresh_ev, 1);
+}
+
+
+/** Any worker refreshes the schema by its next poll, this one does it now
+ */
+static void
+ngx_http_tnt_schema_refresh_soon(ngx_http_tnt_schema_conf_t *scf)
+{
+    scf->sh->refresh_at = 0;
+
+    if (!scf->refresh_ev.posted && scf->refresh_ev.handler != NULL) {
+        ngx_post_event(&scf->refresh_ev, &ngx_posted_events);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_tnt_schema_select(ngx_http_tnt_bg_call_t *bc, uint32_t space)
+{
+    struct tp  tp;
+
+    tp_init(&tp, (char *) bc->out->start, bc->out->end - bc->out->start,
+            NULL, NULL);
+
+    if (tp_select(&tp, space, 0, 0, TP_ITERATOR_ALL, UINT32_MAX) == NULL
+        || tp_key(&tp, 0) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    /** The reply is told by the sync */
+    tp_reqid(&tp, space);
+
+    bc->out->pos = bc->out->start;
+    bc->out->last = (u_char *) tp.p;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_tnt_schema_refresh_done(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    u_char                      *data;
+    size_t                      len;
+    struct tpresponse           reply;
+    ngx_http_tnt_schema_conf_t  *scf;
+
+    scf = bc->data;
+
+    if (rc != NGX_OK) {
+        goto failed;
+    }
+
+    if (tp_reply(&reply, bc->reply, bc->reply_len) <= 0
+        || (reply.code == 0 && reply.data == NULL))
+    {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt_schema: \"%V\" sent an invalid reply", bc->peer.name);
+        goto failed;
+    }
+
+    if (reply.code != 0) {
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt_schema: select from %ui failed: \"%*s\"",
+                (ngx_uint_t) reply.sync,
+                (size_t) (reply.error_end - reply.error), reply.error);
+        goto failed;
+    }
+
+    if (reply.sync == NGX_HTTP_TNT_SCHEMA_VSPACE) {
+
+        /** bc->in is reused by the next select */
+        scf->fetched.len = reply.data_end - reply.data;
+        scf->fetched.data = ngx_pnalloc(bc->pool, scf->fetched.len);
+        if (scf->fetched.data == NULL) {
+            goto failed;
+        }
+
+        ngx_memcpy(scf->fetched.data, reply.data, scf->fetched.len);
+        scf->fetched_version = reply.schema_id;
+
+        if (ngx_http_tnt_schema_select(bc, NGX_HTTP_TNT_SCHEMA_VINDEX)
+                != NGX_OK)
+        {
+            goto failed;
+        }
+
+        bc->keep = 1;
+        ngx_http_tnt_bg_call_next(bc);
+        return;
+    }
+
+    /** The schema has been changed between the selects */
+    if (reply.schema_id != scf->fetched_version) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, bc->log, 0,
+                "tnt_schema: schema changed while refreshing");
+        goto failed;
+    }
+
+    if (scf->sh->generation != 0
+        && scf->sh->version == (ngx_atomic_uint_t) reply.schema_id)
+    {
+        return;
+    }
+
+    len = scf->fetched.len + (reply.data_end - reply.data);
+
+    ngx_shmtx_lock(&scf->shpool->mutex);
+
+    data = ngx_slab_alloc_locked(scf->shpool, len);
+    if (data == NULL) {
+        ngx_shmtx_unlock(&scf->shpool->mutex);
+        ngx_log_error(NGX_LOG_ERR, bc->log, 0,
+                "tnt_schema zone \"%V\" is too small for %uz bytes",
+                &scf->shm_zone->shm.name, len);
+        goto failed;
+    }
+
+    if (scf->sh->data != NULL) {
+        ngx_slab_free_locked(scf->shpool, scf->sh->data);
+    }
+
+    ngx_memcpy(ngx_cpymem(data, scf->fetched.data, scf->fetched.len),
+               reply.data, reply.data_end - reply.data);
+
+    scf->sh->data = data;
+    scf->sh->len = len;
+    scf->sh->version = reply.schema_id;
+    ngx_atomic_fetch_add(&scf->sh->generation, 1);
+
+    ngx_shmtx_unlock(&scf->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, bc->log, 0,
+            "tnt_schema: schema refreshed, version: %uD", reply.schema_id);
+
+    return;
+
+failed:
+    /** Let any worker try it again */
+    scf->sh->refresh_at = 0;
+}
+
+
+static void
+ngx_http_tnt_schema_refresh_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_schema_conf_t   *scf = ev->data;
+
+    ngx_msec_t                   now, at;
+    ngx_http_tnt_bg_call_t       *bc;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, ngx_min(scf->refresh, NGX_HTTP_TNT_SCHEMA_POLL));
+
+    now = ngx_current_msec;
+    at = (ngx_msec_t) scf->sh->refresh_at;
+
+    if (at != 0 && (ngx_msec_int_t) (at - now) > 0) {
+        return;
+    }
+
+    /** Only one worker refreshes the schema */
+    if (!ngx_atomic_cmp_set(&scf->sh->refresh_at, at, now + scf->refresh)) {
+        return;
+    }
+
+    peer = ngx_http_tnt_live_peer(scf->uscf, &scf->peer_next);
+    if (peer == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                "tnt_schema: no live peers in \"%V\"", &scf->uscf->host);
+        goto failed;
+    }
+
+    bc = ngx_http_tnt_bg_call_create(ev->log, 64);
+    if (bc == NULL) {
+        goto failed;
+    }
+
+    if (ngx_http_tnt_schema_select(bc, NGX_HTTP_TNT_SCHEMA_VSPACE)
+            != NGX_OK)
+    {
+        ngx_http_tnt_bg_call_close(bc);
+        goto failed;
+    }
+
+    bc->handler = ngx_http_tnt_schema_refresh_done;
+    bc->data = scf;
+    bc->timeout = scf->refresh;
+
+    if (ngx_http_tnt_bg_call_start(bc, peer->sockaddr, peer->socklen,
+                &peer->name) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    return;
+
+failed:
+    scf->sh->refresh_at = 0;
+}
+
+
+static ngx_http_tnt_schema_space_t *
+ngx_http_tnt_schema_space(ngx_array_t *spaces, ngx_str_t *name,
+        ngx_uint_t id)
+{
+    ngx_uint_t                   i;
+    ngx_http_tnt_schema_space_t  *space;
+
+    if (spaces == NULL) {
+        return NULL;
+    }
+
+    space = spaces->elts;
+
+    for (i = 0; i < spaces->nelts; i++) {
+
+        if (name->len == 0) {
+
+            if (space[i].id == id) {
+                return &space[i];
+            }
+
+            continue;
+        }
+
+        if (space[i].name.len == name->len
+            && ngx_strncmp(space[i].name.data, name->data, name->len) == 0)
+        {
+            return &space[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/** Reads the tuples of _vspace and _vindex:
+ *    [id, owner, name, engine, field_count, flags, format, ...]
+ *    [space_id, iid, name, type, opts, parts, ...]
+ */
+static ngx_int_t
+ngx_http_tnt_schema_parse(ngx_pool_t *pool, const char *p, const char *end,
+        ngx_array_t *spaces)
+{
+    uint32_t                     n, k, i, m, len;
+    ngx_str_t                    *field, none = ngx_null_string;
+    const char                   *it, *key;
+    ngx_http_tnt_schema_index_t  *index;
+    ngx_http_tnt_schema_space_t  *space;
+
+    it = p;
+    if (mp_check(&it, end) != 0 || mp_typeof(*p) != MP_ARRAY) {
+        return NGX_ERROR;
+    }
+
+    for (n = mp_decode_array(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_ARRAY) {
+            return NGX_ERROR;
+        }
+
+        k = mp_decode_array(&p);
+        if (k < 7 || mp_typeof(*p) != MP_UINT) {
+            return NGX_ERROR;
+        }
+
+        space = ngx_array_push(spaces);
+        if (space == NULL) {
+            return NGX_ERROR;
+        }
+
+        space->id = (ngx_uint_t) mp_decode_uint(&p);
+
+        /** owner */
+        mp_next(&p);
+
+        if (mp_typeof(*p) != MP_STR) {
+            return NGX_ERROR;
+        }
+
+        space->name.data = (u_char *) mp_decode_str(&p, &len);
+        space->name.len = len;
+
+        /** engine, field_count, flags */
+        mp_next(&p);
+        mp_next(&p);
+        mp_next(&p);
+
+        if (ngx_array_init(&space->fields, pool, 8, sizeof(ngx_str_t))
+                != NGX_OK
+            || ngx_array_init(&space->indexes, pool, 2,
+                              sizeof(ngx_http_tnt_schema_index_t))
+                != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        /** format: [{name = ..., type = ...}, ...] */
+        if (mp_typeof(*p) != MP_ARRAY) {
+            mp_next(&p);
+            i = 0;
+        } else {
+            i = mp_decode_array(&p);
+        }
+
+        for (; i > 0; i--) {
+
+            field = ngx_array_push(&space->fields);
+            if (field == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_str_null(field);
+
+            if (mp_typeof(*p) != MP_MAP) {
+                mp_next(&p);
+                continue;
+            }
+
+            for (m = mp_decode_map(&p); m > 0; m--) {
+
+                if (mp_typeof(*p) != MP_STR) {
+                    mp_next(&p);
+                    mp_next(&p);
+                    continue;
+                }
+
+                key = mp_decode_str(&p, &len);
+
+                if (len == sizeof("name") - 1
+                    && ngx_strncmp(key, "name", len) == 0
+                    && mp_typeof(*p) == MP_STR)
+                {
+                    field->data = (u_char *) mp_decode_str(&p, &len);
+                    field->len = len;
+                    continue;
+                }
+
+                mp_next(&p);
+            }
+        }
+
+        for (k -= 7; k > 0; k--) {
+            mp_next(&p);
+        }
+    }
+
+    it = p;
+    if (mp_check(&it, end) != 0 || mp_typeof(*p) != MP_ARRAY) {
+        return NGX_ERROR;
+    }
+
+    for (n = mp_decode_array(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_ARRAY) {
+            return NGX_ERROR;
+        }
+
+        k = mp_decode_array(&p);
+        if (k < 3 || mp_typeof(*p) != MP_UINT) {
+            return NGX_ERROR;
+        }
+
+        space = ngx_http_tnt_schema_space(spaces, &none,
+                                          (ngx_uint_t) mp_decode_uint(&p));
+
+        if (space == NULL || mp_typeof(*p) != MP_UINT) {
+            for (k -= 1; k > 0; k--) {
+                mp_next(&p);
+            }
+            continue;
+        }
+
+        index = ngx_array_push(&space->indexes);
+        if (index == NULL) {
+            return NGX_ERROR;
+        }
+
+        index->id = (ngx_uint_t) mp_decode_uint(&p);
+
+        if (mp_typeof(*p) != MP_STR) {
+            return NGX_ERROR;
+        }
+
+        index->name.data = (u_char *) mp_decode_str(&p, &len);
+        index->name.len = len;
+
+        for (k -= 3; k > 0; k--) {
+            mp_next(&p);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/** Reloads the snapshot of the worker, if the shared one is newer
+ */
+static void
+ngx_http_tnt_schema_sync(ngx_http_tnt_schema_conf_t *scf, ngx_log_t *log)
+{
+    size_t       len;
+    u_char       *data;
+    ngx_uint_t   generation;
+    ngx_pool_t   *pool;
+    ngx_array_t  *spaces;
+
+    if (scf->sh == NULL
+        || (ngx_uint_t) scf->sh->generation == scf->generation)
+    {
+        return;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&scf->shpool->mutex);
+
+    generation = (ngx_uint_t) scf->sh->generation;
+    len = scf->sh->len;
+
+    data = ngx_pnalloc(pool, len);
+    if (data == NULL) {
+        ngx_shmtx_unlock(&scf->shpool->mutex);
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    ngx_memcpy(data, scf->sh->data, len);
+
+    ngx_shmtx_unlock(&scf->shpool->mutex);
+
+    /** A broken snapshot isn't parsed again until the next one */
+    scf->generation = generation;
+
+    spaces = ngx_array_create(pool, 64, sizeof(ngx_http_tnt_schema_space_t));
+    if (spaces == NULL
+        || ngx_http_tnt_schema_parse(pool, (const char *) data,
+                                     (const char *) data + len, spaces)
+           != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "tnt_schema: failed to parse the schema of \"%V\"",
+                &scf->uscf->host);
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    if (scf->pool != NULL) {
+        ngx_destroy_pool(scf->pool);
+    }
+
+    scf->pool = pool;
+    scf->spaces = spaces;
+}
+
+
+/** Sets the ids of the names of tnt_select, tnt_insert, etc. The names are
+ *  looked up once per a snapshot of the schema.
+ *
+ *  Returns NGX_HTTP_SERVICE_UNAVAILABLE if a name is unknown, the schema
+ *  is refreshed then.
+ */
+static ngx_int_t
+ngx_http_tnt_schema_resolve(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_prepared_result_t *prepared_result)
+{
+    ngx_uint_t                   i;
+    ngx_http_tnt_schema_ref_t    *ref;
+    const ngx_http_tnt_error_t   *e;
+    ngx_http_tnt_schema_conf_t   *scf;
+    ngx_http_tnt_schema_space_t  *space;
+    ngx_http_tnt_schema_index_t  *index;
+
+    ref = tlcf->schema_ref;
+    if (ref == NULL) {
+        return NGX_OK;
+    }
+
+    scf = ngx_http_tnt_schema_get_conf(tlcf->upstream.upstream);
+    if (scf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt: names of spaces and indexes require \"tnt_schema\" "
+                "in the upstream");
+        return NGX_ERROR;
+    }
+
+    ngx_http_tnt_schema_sync(scf, r->connection->log);
+
+    if (scf->generation == 0 || ref->generation != scf->generation) {
+
+        space = ngx_http_tnt_schema_space(scf->spaces, &ref->space,
+                                          tlcf->space_id);
+        if (space == NULL) {
+            goto unknown;
+        }
+
+        ref->space_id = space->id;
+
+        if (ref->index.len != 0) {
+
+            index = space->indexes.elts;
+
+            for (i = 0; i < space->indexes.nelts; i++) {
+                if (index[i].name.len == ref->index.len
+                    && ngx_strncmp(index[i].name.data, ref->index.data,
+                                   ref->index.len) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (i == space->indexes.nelts) {
+                goto unknown;
+            }
+
+            ref->index_id = index[i].id;
+        }
+
+        ref->generation = scf->generation;
+    }
+
+    if (ref->space.len != 0) {
+        prepared_result->space_id = ref->space_id;
+    }
+
+    if (ref->index.len != 0) {
+        prepared_result->index_id = ref->index_id;
+    }
+
+    return NGX_OK;
+
+unknown:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "tnt_schema: space \"%V\" or index \"%V\" isn't found",
+            &ref->space, &ref->index);
+
+    if (scf->generation != 0) {
+        ngx_http_tnt_schema_refresh_soon(scf);
+    }
+
+    e = ngx_http_tnt_get_error_text(SCHEMA_UNKNOWN);
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+
+/** Refreshes the schema, if a reply has a schema version which differs
+ *  from the version of the snapshot
+ */
+static void
+ngx_http_tnt_schema_check_reply(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_buf_t *b)
+{
+    uint32_t                    n;
+    uint64_t                    key, version;
+    const char                  *p, *end, *it;
+    ngx_atomic_uint_t           wanted;
+    ngx_http_tnt_schema_conf_t  *scf;
+
+    scf = ngx_http_tnt_schema_get_conf(tlcf->upstream.upstream);
+    if (scf == NULL || scf->sh == NULL || b == NULL) {
+        return;
+    }
+
+    p = (const char *) b->start + 5;
+    end = (const char *) b->end;
+
+    it = p;
+    if (p >= end || mp_check(&it, end) != 0 || mp_typeof(*p) != MP_MAP) {
+        return;
+    }
+
+    version = 0;
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_UINT) {
+            mp_next(&p);
+            mp_next(&p);
+            continue;
+        }
+
+        key = mp_decode_uint(&p);
+
+        if (key == TP_SCHEMA_ID && mp_typeof(*p) == MP_UINT) {
+            version = mp_decode_uint(&p);
+            break;
+        }
+
+        mp_next(&p);
+    }
+
+    if (version == 0 || version == (uint64_t) scf->sh->version) {
+        return;
+    }
+
+    wanted = scf->sh->wanted;
+
+    if (version == (uint64_t) wanted
+        || !ngx_atomic_cmp_set(&scf->sh->wanted, wanted,
+                               (ngx_atomic_uint_t) version))
+    {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "tnt_schema: schema version of \"%V\" is %uL, refreshing",
+            &scf->uscf->host, version);
+
+    ngx_http_tnt_schema_refresh_soon(scf);
+}
+/** }}}
+ */
+
+
+/** Objects {{{
+ */
+static char *
+ngx_http_tnt_objects(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    u_char                  *p, *last, *sep;
+    ngx_str_t               *value, *name;
+    ngx_http_tnt_objects_t  *ob;
+
+    if (tlcf->objects != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->objects = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ob = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_objects_t));
+    if (ob == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") != 0) {
+
+        ob->names = ngx_array_create(cf->pool, 4, sizeof(ngx_str_t));
+        if (ob->names == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        p = value[1].data;
+        last = p + value[1].len;
+
+        while (p <= last) {
+
+            sep = ngx_strlchr(p, last, ',');
+            if (sep == NULL) {
+                sep = last;
+            }
+
+            if (sep == p) {
+                return "has an empty field name";
+            }
+
+            name = ngx_array_push(ob->names);
+            if (name == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            name->data = p;
+            name->len = sep - p;
+
+            p = sep + 1;
+        }
+    }
+
+    tlcf->objects = ob;
+
+    return NGX_CONF_OK;
+}
+
+
+/** Returns the fields of the objects for the space of the request, NULL
+ *  means the tuples are arrays, e.g. if the schema isn't selected yet.
+ *  The fields are looked up once per a snapshot of the schema.
+ */
+static ngx_http_tnt_objects_t *
+ngx_http_tnt_objects_get(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_ctx_t *ctx)
+{
+    size_t                       size;
+    ngx_str_t                    none = ngx_null_string, *names, *formats;
+    ngx_uint_t                   i, k, n;
+    tp_transcode_field_t         *field;
+    ngx_http_tnt_objects_t       *ob;
+    ngx_http_tnt_schema_conf_t   *scf;
+    ngx_http_tnt_schema_space_t  *space;
+
+    ob = tlcf->objects;
+
+    scf = ngx_http_tnt_schema_get_conf(tlcf->upstream.upstream);
+    if (scf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt: \"tnt_objects\" requires \"tnt_schema\" "
+                "in the upstream");
+        return NULL;
+    }
+
+    ngx_http_tnt_schema_sync(scf, r->connection->log);
+
+    if (scf->generation == 0) {
+        return NULL;
+    }
+
+    if (ob->generation == scf->generation && ob->space_id == ctx->space_id) {
+        return ob;
+    }
+
+    space = ngx_http_tnt_schema_space(scf->spaces, &none, ctx->space_id);
+    if (space == NULL) {
+        return NULL;
+    }
+
+    formats = space->fields.elts;
+    n = ob->names != NULL ? ob->names->nelts : space->fields.nelts;
+
+    ob->fields = ngx_palloc(scf->pool,
+                            (n + 1) * sizeof(tp_transcode_field_t));
+    if (ob->fields == NULL) {
+        return NULL;
+    }
+
+    size = 0;
+
+    for (i = 0; i < n; i++) {
+
+        field = &ob->fields[i];
+
+        if (ob->names == NULL) {
+            field->name = (const char *) formats[i].data;
+            field->len = formats[i].len;
+            field->fieldno = (uint32_t) i;
+
+        } else {
+            names = ob->names->elts;
+
+            field->name = (const char *) names[i].data;
+            field->len = names[i].len;
+            field->fieldno = UINT32_MAX;
+
+            for (k = 0; k < space->fields.nelts; k++) {
+                if (formats[k].len == names[i].len
+                    && ngx_strncmp(formats[k].data, names[i].data,
+                                   names[i].len) == 0)
+                {
+                    field->fieldno = (uint32_t) k;
+                    break;
+                }
+            }
+        }
+
+        /** An escaped key, ':', ',' and a null */
+        size += field->len * 6 + sizeof("\"4294967295\":,null");
+    }
+
+    ob->nfields = n;
+    ob->keys_size = size + sizeof("{}");
+    ob->generation = scf->generation;
+    ob->space_id = ctx->space_id;
+
+    return ob;
+}
+
+
+/** The size of the keys of the objects of a reply
+ */
+static size_t
+ngx_http_tnt_objects_size(ngx_http_tnt_objects_t *ob, const char *reply,
+        size_t len)
+{
+    size_t             size;
+    uint32_t           n, k;
+    const char         *p, *it;
+    struct tpresponse  resp;
+
+    if (tp_reply(&resp, reply, len) <= 0
+        || resp.data == NULL
+        || mp_typeof(*resp.data) != MP_ARRAY)
+    {
+        return 0;
+    }
+
+    p = resp.data;
+    size = 0;
+
+    for (n = mp_decode_array(&p); n > 0; n--) {
+
+        it = p;
+        k = (mp_typeof(*it) == MP_ARRAY) ? mp_decode_array(&it) : 0;
+
+        size += ob->keys_size;
+
+        /** The fields after the format are named by their numbers */
+        if (ob->names == NULL && k > ob->nfields) {
+            size += (k - ob->nfields) * sizeof("\"4294967295\":,");
+        }
+
+        mp_next(&p);
+    }
+
+    return size;
+}
 /** }}}
  */
 
 
-/** Entry point {{{
+/** Transactions {{{
+ */
+
+/** How often workers retry a failed negotiation and check a done one */
+#define NGX_HTTP_TNT_TX_RETRY 1000
+#define NGX_HTTP_TNT_TX_RECHECK 60000
+
+/** The version of IPROTO_ID, i.e. Tarantool 2.10 */
+#define NGX_HTTP_TNT_TX_VERSION 3
+
+
+static ngx_http_tnt_tx_conf_t *
+ngx_http_tnt_tx_get_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_srv_conf_t  *tscf;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        return NULL;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    return tscf->tx;
+}
+
+
+/** Called by ngx_http_tnt_merge_loc_conf(), the upstream of a location with
+ *  tnt_transaction gets the negotiation
+ */
+static char *
+ngx_http_tnt_tx_conf(ngx_conf_t *cf, ngx_http_tnt_loc_conf_t *tlcf)
+{
+    ngx_http_tnt_srv_conf_t       *tscf;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (tlcf->req_type != 0 || tlcf->fanout != NULL
+        || tlcf->export_format != NGX_HTTP_TNT_EXPORT_OFF)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"tnt_transaction\" can't be used with \"tnt_select\", "
+                "\"tnt_insert\", \"tnt_fanout\", etc.");
+        return NGX_CONF_ERROR;
+    }
+
+    uscf = tlcf->upstream.upstream;
+
+    if (uscf == NULL || uscf->srv_conf == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"tnt_transaction\" requires \"tnt_pass\" to an upstream");
+        return NGX_CONF_ERROR;
+    }
+
+    tscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_tnt_module);
+
+    if (tscf->vshard != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "\"tnt_transaction\" can't be used with \"tnt_vshard\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (tscf->tx == NULL) {
+
+        tscf->tx = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_tx_conf_t));
+        if (tscf->tx == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        tscf->tx->uscf = uscf;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/** Encodes the header of a request, the size is set by
+ *  ngx_http_tnt_tx_size(). A stream_id of 0 means no stream.
+ */
+static char *
+ngx_http_tnt_tx_header(char *p, uint32_t code, uint32_t sync,
+        uint64_t stream_id)
+{
+    p = mp_encode_map(p + 5, stream_id != 0 ? 3 : 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, code);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, sync);
+
+    if (stream_id != 0) {
+        p = mp_encode_uint(p, TP_STREAM_ID);
+        p = mp_encode_uint(p, stream_id);
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_tnt_tx_size(char *start, char *end)
+{
+    *start = (char) 0xce;
+    *(uint32_t *) (start + 1) = mp_bswap_u32(end - start - 5);
+}
+
+
+static void ngx_http_tnt_tx_negotiate_handler(ngx_event_t *ev);
+
+
+static void
+ngx_http_tnt_tx_init_process(ngx_cycle_t *cycle,
+        ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_tnt_tx_conf_t  *txc;
+
+    txc = ngx_http_tnt_tx_get_conf(uscf);
+    if (txc == NULL) {
+        return;
+    }
+
+    txc->negotiate_ev.handler = ngx_http_tnt_tx_negotiate_handler;
+    txc->negotiate_ev.data = txc;
+    txc->negotiate_ev.log = cycle->log;
+    txc->negotiate_ev.cancelable = 1;
+
+    ngx_add_timer(&txc->negotiate_ev, 1);
+}
+
+
+static void
+ngx_http_tnt_tx_negotiate_done(ngx_http_tnt_bg_call_t *bc, ngx_int_t rc)
+{
+    ngx_http_tnt_tx_conf_t  *txc = bc->data;
+
+    struct tpresponse       resp;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    if (rc != NGX_OK || tp_reply(&resp, bc->reply, bc->reply_len) <= 0) {
+        ngx_add_timer(&txc->negotiate_ev, NGX_HTTP_TNT_TX_RETRY);
+        return;
+    }
+
+    /** Tarantool before 2.10 doesn't know IPROTO_ID */
+    if (resp.code == 0
+        && (resp.features & NGX_HTTP_TNT_TX_FEATURES)
+            == NGX_HTTP_TNT_TX_FEATURES)
+    {
+        txc->streams = NGX_HTTP_TNT_TX_ON;
+
+    } else {
+
+        if (txc->streams != NGX_HTTP_TNT_TX_OFF) {
+            ngx_log_error(NGX_LOG_WARN, bc->log, 0,
+                    "tnt_transaction: \"%V\" doesn't support streams",
+                    bc->peer.name);
+        }
+
+        txc->streams = NGX_HTTP_TNT_TX_OFF;
+    }
+
+    ngx_add_timer(&txc->negotiate_ev, NGX_HTTP_TNT_TX_RECHECK);
+}
+
+
+/** Sends IPROTO_ID to a peer of the upstream. The peers are expected to be
+ *  the same version, so the result is for all of them.
+ */
+static void
+ngx_http_tnt_tx_negotiate_handler(ngx_event_t *ev)
+{
+    ngx_http_tnt_tx_conf_t       *txc = ev->data;
+
+    char                         *p;
+    ngx_http_tnt_bg_call_t       *bc;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    peer = ngx_http_tnt_live_peer(txc->uscf, &txc->peer_next);
+    if (peer == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                "tnt_transaction: no live peers in \"%V\"",
+                &txc->uscf->host);
+        goto failed;
+    }
+
+    bc = ngx_http_tnt_bg_call_create(ev->log, 64);
+    if (bc == NULL) {
+        goto failed;
+    }
+
+    p = ngx_http_tnt_tx_header((char *) bc->out->last, TP_ID, 0, 0);
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_VERSION);
+    p = mp_encode_uint(p, NGX_HTTP_TNT_TX_VERSION);
+    p = mp_encode_uint(p, TP_FEATURES);
+    p = mp_encode_array(p, 2);
+    p = mp_encode_uint(p, 0);
+    p = mp_encode_uint(p, 1);
+
+    ngx_http_tnt_tx_size((char *) bc->out->last, p);
+    bc->out->last = (u_char *) p;
+
+    bc->handler = ngx_http_tnt_tx_negotiate_done;
+    bc->data = txc;
+
+    if (ngx_http_tnt_bg_call_start(bc, peer->sockaddr, peer->socklen,
+                &peer->name) != NGX_OK)
+    {
+        goto failed;
+    }
+
+    return;
+
+failed:
+    ngx_add_timer(ev, NGX_HTTP_TNT_TX_RETRY);
+}
+
+
+/** Resolves the names of an operation by tnt_schema
+ */
+static ngx_int_t
+ngx_http_tnt_tx_resolve(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_tx_op_t *op)
+{
+    ngx_uint_t                   i;
+    const ngx_http_tnt_error_t   *e;
+    ngx_http_tnt_schema_conf_t   *scf;
+    ngx_http_tnt_schema_space_t  *space;
+    ngx_http_tnt_schema_index_t  *index;
+
+    if (op->space.len == 0 && op->index.len == 0) {
+        return NGX_OK;
+    }
+
+    scf = ngx_http_tnt_schema_get_conf(tlcf->upstream.upstream);
+    if (scf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "tnt: names of spaces and indexes require \"tnt_schema\" "
+                "in the upstream");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_http_tnt_schema_sync(scf, r->connection->log);
+
+    space = ngx_http_tnt_schema_space(scf->spaces, &op->space, op->space_id);
+    if (space == NULL) {
+        goto unknown;
+    }
+
+    op->space_id = space->id;
+
+    if (op->index.len != 0) {
+
+        index = space->indexes.elts;
+
+        for (i = 0; i < space->indexes.nelts; i++) {
+            if (index[i].name.len == op->index.len
+                && ngx_strncmp(index[i].name.data, op->index.data,
+                               op->index.len) == 0)
+            {
+                break;
+            }
+        }
+
+        if (i == space->indexes.nelts) {
+            goto unknown;
+        }
+
+        op->index_id = index[i].id;
+    }
+
+    return NGX_OK;
+
+unknown:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "tnt_transaction: space \"%V\" or index \"%V\" isn't found",
+            &op->space, &op->index);
+
+    if (scf->generation != 0) {
+        ngx_http_tnt_schema_refresh_soon(scf);
+    }
+
+    e = ngx_http_tnt_get_error_text(SCHEMA_UNKNOWN);
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+
+/** Reads an operation of a body:
+ *    {"op": "insert", "space": 512, "tuple": [1, "a"]}
+ *    {"op": "update", "space": "t", "index": 0, "key": [1], "ops": [...]}
  */
 static ngx_int_t
-ngx_http_tnt_handler(ngx_http_request_t *r)
+ngx_http_tnt_tx_parse(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_tx_op_t *op, const char **it)
 {
-    ngx_int_t               rc;
-    ngx_http_upstream_t     *u;
-    ngx_http_tnt_loc_conf_t *tlcf;
+    uint32_t         n, len;
+    ngx_int_t        rc;
+    ngx_str_t        key, name;
+    ngx_uint_t       i;
+    const char       *p, *v;
+    ngx_conf_enum_t  *e;
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    p = *it;
 
-    if (tlcf->method_ccv != NULL) {
+    ngx_memzero(op, sizeof(ngx_http_tnt_tx_op_t));
+    op->limit = tlcf->select_limit_max;
 
-        if (ngx_http_complex_value(r, tlcf->method_ccv, &tlcf->method)
-                    != NGX_OK)
+    if (mp_typeof(*p) != MP_MAP) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_STR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        key.data = (u_char *) mp_decode_str(&p, &len);
+        key.len = len;
+
+        v = p;
+        mp_next(&p);
+
+        if (ngx_http_tnt_str_match(&key, "op", sizeof("op") - 1)) {
+
+            if (mp_typeof(*v) != MP_STR) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            name.data = (u_char *) mp_decode_str(&v, &len);
+            name.len = len;
+
+            e = ngx_http_tnt_tx_ops;
+
+            for (i = 0; e[i].name.len != 0; i++) {
+                if (ngx_http_tnt_str_match(&name, (const char *) e[i].name.data,
+                            e[i].name.len))
+                {
+                    op->type = e[i].value;
+                    break;
+                }
+            }
+
+            if (op->type == 0) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+        } else if (ngx_http_tnt_str_match(&key, "space", sizeof("space") - 1)
+                   || ngx_http_tnt_str_match(&key, "index",
+                                             sizeof("index") - 1))
         {
-            return NGX_ERROR;
+            if (mp_typeof(*v) == MP_UINT) {
+                i = (ngx_uint_t) mp_decode_uint(&v);
+                ngx_str_null(&name);
+
+            } else if (mp_typeof(*v) == MP_STR) {
+                name.data = (u_char *) mp_decode_str(&v, &len);
+                name.len = len;
+                i = 0;
+
+            } else {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            if (key.data[0] == 's') {
+                op->space_id = i;
+                op->space = name;
+                op->has_space = 1;
+
+            } else {
+                op->index_id = i;
+                op->index = name;
+            }
+
+        } else if (ngx_http_tnt_str_match(&key, "limit", sizeof("limit") - 1)
+                   || ngx_http_tnt_str_match(&key, "offset",
+                                             sizeof("offset") - 1))
+        {
+            if (mp_typeof(*v) != MP_UINT) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            if (key.data[0] == 'l') {
+                op->limit = (ngx_uint_t) mp_decode_uint(&v);
+            } else {
+                op->offset = (ngx_uint_t) mp_decode_uint(&v);
+            }
+
+        } else if (mp_typeof(*v) != MP_ARRAY) {
+            return NGX_HTTP_BAD_REQUEST;
+
+        } else if (ngx_http_tnt_str_match(&key, "tuple", sizeof("tuple") - 1))
+        {
+            op->tuple = v;
+            op->tuple_end = p;
+
+        } else if (ngx_http_tnt_str_match(&key, "key", sizeof("key") - 1)) {
+            op->key = v;
+            op->key_end = p;
+
+        } else if (ngx_http_tnt_str_match(&key, "ops", sizeof("ops") - 1)) {
+            op->ops = v;
+            op->ops_end = p;
+
+        } else {
+            return NGX_HTTP_BAD_REQUEST;
         }
     }
 
-    if (ngx_http_tnt_process_headers(r, tlcf) != NGX_OK) {
-        return NGX_ERROR;
+    *it = p;
+
+    if (op->type == 0 || !op->has_space) {
+        return NGX_HTTP_BAD_REQUEST;
     }
 
-    if ((!tlcf->method.len && r->uri.len <= 1 /* i.e '/' */) ||
-        !(r->method & ngx_http_tnt_allowed_methods))
-    {
-        return NGX_HTTP_NOT_ALLOWED;
+    switch (op->type) {
+    case TP_INSERT:
+    case TP_REPLACE:
+        if (op->tuple == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        break;
+    case TP_DELETE:
+        if (op->key == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        break;
+    case TP_UPDATE:
+        if (op->key == NULL || op->ops == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        break;
+    case TP_UPSERT:
+        if (op->tuple == NULL || op->ops == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+        break;
+    default:
+        break;
     }
 
-    if (
-      /* NOTE https://github.com/tarantool/nginx_upstream_module/issues/43
-       */
-      !(r->method & tlcf->http_methods) &&
-      !(r->method & tlcf->http_rest_methods)
-      )
+    rc = ngx_http_tnt_tx_resolve(r, tlcf, op);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_tnt_test_allowed(tlcf->allowed_spaces, op->space_id)
+            != NGX_OK
+        || ngx_http_tnt_test_allowed(tlcf->allowed_indexes, op->index_id)
+            != NGX_OK
+        || op->limit > tlcf->select_limit_max)
     {
         return NGX_HTTP_NOT_ALLOWED;
     }
 
-    if (ngx_http_set_content_type(r) != NGX_OK
-        || ngx_http_upstream_create(r) != NGX_OK)
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_tnt_tx_encode(char *p, ngx_http_tnt_tx_op_t *op, uint32_t sync,
+        uint64_t stream_id)
+{
+    char  *start;
+
+    start = p;
+
+    p = ngx_http_tnt_tx_header(p, (uint32_t) op->type, sync, stream_id);
+
+    switch (op->type) {
+    case TP_INSERT:
+    case TP_REPLACE:
+        p = mp_encode_map(p, 2);
+        p = mp_encode_uint(p, TP_SPACE);
+        p = mp_encode_uint(p, op->space_id);
+        p = mp_encode_uint(p, TP_TUPLE);
+        p = (char *) ngx_cpymem(p, op->tuple, op->tuple_end - op->tuple);
+        break;
+    case TP_DELETE:
+        p = mp_encode_map(p, 3);
+        p = mp_encode_uint(p, TP_SPACE);
+        p = mp_encode_uint(p, op->space_id);
+        p = mp_encode_uint(p, TP_INDEX);
+        p = mp_encode_uint(p, op->index_id);
+        p = mp_encode_uint(p, TP_KEY);
+        p = (char *) ngx_cpymem(p, op->key, op->key_end - op->key);
+        break;
+    case TP_UPDATE:
+        /** The operations of an update are its IPROTO_TUPLE */
+        p = mp_encode_map(p, 4);
+        p = mp_encode_uint(p, TP_SPACE);
+        p = mp_encode_uint(p, op->space_id);
+        p = mp_encode_uint(p, TP_INDEX);
+        p = mp_encode_uint(p, op->index_id);
+        p = mp_encode_uint(p, TP_KEY);
+        p = (char *) ngx_cpymem(p, op->key, op->key_end - op->key);
+        p = mp_encode_uint(p, TP_TUPLE);
+        p = (char *) ngx_cpymem(p, op->ops, op->ops_end - op->ops);
+        break;
+    case TP_UPSERT:
+        p = mp_encode_map(p, 3);
+        p = mp_encode_uint(p, TP_SPACE);
+        p = mp_encode_uint(p, op->space_id);
+        p = mp_encode_uint(p, TP_TUPLE);
+        p = (char *) ngx_cpymem(p, op->tuple, op->tuple_end - op->tuple);
+        p = mp_encode_uint(p, TP_OPS);
+        p = (char *) ngx_cpymem(p, op->ops, op->ops_end - op->ops);
+        break;
+    default:
+        p = mp_encode_map(p, 6);
+        p = mp_encode_uint(p, TP_SPACE);
+        p = mp_encode_uint(p, op->space_id);
+        p = mp_encode_uint(p, TP_INDEX);
+        p = mp_encode_uint(p, op->index_id);
+        p = mp_encode_uint(p, TP_LIMIT);
+        p = mp_encode_uint(p, op->limit);
+        p = mp_encode_uint(p, TP_OFFSET);
+        p = mp_encode_uint(p, op->offset);
+        p = mp_encode_uint(p, TP_ITERATOR);
+
+        /** A select without a key is a select of all tuples */
+        if (op->key == NULL) {
+            p = mp_encode_uint(p, TP_ITERATOR_ALL);
+            p = mp_encode_uint(p, TP_KEY);
+            p = mp_encode_array(p, 0);
+            break;
+        }
+
+        p = mp_encode_uint(p, TP_ITERATOR_EQ);
+        p = mp_encode_uint(p, TP_KEY);
+        p = (char *) ngx_cpymem(p, op->key, op->key_end - op->key);
+        break;
+    }
+
+    ngx_http_tnt_tx_size(start, p);
+
+    return p;
+}
+
+
+/** The operations are pipelined on one stream: BEGIN has sync 0, the
+ *  operations have their numbers. COMMIT is sent by ngx_http_tnt_tx_reply()
+ *  when all operations are done.
+ */
+static ngx_int_t
+ngx_http_tnt_tx_handler(ngx_http_request_t *r)
+{
+    char                        *p, *start;
+    size_t                      size;
+    uint32_t                    n, i;
+    ngx_int_t                   rc;
+    ngx_str_t                   doc;
+    const char                  *it;
+    ngx_chain_t                 *out_chain;
+    ngx_http_tnt_ctx_t          *ctx;
+    ngx_http_tnt_tx_op_t        op;
+    ngx_http_tnt_tx_conf_t      *txc;
+    ngx_http_tnt_loc_conf_t     *tlcf;
+    const ngx_http_tnt_error_t  *e;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    out_chain = ngx_alloc_chain_link(r->pool);
+    if (out_chain == NULL) {
+        return NGX_ERROR;
+    }
+
+    txc = ngx_http_tnt_tx_get_conf(tlcf->upstream.upstream);
+    if (txc == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (txc->streams != NGX_HTTP_TNT_TX_ON) {
+
+        e = ngx_http_tnt_get_error_text(
+                txc->streams == NGX_HTTP_TNT_TX_OFF ?
+                    TX_UNSUPPORTED : TX_UNKNOWN);
+        if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->state = INPUT_TX_UNAVAILABLE;
+        goto dying;
+    }
+
+    rc = ngx_http_tnt_format_read_body(r, ctx, &doc);
+    if (rc != NGX_OK) {
+
+        if (rc != NGX_HTTP_BAD_REQUEST) {
+            return rc;
+        }
+
+        ctx->state = INPUT_FMT_CANT_READ_INPUT;
+        goto dying;
+    }
+
+    it = (const char *) doc.data;
+
+    if (doc.len == 0
+        || mp_check(&it, (const char *) doc.data + doc.len) != 0
+        || it != (const char *) doc.data + doc.len)
     {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto bad_ops;
     }
 
-    u = r->upstream;
+    it = (const char *) doc.data;
 
-    ngx_str_set(&u->schema, "tnt://");
-    u->output.tag = (ngx_buf_tag_t) &ngx_http_tnt_module;
+    if (mp_typeof(*it) != MP_ARRAY) {
+        goto bad_ops;
+    }
 
-    u->conf = &tlcf->upstream;
+    n = mp_decode_array(&it);
+    if (n == 0) {
+        goto bad_ops;
+    }
 
-    rc = ngx_http_tnt_init_handlers(r, u, tlcf);
-    if (rc != NGX_OK){
-        return rc;
+    if (n > tlcf->bulk_max_rows) {
+        e = ngx_http_tnt_get_error_text(BULK_ROWS_ERROR);
+        if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ctx->state = INPUT_FMT_CANT_READ_INPUT;
+        goto dying;
     }
 
-    u->input_filter_init = ngx_http_tnt_filter_init;
-    u->input_filter = ngx_http_tnt_filter;
-    u->input_filter_ctx = r;
+    /** The operations, their headers and BEGIN */
+    size = doc.len + (n + 1) * 64;
 
-    u->length = 0;
-    u->state = 0;
+    if (tlcf->max_request_memory != 0 && size > tlcf->max_request_memory) {
+        return ngx_http_tnt_request_limited(r, ctx, out_chain);
+    }
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        return rc;
+    ctx->stats.memory += size;
+
+    out_chain->buf = ngx_create_temp_buf(r->pool, size);
+    if (out_chain->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    out_chain->next = NULL;
+    out_chain->buf->memory = 1;
+    out_chain->buf->flush = 1;
+    out_chain->buf->last_in_chain = 1;
+
+    ctx->tx.stream_id = ++txc->stream_id;
+
+    start = (char *) out_chain->buf->last;
+
+    p = ngx_http_tnt_tx_header(start, TP_BEGIN, 0, ctx->tx.stream_id);
+    p = mp_encode_map(p, 0);
+
+    ngx_http_tnt_tx_size(start, p);
+
+    for (i = 1; i <= n; i++) {
+
+        rc = ngx_http_tnt_tx_parse(r, tlcf, &op, &it);
+
+        switch (rc) {
+        case NGX_OK:
+            break;
+        case NGX_HTTP_BAD_REQUEST:
+            if (ctx->in_err == NULL) {
+                goto bad_ops;
+            }
+            ctx->state = INPUT_FMT_CANT_READ_INPUT;
+            goto dying;
+        case NGX_HTTP_NOT_ALLOWED:
+            e = ngx_http_tnt_get_error_text(DML_HANDLER_FMT_LIMIT_ERROR);
+            if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            ctx->state = INPUT_FMT_CANT_READ_INPUT;
+            goto dying;
+        case NGX_HTTP_SERVICE_UNAVAILABLE:
+            ctx->state = INPUT_SCHEMA_UNKNOWN;
+            goto dying;
+        default:
+            return NGX_ERROR;
+        }
+
+        p = ngx_http_tnt_tx_encode(p, &op, i, ctx->tx.stream_id);
+    }
+
+    out_chain->buf->last = (u_char *) p;
+
+    ctx->tx.replies = ngx_pcalloc(r->pool, sizeof(ngx_str_t) * (n + 1));
+    if (ctx->tx.replies == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->tx.n = n;
+    ctx->tx.received = 0;
+    ctx->tx.open = 1;
+    ctx->tx.commit = 0;
+    ctx->rest_batch_size = ctx->batch_size = (int) n + 1;
+
+    /** Hooking output chain */
+    r->upstream->request_bufs = out_chain;
+
+    return NGX_OK;
+
+bad_ops:
+
+    e = ngx_http_tnt_get_error_text(TX_OPS_ERROR);
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    return NGX_DONE;
+    ctx->state = INPUT_FMT_CANT_READ_INPUT;
+
+dying:
+
+    if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /** Hooking output chain */
+    r->upstream->request_bufs = out_chain;
+
+    return NGX_OK;
 }
 
-/** }}}
- */
 
-/** Confs {{{
+/** Writes COMMIT to the connection of the request. The request has been
+ *  sent and all replies have been read, so the socket buffer is empty.
  */
 static ngx_int_t
-ngx_http_tnt_preconfiguration(ngx_conf_t *cf)
+ngx_http_tnt_tx_commit(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
 {
-    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
-                    "Tarantool upstream module, version: '%s'",
-                    NGX_HTTP_TNT_MODULE_VERSION_STRING);
+    char              buf[64], *p;
+    ssize_t           n;
+    ngx_connection_t  *c;
+
+    p = ngx_http_tnt_tx_header(buf, TP_COMMIT, (uint32_t) ctx->tx.n + 1,
+                               ctx->tx.stream_id);
+    p = mp_encode_map(p, 0);
+
+    ngx_http_tnt_tx_size(buf, p);
+
+    c = u->peer.connection;
+
+    n = c->send(c, (u_char *) buf, p - buf);
+    if (n != p - buf) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "transaction: can't send COMMIT");
+        return NGX_ERROR;
+    }
+
+    ctx->tx.commit = 1;
+
     return NGX_OK;
 }
 
 
-static void *
-ngx_http_tnt_create_loc_conf(ngx_conf_t *cf)
+/** The error of a failed operation, the message has the number of the
+ *  operation
+ */
+static ngx_buf_t *
+ngx_http_tnt_tx_error(ngx_http_request_t *r, struct tpresponse *resp,
+        ngx_uint_t i)
 {
-    ngx_http_tnt_loc_conf_t  *conf;
+    char       *p;
+    u_char     prefix[sizeof("operation #4294967295: ")], *last;
+    uint32_t   len;
+    ngx_buf_t  *b;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_loc_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    if (i == 0) {
+        last = ngx_cpymem(prefix, "BEGIN: ", sizeof("BEGIN: ") - 1);
+    } else {
+        last = ngx_sprintf(prefix, "operation #%ui: ", i);
     }
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->upstream.bufs.num = 0;
-     *     conf->upstream.next_upstream = 0;
-     *     conf->upstream.temp_path = NULL;
-     *     conf->upstream.uri = { 0, NULL };
-     *     conf->upstream.location = NULL;
-     *     conf->method = { 0, NULL };
-     *     conf->queries = NULL;
-     *     ...
-     */
+    len = resp->error != NULL ? resp->error_end - resp->error : 0;
 
-    conf->upstream.local = NGX_CONF_UNSET_PTR;
+    b = ngx_create_temp_buf(r->pool, 64 + sizeof(prefix) + len);
+    if (b == NULL) {
+        return NULL;
+    }
 
-    conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.send_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.read_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.next_upstream_timeout = NGX_CONF_UNSET_MSEC;
-    conf->upstream.next_upstream_tries = NGX_CONF_UNSET;
+    p = (char *) b->last + 5;
 
-    conf->upstream.buffer_size = NGX_CONF_UNSET_SIZE;
-    conf->in_multiplier = NGX_CONF_UNSET_SIZE;
-    conf->out_multiplier = NGX_CONF_UNSET_SIZE;
-    conf->multireturn_skip_count = NGX_CONF_UNSET_SIZE;
-    conf->pass_http_request_buffer_size = NGX_CONF_UNSET_SIZE;
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, resp->code);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, 0);
 
-    conf->req_type = NGX_CONF_UNSET_SIZE;
-    conf->iter_type = NGX_CONF_UNSET_SIZE;
-    conf->select_limit = NGX_CONF_UNSET_SIZE;
-    conf->select_limit_max = NGX_CONF_UNSET_SIZE;
-    conf->select_offset = NGX_CONF_UNSET_SIZE;
-    conf->space_id = NGX_CONF_UNSET_SIZE;
-    conf->index_id = NGX_CONF_UNSET_SIZE;
+    p = mp_encode_map(p, 1);
+    p = mp_encode_uint(p, TP_ERROR);
+    p = mp_encode_strl(p, (uint32_t) (last - prefix) + len);
+    p = (char *) ngx_cpymem(p, prefix, last - prefix);
 
-    /*
-     * Hardcoded values
-     */
-    conf->upstream.cyclic_temp_file = 0;
-    conf->upstream.buffering = 0;
-    conf->upstream.ignore_client_abort = 0;
-    conf->upstream.send_lowat = 0;
-    conf->upstream.bufs.num = 0;
-    conf->upstream.busy_buffers_size = 0;
-    conf->upstream.max_temp_file_size = 0;
-    conf->upstream.temp_file_write_size = 0;
-    conf->upstream.intercept_errors = 1;
-    conf->upstream.intercept_404 = 1;
+    if (len != 0) {
+        p = (char *) ngx_cpymem(p, resp->error, len);
+    }
 
-    conf->upstream.pass_request_headers = 0;
-    conf->upstream.pass_request_body = 0;
+    ngx_http_tnt_tx_size((char *) b->last, p);
 
-    conf->index = NGX_CONF_UNSET;
+    b->last = (u_char *) p;
+    b->end = b->last;
 
-    return conf;
+    return b;
 }
 
 
-static char *
-ngx_http_tnt_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+/** The results of the operations as one reply, i.e. an array of
+ *  their data
+ */
+static ngx_buf_t *
+ngx_http_tnt_tx_merge(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx)
 {
-    ngx_http_tnt_loc_conf_t *prev = parent;
-    ngx_http_tnt_loc_conf_t *conf = child;
+    char               *p;
+    size_t             size;
+    ngx_buf_t          *b;
+    ngx_uint_t         i;
+    ngx_str_t          *reply;
+    struct tpresponse  resp;
 
-    ngx_conf_merge_ptr_value(conf->upstream.local,
-                  prev->upstream.local, NULL);
-    ngx_conf_merge_msec_value(conf->upstream.connect_timeout,
-                  prev->upstream.connect_timeout, 60000);
+    size = 64;
 
-    ngx_conf_merge_msec_value(conf->upstream.send_timeout,
-                  prev->upstream.send_timeout, 60000);
+    for (i = 1; i <= ctx->tx.n; i++) {
+        size += ctx->tx.replies[i].len;
+    }
 
-    ngx_conf_merge_msec_value(conf->upstream.read_timeout,
-                  prev->upstream.read_timeout, 60000);
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
 
-    ngx_conf_merge_size_value(conf->upstream.buffer_size,
-                  prev->upstream.buffer_size,
-                  (size_t) ngx_pagesize);
+    p = (char *) b->last + 5;
 
-    ngx_conf_merge_bitmask_value(conf->upstream.next_upstream,
-                  prev->upstream.next_upstream,
-                              (NGX_CONF_BITMASK_SET
-                               |NGX_HTTP_UPSTREAM_FT_ERROR
-                               |NGX_HTTP_UPSTREAM_FT_TIMEOUT));
+    p = mp_encode_map(p, 2);
+    p = mp_encode_uint(p, TP_CODE);
+    p = mp_encode_uint(p, 0);
+    p = mp_encode_uint(p, TP_SYNC);
+    p = mp_encode_uint(p, 0);
 
-    if (conf->upstream.next_upstream & NGX_HTTP_UPSTREAM_FT_OFF) {
-        conf->upstream.next_upstream = NGX_CONF_BITMASK_SET
-                                       |NGX_HTTP_UPSTREAM_FT_OFF;
-    }
+    p = mp_encode_map(p, 1);
+    p = mp_encode_uint(p, TP_DATA);
+    p = mp_encode_array(p, ctx->tx.n);
 
-    if (conf->upstream.upstream == NULL) {
-        conf->upstream.upstream = prev->upstream.upstream;
-    }
+    for (i = 1; i <= ctx->tx.n; i++) {
 
-    ngx_conf_merge_size_value(conf->in_multiplier, prev->in_multiplier, 2);
+        reply = &ctx->tx.replies[i];
 
-    ngx_conf_merge_size_value(conf->out_multiplier, prev->out_multiplier, 2);
+        if (tp_reply(&resp, (const char *) reply->data, reply->len) <= 0
+            || resp.data == NULL)
+        {
+            p = mp_encode_array(p, 0);
+            continue;
+        }
 
-    if (conf->method_ccv == NULL) {
-        conf->method_ccv = prev->method_ccv;
+        p = (char *) ngx_cpymem(p, resp.data, resp.data_end - resp.data);
     }
 
-    ngx_conf_merge_size_value(conf->pass_http_request_buffer_size,
-                  prev->pass_http_request_buffer_size, 4096*2);
+    ngx_http_tnt_tx_size((char *) b->last, p);
 
-    ngx_conf_merge_bitmask_value(conf->pass_http_request,
-                  prev->pass_http_request, NGX_TNT_CONF_OFF);
+    b->last = (u_char *) p;
+    b->end = b->last;
 
-    ngx_conf_merge_bitmask_value(conf->http_rest_methods,
-                  prev->http_rest_methods,
-                              (NGX_HTTP_GET
-                               |NGX_HTTP_PUT));
+    return b;
+}
 
-    ngx_conf_merge_bitmask_value(conf->http_methods,
-                  prev->http_methods,
-                              (NGX_HTTP_POST
-                               |NGX_HTTP_DELETE));
 
-    ngx_conf_merge_bitmask_value(conf->pure_result, prev->pure_result,
-                NGX_TNT_CONF_OFF);
+/** Called by ngx_http_tnt_filter_reply() for each reply of a transaction.
+ *  If BEGIN or an operation fails, then COMMIT isn't sent and the
+ *  connection is closed, so Tarantool rolls the transaction back.
+ */
+static ngx_int_t
+ngx_http_tnt_tx_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
+{
+    ngx_int_t          rc;
+    ngx_buf_t          *b;
+    ngx_str_t          *reply;
+    ngx_uint_t         i;
+    struct tpresponse  resp;
+
+    if (tp_reply(&resp, (const char *) ctx->tp_cache->start,
+                ctx->tp_cache->end - ctx->tp_cache->start) <= 0
+        || resp.sync > ctx->tx.n + ctx->tx.commit
+        || (resp.sync <= ctx->tx.n
+            && ctx->tx.replies[resp.sync].data != NULL))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "transaction: Tarantool sent an unexpected reply");
+        return NGX_ERROR;
+    }
 
-    ngx_conf_merge_size_value(conf->multireturn_skip_count,
-                  prev->multireturn_skip_count, 0);
+    /** COMMIT */
+    if (resp.sync == ctx->tx.n + 1) {
 
-    if (conf->headers == NULL) {
-        conf->headers = prev->headers;
-    }
+        if (resp.code != 0) {
+            b = ctx->tp_cache;
+            goto send;
+        }
 
-    ngx_conf_merge_uint_value(conf->req_type, prev->req_type, 0);
-    ngx_conf_merge_uint_value(conf->space_id, prev->space_id, 513);
-    ngx_conf_merge_uint_value(conf->index_id, prev->index_id, 0);
-    ngx_conf_merge_uint_value(conf->select_offset, prev->select_offset, 0);
-    ngx_conf_merge_uint_value(conf->select_limit, prev->select_limit, 0);
-    ngx_conf_merge_uint_value(conf->select_limit_max, prev->select_limit_max,
-            100);
-    ngx_conf_merge_uint_value(conf->iter_type, prev->iter_type,
-            (ngx_uint_t) TP_ITERATOR_EQ);
+        ctx->tx.open = 0;
 
-    if (conf->allowed_spaces == NULL) {
-        conf->allowed_spaces = prev->allowed_spaces;
-    }
+        b = ngx_http_tnt_tx_merge(r, ctx);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
 
-    if (conf->allowed_indexes == NULL) {
-        conf->allowed_indexes = prev->allowed_indexes;
+        goto send;
     }
 
-    if (conf->format_values == NULL) {
-        conf->format_values = prev->format_values;
-    }
+    ctx->tx.replies[resp.sync].data = ctx->tp_cache->start;
+    ctx->tx.replies[resp.sync].len = ctx->tp_cache->end - ctx->tp_cache->start;
 
-    return NGX_CONF_OK;
-}
+    if (++ctx->tx.received <= ctx->tx.n) {
+        return NGX_OK;
+    }
 
+    for (i = 0; i <= ctx->tx.n; i++) {
 
-static char *
-ngx_http_tnt_method(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+        reply = &ctx->tx.replies[i];
 
-    ngx_http_compile_complex_value_t   ccv;
-    ngx_str_t                          *value;
-    ngx_http_complex_value_t           cv;
+        if (tp_reply(&resp, (const char *) reply->data, reply->len) <= 0) {
+            return NGX_ERROR;
+        }
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
-    value = cf->args->elts;
+        if (resp.code != 0) {
 
-    ccv.cf = cf;
-    ccv.value = &value[1];
-    ccv.complex_value = &cv;
+            b = ngx_http_tnt_tx_error(r, &resp, i);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NGX_CONF_ERROR;
+            goto send;
+        }
     }
 
-    tlcf->method_ccv = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (tlcf->method_ccv == NULL) {
-        return NGX_CONF_ERROR;
+    rc = ngx_http_tnt_tx_commit(r, u, ctx);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    *tlcf->method_ccv = cv;
-
-    return NGX_CONF_OK;
-}
+    /** The reply of COMMIT */
+    ++ctx->rest_batch_size;
 
+    return NGX_OK;
 
-static char *
-ngx_http_tnt_headers_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
-
-    ngx_str_t                          *value;
-    ngx_http_tnt_header_val_t          *hv;
-    ngx_http_compile_complex_value_t   ccv;
+send:
 
-    value = cf->args->elts;
+    /** The result is sent as the reply of one request */
+    ctx->tp_cache = b;
+    ctx->batch_size = 0;
 
-    if (tlcf->headers == NULL) {
+    rc = ngx_http_tnt_send_reply(r, u, ctx);
 
-        tlcf->headers = ngx_array_create(cf->pool, 1,
-                                        sizeof(ngx_http_tnt_header_val_t));
-        if (tlcf->headers == NULL) {
-            return NGX_CONF_ERROR;
-        }
-    }
+    ctx->batch_size = (int) ctx->tx.n + 1;
 
-    hv = ngx_array_push(tlcf->headers);
-    if (hv == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    return rc;
+}
+/** }}}
+ */
 
-    hv->key = value[1];
-    hv->handler = ngx_http_tnt_add_header_in;
 
-    if (value[2].len == 0) {
-        ngx_memzero(&hv->value, sizeof(ngx_http_complex_value_t));
+/** Statistics {{{
+ */
+static ngx_int_t
+ngx_http_tnt_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_tnt_stats_conf_t  *osc = data;
 
-    } else {
-        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    size_t                     len;
+    ngx_uint_t                 n;
+    ngx_http_tnt_stats_conf_t  *sc;
 
-        ccv.cf = cf;
-        ccv.value = &value[2];
-        ccv.complex_value = &hv->value;
+    sc = shm_zone->data;
 
-        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-            return NGX_CONF_ERROR;
-        }
+    if (osc) {
+        sc->shpool = osc->shpool;
+        sc->sh = osc->sh;
+        return NGX_OK;
     }
 
-    if (cf->args->nelts == 3) {
-        return NGX_CONF_OK;
+    sc->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        sc->sh = sc->shpool->data;
+        return NGX_OK;
     }
 
-    return NGX_CONF_OK;
-}
+    len = sizeof(" in tnt_stats_zone \"\"") + shm_zone->shm.name.len;
 
+    sc->shpool->log_ctx = ngx_slab_alloc(sc->shpool, len);
+    if (sc->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-static char *
-ngx_http_tnt_insert_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    ngx_sprintf(sc->shpool->log_ctx, " in tnt_stats_zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-    ngx_str_t *value;
-    ngx_int_t tmp;
+    /** The nodes take the rest of the zone */
+    n = shm_zone->shm.size / sizeof(ngx_http_tnt_stats_node_t);
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
-        return "is duplicate";
+    if (ngx_http_tnt_hot_keys_used) {
+        n -= n / 4;
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_INSERT;
+    sc->shpool->log_nomem = 0;
 
-    value = cf->args->elts;
+    for ( ;; ) {
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    }
-    else {
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                    "tnt_stats_zone \"%V\" is too small",
+                    &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
 
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
+        sc->sh = ngx_slab_calloc(sc->shpool,
+                sizeof(ngx_http_tnt_stats_shctx_t)
+                + (n - 1) * sizeof(ngx_http_tnt_stats_node_t));
+        if (sc->sh != NULL) {
+            break;
         }
-        tlcf->space_id = (ngx_uint_t) tmp;
+
+        n -= n / 8 + 1;
     }
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
-}
 
+    sc->shpool->log_nomem = 1;
+
+    sc->sh->max = n;
+    sc->shpool->data = sc->sh;
 
-static ngx_int_t
-ngx_http_tnt_set_iter_type(ngx_str_t *v, ngx_uint_t *iter_type)
-{
-    if (ngx_strncmp(v->data, "eq", sizeof("eq") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_EQ;
-    } else if (ngx_strncmp(v->data, "req", sizeof("req") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_REQ;
-    } else if (ngx_strncmp(v->data, "all", sizeof("all") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_ALL;
-    } else if (ngx_strncmp(v->data, "lt", sizeof("lt") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_LT;
-    } else if (ngx_strncmp(v->data, "le", sizeof("le") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_LE;
-    } else if (ngx_strncmp(v->data, "ge", sizeof("ge") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_GE;
-    } else if (ngx_strncmp(v->data, "gt", sizeof("gt") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_GT;
-    } else if (ngx_strncmp(v->data, "all_set", sizeof("all_set") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ALL_SET;
-    } else if (ngx_strncmp(v->data, "any_set", sizeof("any_set") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ANY_SET;
-    } else if (ngx_strncmp(v->data, "all_non_set",
-                    sizeof("all_non_set") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_BITS_ALL_NON_SET;
-    } else if (ngx_strncmp(v->data, "overlaps", sizeof("overlaps") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_OVERLAPS;
-    } else if (ngx_strncmp(v->data, "neighbor", sizeof("neighbor") - 1) == 0) {
-        *iter_type = (ngx_uint_t) TP_ITERATOR_NEIGHBOR;
-    } else {
-        return NGX_ERROR;
-    }
     return NGX_OK;
 }
 
 
 static char *
-ngx_http_tnt_select_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_tnt_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    u_char                     *p;
+    ssize_t                    size;
+    ngx_str_t                  *value, name, s;
+    ngx_http_tnt_stats_conf_t  *sc;
 
-    ngx_int_t tmp;
-    ngx_str_t *value;
+    value = cf->args->elts;
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
-        return "is duplicate";
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL) {
+        goto invalid;
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_SELECT;
+    name.data = value[1].data;
+    name.len = p - name.data;
 
-    value = cf->args->elts;
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    } else {
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || name.len == 0) {
+        goto invalid;
+    }
 
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
-        }
-        tlcf->space_id = (ngx_uint_t) tmp;
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    if (ngx_strcmp(value[2].data, "off") == 0) {
-        tlcf->index_id = 0;
-    } else {
+    sc = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_stats_conf_t));
+    if (sc == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-        tmp = ngx_atoi(value[2].data, value[2].len);
-        if (tmp < 0) {
-            return "index id should be non negative number";
-        }
-        tlcf->index_id = (ngx_uint_t) tmp;
+    sc->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                         &ngx_http_tnt_module);
+    if (sc->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    tmp = ngx_atoi(value[3].data, value[3].len);
-    if (tmp < 0) {
-        return "select offset should be non negative number";
+    if (sc->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
     }
-    tlcf->select_offset = (ngx_uint_t) tmp;
 
+    sc->shm_zone->init = ngx_http_tnt_stats_init_zone;
+    sc->shm_zone->data = sc;
 
-    tmp = ngx_atoi(value[4].data, value[4].len);
-    if (tmp < 0) {
-        return "select limit should be non negative number";
-    }
-    tlcf->select_limit = (ngx_uint_t) tmp;
+    return NGX_CONF_OK;
 
-    if (ngx_http_tnt_set_iter_type(&value[5], &tlcf->iter_type) != NGX_OK) {
-        return "unknown iterator type, allowed "
-                "eq,req,all,lt,le,ge,gt,all_set,any_set,"
-                "all_non_set,overlaps,neighbor";
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid zone \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+}
+
+
+/** The zone of tnt_stats and tnt_status can be defined later, it's checked
+ *  by ngx_http_tnt_stats_get_conf()
+ */
+static ngx_shm_zone_t *
+ngx_http_tnt_stats_ref(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_shm_zone_t  *shm_zone;
+
+    shm_zone = ngx_shared_memory_add(cf, name, 0, &ngx_http_tnt_module);
+    if (shm_zone == NULL) {
+        return NULL;
     }
 
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[6]);
+    if (shm_zone->init != NULL
+        && shm_zone->init != ngx_http_tnt_stats_init_zone)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" isn't a tnt_stats_zone", name);
+        return NULL;
+    }
 
+    return shm_zone;
 }
 
 
 static char *
-ngx_http_tnt_replace_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_tnt_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_tnt_loc_conf_t *tlcf = conf;
 
-    ngx_int_t tmp;
-    ngx_str_t *value;
+    ngx_str_t  *value;
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+    if (tlcf->stats_zone != NGX_CONF_UNSET_PTR) {
         return "is duplicate";
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_REPLACE;
-
     value = cf->args->elts;
+
     if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    } else {
+        tlcf->stats_zone = NULL;
+        return NGX_CONF_OK;
+    }
 
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
-        }
-        tlcf->space_id = (ngx_uint_t) tmp;
+    tlcf->stats_zone = ngx_http_tnt_stats_ref(cf, &value[1]);
+    if (tlcf->stats_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
+    return NGX_CONF_OK;
 }
 
 
+static ngx_int_t ngx_http_tnt_status_handler(ngx_http_request_t *r);
+
+
 static char *
-ngx_http_tnt_delete_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_tnt_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_tnt_loc_conf_t *tlcf = conf;
 
-    ngx_int_t tmp;
-    ngx_str_t *value;
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
+    if (tlcf->status_zone != NULL) {
         return "is duplicate";
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_DELETE;
-
     value = cf->args->elts;
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    } else {
-
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
-        }
-        tlcf->space_id = (ngx_uint_t) tmp;
+    tlcf->status_zone = ngx_http_tnt_stats_ref(cf, &value[1]);
+    if (tlcf->status_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    if (ngx_strcmp(value[2].data, "off") == 0) {
-        tlcf->index_id = 0;
-    } else {
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_tnt_status_handler;
 
-        tmp = ngx_atoi(value[2].data, value[2].len);
-        if (tmp < 0) {
-            return "index id should be non negative number";
-        }
-        tlcf->index_id = (ngx_uint_t) tmp;
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_tnt_stats_conf_t *
+ngx_http_tnt_stats_get_conf(ngx_log_t *log, ngx_shm_zone_t *shm_zone)
+{
+    if (shm_zone->init != ngx_http_tnt_stats_init_zone) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "zone \"%V\" isn't a tnt_stats_zone", &shm_zone->shm.name);
+        return NULL;
     }
 
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
+    return shm_zone->data;
 }
 
 
-static char *
-ngx_http_tnt_update_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_http_tnt_stats_node_t *
+ngx_http_tnt_stats_find(ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t from,
+        ngx_uint_t to, ngx_uint_t kind, ngx_uint_t hash, u_char *name,
+        size_t len)
 {
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    ngx_http_tnt_stats_node_t  *node;
 
-    ngx_int_t tmp;
-    ngx_str_t *value;
-    char      *ok;
+    for (node = &sh->nodes[from]; node < &sh->nodes[to]; node++) {
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
-        return "is duplicate";
+        if (node->hash == hash && node->kind == kind && node->len == len
+            && ngx_memcmp(node->name, name, len) == 0)
+        {
+            return node;
+        }
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_UPDATE;
+    return NULL;
+}
 
-    value = cf->args->elts;
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    } else {
+/** Returns the node of the name, it's added if it's a new name. Too long
+ *  names are cut.
+ */
+static ngx_http_tnt_stats_node_t *
+ngx_http_tnt_stats_lookup(ngx_http_tnt_stats_conf_t *sc, ngx_log_t *log,
+        ngx_uint_t kind, u_char *name, size_t len)
+{
+    ngx_uint_t                  n, hash;
+    ngx_http_tnt_stats_node_t   *node;
+    ngx_http_tnt_stats_shctx_t  *sh;
 
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
-        }
-        tlcf->space_id = (ngx_uint_t) tmp;
-    }
+    sh = sc->sh;
 
-    /** Keys  */
-    ok = ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
-    if (ok != NGX_CONF_OK) {
-        return ok;
+    len = ngx_min(len, NGX_HTTP_TNT_STATS_NAME_LEN);
+    hash = ngx_hash_key(name, len);
+
+    n = sh->n;
+    ngx_memory_barrier();
+
+    node = ngx_http_tnt_stats_find(sh, 0, n, kind, hash, name, len);
+    if (node != NULL) {
+        return node;
     }
 
-    /** Tuples */
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
-}
+    ngx_shmtx_lock(&sc->shpool->mutex);
 
+    node = ngx_http_tnt_stats_find(sh, n, sh->n, kind, hash, name, len);
+    if (node != NULL) {
+        ngx_shmtx_unlock(&sc->shpool->mutex);
+        return node;
+    }
 
-static char *
-ngx_http_tnt_upsert_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    n = sh->n;
 
-    ngx_int_t tmp;
-    ngx_str_t *value;
-    char      *ok;
+    if (n == sh->max) {
+        ngx_shmtx_unlock(&sc->shpool->mutex);
 
-    if (tlcf->req_type != 0 && tlcf->req_type != NGX_CONF_UNSET_SIZE) {
-        return "is duplicate";
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "tnt_stats_zone \"%V\" is full, \"%*s\" isn't counted",
+                &sc->shm_zone->shm.name, len, name);
+        return NULL;
     }
 
-    tlcf->req_type = (ngx_uint_t) TP_UPSERT;
+    node = &sh->nodes[n];
 
-    value = cf->args->elts;
+    node->kind = kind;
+    node->hash = hash;
+    node->len = len;
+    ngx_memcpy(node->name, name, len);
 
-    if (ngx_strcmp(value[1].data, "off") == 0) {
-        tlcf->space_id = 0;
-    } else {
+    ngx_memory_barrier();
 
-        tmp = ngx_atoi(value[1].data, value[1].len);
-        if (tmp < 0) {
-            return "space id should be non negative number";
-        }
-        tlcf->space_id = (ngx_uint_t) tmp;
-    }
+    sh->n = n + 1;
 
-    /** Tuples */
-    ok = ngx_http_tnt_format_compile(cf, tlcf, &value[2]);
-    if (ok != NGX_CONF_OK) {
-        return ok;
-    }
+    ngx_shmtx_unlock(&sc->shpool->mutex);
 
-    /** Operations */
-    return ngx_http_tnt_format_compile(cf, tlcf, &value[3]);
+    return node;
 }
 
 
-static char *
-ngx_http_tnt_read_array_of_uint(ngx_pool_t *pool, ngx_array_t *arr,
-        ngx_str_t *str, u_char sep)
+static ngx_http_tnt_stats_node_t *
+ngx_http_tnt_stats_location(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf)
 {
-    ngx_uint_t  *val;
-    u_char      *p, *e, *it;
-
-    p = str->data;
-    e = str->data + str->len;
-
-    for (it = p; p < e; ++p) {
+    ngx_http_tnt_stats_conf_t  *sc;
+    ngx_http_core_loc_conf_t   *clcf;
 
-        if (*p == ',') {
-            val = ngx_array_push(arr);
-            if (val == NULL) {
-                return NGX_CONF_ERROR;
-            }
-            *val = (ngx_uint_t) atoi((const char *) it);
-            it = p + 1;
-        }
+    if (tlcf->stats_node != NULL) {
+        return tlcf->stats_node;
     }
 
-    if (it && it > e) {
-        val = ngx_array_push(arr);
-        if (val == NULL) {
-            return NGX_CONF_ERROR;
-        }
-        *val = (ngx_uint_t) atoi((const char *) it);
+    sc = ngx_http_tnt_stats_get_conf(r->connection->log, tlcf->stats_zone);
+    if (sc == NULL) {
+        return NULL;
     }
 
-    return NGX_CONF_OK;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /** The node is found once by the worker */
+    tlcf->stats_node = ngx_http_tnt_stats_lookup(sc, r->connection->log,
+            NGX_HTTP_TNT_STATS_LOCATION, clcf->name.data, clcf->name.len);
+
+    return tlcf->stats_node;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_test_allowed(ngx_array_t *arr, ngx_uint_t val)
+static ngx_uint_t
+ngx_http_tnt_stats_bucket(uint64_t usec)
 {
-    ngx_uint_t  i;
-    ngx_uint_t  *arr_val;
+    ngx_uint_t  e, i;
 
-    if (arr == NULL) {
-        return NGX_OK;
+    if (usec < NGX_HTTP_TNT_STATS_SUB) {
+        return (ngx_uint_t) usec;
     }
 
-    arr_val = arr->elts;
+    /** 2^e <= usec < 2^(e+1), the sub-bucket is the next 3 bits */
+    for (e = 3; (usec >> (e + 1)) != 0; e++) { /* void */ }
 
-    for (i = 0; i < arr->nelts; i++) {
+    i = (e - 2) * NGX_HTTP_TNT_STATS_SUB
+        + (ngx_uint_t) ((usec >> (e - 3)) & (NGX_HTTP_TNT_STATS_SUB - 1));
 
-        if (arr_val[i] == val) {
-            return NGX_OK;
-        }
+    return ngx_min(i, NGX_HTTP_TNT_STATS_BUCKETS - 1);
+}
+
+
+/** The upper bound of a bucket (exclusive) in usec */
+static uint64_t
+ngx_http_tnt_stats_bucket_le(ngx_uint_t i)
+{
+    ngx_uint_t  e;
+
+    if (i < NGX_HTTP_TNT_STATS_SUB) {
+        return i + 1;
     }
 
-    return NGX_HTTP_NOT_ALLOWED;
+    e = i / NGX_HTTP_TNT_STATS_SUB + 2;
+
+    return (uint64_t) (NGX_HTTP_TNT_STATS_SUB + i % NGX_HTTP_TNT_STATS_SUB + 1)
+           << (e - 3);
 }
 
 
-static char *
-ngx_http_tnt_allowed_spaces_add(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_http_tnt_stats_hist_add(ngx_http_tnt_stats_hist_t *h, uint64_t usec)
 {
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
-
-    ngx_str_t  *value;
+    (void) ngx_atomic_fetch_add(&h->count, 1);
+    (void) ngx_atomic_fetch_add(&h->sum, (ngx_atomic_int_t) usec);
+    (void) ngx_atomic_fetch_add(&h->buckets[ngx_http_tnt_stats_bucket(usec)],
+                                1);
+}
 
-    value = cf->args->elts;
 
-    if (tlcf->allowed_spaces == NULL) {
-        tlcf->allowed_spaces = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
-        if (tlcf->allowed_spaces == NULL) {
-            return NGX_CONF_ERROR;
-        }
+static uint64_t
+ngx_http_tnt_stats_clock(ngx_http_tnt_loc_conf_t *tlcf)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+#else
+    struct timeval   tv;
+#endif
+
+    if (tlcf->stats_zone == NULL && tlcf->slowlog_zone == NULL
+        && !ngx_http_tnt_timing)
+    {
+        return 0;
     }
 
-    return ngx_http_tnt_read_array_of_uint(cf->pool, tlcf->allowed_spaces,
-            &value[1], ',');
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    ngx_gettimeofday(&tv);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
 
 
-static char *
-ngx_http_tnt_allowed_indexes_add(ngx_conf_t *cf, ngx_command_t *cmd,
-        void *conf)
+/** Adds the time since start to the transcoding of the request (out is 0)
+ *  or of the reply (out is 1), start is 0 if the timing is off
+ */
+static void
+ngx_http_tnt_stats_transcoded(ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_http_tnt_ctx_t *ctx, uint64_t start, ngx_uint_t out)
 {
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    uint64_t  now, usec;
 
-    ngx_str_t  *value;
+    if (start == 0) {
+        return;
+    }
 
-    value = cf->args->elts;
+    now = ngx_http_tnt_stats_clock(tlcf);
+    usec = now > start ? now - start : 0;
 
-    if (tlcf->allowed_indexes == NULL) {
-        tlcf->allowed_indexes = ngx_array_create(cf->pool, 1,
-                sizeof(ngx_uint_t));
-        if (tlcf->allowed_indexes == NULL) {
-            return NGX_CONF_ERROR;
-        }
-    }
+    if (out) {
+        ctx->stats.transcode_out += usec;
+        ctx->stats.transcoded_out = 1;
 
-    return ngx_http_tnt_read_array_of_uint(cf->pool, tlcf->allowed_indexes,
-            &value[1], ',');
+    } else {
+        ctx->stats.transcode_in += usec;
+        ctx->stats.transcoded_in = 1;
+    }
 }
 
 
-static ngx_int_t
-ngx_http_tnt_format_read_input(ngx_http_request_t *r, ngx_str_t *dst)
+static void
+ngx_http_tnt_stats_error(ngx_http_request_t *r, ngx_int_t code)
 {
-    ngx_int_t           rc;
-    ngx_buf_t           *b;
-    ngx_chain_t         *body;
-    ngx_buf_t           unparsed_body;
-    ngx_str_t           tmp;
+    ngx_uint_t                 i;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_conf_t  *sc;
+    ngx_http_tnt_stats_node_t  *node;
+    ngx_http_tnt_stats_code_t  *c;
 
-    tmp = r->args;
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-    if (r->headers_in.content_length_n > 0) {
+    if (tlcf->stats_zone == NULL) {
+        return;
+    }
 
-        unparsed_body.pos = ngx_pnalloc(r->pool,
-            sizeof(u_char) * r->headers_in.content_length_n + 1);
+    node = ngx_http_tnt_stats_location(r, tlcf);
+    if (node == NULL) {
+        return;
+    }
 
-        if (unparsed_body.pos == NULL) {
-            return NGX_ERROR;
+    for (i = 0; i < NGX_HTTP_TNT_STATS_CODES; i++) {
+
+        c = &node->codes[i];
+
+        if (!c->used) {
+            break;
         }
 
-        unparsed_body.last = unparsed_body.pos;
-        unparsed_body.start = unparsed_body.pos;
-        unparsed_body.end = unparsed_body.pos + r->headers_in.content_length_n + 1;
+        if (c->code == code) {
+            (void) ngx_atomic_fetch_add(&c->count, 1);
+            return;
+        }
+    }
 
-        for (body = r->upstream->request_bufs; body; body = body->next) {
+    /** A new code */
+    sc = tlcf->stats_zone->data;
 
-            b = body->buf;
+    ngx_shmtx_lock(&sc->shpool->mutex);
 
-                if (b->in_file) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                        "in-file buffer found. aborted. "
-                        "consider increasing your 'client_body_buffer_size' "
-                        "setting");
-                    return NGX_ERROR;
-                }
+    for ( ; i < NGX_HTTP_TNT_STATS_CODES; i++) {
 
-            unparsed_body.last = ngx_copy(unparsed_body.last,
-                b->pos, b->last - b->pos);
+        c = &node->codes[i];
+
+        if (!c->used) {
+            c->code = code;
+            ngx_memory_barrier();
+            c->used = 1;
         }
 
-        tmp.data = unparsed_body.start;
-        tmp.len = unparsed_body.last - unparsed_body.start;
+        if (c->code == code) {
+            (void) ngx_atomic_fetch_add(&c->count, 1);
+            break;
+        }
     }
 
-    rc = ngx_http_tnt_unescape_uri(r, dst, &tmp);
-    if (rc != NGX_OK) {
-        return rc;
-    }
+    ngx_shmtx_unlock(&sc->shpool->mutex);
 
-    return NGX_OK;
+    if (i == NGX_HTTP_TNT_STATS_CODES) {
+        (void) ngx_atomic_fetch_add(&node->other_codes, 1);
+    }
 }
 
 
-static char *
-ngx_http_tnt_format_compile(ngx_conf_t *cf, ngx_http_tnt_loc_conf_t *conf,
-        ngx_str_t *format)
+/** Counts an attempt of the upstream, for the location and for the peer.
+ *  The times are taken from t, the msec of nginx are used if t doesn't
+ *  have them, e.g. the request was retried before it was sent.
+ */
+static void
+ngx_http_tnt_stats_attempt(ngx_http_request_t *r,
+        ngx_http_tnt_stats_conf_t *sc, ngx_http_tnt_stats_node_t *node,
+        ngx_http_upstream_state_t *state, ngx_http_tnt_stats_time_t *t)
 {
-    u_char                      *name, *type;
-    ngx_uint_t                  i;
-    ngx_http_tnt_format_value_t fmt_val, *val;
-
-    if (conf->format_values == NULL) {
+    uint64_t                   connect, upstream;
+    ngx_uint_t                 i, has_connect, has_upstream;
+    ngx_http_tnt_stats_node_t  *nodes[2];
 
-        conf->format_values = ngx_array_create(cf->pool, 1,
-                sizeof(ngx_http_tnt_format_value_t));
+    has_connect = has_upstream = 0;
+    connect = upstream = 0;
 
-        if (conf->format_values == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    if (t != NULL && t->start != 0 && t->connected >= t->start) {
+        connect = t->connected - t->start;
+        has_connect = 1;
     }
 
-    name = NULL;
-    type = NULL;
+#if (nginx_version >= 1009001)
+    if (!has_connect && state->connect_time != (ngx_msec_t) -1) {
+        connect = (uint64_t) state->connect_time * 1000;
+        has_connect = 1;
+    }
+#endif
 
-    for (i = 0; i < format->len; ++i) {
+    if (t != NULL && t->start != 0 && t->end >= t->start) {
+        upstream = t->end - t->start;
+        has_upstream = 1;
 
-        if (name == NULL) {
-            name = format->data + i;
-        }
+    } else if (state->response_time != (ngx_msec_t) -1) {
+        upstream = (uint64_t) state->response_time * 1000;
+        has_upstream = 1;
+    }
 
-        if (format->data[i] == '=' && type == NULL) {
-            type = format->data + i + 1;
-        }
+    nodes[0] = node;
+    nodes[1] = ngx_http_tnt_stats_lookup(sc, r->connection->log,
+            NGX_HTTP_TNT_STATS_PEER, state->peer->data, state->peer->len);
 
-        if (format->data[i] == '&' || format->data[i] == ','
-                || i == format->len - 1)
-        {
-            fmt_val.name.data = name;
-            fmt_val.name.len = (ngx_uint_t) (type - name);
+    for (i = 0; i < 2; i++) {
 
-            name = NULL;
+        node = nodes[i];
 
-            /** Spec. values */
-            if (ngx_strncmp(type, "%%lim", sizeof("%%lim") - 1) == 0) {
-                conf->limit_name = fmt_val.name;
-            } else if (
-                    ngx_strncmp(type, "%%off", sizeof("%%off") - 1) == 0) {
+        if (node == NULL) {
+            continue;
+        }
 
-                conf->offset_name = fmt_val.name;
-            } else if (ngx_strncmp(type, "%%it", sizeof("%%it") - 1) == 0) {
+        /** The location counts requests, see ngx_http_tnt_stats_record() */
+        if (i == 1) {
 
-                conf->iter_type_name = fmt_val.name;
-            } else if (
-                ngx_strncmp(type, "%%space_id", sizeof("%%space_id") - 1) == 0) {
-                conf->space_id_name = fmt_val.name;
-            } else if (
-                ngx_strncmp(type, "%%idx_id", sizeof("%%idx_id") - 1) == 0) {
+            (void) ngx_atomic_fetch_add(&node->requests, 1);
 
-                conf->index_id_name = fmt_val.name;
-            /** Tuple */
-            } else {
+            if (state->status >= 100 && state->status < 600) {
+                (void) ngx_atomic_fetch_add(
+                        &node->responses[state->status / 100 - 1], 1);
+            }
+        }
 
-                val = ngx_array_push(conf->format_values);
-                if (val == NULL) {
-                    return NGX_CONF_ERROR;
-                }
+        if (has_connect) {
+            ngx_http_tnt_stats_hist_add(
+                    &node->hist[NGX_HTTP_TNT_STATS_CONNECT], connect);
+        }
 
-                val->name = fmt_val.name;
-                val->value.len = 0;
+        if (has_upstream) {
+            ngx_http_tnt_stats_hist_add(
+                    &node->hist[NGX_HTTP_TNT_STATS_UPSTREAM], upstream);
+        }
 
-                if (ngx_strncmp(type, "%n", sizeof("%n") - 1) == 0) {
-                    val->type = TP_INT;
-                } else if (ngx_strncmp(type, "%d", sizeof("%d") - 1) == 0) {
-                    val->type = TP_DOUBLE;
-                } else if (ngx_strncmp(type, "%f", sizeof("%f") - 1) == 0) {
-                    val->type = TP_FLOAT;
-                } else if (ngx_strncmp(type, "%s", sizeof("%s") - 1) == 0) {
-                    val->type = TP_STR;
-                } else if (ngx_strncmp(type, "%b", sizeof("%b") - 1) == 0) {
-                    val->type = TP_BOOL;
+#if (nginx_version >= 1011004)
+        (void) ngx_atomic_fetch_add(&node->bytes_in,
+                                    (ngx_atomic_int_t) state->bytes_received);
+#endif
+#if (nginx_version >= 1015008)
+        (void) ngx_atomic_fetch_add(&node->bytes_out,
+                                    (ngx_atomic_int_t) state->bytes_sent);
+#endif
+    }
+}
 
-                /* If a type has a prefix '%k' then it is a key for TP_UPDATE
-                 */
-                } else if (conf->req_type == TP_UPDATE) {
 
-                    if (ngx_strncmp(type, "%kn", sizeof("%kn") - 1) == 0) {
-                        val->type = TP_INT;
-                        val->update_key = 1;
-                    } else if (ngx_strncmp(type, "%kd", sizeof("%kd") - 1) == 0) {
-                        val->type = TP_DOUBLE;
-                        val->update_key = 1;
-                    } else if (ngx_strncmp(type, "%kf", sizeof("%kf") - 1) == 0) {
-                        val->type = TP_FLOAT;
-                        val->update_key = 1;
-                    } else if (ngx_strncmp(type, "%ks", sizeof("%ks") - 1) == 0) {
-                        val->type = TP_STR;
-                        val->update_key = 1;
-                    } else if (ngx_strncmp(type, "%kb", sizeof("%kb") - 1) == 0) {
-                        val->type = TP_BOOL;
-                        val->update_key = 1;
-                    } else {
-                        goto unknown_format_error;
-                    }
-                }
-                /* If a type has a prefix '%o' then it is an operation for
-                 * TP_UPDATE
-                 */
-                else if (conf->req_type == TP_UPSERT) {
+static void
+ngx_http_tnt_stats_record(void *data)
+{
+    ngx_http_request_t  *r = data;
 
-                    if (ngx_strncmp(type, "%on", sizeof("%on") - 1) == 0) {
-                        val->type = TP_INT;
-                        val->upsert_op = 1;
-                    } else if (ngx_strncmp(type, "%od", sizeof("%od") - 1) == 0) {
-                        val->type = TP_DOUBLE;
-                        val->upsert_op = 1;
-                    } else if (ngx_strncmp(type, "%of", sizeof("%of") - 1) == 0) {
-                        val->type = TP_FLOAT;
-                        val->upsert_op = 1;
-                    } else if (ngx_strncmp(type, "%os", sizeof("%os") - 1) == 0) {
-                        val->type = TP_STR;
-                        val->upsert_op = 1;
-                    } else if (ngx_strncmp(type, "%ob", sizeof("%ob") - 1) == 0) {
-                        val->type = TP_BOOL;
-                        val->upsert_op = 1;
-                    } else {
-                        goto unknown_format_error;
-                    }
+    u_char                     key[NGX_HTTP_TNT_STATS_NAME_LEN];
+    size_t                     len;
+    ngx_uint_t                 i, calls, status;
+    ngx_http_tnt_ctx_t         *ctx;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_conf_t  *sc;
+    ngx_http_tnt_stats_node_t  *node;
+    ngx_http_tnt_stats_time_t  *t;
+    ngx_http_upstream_state_t  *state;
 
-                } else {
-                    goto unknown_format_error;
-                }
-            }
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-            type = NULL;
-        }
+    /** The request could be redirected to another location */
+    if (tlcf->stats_zone == NULL) {
+        return;
     }
 
-    return NGX_CONF_OK;
+    node = ngx_http_tnt_stats_location(r, tlcf);
+    if (node == NULL) {
+        return;
+    }
 
-unknown_format_error:
-    return "unknown format has been found, "
-        "allowed %n,%d,%f,%s,%b,%lim,%off,%it,"
-        "%space_id,%idx_id,%kn,%kd,%kf,%ks";
-}
+    sc = tlcf->stats_zone->data;
 
+    (void) ngx_atomic_fetch_add(&node->requests, 1);
 
-static ngx_int_t
-ngx_http_tnt_tolower(int c)
-{
-    if (c >= 'A' && c <= 'Z') {
-        c ^= 0x20;
+    status = r->headers_out.status;
+    if (status >= 100 && status < 600) {
+        (void) ngx_atomic_fetch_add(&node->responses[status / 100 - 1], 1);
     }
-    return c;
-}
 
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-static ngx_str_t /* dst */
-ngx_http_tnt_urldecode(ngx_http_request_t *r, ngx_str_t *src)
-{
-    ngx_uint_t s;
-    u_char     c;
-    ngx_str_t  dst;
+    if (ctx != NULL) {
 
-    dst.len = 0;
-    dst.data = ngx_pnalloc(r->pool, src->len);
-    if (dst.data == NULL) {
-        return dst;
-    }
+        calls = ngx_max((ngx_uint_t) ctx->stats.replies, ctx->in_list.n);
+        calls = ngx_max(calls, ngx_max(ctx->bulk.n, ctx->tx.n));
 
-    s = 0;
-    while (s < src->len) {
+        if (calls > 1) {
+            (void) ngx_atomic_fetch_add(&node->batches, 1);
+            (void) ngx_atomic_fetch_add(&node->batch_calls, calls);
+        }
 
-        c = src->data[s++];
+        if (ctx->stats.transcoded_in || ctx->stats.transcoded_out) {
+            ngx_http_tnt_stats_hist_add(
+                    &node->hist[NGX_HTTP_TNT_STATS_TRANSCODE],
+                    ctx->stats.transcode_in + ctx->stats.transcode_out);
+        }
+    }
 
-        if (c == '%' && (ngx_uint_t) (s + 2) <= src->len) {
+    if (tlcf->hot_keys) {
 
-            u_char c2 = src->data[s++];
-            u_char c3 = src->data[s++];
+        len = ngx_http_tnt_hot_key(r, key);
 
-            if (isxdigit(c2) && isxdigit(c3)) {
+        if (len > 0) {
+            ngx_http_tnt_hot_add(sc, node, tlcf->hot_keys, key, len);
+        }
+    }
 
-                c2 = ngx_http_tnt_tolower(c2);
-                c3 = ngx_http_tnt_tolower(c3);
+    if (r->upstream_states == NULL) {
+        return;
+    }
 
-                if (c2 <= '9') {
-                    c2 = c2 - '0';
-                } else {
-                    c2 = c2 - 'a' + 10;
-                }
+    state = r->upstream_states->elts;
 
-                if (c3 <= '9') {
-                    c3 = c3 - '0';
-                } else {
-                    c3 = c3 - 'a' + 10;
-                }
+    for (i = 0; i < r->upstream_states->nelts; i++) {
 
-                dst.data[dst.len++] = 16 * c2 + c3;
+        if (state[i].peer == NULL) {
+            continue;
+        }
 
-            } else { /* %zz or something other invalid */
-                dst.data[dst.len++] = c;
-                dst.data[dst.len++] = c2;
-                dst.data[dst.len++] = c3;
-            }
+        t = NULL;
 
-        } else if (c == '+') {
-            dst.data[dst.len++] = ' ';
-        } else {
-            dst.data[dst.len++] = c;
+        if (ctx != NULL && ctx->stats.times != NULL
+            && i < ctx->stats.times->nelts)
+        {
+            t = (ngx_http_tnt_stats_time_t *) ctx->stats.times->elts + i;
         }
-    }
 
-    return dst;
+        ngx_http_tnt_stats_attempt(r, sc, node, &state[i], t);
+    }
 }
 
 
+/** The request is counted when its pool is destroyed, i.e. after it's
+ *  completed by any path: the upstream, tnt_fanout, tnt_multiplex, etc.
+ */
 static ngx_int_t
-ngx_http_tnt_unescape_uri(ngx_http_request_t *r, ngx_str_t *dst,
-        ngx_str_t *src)
+ngx_http_tnt_stats_init(ngx_http_request_t *r)
 {
-    dst->data = NULL;
-    dst->len = 0;
+    ngx_pool_cleanup_t  *cln;
 
-    *dst = ngx_http_tnt_urldecode(r, src);
+    /** An internal redirect enters the handler again. The ctx of the module
+     *  is cleared by the redirect, so the cleanup itself is looked for.
+     */
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_tnt_stats_record && cln->data == r) {
+            return NGX_OK;
+        }
+    }
 
-    if (dst->data == NULL) {
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
         return NGX_ERROR;
     }
 
+    cln->handler = ngx_http_tnt_stats_record;
+    cln->data = r;
+
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_format_init(ngx_http_tnt_loc_conf_t *conf,
-        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result)
+/** Sets a time of the current attempt of the upstream, the attempt is
+ *  the last of r->upstream_states.
+ */
+static void
+ngx_http_tnt_stats_timed(ngx_http_request_t *r, ngx_uint_t event)
 {
-    ngx_int_t                   rc;
-    ngx_uint_t                  i;
-    ngx_http_tnt_ctx_t          *ctx;
-    ngx_http_tnt_format_value_t *fmt_val, *conf_fmt_val;
+    uint64_t                   now;
+    ngx_uint_t                 n;
+    ngx_http_tnt_ctx_t         *ctx;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_time_t  *t;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-    memset(prepared_result, 0, sizeof(ngx_http_tnt_prepared_result_t));
+    if (tlcf->stats_zone == NULL || ctx == NULL
+        || r->upstream_states == NULL || r->upstream_states->nelts == 0)
+    {
+        return;
+    }
 
-    prepared_result->space_id = conf->space_id;
-    prepared_result->index_id = conf->index_id;
-    prepared_result->limit = conf->select_limit;
-    prepared_result->offset = conf->select_offset;
-    prepared_result->iter_type = conf->iter_type;
+    n = r->upstream_states->nelts;
 
-    if (conf->format_values == NULL) {
-        ctx->format_values = NULL;
-        return NGX_OK;
+    if (ctx->stats.times == NULL) {
+
+        ctx->stats.times = ngx_array_create(r->pool, n,
+                sizeof(ngx_http_tnt_stats_time_t));
+        if (ctx->stats.times == NULL) {
+            return;
+        }
     }
 
-    ctx->format_values = ngx_array_create(r->connection->pool, 1,
-                        sizeof(ngx_http_tnt_format_value_t));
-    if (ctx->format_values == NULL) {
-        return NGX_ERROR;
+    while (ctx->stats.times->nelts < n) {
+
+        t = ngx_array_push(ctx->stats.times);
+        if (t == NULL) {
+            return;
+        }
+
+        ngx_memzero(t, sizeof(ngx_http_tnt_stats_time_t));
     }
 
-    rc = ngx_http_tnt_format_read_input(r, &prepared_result->in);
-    if (rc != NGX_OK) {
-        return rc;
+    now = ngx_http_tnt_stats_clock(tlcf);
+
+    t = (ngx_http_tnt_stats_time_t *) ctx->stats.times->elts + n - 1;
+
+    /** The first attempt starts when the request has been created */
+    if (n == 1 && t->start == 0) {
+        t->start = ctx->stats.start;
     }
 
-    conf_fmt_val = conf->format_values->elts;
+    switch (event) {
 
-    for (i = 0; i < conf->format_values->nelts; ++i) {
+    /** reinit_request is called after the state of the next attempt is
+     *  added, so the previous attempt is over
+     */
+    case NGX_HTTP_TNT_STATS_RETRIED:
+        if (n > 1 && t[-1].end == 0) {
+            t[-1].end = now;
+        }
 
-        fmt_val = ngx_array_push(ctx->format_values);
-        if (fmt_val == NULL) {
-            return NGX_ERROR;
+        t->start = now;
+        break;
+
+    case NGX_HTTP_TNT_STATS_CONNECTED:
+        if (t->connected == 0) {
+            t->connected = now;
         }
+        break;
 
-        fmt_val->name = conf_fmt_val[i].name;
-        fmt_val->type = conf_fmt_val[i].type;
-        fmt_val->value.data = NULL;
-        fmt_val->value.len = 0;
-        fmt_val->update_key = conf_fmt_val[i].update_key;
-        fmt_val->upsert_op = conf_fmt_val[i].upsert_op;
+    default: /* NGX_HTTP_TNT_STATS_FINISHED */
+        t->end = now;
+        break;
     }
-
-    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_tnt_format_prepare(ngx_http_tnt_loc_conf_t *conf,
-        ngx_http_request_t *r, ngx_http_tnt_prepared_result_t *prepared_result)
+ngx_http_tnt_stats_create_request(ngx_http_request_t *r)
 {
-    enum {
-        NOTHING = 0,
-        EXPECTS_LIMIT = 2,
-        EXPECTS_OFFSET = 4,
-        EXPECTS_ITER_TYPE = 8,
-        EXPECTS_SPACE_ID = 16,
-        EXPECTS_INDEX_ID = 32,
-    };
-
-    u_char                     *arg_begin, *end;
-    ngx_http_tnt_next_arg_t    arg;
-    ngx_str_t                  key, value;
-    ngx_int_t                  tmp;
-    ngx_int_t                  expects;
-    ngx_int_t                  rc;
-    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_int_t                rc;
+    ngx_http_tnt_ctx_t       *ctx;
+    ngx_http_tnt_loc_conf_t  *tlcf;
 
-    expects = NOTHING;
-    arg.it = prepared_result->in.data;
-    arg_begin = arg.it;
-    end = arg.it + prepared_result->in.len;
-    arg.value = NULL;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-    if (conf->limit_name.len != 0) {
-        expects |= EXPECTS_LIMIT;
-    }
+    rc = ctx->stats.create_request(r);
 
-    if (conf->offset_name.len != 0) {
-        expects |= EXPECTS_OFFSET;
+    if (rc == NGX_OK) {
+        tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+        ctx->stats.start = ngx_http_tnt_stats_clock(tlcf);
     }
 
-    if (conf->iter_type_name.len != 0) {
-        expects |= EXPECTS_ITER_TYPE;
-    }
+    return rc;
+}
 
-    if (conf->space_id_name.len != 0) {
-        expects |= EXPECTS_SPACE_ID;
-    }
 
-    if (conf->index_id_name.len != 0) {
-        expects |= EXPECTS_INDEX_ID;
-    }
+#if (nginx_version >= 1013010)
 
-    for (; arg.it < end; ) {
+/** The request is written when the connection is established, so the first
+ *  write of an attempt is the end of its connect
+ */
+static ngx_int_t
+ngx_http_tnt_stats_output_filter(void *data, ngx_chain_t *in)
+{
+    ngx_http_request_t  *r = data;
 
+    ngx_http_tnt_stats_timed(r, NGX_HTTP_TNT_STATS_CONNECTED);
 
-        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+    return ngx_chain_writer(&r->upstream->writer, in);
+}
 
-        if (arg.value != NULL) {
+#endif
 
-            key.data = arg_begin;
-            key.len = arg.value - arg_begin;
 
-            value.data = arg.value;
-            value.len = arg.it - arg.value;
+/** The attempts of the upstream are timed in usec, the upstream states of
+ *  nginx have msec only. The request is created, written and finalized
+ *  through the hooks.
+ */
+static void
+ngx_http_tnt_stats_hook(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_tnt_ctx_t  *ctx;
 
-            if (expects & EXPECTS_LIMIT &&
-                    key.len == conf->limit_name.len &&
-                    ngx_strncmp(key.data, conf->limit_name.data,
-                                conf->limit_name.len) == 0)
-            {
-                prepared_result->limit = conf->select_limit_max;
-                tmp = ngx_atoi(value.data, value.len);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-                if (tmp >= 0) {
+    ctx->stats.create_request = u->create_request;
+    u->create_request = ngx_http_tnt_stats_create_request;
 
-                    if ((ngx_uint_t) tmp > conf->select_limit_max) {
-                        goto not_allowed;
-                    }
+#if (nginx_version >= 1013010)
+    /** nginx keeps the output filter of the module, see
+     *  ngx_http_upstream_init_request()
+     */
+    u->output.output_filter = ngx_http_tnt_stats_output_filter;
+    u->output.filter_ctx = r;
+#endif
+}
 
-                    prepared_result->limit = (ngx_uint_t) tmp;
 
-                    expects &= ~EXPECTS_LIMIT;
-                }
-            }
-            else if (expects & EXPECTS_OFFSET &&
-                    key.len == conf->offset_name.len &&
-                    ngx_strncmp(key.data, conf->offset_name.data,
-                                conf->offset_name.len) == 0)
-            {
-                tmp = ngx_atoi(value.data, value.len);
-                if (tmp >= 0) {
-                    prepared_result->offset = (ngx_uint_t) tmp;
-                    expects &= ~EXPECTS_OFFSET;
-                }
-            }
-            else if (expects & EXPECTS_ITER_TYPE &&
-                    key.len == conf->iter_type_name.len &&
-                    ngx_strncmp(key.data, conf->iter_type_name.data,
-                                conf->iter_type_name.len) == 0)
-            {
-                if (ngx_http_tnt_set_iter_type(&value, (ngx_uint_t *) &tmp) == NGX_OK) {
-                    prepared_result->iter_type = (ngx_uint_t) tmp;
-                    expects &= ~EXPECTS_ITER_TYPE;
-                }
-            }
-            else if (expects & EXPECTS_SPACE_ID &&
-                    key.len == conf->space_id_name.len &&
-                    ngx_strncmp(key.data, conf->space_id_name.data,
-                                conf->space_id_name.len) == 0)
-            {
-                tmp = ngx_atoi(value.data, value.len);
-                if (tmp >= 0) {
-                    prepared_result->space_id = (ngx_uint_t) tmp;
-                    expects &= ~EXPECTS_SPACE_ID;
-                }
-            }
-            else if (expects & EXPECTS_INDEX_ID &&
-                    key.len == conf->index_id_name.len &&
-                    ngx_strncmp(key.data, conf->index_id_name.data,
-                                conf->index_id_name.len) == 0)
-            {
-                tmp = ngx_atoi(value.data, value.len);
-                if (tmp >= 0) {
-                    prepared_result->index_id = (ngx_uint_t) tmp;
-                    expects &= ~EXPECTS_INDEX_ID;
-                }
-            }
-            else {
+/** JSON strings and Prometheus label values are escaped in the same way */
+static u_char *
+ngx_http_tnt_stats_escape(u_char *p, u_char *end, u_char *name, size_t len)
+{
+    u_char  *last;
 
-                rc = ngx_http_tnt_format_prepare_kv(r, prepared_result, &key,
-                        &value);
+    for (last = name + len; name < last && p < end - 1; name++) {
 
-                if (rc != NGX_OK) {
-                    return rc;
-                }
-            }
+        if (*name == '"' || *name == '\\') {
+            *p++ = '\\';
+            *p++ = *name;
 
+        } else {
+            *p++ = *name < 0x20 ? ' ' : *name;
         }
-
-        arg_begin = ++arg.it;
     }
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
-
-    rc = ngx_http_tnt_test_allowed(tlcf->allowed_spaces,
-            prepared_result->space_id);
-    if (rc != NGX_OK) {
-        goto not_allowed;
-    }
+    return p;
+}
 
-    rc = ngx_http_tnt_test_allowed(tlcf->allowed_indexes,
-            prepared_result->index_id);
-    if (rc != NGX_OK) {
-        goto not_allowed;
-    }
 
-    if (expects == NOTHING) {
-        return NGX_OK;
-    }
+static uint64_t
+ngx_http_tnt_stats_percentile(ngx_http_tnt_stats_hist_t *h,
+        ngx_atomic_uint_t count, ngx_uint_t pct)
+{
+    ngx_uint_t         i;
+    ngx_atomic_uint_t  n, target;
 
-    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_BAD_REQUEST,
-                ngx_http_tnt_get_error_text(DML_HANDLER_FMT_ERROR)->msg);
-    if (rc != NGX_OK) {
-        return rc;
-    }
+    target = (count * pct + 99) / 100;
+    n = 0;
 
-    return NGX_HTTP_BAD_REQUEST;
+    for (i = 0; i < NGX_HTTP_TNT_STATS_BUCKETS; i++) {
 
-not_allowed:
+        n += h->buckets[i];
 
-    rc = ngx_http_tnt_set_err_str(r, NGX_HTTP_NOT_ALLOWED,
-                ngx_http_tnt_get_error_text(
-                        DML_HANDLER_FMT_LIMIT_ERROR)->msg);
-    if (rc != NGX_OK) {
-        return rc;
+        if (n != 0 && n >= target) {
+            return ngx_http_tnt_stats_bucket_le(i);
+        }
     }
 
-    return NGX_HTTP_NOT_ALLOWED;
+    return 0;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_format_prepare_kv(ngx_http_request_t *r,
-        ngx_http_tnt_prepared_result_t *prepared_result,
-        ngx_str_t *key, ngx_str_t *value)
-{
-    ngx_uint_t                   i;
-    ngx_http_tnt_format_value_t  *fmt_val;
-    ngx_http_tnt_ctx_t           *ctx;
+static const char *ngx_http_tnt_stats_phases[] = {
+    "connect", "upstream", "transcode"
+};
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-    if (ctx->format_values == NULL) {
-        return NGX_OK;
+static u_char *
+ngx_http_tnt_stats_json_node(u_char *p, u_char *end,
+        ngx_http_tnt_stats_node_t *node)
+{
+    ngx_uint_t                 i;
+    ngx_atomic_uint_t          count;
+    ngx_http_tnt_stats_hist_t  *h;
+
+    p = ngx_slprintf(p, end, "\"");
+    p = ngx_http_tnt_stats_escape(p, end, node->name, node->len);
+
+    p = ngx_slprintf(p, end, "\":{\"requests\":%uA,\"responses\":{"
+                     "\"1xx\":%uA,\"2xx\":%uA,\"3xx\":%uA,\"4xx\":%uA,"
+                     "\"5xx\":%uA},\"errors\":{",
+                     node->requests, node->responses[0], node->responses[1],
+                     node->responses[2], node->responses[3],
+                     node->responses[4]);
+
+    for (i = 0; i < NGX_HTTP_TNT_STATS_CODES && node->codes[i].used; i++) {
+        p = ngx_slprintf(p, end, "\"%A\":%uA,", node->codes[i].code,
+                         node->codes[i].count);
     }
-    if (value->len == 0 && value->data == NULL) {
-        return NGX_OK;
+
+    p = ngx_slprintf(p, end, "\"other\":%uA},\"bytes_in\":%uA,"
+                     "\"bytes_out\":%uA,\"batches\":%uA,\"batch_calls\":%uA,"
+                     "\"limited\":%uA,\"latency\":{",
+                     node->other_codes, node->bytes_in, node->bytes_out,
+                     node->batches, node->batch_calls, node->limited);
+
+    for (i = 0; i < NGX_HTTP_TNT_STATS_PHASES; i++) {
+
+        h = &node->hist[i];
+        count = h->count;
+
+        p = ngx_slprintf(p, end, "%s\"%s\":{\"count\":%uA,\"sum\":%uA,"
+                         "\"p50\":%uL,\"p90\":%uL,\"p99\":%uL,\"max\":%uL}",
+                         i ? "," : "", ngx_http_tnt_stats_phases[i],
+                         count, h->sum,
+                         ngx_http_tnt_stats_percentile(h, count, 50),
+                         ngx_http_tnt_stats_percentile(h, count, 90),
+                         ngx_http_tnt_stats_percentile(h, count, 99),
+                         ngx_http_tnt_stats_percentile(h, count, 100));
+    }
+
+    p = ngx_slprintf(p, end, "}");
+
+    if (node->hot != NULL) {
+        p = ngx_slprintf(p, end, ",\"hot_keys\":");
+        p = ngx_http_tnt_hot_json(p, end, node->hot);
     }
 
-    fmt_val = ctx->format_values->elts;
+    return ngx_slprintf(p, end, "}");
+}
+
+
+static u_char *
+ngx_http_tnt_stats_json(u_char *p, u_char *end,
+        ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t n)
+{
+    ngx_uint_t  i, kind, first;
 
-    for (i = 0; i < ctx->format_values->nelts; i++) {
+    static const char  *names[] = { "locations", "peers" };
 
-        if (fmt_val[i].value.len != 0 || key->len != fmt_val[i].name.len) {
-            continue;
-        }
+    p = ngx_slprintf(p, end, "{");
 
-        if (ngx_strncmp(key->data, fmt_val[i].name.data,
-                    fmt_val[i].name.len) == 0) {
+    for (kind = 0; kind < 2; kind++) {
 
-            fmt_val[i].value = *value;
+        p = ngx_slprintf(p, end, "%s\"%s\":{", kind ? "," : "", names[kind]);
 
-            if (fmt_val[i].update_key) {
-                ++prepared_result->update_keys_count;
+        first = 1;
 
-            } else if (fmt_val[i].upsert_op) {
-                ++prepared_result->upsert_tuples_count;
+        for (i = 0; i < n; i++) {
 
-            } else {
+            if (sh->nodes[i].kind != kind) {
+                continue;
+            }
 
-                ++prepared_result->tuples_count;
+            if (!first) {
+                p = ngx_slprintf(p, end, ",");
             }
 
-            break;
+            first = 0;
+
+            p = ngx_http_tnt_stats_json_node(p, end, &sh->nodes[i]);
         }
+
+        p = ngx_slprintf(p, end, "}");
     }
 
-    return NGX_OK;
+    return ngx_slprintf(p, end, "}\n");
 }
 
 
+/** Prometheus wants the samples of a metric together, so the nodes are
+ *  iterated by each metric
+ */
 static u_char *
-ngx_http_tnt_read_next(ngx_str_t *str, u_char sep)
+ngx_http_tnt_stats_prometheus(u_char *p, u_char *end,
+        ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t n)
 {
-    u_char *beg = str->data;
-    u_char *end = str->data + str->len;
+    uint64_t                   le;
+    ngx_uint_t                 i, j, k, b, kind;
+    ngx_atomic_uint_t          count, cumulative;
+    ngx_http_tnt_stats_node_t  *node;
+    ngx_http_tnt_stats_hist_t  *h;
 
-    for (; str->data < end; ++str->data, --str->len) {
+    static const char  *kinds[] = { "location", "peer" };
 
-        if (*str->data == sep) {
-            ++str->data;
-            --str->len;
-            return beg;
-        }
-    }
+    enum {
+        REQUESTS = 0, RESPONSES, ERRORS, BYTES_IN, BYTES_OUT, BATCHES,
+        BATCH_CALLS, LIMITED, DURATION, METRICS
+    };
 
-    return NULL;
-}
+    static const char  *metrics[][3] = {
+        { "requests_total", "counter", "Requests" },
+        { "responses_total", "counter", "Responses by status" },
+        { "errors_total", "counter", "JSON-RPC errors by code" },
+        { "received_bytes_total", "counter", "Bytes from Tarantool" },
+        { "sent_bytes_total", "counter", "Bytes to Tarantool" },
+        { "batches_total", "counter", "Requests of more than one call" },
+        { "batch_calls_total", "counter", "Calls of the batches" },
+        { "limited_total", "counter", "Requests stopped by the limits" },
+        { "duration_seconds", "histogram", "Duration of a phase" }
+    };
 
-static ngx_int_t
-ngx_http_tnt_format_bind_bad_request(ngx_http_request_t *r, ngx_str_t *name,
-        const char *msg)
-{
-    ngx_int_t  rc;
-    u_char     err_msg[64];
+    for (kind = 0; kind < 2; kind++) {
 
-    if (msg == NULL) {
-        snprintf((char *) err_msg, sizeof(err_msg), "'%.*s' is invalid",
-                (int) name->len, (char *) name->data);
-    } else {
-         snprintf((char *) err_msg, sizeof(err_msg), "'%.*s' is invalid. %s",
-                (int) name->len, (char *) name->data, msg);
-    }
+        for (j = 0; j < METRICS; j++) {
 
-    rc = ngx_http_tnt_set_err(r, NGX_HTTP_BAD_REQUEST, err_msg,
-            ngx_strlen(err_msg));
-    if (rc != NGX_OK) {
-        return rc;
-    }
+            p = ngx_slprintf(p, end,
+                             "# HELP tnt_%s_%s %s\n# TYPE tnt_%s_%s %s\n",
+                             kinds[kind], metrics[j][0], metrics[j][2],
+                             kinds[kind], metrics[j][0], metrics[j][1]);
 
-    return NGX_HTTP_BAD_REQUEST;
-}
+            for (i = 0; i < n; i++) {
 
+                node = &sh->nodes[i];
 
-static ngx_int_t
-ngx_http_tnt_format_bind_operation(ngx_http_request_t *r, struct tp *tp,
-        ngx_str_t *name, ngx_str_t *val)
-{
-    u_char      *update_operation, *filedno_pt, *filedno_pt_end;
-    ngx_int_t   filedno;
+                if (node->kind != kind) {
+                    continue;
+                }
 
-    update_operation = ngx_http_tnt_read_next(val, ',');
+                switch (j) {
+
+                case RESPONSES:
+                    for (k = 0; k < 5; k++) {
+                        p = ngx_slprintf(p, end, "tnt_%s_%s{%s=\"",
+                                         kinds[kind], metrics[j][0],
+                                         kinds[kind]);
+                        p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                      node->len);
+                        p = ngx_slprintf(p, end, "\",status=\"%uixx\"} %uA\n",
+                                         k + 1, node->responses[k]);
+                    }
+                    break;
 
-    if (update_operation == NULL) {
-        goto no_operation_type;
-    }
+                case ERRORS:
+                    for (k = 0; k <= NGX_HTTP_TNT_STATS_CODES; k++) {
+
+                        if (k < NGX_HTTP_TNT_STATS_CODES
+                            && !node->codes[k].used)
+                        {
+                            k = NGX_HTTP_TNT_STATS_CODES;
+                        }
+
+                        p = ngx_slprintf(p, end, "tnt_%s_%s{%s=\"",
+                                         kinds[kind], metrics[j][0],
+                                         kinds[kind]);
+                        p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                      node->len);
+
+                        if (k == NGX_HTTP_TNT_STATS_CODES) {
+                            p = ngx_slprintf(p, end,
+                                             "\",code=\"other\"} %uA\n",
+                                             node->other_codes);
+                        } else {
+                            p = ngx_slprintf(p, end, "\",code=\"%A\"} %uA\n",
+                                             node->codes[k].code,
+                                             node->codes[k].count);
+                        }
+                    }
+                    break;
 
-    switch (*update_operation) {
-    case '=':
-    case '!':
-    case '+':
-    case '-':
-    case '&':
-    case '^':
-    case '|':
-    case '#':
-        break;
-    default:
-        goto no_operation_type;
+                case DURATION:
+                    for (k = 0; k < NGX_HTTP_TNT_STATS_PHASES; k++) {
+
+                        h = &node->hist[k];
+                        count = h->count;
+                        cumulative = 0;
+
+                        for (b = 0; b < NGX_HTTP_TNT_STATS_BUCKETS; b++) {
+
+                            if (h->buckets[b] == 0) {
+                                continue;
+                            }
+
+                            cumulative += h->buckets[b];
+                            le = ngx_http_tnt_stats_bucket_le(b);
+
+                            p = ngx_slprintf(p, end, "tnt_%s_%s_bucket{%s=\"",
+                                             kinds[kind], metrics[j][0],
+                                             kinds[kind]);
+                            p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                          node->len);
+                            p = ngx_slprintf(p, end,
+                                    "\",phase=\"%s\",le=\"%uL.%06uL\"} %uA\n",
+                                    ngx_http_tnt_stats_phases[k],
+                                    le / 1000000, le % 1000000, cumulative);
+                        }
+
+                        p = ngx_slprintf(p, end, "tnt_%s_%s_bucket{%s=\"",
+                                         kinds[kind], metrics[j][0],
+                                         kinds[kind]);
+                        p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                      node->len);
+                        p = ngx_slprintf(p, end,
+                                         "\",phase=\"%s\",le=\"+Inf\"} %uA\n",
+                                         ngx_http_tnt_stats_phases[k],
+                                         ngx_max(count, cumulative));
+
+                        p = ngx_slprintf(p, end, "tnt_%s_%s_sum{%s=\"",
+                                         kinds[kind], metrics[j][0],
+                                         kinds[kind]);
+                        p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                      node->len);
+                        p = ngx_slprintf(p, end,
+                                         "\",phase=\"%s\"} %uA.%06uA\n",
+                                         ngx_http_tnt_stats_phases[k],
+                                         h->sum / 1000000, h->sum % 1000000);
+
+                        p = ngx_slprintf(p, end, "tnt_%s_%s_count{%s=\"",
+                                         kinds[kind], metrics[j][0],
+                                         kinds[kind]);
+                        p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                      node->len);
+                        p = ngx_slprintf(p, end, "\",phase=\"%s\"} %uA\n",
+                                         ngx_http_tnt_stats_phases[k],
+                                         ngx_max(count, cumulative));
+                    }
+                    break;
+
+                default:
+                    p = ngx_slprintf(p, end, "tnt_%s_%s{%s=\"",
+                                     kinds[kind], metrics[j][0], kinds[kind]);
+                    p = ngx_http_tnt_stats_escape(p, end, node->name,
+                                                  node->len);
+                    p = ngx_slprintf(p, end, "\"} %uA\n",
+                            j == REQUESTS ? node->requests
+                            : j == BYTES_IN ? node->bytes_in
+                            : j == BYTES_OUT ? node->bytes_out
+                            : j == BATCHES ? node->batches
+                            : j == BATCH_CALLS ? node->batch_calls
+                            : node->limited);
+                    break;
+                }
+            }
+        }
     }
 
-    filedno_pt = ngx_http_tnt_read_next(val, ',');
-    filedno_pt_end = (val->data - 1);
+    return ngx_http_tnt_hot_prometheus(p, end, sh, n);
+}
 
-    if (filedno_pt == NULL || (size_t) (filedno_pt_end - filedno_pt) == 0) {
-        goto no_fieldno;
-    }
 
-    filedno = ngx_atoi(filedno_pt, (size_t) (filedno_pt_end - filedno_pt));
-    if (filedno < 0 || filedno - 1 < 0) {
-        goto no_fieldno;
-    }
-    filedno -= 1;
+/** The maximal size of the output, a line of a metric is less than 256
+ *  bytes
+ */
+static size_t
+ngx_http_tnt_stats_size(ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t n)
+{
+    size_t      lines;
+    ngx_uint_t  i, k, b;
 
-    if (tp_op(tp, *update_operation, (uint32_t) filedno) == NULL) {
-        return NGX_ERROR;
-    }
+    lines = 64;
 
-    return NGX_OK;
+    for (i = 0; i < n; i++) {
 
-no_operation_type:
-    return ngx_http_tnt_format_bind_bad_request( r, name,
-            "Operation type is expecting");
+        lines += 32 + NGX_HTTP_TNT_STATS_CODES;
 
-no_fieldno:
-    return ngx_http_tnt_format_bind_bad_request( r, name,
-            "Fieldno is expecting");
+        /** A line of a hot key can take two */
+        if (sh->nodes[i].hot != NULL) {
+            lines += 4 * NGX_HTTP_TNT_HOT_TOP_MAX;
+        }
+
+        for (k = 0; k < NGX_HTTP_TNT_STATS_PHASES; k++) {
+            for (b = 0; b < NGX_HTTP_TNT_STATS_BUCKETS; b++) {
+                lines += sh->nodes[i].hist[k].buckets[b] != 0;
+            }
+        }
+    }
+
+    return lines * 256;
 }
 
 
 static ngx_int_t
-ngx_http_tnt_format_bind(ngx_http_request_t *r,
-        ngx_http_tnt_prepared_result_t *prepared_result, struct tp *tp)
+ngx_http_tnt_status_handler(ngx_http_request_t *r)
 {
-    ngx_int_t                    rc;
-    ngx_str_t                    *value;
-    ngx_uint_t                   i;
-    ngx_http_tnt_format_value_t  *fmt_val;
-    ngx_http_tnt_ctx_t           *ctx;
-    ngx_http_tnt_loc_conf_t      *tlcf;
-    ngx_int_t                    update_started;
-    ngx_int_t                    upsert_add_ops_started;
-    char                         num_buf[16];
-
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    ngx_int_t                  rc;
+    ngx_uint_t                 n, prometheus;
+    ngx_str_t                  format;
+    ngx_buf_t                  *b;
+    ngx_chain_t                out;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_conf_t  *sc;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
 
-    if (ctx->format_values == NULL) {
-        return NGX_OK;
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    update_started = 0;
-    upsert_add_ops_started = 0;
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-    fmt_val = ctx->format_values->elts;
+    sc = ngx_http_tnt_stats_get_conf(r->connection->log, tlcf->status_zone);
+    if (sc == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    for (i = 0; i < ctx->format_values->nelts; i++) {
+    prometheus = ngx_http_arg(r, (u_char *) "format", sizeof("format") - 1,
+                              &format) == NGX_OK
+                 && format.len == sizeof("prometheus") - 1
+                 && ngx_strncmp(format.data, "prometheus", format.len) == 0;
 
-        value = &fmt_val[i].value;
+    n = sc->sh->n;
+    ngx_memory_barrier();
 
-        if (value->len == 0 && value->data == NULL) {
-            continue;
-        }
+    b = ngx_create_temp_buf(r->pool, ngx_http_tnt_stats_size(sc->sh, n));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        /** Update {{{ */
-        if (tlcf->req_type == TP_UPDATE) {
+    if (prometheus) {
+        b->last = ngx_http_tnt_stats_prometheus(b->pos, b->end, sc->sh, n);
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
 
-            if (!update_started && !fmt_val[i].update_key) {
+    } else {
+        b->last = ngx_http_tnt_stats_json(b->pos, b->end, sc->sh, n);
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
 
-                if (tp_updatebegin(tp,
-                        (uint32_t) prepared_result->tuples_count)
-                            == NULL)
-                {
-                    goto oom;
-                }
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
 
-                update_started = 1;
-            }
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
-            if (update_started) {
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
-                rc = ngx_http_tnt_format_bind_operation(r, tp,
-                        &fmt_val[i].name, value);
-                if (rc == NGX_ERROR) {
-                    goto oom;
-                } else if (rc != NGX_OK) {
-                    return rc;
-                }
-            }
-        }
-        /* }}} */
+    out.buf = b;
+    out.next = NULL;
 
-        /** Upsert {{{ */
-        if (tlcf->req_type == TP_UPSERT && fmt_val[i].upsert_op) {
+    return ngx_http_output_filter(r, &out);
+}
 
-            if (!upsert_add_ops_started) {
 
-                if (tp_upsertbegin_add_ops(tp,
-                        (uint32_t) prepared_result->upsert_tuples_count)
-                            == NULL)
-                {
-                    goto oom;
-                }
+/** $tnt_transcode_in_time and $tnt_transcode_out_time, in seconds with
+ *  microsecond resolution
+ */
+static ngx_int_t
+ngx_http_tnt_time_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char              *p;
+    uint64_t            usec;
+    ngx_uint_t          timed;
+    ngx_http_tnt_ctx_t  *ctx;
 
-                upsert_add_ops_started = 1;
-            }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-                rc = ngx_http_tnt_format_bind_operation(r, tp,
-                    &fmt_val[i].name, value);
-            if (rc == NGX_ERROR) {
-                goto oom;
-            } else if (rc != NGX_OK) {
-                return rc;
-            }
-        }
-        /* }}} */
+    timed = data == offsetof(ngx_http_tnt_ctx_t, stats.transcode_in)
+            ? ctx->stats.transcoded_in : ctx->stats.transcoded_out;
+    if (!timed) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-        switch (fmt_val[i].type) {
-        case TP_BOOL:
-            if (value->len == sizeof("true") - 1 &&
-                    ngx_strncasecmp(value->data,
-                        (u_char *) "true", sizeof("true") - 1) == 0)
-            {
-                if (tp_encode_bool(tp, true) == NULL) {
-                    goto oom;
-                }
-            } else if (value->len == sizeof("false") - 1 &&
-                ngx_strncasecmp(value->data,
-                            (u_char *) "false", sizeof("false") - 1) == 0)
-            {
-                if (tp_encode_bool(tp, false) == NULL) {
-                    goto oom;
-                }
-            }
-            else {
-                return ngx_http_tnt_format_bind_bad_request(
-                        r, &fmt_val[i].name, "True/False is expecting.");
-            }
+    usec = *(uint64_t *) ((char *) ctx + data);
 
-            break;
-        case TP_INT:
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN + sizeof(".000000") - 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-            snprintf(num_buf, sizeof(num_buf), "%.*s",
-                    (int) value->len, (char *) value->data);
+    v->len = ngx_sprintf(p, "%uL.%06uL", usec / 1000000, usec % 1000000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-            if (*value->data == '-') {
+    return NGX_OK;
+}
 
-                if (tp_encode_int(tp, (int64_t) atoll(num_buf)) == NULL) {
-                    goto oom;
-                }
 
-            } else if (tp_encode_uint(tp, (int64_t) atoll(num_buf)) == NULL) {
-                goto oom;
-            }
+/** $tnt_upstream_payload_size, $tnt_reply_json_size and $tnt_batch_size */
+static ngx_int_t
+ngx_http_tnt_size_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char              *p;
+    ngx_http_tnt_ctx_t  *ctx;
 
-            break;
-        case TP_DOUBLE:
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-            snprintf((char *) num_buf, sizeof(num_buf), "%.*s",
-                    (int) value->len, (char *) value->data);
+    p = ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-            if (tp_encode_double(tp, atof(num_buf)) == NULL) {
-                goto oom;
-            }
+    v->len = ngx_sprintf(p, "%uz", *(size_t *) ((char *) ctx + data)) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-            break;
-        case TP_FLOAT:
+    return NGX_OK;
+}
 
-            snprintf((char *) num_buf, sizeof(num_buf), "%.*s",
-                    (int) value->len, (char *) value->data);
 
-            if (tp_encode_double(tp, (float) atof(num_buf)) == NULL) {
-                goto oom;
-            }
+/** $tnt_sync, the sync of the last reply of Tarantool */
+static ngx_int_t
+ngx_http_tnt_sync_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char              *p;
+    ngx_http_tnt_ctx_t  *ctx;
 
-            break;
-        case TP_STR:
-            if (tp_encode_str(tp, (const char *) value->data,
-                        value->len) == NULL)
-            {
-                goto oom;
-            }
-            break;
-        default:
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "Can't issue the query, error = 'unknown type %d'",
-                (int) fmt_val[i].type);
-            return NGX_ERROR;
-        }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL || !ctx->stats.has_sync) {
+        v->not_found = 1;
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    p = ngx_pnalloc(r->pool, NGX_INT64_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
-oom:
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "Can't issue the query, error = '%V'",
-            &ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE)->msg);
+    v->len = ngx_sprintf(p, "%uL", ctx->stats.sync) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
-    return NGX_ERROR;
+    return NGX_OK;
 }
 
 
+/** $tnt_error_code, the code of the error reply of the module */
 static ngx_int_t
-ngx_http_tnt_add_header_in(ngx_http_request_t *r,
-        ngx_http_tnt_header_val_t *hv, ngx_str_t *value)
+ngx_http_tnt_error_code_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_table_elt_t  *h;
-
-    if (value->len) {
+    u_char              *p;
+    ngx_http_tnt_ctx_t  *ctx;
 
-        h = ngx_list_push(&r->headers_in.headers);
-        if (h == NULL) {
-            return NGX_ERROR;
-        }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL || !ctx->stats.has_error) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
 
-        h->hash = 1;
-        h->key = hv->key;
-        h->value = *value;
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
     }
 
+    v->len = ngx_sprintf(p, "%i", ctx->stats.error_code) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
     return NGX_OK;
 }
+/** }}}
+ */
 
 
+/** Slow log {{{
+ */
 static ngx_int_t
-ngx_http_tnt_process_headers(ngx_http_request_t *r,
-        ngx_http_tnt_loc_conf_t *tlcf)
+ngx_http_tnt_slowlog_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_uint_t                i;
-    ngx_str_t                 value;
-    ngx_http_tnt_header_val_t *h;
+    ngx_http_tnt_slowlog_conf_t  *olc = data;
 
-    if (tlcf->headers == NULL) {
+    size_t                       len, entry_size;
+    ngx_uint_t                   n;
+    ngx_http_tnt_slowlog_conf_t  *lc;
+
+    lc = shm_zone->data;
+
+    /** The sample size of the zone is kept until it's recreated */
+    if (olc) {
+        lc->shpool = olc->shpool;
+        lc->sh = olc->sh;
         return NGX_OK;
     }
 
-    h = tlcf->headers->elts;
+    lc->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    for (i = 0; i < tlcf->headers->nelts; i++) {
+    if (shm_zone->shm.exists) {
+        lc->sh = lc->shpool->data;
+        return NGX_OK;
+    }
 
-        if (ngx_http_complex_value(r, &h[i].value, &value) != NGX_OK) {
+    len = sizeof(" in tnt_slowlog_zone \"\"") + shm_zone->shm.name.len;
+
+    lc->shpool->log_ctx = ngx_slab_alloc(lc->shpool, len);
+    if (lc->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(lc->shpool->log_ctx, " in tnt_slowlog_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    entry_size = ngx_align(offsetof(ngx_http_tnt_slowlog_entry_t, data)
+                           + 2 * lc->sample, NGX_ALIGNMENT);
+
+    /** The entries take the rest of the zone */
+    n = shm_zone->shm.size / entry_size;
+
+    lc->shpool->log_nomem = 0;
+
+    for ( ;; ) {
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                    "tnt_slowlog_zone \"%V\" is too small",
+                    &shm_zone->shm.name);
             return NGX_ERROR;
         }
 
-        if (h[i].handler(r, &h[i], &value) != NGX_OK) {
-            return NGX_ERROR;
+        lc->sh = ngx_slab_calloc(lc->shpool,
+                offsetof(ngx_http_tnt_slowlog_shctx_t, entries)
+                + n * entry_size);
+        if (lc->sh != NULL) {
+            break;
         }
+
+        n -= n / 8 + 1;
     }
 
+    lc->shpool->log_nomem = 1;
+
+    lc->sh->max = n;
+    lc->sh->sample = lc->sample;
+    lc->sh->entry_size = entry_size;
+    lc->shpool->data = lc->sh;
+
     return NGX_OK;
 }
 
 
 static char *
-ngx_http_tnt_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_tnt_slowlog_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_tnt_loc_conf_t *tlcf = conf;
+    u_char                       *p;
+    ssize_t                      size, sample;
+    ngx_str_t                    *value, name, s;
+    ngx_http_tnt_slowlog_conf_t  *lc;
 
-    ngx_str_t                 *value;
-    ngx_url_t                 u;
-    ngx_http_core_loc_conf_t  *clcf;
+    value = cf->args->elts;
 
-    if (tlcf->upstream.upstream) {
-        return "is duplicate";
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL) {
+        goto invalid;
     }
 
-    value = cf->args->elts;
+    name.data = value[1].data;
+    name.len = p - name.data;
 
-    ngx_memzero(&u, sizeof(ngx_url_t));
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
 
-    u.url = value[1];
-    u.no_resolve = 1;
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || name.len == 0) {
+        goto invalid;
+    }
 
-    tlcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
-    if (tlcf->upstream.upstream == NULL) {
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
         return NGX_CONF_ERROR;
     }
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    sample = 0;
 
-    clcf->handler = ngx_http_tnt_handler;
+    if (cf->args->nelts == 3) {
 
-    if (clcf->name.data[clcf->name.len - 1] == '/') {
-        clcf->auto_redirect = 1;
+        if (ngx_strncmp(value[2].data, "sample=", sizeof("sample=") - 1)
+                != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + sizeof("sample=") - 1;
+        s.len = value[2].len - (sizeof("sample=") - 1);
+
+        sample = ngx_parse_size(&s);
+        if (sample == NGX_ERROR || sample > size / 16) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid sample \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    lc = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_slowlog_conf_t));
+    if (lc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lc->sample = (size_t) sample;
+
+    lc->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                         &ngx_http_tnt_module);
+    if (lc->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lc->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
     }
 
+    lc->shm_zone->init = ngx_http_tnt_slowlog_init_zone;
+    lc->shm_zone->data = lc;
+
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid zone \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
 }
-/** }}}
- */
 
 
-/** Filters {{{
+/** The zone of tnt_slowlog and tnt_slowlog_status can be defined later, it's
+ *  checked by ngx_http_tnt_slowlog_get_conf()
  */
-static ngx_int_t
-ngx_http_tnt_filter_init(void *data)
+static ngx_shm_zone_t *
+ngx_http_tnt_slowlog_ref(ngx_conf_t *cf, ngx_str_t *name)
 {
-    dd("init filter");
-
-    ngx_http_request_t  *r = data;
-    ngx_http_upstream_t *u = r->upstream;
-    ngx_http_tnt_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    ngx_shm_zone_t  *shm_zone;
 
-    ctx->state = READ_PAYLOAD;
-    ctx->payload_size = ctx->rest = 0;
+    shm_zone = ngx_shared_memory_add(cf, name, 0, &ngx_http_tnt_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
 
-    if (u->headers_in.status_n != 200) {
-        u->length = 0;
-    } else {
-        u->length = -1;
+    if (shm_zone->init != NULL
+        && shm_zone->init != ngx_http_tnt_slowlog_init_zone)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" isn't a tnt_slowlog_zone", name);
+        return NULL;
     }
 
-    return NGX_OK;
+    return shm_zone;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_send_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
-        ngx_http_tnt_ctx_t *ctx)
+static char *
+ngx_http_tnt_slowlog(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    tp_transcode_t          tc;
-    ngx_int_t               rc;
-    ngx_http_tnt_loc_conf_t *tlcf;
-    ngx_buf_t               *output;
-    size_t                  output_size;
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    ngx_str_t   *value, s;
+    ngx_uint_t  i;
 
-    output_size =
-        (ctx->tp_cache->end - ctx->tp_cache->start + ngx_http_tnt_overhead())
-        * tlcf->out_multiplier;
-    output = ngx_http_tnt_create_mem_buf(r, u, output_size);
-    if (output == NULL) {
-        return NGX_ERROR;
+    if (tlcf->slowlog_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    if (ctx->batch_size > 0
-        && ctx->rest_batch_size == ctx->batch_size)
-    {
-        *output->pos = '[';
-        ++output->pos;
-    }
+    value = cf->args->elts;
 
-    tp_transcode_init_args_t args = {
-        .output = (char *) output->pos,
-        .output_size = output->end - output->pos,
-        .method = NULL, .method_len = 0,
-        .codec = TP_REPLY_TO_JSON,
-        .mf = NULL
-    };
+    if (ngx_strcmp(value[1].data, "off") == 0) {
 
-    rc = tp_transcode_init(&tc, &args);
-    if (rc == TP_TRANSCODE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                "[BUG] failed to call tp_transcode_init(output)");
-        return NGX_ERROR;
+        if (cf->args->nelts > 2) {
+            return "has parameters with \"off\"";
+        }
+
+        tlcf->slowlog_zone = NULL;
+        return NGX_CONF_OK;
     }
 
-    tp_reply_to_json_set_options(&tc, tlcf->pure_result == NGX_TNT_CONF_ON,
-            tlcf->multireturn_skip_count);
+    tlcf->slowlog_zone = ngx_http_tnt_slowlog_ref(cf, &value[1]);
+    if (tlcf->slowlog_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    rc = tp_transcode(&tc, (char *)ctx->tp_cache->start,
-                      ctx->tp_cache->end - ctx->tp_cache->start);
-    if (rc != TP_TRANSCODE_ERROR) {
+    tlcf->slowlog_time = 0;
+    tlcf->slowlog_size = 0;
 
-        /* Finishing */
-        size_t complete_msg_size = 0;
-        rc = tp_transcode_complete(&tc, &complete_msg_size);
-        if (rc == TP_TRANSCODE_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "[BUG] failed to complete output transcoding. "
-                    "UNKNOWN ERROR");
-            goto error_exit;
-        }
+    for (i = 2; i < cf->args->nelts; i++) {
 
-        /* Send an error to the client */
-        if (rc == TP_TNT_ERROR) {
-            ngx_pfree(r->pool, output);
+        if (ngx_strncmp(value[i].data, "time=", sizeof("time=") - 1) == 0) {
 
-            if (ngx_http_tnt_set_err(r, tc.errcode,
-                    (u_char *) tc.errmsg, ngx_strlen(tc.errmsg)) != NGX_OK)
-            {
-                goto error_exit;
+            s.data = value[i].data + sizeof("time=") - 1;
+            s.len = value[i].len - (sizeof("time=") - 1);
+
+            tlcf->slowlog_time = ngx_parse_time(&s, 0);
+            if (tlcf->slowlog_time == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
             }
-        } else {
-            output->last = output->pos + complete_msg_size;
+
+            continue;
         }
-    }
-    /** Transcoder down */
-    else {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "[BUG] failed to transcode output. errcode: '%d', errmsg: '%s'",
-            tc.errcode, get_str_safe((const u_char *) tc.errmsg));
-        goto error_exit;
-    }
 
-    /** Transcoding - OK */
-    tp_transcode_free(&tc);
+        if (ngx_strncmp(value[i].data, "size=", sizeof("size=") - 1) == 0) {
 
-    if (ctx->batch_size > 0) {
+            s.data = value[i].data + sizeof("size=") - 1;
+            s.len = value[i].len - (sizeof("size=") - 1);
 
-        if (ctx->rest_batch_size == 1)
-        {
-            *output->last = ']';
-            ++output->last;
-        }
-        else if (ctx->rest_batch_size <= ctx->batch_size)
-        {
-            *output->last = ',';
-            ++output->last;
+            tlcf->slowlog_size = ngx_parse_size(&s);
+            if (tlcf->slowlog_size == (size_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
         }
+
+        goto invalid;
     }
 
-    /** Reply was created in the ngx_http_tnt_output_err.
-     *  That means we don't need the 'output' buffer.
-     */
-    if (ctx->in_err != NULL) {
-        return NGX_OK;
+    if (cf->args->nelts == 2) {
+        tlcf->slowlog_time = 1000;
     }
 
-    return ngx_http_tnt_output(r, u, output);
+    return NGX_CONF_OK;
 
-error_exit:
+invalid:
 
-    if (output) {
-        ngx_pfree(r->pool, output);
-    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
 
-    tp_transcode_free(&tc);
 
-    return NGX_ERROR;
-}
+static ngx_int_t ngx_http_tnt_slowlog_status_handler(ngx_http_request_t *r);
 
 
-static ngx_int_t
-ngx_http_tnt_filter_reply(ngx_http_request_t *r, ngx_http_upstream_t *u,
-        ngx_buf_t *b)
+static char *
+ngx_http_tnt_slowlog_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_int_t          rc;
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
 
-    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
-    ssize_t            bytes = b->last - b->pos;
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    dd("filter_reply -> recv bytes: %i, rest: %i",
-            (int) bytes, (int) ctx->rest);
+    if (tlcf->slowlog_status_zone != NULL) {
+        return "is duplicate";
+    }
 
-    if (ctx->state == READ_PAYLOAD) {
+    value = cf->args->elts;
 
-        ssize_t payload_rest = ngx_min(ctx->payload.e - ctx->payload.p, bytes);
+    tlcf->slowlog_status_zone = ngx_http_tnt_slowlog_ref(cf, &value[1]);
+    if (tlcf->slowlog_status_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-        if (payload_rest > 0) {
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_tnt_slowlog_status_handler;
 
-            ctx->payload.p = ngx_copy(ctx->payload.p, b->pos, payload_rest);
-            bytes -= payload_rest;
-            b->pos += payload_rest;
-            payload_rest = ctx->payload.e - ctx->payload.p;
+    return NGX_CONF_OK;
+}
+
+
+static ngx_http_tnt_slowlog_conf_t *
+ngx_http_tnt_slowlog_get_conf(ngx_log_t *log, ngx_shm_zone_t *shm_zone)
+{
+    if (shm_zone->init != ngx_http_tnt_slowlog_init_zone) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "zone \"%V\" isn't a tnt_slowlog_zone", &shm_zone->shm.name);
+        return NULL;
+    }
 
-            dd("filter_reply -> payload rest:%i", (int) payload_rest);
-        }
+    return shm_zone->data;
+}
 
-        if (payload_rest == 0) {
 
-            ctx->payload_size = tp_read_payload((char *) &ctx->payload.mem[0],
-                                                (char *) ctx->payload.e);
-            if (ctx->payload_size <= 0) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                        "[BUG] tp_read_payload failed, ret:%i",
-                        (int) ctx->payload_size);
-                return NGX_ERROR;
-            }
+/** Keeps the first bytes of the first reply, the reply is freed after it's
+ *  transcoded and it's unknown yet if the request is slow
+ */
+static void
+ngx_http_tnt_slowlog_sample(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_http_tnt_ctx_t *ctx)
+{
+    size_t                       len;
+    ngx_http_tnt_slowlog_conf_t  *lc;
 
-            ctx->rest = ctx->payload_size - 5 /* - header size */;
+    lc = ngx_http_tnt_slowlog_get_conf(r->connection->log,
+                                       tlcf->slowlog_zone);
+    if (lc == NULL) {
+        return;
+    }
 
-            dd("filter_reply -> got header payload:%i, rest:%i",
-                    (int) ctx->payload_size,
-                    (int) ctx->rest);
+    len = ngx_min(lc->sh->sample,
+                  (size_t) (ctx->tp_cache->pos - ctx->tp_cache->start));
+    if (len == 0) {
+        return;
+    }
 
-            ctx->tp_cache = ngx_create_temp_buf(r->pool, ctx->payload_size);
-            if (ctx->tp_cache == NULL) {
-                return NGX_ERROR;
-            }
+    ctx->stats.reply.data = ngx_pnalloc(r->pool, len);
+    if (ctx->stats.reply.data == NULL) {
+        return;
+    }
 
-            ctx->tp_cache->pos = ctx->tp_cache->start;
-            ctx->tp_cache->memory = 1;
+    ngx_memcpy(ctx->stats.reply.data, ctx->tp_cache->start, len);
+    ctx->stats.reply.len = len;
+}
 
 
-            ctx->tp_cache->pos = ngx_copy(ctx->tp_cache->pos,
-                                          &ctx->payload.mem[0],
-                                          sizeof(ctx->payload.mem) - 1);
+static size_t
+ngx_http_tnt_slowlog_copy(u_char *dst, size_t size, u_char *src, size_t len)
+{
+    len = ngx_min(len, size);
 
-            ctx->payload.p = &ctx->payload.mem[0];
+    ngx_memcpy(dst, src, len);
 
-            ctx->state = READ_BODY;
+    return len;
+}
 
-        } else {
-            return NGX_OK;
-        }
-    }
 
-    rc = NGX_OK;
+static void
+ngx_http_tnt_slowlog_record(void *data)
+{
+    ngx_http_request_t  *r = data;
 
-    if (ctx->state == READ_BODY) {
+    u_char                        *p;
+    size_t                        len;
+    ngx_msec_int_t                ms;
+    ngx_time_t                    *now;
+    ngx_chain_t                   *cl;
+    ngx_http_tnt_ctx_t            *ctx;
+    ngx_http_tnt_loc_conf_t       *tlcf;
+    ngx_http_upstream_state_t     *state;
+    ngx_http_tnt_slowlog_conf_t   *lc;
+    ngx_http_tnt_slowlog_entry_t  *e;
+    ngx_http_tnt_slowlog_shctx_t  *sh;
 
-        ssize_t rest = ctx->rest - bytes, read_on = bytes;
-        if (rest < 0) {
-            rest *= -1;
-            read_on = bytes - rest;
-            ctx->rest = 0;
-            ctx->state = SEND_REPLY;
-            rc = NGX_AGAIN;
-        } else if (rest == 0) {
-            ctx->state = SEND_REPLY;
-            ctx->rest = 0;
-        } else {
-            ctx->rest -= bytes;
-        }
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-        ctx->tp_cache->pos = ngx_copy(ctx->tp_cache->pos, b->pos, read_on);
-        b->pos += read_on;
+    /** The request could be redirected to another location */
+    if (tlcf->slowlog_zone == NULL) {
+        return;
+    }
 
-        dd("filter_reply -> read_on:%i, rest:%i, cache rest:%i, buf size:%i",
-                (int) read_on,
-                (int) ctx->rest,
-                (int) (ctx->tp_cache->end - ctx->tp_cache->pos),
-                (int) (b->last - b->pos));
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (ctx == NULL) {
+        return;
     }
 
-    if (ctx->state == SEND_REPLY) {
+    now = ngx_timeofday();
 
-        rc = ngx_http_tnt_send_reply(r, u, ctx);
+    ms = (ngx_msec_int_t) ((now->sec - r->start_sec) * 1000
+                           + (now->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
 
-        ctx->state = READ_PAYLOAD;
-        ctx->rest = ctx->payload_size = 0;
+    if (!(tlcf->slowlog_time && (ngx_msec_t) ms >= tlcf->slowlog_time)
+        && !(tlcf->slowlog_size
+             && ((size_t) r->request_length >= tlcf->slowlog_size
+                 || ctx->stats.payload_size >= tlcf->slowlog_size
+                 || ctx->stats.json_size >= tlcf->slowlog_size)))
+    {
+        return;
+    }
 
-        --ctx->rest_batch_size;
+    lc = ngx_http_tnt_slowlog_get_conf(r->connection->log,
+                                       tlcf->slowlog_zone);
+    if (lc == NULL) {
+        return;
+    }
 
-        if (ctx->rest_batch_size <= 0) {
-            u->length = 0;
-            ctx->rest_batch_size = 0;
-            ctx->batch_size = 0;
-        }
+    sh = lc->sh;
 
-        ngx_pfree(r->pool, ctx->tp_cache);
-        ctx->tp_cache = NULL;
+    state = NULL;
 
-        if (b->last - b->pos > 0) {
-            rc = NGX_AGAIN;
-        }
+    if (r->upstream_states != NULL && r->upstream_states->nelts > 0) {
+        state = r->upstream_states->elts;
+        state += r->upstream_states->nelts - 1;
     }
 
-    return rc;
-}
+    ngx_shmtx_lock(&lc->shpool->mutex);
 
-static ngx_int_t
-ngx_http_tnt_filter(void *data, ssize_t bytes)
-{
-    dd("filter");
+    e = (ngx_http_tnt_slowlog_entry_t *)
+            (sh->entries + (sh->n % sh->max) * sh->entry_size);
 
-    ngx_http_request_t   *r = data;
-    ngx_http_upstream_t  *u = r->upstream;
-    ngx_buf_t            *b = &u->buffer;
+    e->id = ++sh->n;
+    e->sec = now->sec;
+    e->msec = now->msec;
 
-    b->last = b->last + bytes;
+    e->request_time = ms;
+    e->connect_time = -1;
+    e->upstream_time = -1;
+    e->peer_len = 0;
 
-    ngx_int_t rc = NGX_OK;
-    for (;;) {
-        rc = ngx_http_tnt_filter_reply(r, u, b);
-        if (rc != NGX_AGAIN)
-            break;
-        dd("Next message in same input buffer -- merge");
-    }
+    if (state != NULL) {
+#if (nginx_version >= 1009001)
+        e->connect_time = (ngx_msec_int_t) state->connect_time;
+#endif
+        e->upstream_time = (ngx_msec_int_t) state->response_time;
 
-    if (rc != NGX_ERROR) {
-      u->keepalive = 1;
+        if (state->peer != NULL) {
+            e->peer_len = ngx_http_tnt_slowlog_copy(e->peer, sizeof(e->peer),
+                    state->peer->data, state->peer->len);
+        }
     }
 
-    return rc;
-}
-/** }}}
- */
+    e->transcode_in = ctx->stats.transcode_in;
+    e->transcode_out = ctx->stats.transcode_out;
+    e->request_length = r->request_length;
+    e->payload_size = ctx->stats.payload_size;
+    e->json_size = ctx->stats.json_size;
+    e->replies = ctx->stats.replies;
+    e->status = r->headers_out.status;
+    e->error_code = ctx->stats.error_code;
+    e->has_error = ctx->stats.has_error;
+
+    e->method_len = ngx_http_tnt_slowlog_copy(e->method, sizeof(e->method),
+            r->method_name.data, r->method_name.len);
+    e->uri_len = ngx_http_tnt_slowlog_copy(e->uri, sizeof(e->uri),
+            r->uri.data, r->uri.len);
+    e->tnt_method_len = ngx_http_tnt_slowlog_copy(e->tnt_method,
+            sizeof(e->tnt_method), ctx->preset_method,
+            ctx->preset_method_len);
+
+    /** The body is sampled from the memory, i.e. a body in a temp file
+     *  isn't sampled
+     */
+    p = e->data;
+    len = 0;
 
+    if (r->request_body != NULL) {
 
-/** Other functions and utils {{{
- */
-static ngx_buf_t *
-ngx_http_tnt_create_mem_buf(ngx_http_request_t *r, ngx_http_upstream_t *u,
-        size_t size)
-{
-    ngx_buf_t *b = ngx_create_temp_buf(r->pool, size);
-    if (b == NULL) {
-        return NULL;
+        for (cl = r->request_body->bufs;
+             cl != NULL && len < sh->sample;
+             cl = cl->next)
+        {
+            if (!ngx_buf_in_memory(cl->buf)) {
+                break;
+            }
+
+            len += ngx_http_tnt_slowlog_copy(p + len, sh->sample - len,
+                    cl->buf->pos, cl->buf->last - cl->buf->pos);
+        }
     }
 
-    b->pos = b->start;
+    e->body_len = len;
 
-    b->memory = 1;
-    b->flush = 1;
-    b->tag = u->output.tag;
-    b->last = b->end;
+    e->reply_len = ngx_http_tnt_slowlog_copy(p + sh->sample, sh->sample,
+            ctx->stats.reply.data, ctx->stats.reply.len);
 
-    return b;
+    ngx_shmtx_unlock(&lc->shpool->mutex);
 }
 
 
+/** The request is checked when its pool is destroyed, i.e. its time
+ *  includes sending of the response
+ */
 static ngx_int_t
-ngx_http_tnt_output(ngx_http_request_t *r, ngx_http_upstream_t *u,
-        ngx_buf_t *b)
+ngx_http_tnt_slowlog_init(ngx_http_request_t *r)
 {
-    ngx_chain_t *cl, **ll;
+    ngx_pool_cleanup_t  *cln;
 
-    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
-        ll = &cl->next;
+    /** See ngx_http_tnt_stats_init() */
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_tnt_slowlog_record && cln->data == r) {
+            return NGX_OK;
+        }
     }
 
-    cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
-    if (cl == NULL) {
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
         return NGX_ERROR;
     }
 
-    b->pos = b->start;
-    b->flush = 1;
-    b->last_in_chain = 1;
-    b->tag = u->output.tag;
-
-    cl->buf = b;
-    cl->next = NULL;
-
-    *ll = cl;
+    cln->handler = ngx_http_tnt_slowlog_record;
+    cln->data = r;
 
     return NGX_OK;
 }
-/** }}}
- */
 
 
-static ngx_int_t
-ngx_http_tnt_copy_headers(struct tp *tp, ngx_list_t *headers,
-        size_t *map_items)
+static u_char *
+ngx_http_tnt_slowlog_str(u_char *p, u_char *end, u_char *s, size_t len)
 {
-    size_t          i = 0;
-    ngx_table_elt_t *h;
-    ngx_list_part_t *part;
+    char  *out;
 
-    if (headers->size > 0) {
+    out = (char *) p;
 
-        part = &headers->part;
-        h = part->elts;
+    if (json_encode_string(&out, end - p, (const char *) s, len, false)
+            != NULL)
+    {
+        return ngx_slprintf(p, end, "\"\"");
+    }
 
-        for (;; i++) {
+    return (u_char *) out;
+}
 
-            if (i >= part->nelts) {
-                if (part->next == NULL) {
-                    break;
-                }
-                part = part->next;
-                h = part->elts;
-                i = 0;
-            }
 
-            if (!tp_encode_str_map_item(tp,
-                                        (const char *) h[i].key.data,
-                                        h[i].key.len,
-                                        (const char *) h[i].value.data,
-                                        h[i].value.len) )
-            {
-                return NGX_ERROR;
-            }
+static u_char *
+ngx_http_tnt_slowlog_entry(u_char *p, u_char *end,
+        ngx_http_tnt_slowlog_entry_t *e, size_t sample)
+{
+    ngx_str_t  src, dst;
 
-            ++(*map_items);
-        }
-    }
+    p = ngx_slprintf(p, end, "{\"id\":%ui,\"time\":%T.%03M,\"method\":",
+                     e->id, e->sec, e->msec);
+    p = ngx_http_tnt_slowlog_str(p, end, e->method, e->method_len);
 
-    return NGX_OK;
-}
+    p = ngx_slprintf(p, end, ",\"uri\":");
+    p = ngx_http_tnt_slowlog_str(p, end, e->uri, e->uri_len);
 
+    p = ngx_slprintf(p, end, ",\"tnt_method\":");
+    p = ngx_http_tnt_slowlog_str(p, end, e->tnt_method, e->tnt_method_len);
 
-static size_t
-ngx_http_tnt_get_output_size(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
-        ngx_http_tnt_loc_conf_t *tlcf, ngx_buf_t *request_b)
-{
-    (void) ctx;
+    p = ngx_slprintf(p, end, ",\"peer\":");
+    p = ngx_http_tnt_slowlog_str(p, end, e->peer, e->peer_len);
 
-    size_t output_size = ngx_http_tnt_overhead();
+    p = ngx_slprintf(p, end, ",\"status\":%ui", e->status);
 
-    if (r->headers_in.content_length_n > 0) {
-      output_size += r->headers_in.content_length_n;
+    if (e->has_error) {
+        p = ngx_slprintf(p, end, ",\"error\":%i", e->error_code);
     }
 
-    if (tlcf->method.len) {
-      output_size += tlcf->method.len;
+    p = ngx_slprintf(p, end, ",\"request_time_ms\":%i,"
+                             "\"connect_time_ms\":%i,"
+                             "\"upstream_time_ms\":%i,"
+                             "\"transcode_in_us\":%uL,"
+                             "\"transcode_out_us\":%uL,"
+                             "\"request_length\":%O,"
+                             "\"payload_size\":%uz,"
+                             "\"json_size\":%uz,"
+                             "\"batch_size\":%uz",
+                     e->request_time, e->connect_time, e->upstream_time,
+                     e->transcode_in, e->transcode_out, e->request_length,
+                     e->payload_size, e->json_size, e->replies);
+
+    if (e->body_len > 0) {
+        p = ngx_slprintf(p, end, ",\"body\":");
+        p = ngx_http_tnt_slowlog_str(p, end, e->data, e->body_len);
     }
 
-    output_size *= tlcf->in_multiplier + 20 /* header overhead */;
+    /** The reply is in base64, i.e. base64 -d | misc/tp_dump */
+    if (e->reply_len > 0
+        && end - p > (ssize_t) ngx_base64_encoded_length(e->reply_len) + 16)
+    {
+        p = ngx_slprintf(p, end, ",\"reply\":\"");
+
+        src.data = e->data + sample;
+        src.len = e->reply_len;
+        dst.data = p;
 
-    if (request_b != NULL) {
-        output_size += request_b->last - request_b->start;
+        ngx_encode_base64(&dst, &src);
+
+        p += dst.len;
+        p = ngx_slprintf(p, end, "\"");
     }
 
-    return output_size;
+    return ngx_slprintf(p, end, "}");
 }
 
 
 static ngx_int_t
-ngx_http_tnt_output_err(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
-        ngx_int_t code)
+ngx_http_tnt_slowlog_status_handler(ngx_http_request_t *r)
 {
-    ngx_http_upstream_t  *u;
-    ngx_chain_t          *cl, **ll;
-
-    u = r->upstream;
+    u_char                        *p;
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_uint_t                    i, n;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   out;
+    ngx_http_tnt_loc_conf_t       *tlcf;
+    ngx_http_tnt_slowlog_conf_t   *lc;
+    ngx_http_tnt_slowlog_entry_t  *e;
+    ngx_http_tnt_slowlog_shctx_t  *sh;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
 
-    if (ctx->in_err == NULL) {
-        u->headers_in.status_n = 500;
-        u->state->status = 500;
-        u->headers_in.content_length_n = 0;
-        return NGX_OK;
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    u->headers_in.status_n = code;
-    u->state->status = code;
-    u->headers_in.content_length_n = ctx->in_err->last - ctx->in_err->pos;
-    u->length = 0;
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-    for (cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
-        ll = &cl->next;
+    lc = ngx_http_tnt_slowlog_get_conf(r->connection->log,
+                                       tlcf->slowlog_status_zone);
+    if (lc == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    *ll = cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs);
-    if (cl == NULL) {
-        return NGX_ERROR;
-    }
+    sh = lc->sh;
 
-    cl->buf = ctx->in_err;
-    cl->next = NULL;
+    /** The number of the entries doesn't decrease, the newest n entries
+     *  are printed. A string is escaped up to 6 times.
+     */
+    n = ngx_min(sh->n, sh->max);
 
-    cl->buf->pos = cl->buf->start;
-    cl->buf->end = cl->buf->last;
+    size = sizeof("{\"entries\":[]}") + n * (512
+            + 6 * (NGX_HTTP_TNT_SLOWLOG_URI_LEN
+                   + 3 * NGX_HTTP_TNT_STATS_NAME_LEN + sh->sample)
+            + ngx_base64_encoded_length(sh->sample));
 
-    cl->buf->flush = 1;
-    cl->buf->memory = 1;
-    cl->buf->tag = u->output.tag;
-    cl->buf->last_in_chain = 1;
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-    return NGX_OK;
-}
+    p = ngx_sprintf(b->last, "{\"entries\":[");
 
+    ngx_shmtx_lock(&lc->shpool->mutex);
 
-static ngx_int_t
-ngx_http_tnt_read_greeting(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
-        ngx_buf_t *b)
-{
-    if (b->last - b->pos >= (ptrdiff_t) sizeof("Tarantool") - 1
-        && b->pos[0] == 'T'
-        && b->pos[1] == 'a'
-        && b->pos[2] == 'r'
-        && b->pos[3] == 'a'
-        && b->pos[4] == 'n'
-        && b->pos[5] == 't'
-        && b->pos[6] == 'o'
-        && b->pos[7] == 'o'
-        && b->pos[8] == 'l')
-    {
-        b->pos = b->pos + 128;
-        /**
-         *  Nginx should read only "greeting" (128 bytes).
-         *  If tarantool sent the only one message (i.e. greeting),
-         *  then we have to tell to nginx, that it needs read more bytes.
-         */
-        if (b->pos == b->last) {
-            return NGX_AGAIN;
+    for (i = 0; i < n; i++) {
+
+        e = (ngx_http_tnt_slowlog_entry_t *)
+                (sh->entries + ((sh->n - 1 - i) % sh->max) * sh->entry_size);
+
+        if (i > 0) {
+            p = ngx_slprintf(p, b->end, ",");
         }
+
+        p = ngx_http_tnt_slowlog_entry(p, b->end, e, sh->sample);
     }
 
-    ctx->greeting = 1;
+    ngx_shmtx_unlock(&lc->shpool->mutex);
 
-    return NGX_OK;
+    b->last = ngx_slprintf(p, b->end, "]}");
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
 }
+/** }}}
+ */
 
 
-static ngx_int_t
-ngx_http_tnt_wakeup_dying_upstream(ngx_http_request_t *r,
-        ngx_chain_t *out_chain)
+/** Hot keys {{{
+ */
+static char *
+ngx_http_tnt_hot_keys(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    static const u_char fd_event[] =
-              "{\"method\":\"__nginx_tnt_event\",\"params\":[]}";
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
 
-    ngx_http_tnt_ctx_t          *ctx;
-    ngx_http_tnt_loc_conf_t     *tlcf;
+    ngx_int_t  n;
+    ngx_str_t  *value;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    if (tlcf->hot_keys != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    value = cf->args->elts;
 
-    out_chain->buf = ngx_create_temp_buf(r->pool,
-                                sizeof(fd_event) * tlcf->in_multiplier);
-    if (out_chain->buf == NULL) {
-        return NGX_ERROR;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        tlcf->hot_keys = 0;
+        return NGX_CONF_OK;
     }
 
-    out_chain->next = NULL;
-    out_chain->buf->memory = 1;
-    out_chain->buf->flush = 1;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n <= 0 || n > NGX_HTTP_TNT_HOT_TOP_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the keys \"%V\", "
+                           "it must be from 1 to %d",
+                           &value[1], NGX_HTTP_TNT_HOT_TOP_MAX);
+        return NGX_CONF_ERROR;
+    }
 
-    out_chain->buf->pos = out_chain->buf->start;
-    out_chain->buf->last = out_chain->buf->pos;
-    out_chain->buf->last_in_chain = 1;
+    tlcf->hot_keys = (ngx_uint_t) n;
 
-    /** Write some data to the upstream socket.
-     *  This is need for runing handlers in right way.
-     */
-    if (ngx_http_tnt_send_once(r, ctx, out_chain, fd_event,
-                ngx_strlen(fd_event)) != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
+    ngx_http_tnt_hot_keys_used = 1;
 
-    return NGX_OK;
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_send_once(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
-    ngx_chain_t *out_chain, const u_char *buf, size_t len)
+/** The key of a request is the function (or the space) and the first
+ *  scalar of the arguments (or of the key) of the first call, e.g.
+ *  "get_user 42" or "space:512 42". The request is read back from the
+ *  request buffers, so every handler has the same key.
+ *
+ *  Returns the length of the key, 0 if the request has no key.
+ */
+static size_t
+ngx_http_tnt_hot_key(ngx_http_request_t *r, u_char *key)
 {
-    tp_transcode_t           tc;
-    size_t                   complete_msg_size;
+    u_char       *q, *last;
+    uint32_t     n, name_len, str_len;
+    uint64_t     k, space;
+    ngx_buf_t    *b;
+    const char   *p, *end, *h, *name, *arg, *str;
+    ngx_uint_t   has_space;
+
+    if (r->upstream == NULL || r->upstream->request_bufs == NULL) {
+        return 0;
+    }
 
-    tp_transcode_init_args_t args = {
-        .output = (char *) out_chain->buf->start,
-        .output_size = out_chain->buf->end - out_chain->buf->start,
-        .method = NULL,
-        .method_len = 0,
-        .codec = YAJL_JSON_TO_TP,
-        .mf = NULL
-    };
+    b = r->upstream->request_bufs->buf;
 
-    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
-        goto error_exit;
+    /** The buffer is sent already, its start is the request, see
+     *  ngx_http_upstream_reinit()
+     */
+    if (!ngx_buf_in_memory(b) || b->last - b->start <= 5) {
+        return 0;
     }
 
-    if (tp_transcode(&tc, (char *) buf, len) == TP_TRANSCODE_ERROR) {
-        dd("ngx_http_tnt_send:tp_transcode error: %s, code:%d",
-                tc.errmsg, tc.errcode);
-        goto error_exit;
+    p = (const char *) b->start + 5 /* size */;
+    end = (const char *) b->last;
+
+    /** Header */
+    h = p;
+    if (mp_typeof(*p) != MP_MAP || mp_check(&h, end) != 0) {
+        return 0;
     }
 
-    if (tp_transcode_complete(&tc, &complete_msg_size) == TP_TRANSCODE_OK) {
+    p = h;
 
-        out_chain->buf->last = out_chain->buf->start + complete_msg_size;
+    /** Body */
+    h = p;
+    if (p >= end || mp_typeof(*p) != MP_MAP || mp_check(&h, end) != 0) {
+        return 0;
+    }
 
-        if (tc.batch_size > 1) {
-            ctx->rest_batch_size = ctx->batch_size = tc.batch_size;
+    name = NULL;
+    name_len = 0;
+    arg = NULL;
+    space = 0;
+    has_space = 0;
+
+    for (n = mp_decode_map(&p); n > 0; n--) {
+
+        if (mp_typeof(*p) != MP_UINT) {
+            mp_next(&p);
+            mp_next(&p);
+            continue;
+        }
+
+        k = mp_decode_uint(&p);
+
+        if (k == TP_FUNCTION && mp_typeof(*p) == MP_STR) {
+            name = mp_decode_str(&p, &name_len);
+
+        } else if (k == TP_SPACE && mp_typeof(*p) == MP_UINT) {
+            space = mp_decode_uint(&p);
+            has_space = 1;
+
+        } else if ((k == TP_TUPLE || k == TP_KEY)
+                   && mp_typeof(*p) == MP_ARRAY)
+        {
+            h = p;
+
+            if (mp_decode_array(&h) > 0) {
+                arg = h;
+            }
+
+            mp_next(&p);
+
+        } else {
+            mp_next(&p);
         }
+    }
+
+    last = key + NGX_HTTP_TNT_STATS_NAME_LEN;
+
+    if (name != NULL) {
+        q = ngx_slprintf(key, last, "%*s", (size_t) name_len, name);
+
+    } else if (has_space) {
+        q = ngx_slprintf(key, last, "space:%uL", space);
+
     } else {
-        goto error_exit;
+        return 0;
     }
 
-    tp_transcode_free(&tc);
-    return NGX_OK;
+    if (arg != NULL) {
 
-error_exit:
-    tp_transcode_free(&tc);
-    return NGX_ERROR;
-}
+        switch (mp_typeof(*arg)) {
 
+        case MP_STR:
+            str = mp_decode_str(&arg, &str_len);
+            q = ngx_slprintf(q, last, " %*s", (size_t) str_len, str);
+            break;
 
-static void
-ngx_http_tnt_cleanup(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx)
-{
-    if (ctx == NULL) {
-        return;
+        case MP_UINT:
+            q = ngx_slprintf(q, last, " %uL", mp_decode_uint(&arg));
+            break;
+
+        case MP_INT:
+            q = ngx_slprintf(q, last, " %L", mp_decode_int(&arg));
+            break;
+
+        case MP_BOOL:
+            q = ngx_slprintf(q, last, " %s",
+                             mp_decode_bool(&arg) ? "true" : "false");
+            break;
+
+        default:
+            break;
+        }
     }
 
-    if (ctx->tp_cache != NULL) {
-        ngx_pfree(r->pool, ctx->tp_cache);
-        ctx->tp_cache = NULL;
+    /** The keys are printed as they are */
+    for (last = key; last < q; last++) {
+        if (*last < 0x20 || *last == 0x7f || *last == '"' || *last == '\\') {
+            *last = '?';
+        }
     }
+
+    return q - key;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_set_method(ngx_http_tnt_ctx_t *ctx,
-        ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf)
+static ngx_http_tnt_hot_t *
+ngx_http_tnt_hot_get(ngx_http_tnt_stats_conf_t *sc,
+        ngx_http_tnt_stats_node_t *node, ngx_uint_t max)
 {
-    u_char *start, *pos, *end;
-
-    if (tlcf->method.data && tlcf->method.len) {
-
-        ctx->preset_method_len = ngx_min(tlcf->method.len,
-                                         sizeof(ctx->preset_method)-1);
-        ngx_memcpy(ctx->preset_method,
-                   tlcf->method.data,
-                   ctx->preset_method_len);
+    ngx_http_tnt_hot_t  *hot;
 
-    } else if (tlcf->http_rest_methods & r->method) {
+    hot = node->hot;
+    if (hot != NULL) {
+        return hot;
+    }
 
-        if (r->uri.data == NULL || !r->uri.len) {
-            goto error;
-        }
+    ngx_shmtx_lock(&sc->shpool->mutex);
 
-        start = pos = (*r->uri.data == '/' ? r->uri.data + 1 : r->uri.data);
-        end = r->uri.data + r->uri.len;
+    if (node->hot == NULL) {
 
-        for (;pos != end; ++pos) {
-            if (*pos == '/') {
-                ctx->preset_method_len = ngx_min(sizeof(ctx->preset_method)-1,
-                                                 (size_t)(pos - start));
-                ngx_memcpy(ctx->preset_method, start, ctx->preset_method_len);
-                break;
-            }
-        }
+        hot = ngx_slab_calloc_locked(sc->shpool, sizeof(ngx_http_tnt_hot_t));
 
-        if (!ctx->preset_method[0]) {
+        if (hot != NULL) {
+            hot->max = max;
+            hot->start = ngx_time();
+            hot->decayed = hot->start;
 
-            if (start == end) {
-                goto error;
-            }
+            ngx_memory_barrier();
 
-            ctx->preset_method_len = ngx_min(sizeof(ctx->preset_method)-1,
-                                            (size_t)(end - start));
-            ngx_memcpy(ctx->preset_method, start, ctx->preset_method_len);
+            node->hot = hot;
         }
     }
-    /* Else -- expect the method in the body */
 
-    return NGX_OK;
+    hot = node->hot;
 
-error:
-    ctx->preset_method[0] = 0;
-    ctx->preset_method_len = 0;
-    return NGX_ERROR;
+    ngx_shmtx_unlock(&sc->shpool->mutex);
+
+    return hot;
 }
 
 
-static ngx_http_tnt_next_arg_t
-ngx_http_tnt_get_next_arg(u_char *it, u_char *end)
+/** Must be called under the lock of the hot keys */
+static void
+ngx_http_tnt_hot_min(ngx_http_tnt_hot_t *hot)
 {
-    ngx_http_tnt_next_arg_t next_arg = { .it = end, .value = NULL };
+    ngx_uint_t  i, min;
 
-    for ( ; it != end; ++it) {
+    if (hot->n < hot->max) {
+        hot->min = 0;
+        return;
+    }
 
-        if (next_arg.value == NULL /* CASE: ARG==.. */ &&
-                *it == '=')
-        {
-            next_arg.value = it + 1;
-            continue;
-        } else if (*it == '&') {
-            next_arg.it = it;
-            break;
-        }
+    min = hot->keys[0].count;
 
+    for (i = 1; i < hot->n; i++) {
+        min = ngx_min(min, hot->keys[i].count);
     }
 
-    return next_arg;
+    hot->min = min;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_encode_str_map_item(ngx_http_request_t *r,
-                                 ngx_http_tnt_loc_conf_t *tlcf,
-                                 struct tp *tp,
-                                 u_char *key, size_t key_len,
-                                 u_char *value, size_t value_len)
+/** Halves the counts, i.e. the counts are about the last two periods. The
+ *  increments of the sketch meanwhile could be lost, it's an estimate anyway.
+ */
+static void
+ngx_http_tnt_hot_decay(ngx_http_tnt_hot_t *hot, time_t now)
 {
-    ngx_int_t rc;
-    ngx_str_t unescaped_value;
-    ngx_str_t value_str;
+    ngx_uint_t  i, j;
 
-    value_str.data = value;
-    value_str.len = value_len;
+    ngx_spinlock(&hot->lock, ngx_pid, 1024);
 
-    if (tlcf->pass_http_request & NGX_TNT_CONF_UNESCAPE) {
+    if (now - hot->decayed >= NGX_HTTP_TNT_HOT_PERIOD) {
 
-        rc = ngx_http_tnt_unescape_uri(r, &unescaped_value, &value_str);
-        if (rc != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "ngx_http_tnt_encode_str_map_item: unescape failed, "
-                " it looks like OOM happened");
-            return rc;
+        for (i = 0; i < NGX_HTTP_TNT_HOT_DEPTH; i++) {
+            for (j = 0; j < NGX_HTTP_TNT_HOT_WIDTH; j++) {
+                hot->sketch[i][j] /= 2;
+            }
         }
-        value_str = unescaped_value;
-    }
 
-    if (tp_encode_str_map_item(tp, (const char *) key, key_len,
-                (const char *) value_str.data, value_str.len) == NULL)
-    {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "ngx_http_tnt_encode_str_map_item: tp_encode failed, "
-            " it looks like OOM happened");
-        return NGX_ERROR;
+        for (i = 0; i < hot->n; i++) {
+            hot->keys[i].count /= 2;
+        }
+
+        hot->decayed = now;
+
+        ngx_http_tnt_hot_min(hot);
     }
 
-    return NGX_OK;
+    ngx_unlock(&hot->lock);
 }
 
 
-static ngx_int_t
-ngx_http_tnt_encode_query_args(ngx_http_request_t *r,
-    ngx_http_tnt_loc_conf_t *tlcf, struct tp *tp, ngx_uint_t *args_items)
+static void
+ngx_http_tnt_hot_add(ngx_http_tnt_stats_conf_t *sc,
+        ngx_http_tnt_stats_node_t *node, ngx_uint_t max, u_char *key,
+        size_t len)
 {
-    u_char                  *arg_begin, *end;
-    ngx_http_tnt_next_arg_t arg;
-    ngx_str_t               *args;
+    time_t                  now;
+    uint32_t                h1, h2;
+    ngx_uint_t              i, count, c, min;
+    ngx_http_tnt_hot_t      *hot;
+    ngx_http_tnt_hot_key_t  *k;
+
+    hot = ngx_http_tnt_hot_get(sc, node, max);
+    if (hot == NULL) {
+        return;
+    }
 
-    args = &r->args;
+    now = ngx_time();
 
-    if (args->len == 0) {
-        return NGX_OK;
+    if (now - hot->decayed >= NGX_HTTP_TNT_HOT_PERIOD) {
+        ngx_http_tnt_hot_decay(hot, now);
     }
 
-    arg_begin = args->data;
-    end = arg_begin + args->len;
+    /** The rows of the sketch are indexed by the double hashing */
+    h1 = ngx_crc32_short(key, len);
+    h2 = ngx_murmur_hash2(key, len) | 1;
 
-    arg.it = arg_begin;
-    arg.value = NULL;
+    count = (ngx_uint_t) -1;
 
-    for (; arg.it < end; ) {
+    for (i = 0; i < NGX_HTTP_TNT_HOT_DEPTH; i++) {
+        c = ngx_atomic_fetch_add(
+                &hot->sketch[i][(h1 + i * h2) % NGX_HTTP_TNT_HOT_WIDTH], 1)
+            + 1;
+        count = ngx_min(count, c);
+    }
 
-        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+    if (count <= hot->min) {
+        return;
+    }
 
-        const size_t value_len = arg.it - arg.value;
-        if (arg.value && value_len > 0) {
+    ngx_spinlock(&hot->lock, ngx_pid, 1024);
 
-            ++(*args_items);
+    k = NULL;
 
-            if (ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
-                                                 arg_begin,
-                                                 arg.value - arg_begin - 1,
-                                                 arg.value,
-                                                 value_len) != NGX_OK)
-            {
-                return NGX_ERROR;
+    for (i = 0; i < hot->n; i++) {
+
+        if (hot->keys[i].hash == h1 && hot->keys[i].len == len
+            && ngx_memcmp(hot->keys[i].key, key, len) == 0)
+        {
+            k = &hot->keys[i];
+            break;
+        }
+    }
+
+    if (k == NULL) {
+
+        if (hot->n < hot->max) {
+            k = &hot->keys[hot->n++];
+
+        } else {
+
+            /** The key replaces the coldest one */
+            for (min = 0, i = 1; i < hot->n; i++) {
+                if (hot->keys[i].count < hot->keys[min].count) {
+                    min = i;
+                }
+            }
+
+            if (hot->keys[min].count < count) {
+                k = &hot->keys[min];
             }
+        }
 
+        if (k != NULL) {
+            k->hash = h1;
+            k->len = len;
+            ngx_memcpy(k->key, key, len);
         }
-        arg_begin = ++arg.it;
     }
 
-    return NGX_OK;
+    if (k != NULL) {
+        k->count = ngx_max(k->count, count);
+        ngx_http_tnt_hot_min(hot);
+    }
+
+    ngx_unlock(&hot->lock);
 }
 
 
 static ngx_int_t
-ngx_http_tnt_encode_urlencoded_body(ngx_http_request_t *r,
-                                    ngx_http_tnt_loc_conf_t *tlcf,
-                                    struct tp *tp,
-                                    ngx_buf_t *b,
-                                    ngx_uint_t *args_items)
+ngx_http_tnt_hot_cmp(const void *one, const void *two)
 {
-    u_char                  *arg_begin, *end;
-    ngx_http_tnt_next_arg_t arg;
-    size_t                  value_len;
+    const ngx_http_tnt_hot_key_t  *a = one, *b = two;
 
-    if (b->start == b->last) {
-        return NGX_OK;
-    }
+    return (a->count < b->count) - (a->count > b->count);
+}
 
-    arg_begin = b->start;
-    end = b->last;
 
-    arg.it = arg_begin;
-    arg.value = NULL;
+/** Copies the top keys in the descending order, returns the number of them
+ */
+static ngx_uint_t
+ngx_http_tnt_hot_top(ngx_http_tnt_hot_t *hot, ngx_http_tnt_hot_key_t *keys)
+{
+    ngx_uint_t  n;
 
-    for (; arg.it < end; ) {
+    ngx_spinlock(&hot->lock, ngx_pid, 1024);
 
-        arg = ngx_http_tnt_get_next_arg(arg.it, end);
+    n = hot->n;
+    ngx_memcpy(keys, hot->keys, n * sizeof(ngx_http_tnt_hot_key_t));
 
-        value_len = (size_t) (arg.it - arg.value);
+    ngx_unlock(&hot->lock);
 
-        if (arg.value && value_len > 0) {
+    ngx_sort(keys, n, sizeof(ngx_http_tnt_hot_key_t), ngx_http_tnt_hot_cmp);
 
-            if (tp_encode_map(tp, 1) &&
-                ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
-                                                 arg_begin,
-                                                 arg.value - arg_begin - 1,
-                                                 arg.value,
-                                                 value_len) != NGX_OK)
-            {
-                return NGX_ERROR;
-            }
+    return n;
+}
 
-            ++(*args_items);
-        }
-        arg_begin = ++arg.it;
-    }
 
-    return NGX_OK;
+/** The rate is per second, the counts are about the last two periods */
+static ngx_uint_t
+ngx_http_tnt_hot_rate(ngx_http_tnt_hot_t *hot, ngx_uint_t count)
+{
+    time_t  window;
+
+    window = ngx_time() - hot->start;
+    window = ngx_min(window, 2 * NGX_HTTP_TNT_HOT_PERIOD);
+    window = ngx_max(window, 1);
+
+    /** In hundredths */
+    return count * 100 / window;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_get_request_data(ngx_http_request_t *r,
-                              ngx_http_tnt_loc_conf_t *tlcf,
-                              struct tp *tp)
+static u_char *
+ngx_http_tnt_hot_json(u_char *p, u_char *end, ngx_http_tnt_hot_t *hot)
 {
-    /** TODO:
-     *      This function should be a part of tp_transcode.{c,h}. It's very
-     *      strange have this function here, so the best way is piece by piece
-     *      move this functionality ...
-     *
-     *      Also it would be nice to have tied nginx structures
-     *      with tp_transcode
-     */
-    char                *root_map_place;
-    char                *map_place;
-    size_t              root_items;
-    size_t              map_items;
-    ngx_buf_t           *b;
-    ngx_chain_t         *body;
-    char                *p;
-    ngx_buf_t           unparsed_body;
-    ngx_int_t           rc;
+    ngx_uint_t              i, n, rate;
+    ngx_http_tnt_hot_key_t  keys[NGX_HTTP_TNT_HOT_TOP_MAX];
 
-    root_items = 0;
-    root_map_place = tp->p;
+    n = ngx_http_tnt_hot_top(hot, keys);
 
-    if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
-        goto oom_cant_encode;
-    }
+    p = ngx_slprintf(p, end, "[");
 
-    /** Encode protocol */
-    ++root_items;
+    for (i = 0; i < n; i++) {
 
-    if (tp_encode_str_map_item(tp,
-                                "proto", sizeof("proto") - 1,
-                                (const char*) r->http_protocol.data,
-                                r->http_protocol.len) == NULL)
-    {
-        goto oom_cant_encode;
+        rate = ngx_http_tnt_hot_rate(hot, keys[i].count);
+
+        p = ngx_slprintf(p, end, "%s{\"key\":\"%*s\",\"count\":%ui,"
+                         "\"rate\":%ui.%02ui}",
+                         i ? "," : "", keys[i].len, keys[i].key,
+                         keys[i].count, rate / 100, rate % 100);
     }
 
-    /** Encode method */
-    ++root_items;
+    return ngx_slprintf(p, end, "]");
+}
 
-    if (tp_encode_str_map_item(tp,
-                                "method", sizeof("method") - 1,
-                                (const char *) r->method_name.data,
-                                r->method_name.len) == NULL)
-    {
-        goto oom_cant_encode;
-    }
 
-    /** Encode uri:
-     *      whether NGX_TNT_CONF_PASS_SUBREQUEST_URI is not set then raw uri
-     *      will be chosen, otherwise preprocessed value will be used
-     */
-    ++root_items;
+static u_char *
+ngx_http_tnt_hot_prometheus(u_char *p, u_char *end,
+        ngx_http_tnt_stats_shctx_t *sh, ngx_uint_t n)
+{
+    ngx_uint_t                 i, j, m, k, rate;
+    ngx_http_tnt_stats_node_t  *node;
+    ngx_http_tnt_hot_key_t     keys[NGX_HTTP_TNT_HOT_TOP_MAX];
 
-    ngx_str_t uri = tlcf->pass_http_request & NGX_TNT_CONF_PASS_SUBREQUEST_URI
-        ? r->uri : r->unparsed_uri;
+    static const char  *metrics[][2] = {
+        { "hot_key_requests", "Requests of a hot key, halved every minute" },
+        { "hot_key_rate", "Requests per second of a hot key" }
+    };
 
-    if (ngx_http_tnt_encode_str_map_item(r, tlcf, tp,
-                                         (u_char *) "uri", sizeof("uri") - 1,
-                                         uri.data, uri.len) == NGX_ERROR)
-    {
-        goto oom_cant_encode;
-    }
+    for (j = 0; j < 2; j++) {
 
-    /** Encode query args */
-    if (tlcf->pass_http_request & NGX_TNT_CONF_PARSE_ARGS) {
+        p = ngx_slprintf(p, end,
+                         "# HELP tnt_location_%s %s\n"
+                         "# TYPE tnt_location_%s gauge\n",
+                         metrics[j][0], metrics[j][1], metrics[j][0]);
 
-        ++root_items;
+        for (i = 0; i < n; i++) {
 
-        if (tp_encode_str(tp, "args", sizeof("args") - 1) == NULL) {
-            goto oom_cant_encode;
-        }
+            node = &sh->nodes[i];
 
-        map_place = tp->p;
-        if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
-            goto oom_cant_encode;
-        }
+            if (node->kind != NGX_HTTP_TNT_STATS_LOCATION
+                || node->hot == NULL)
+            {
+                continue;
+            }
 
-        map_items = 0;
+            m = ngx_http_tnt_hot_top(node->hot, keys);
 
-        rc = ngx_http_tnt_encode_query_args(r, tlcf, tp, &map_items);
-        if (rc == NGX_ERROR) {
-            goto oom_cant_encode;
+            for (k = 0; k < m; k++) {
+
+                p = ngx_slprintf(p, end, "tnt_location_%s{location=\"",
+                                 metrics[j][0]);
+                p = ngx_http_tnt_stats_escape(p, end, node->name, node->len);
+                p = ngx_slprintf(p, end, "\",key=\"%*s\"} ",
+                                 keys[k].len, keys[k].key);
+
+                if (j == 0) {
+                    p = ngx_slprintf(p, end, "%ui\n", keys[k].count);
+
+                } else {
+                    rate = ngx_http_tnt_hot_rate(node->hot, keys[k].count);
+                    p = ngx_slprintf(p, end, "%ui.%02ui\n",
+                                     rate / 100, rate % 100);
+                }
+            }
         }
+    }
 
-        *(map_place++) = 0xdf;
-        *(uint32_t *) map_place = mp_bswap_u32(map_items);
+    return p;
+}
+
+
+/** $tnt_hot_key, the key of the request if it's one of the top keys of the
+ *  location
+ */
+static ngx_int_t
+ngx_http_tnt_hot_key_variable(ngx_http_request_t *r,
+        ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                     key[NGX_HTTP_TNT_STATS_NAME_LEN];
+    size_t                     len;
+    uint32_t                   hash;
+    ngx_uint_t                 i, found;
+    ngx_http_tnt_hot_t         *hot;
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_node_t  *node;
+
+    v->not_found = 1;
+
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+
+    if (tlcf->hot_keys == 0 || tlcf->stats_zone == NULL) {
+        return NGX_OK;
     }
 
-    /** Encode http headers */
-    ++root_items;
+    node = ngx_http_tnt_stats_location(r, tlcf);
+    if (node == NULL || node->hot == NULL) {
+        return NGX_OK;
+    }
 
-    if (tp_encode_str(tp, "headers", sizeof("headers") - 1) == NULL) {
-        goto oom_cant_encode_headers;
+    len = ngx_http_tnt_hot_key(r, key);
+    if (len == 0) {
+        return NGX_OK;
     }
 
-    map_items = 0;
-    map_place = tp->p;
+    hot = node->hot;
+    hash = ngx_crc32_short(key, len);
+    found = 0;
 
-    if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
-        goto oom_cant_encode_headers;
+    ngx_spinlock(&hot->lock, ngx_pid, 1024);
+
+    for (i = 0; i < hot->n; i++) {
+
+        if (hot->keys[i].hash == hash && hot->keys[i].len == len
+            && ngx_memcmp(hot->keys[i].key, key, len) == 0)
+        {
+            found = 1;
+            break;
+        }
     }
 
-    if (ngx_http_tnt_copy_headers(tp, &r->headers_in.headers, &map_items) ==
-            NGX_ERROR)
-    {
-        goto oom_cant_encode_headers;
+    ngx_unlock(&hot->lock);
+
+    if (!found) {
+        return NGX_OK;
     }
 
-    if ((tlcf->pass_http_request & NGX_TNT_CONF_PASS_HEADERS_OUT) &&
-        (ngx_http_tnt_copy_headers(tp, &r->headers_out.headers, &map_items) ==
-            NGX_ERROR) )
-    {
-        goto oom_cant_encode_headers;
+    v->data = ngx_pnalloc(r->pool, len);
+    if (v->data == NULL) {
+        return NGX_ERROR;
     }
 
-    *(map_place++) = 0xdf;
-    *(uint32_t *) map_place = mp_bswap_u32(map_items);
+    ngx_memcpy(v->data, key, len);
 
-    /** Encode body */
-    if ((tlcf->pass_http_request & NGX_TNT_CONF_PARSE_URLENCODED) &&
-            r->headers_in.content_length_n > 0 &&
-            r->upstream->request_bufs)
-    {
-        ++root_items;
+    v->len = len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
 
-        if (tp_encode_str(tp, "args_urlencoded", sizeof("args_urlencoded") - 1) == NULL) {
-            goto oom_cant_encode_body;
-        }
+    return NGX_OK;
+}
+/** }}}
+ */
 
-        /** Encode urlencoded body as map - body = { K = V, .. } */
-        map_place = tp->p;
 
-        if (tp_add(tp, 1 + sizeof(uint32_t)) == NULL) {
-            goto oom_cant_encode_body;
-        }
+/** Limits {{{
+ */
+static void
+ngx_http_tnt_stats_limited(ngx_http_request_t *r)
+{
+    ngx_http_tnt_loc_conf_t    *tlcf;
+    ngx_http_tnt_stats_node_t  *node;
 
-        ngx_memset(&unparsed_body, 0, sizeof(ngx_buf_t));
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-        unparsed_body.pos = ngx_pnalloc(r->pool,
-                        sizeof(u_char) * r->headers_in.content_length_n + 1);
-        if (unparsed_body.pos == NULL) {
-            return NGX_ERROR;
-        }
-        unparsed_body.last = unparsed_body.pos;
-        unparsed_body.start = unparsed_body.pos;
-        unparsed_body.end = unparsed_body.pos +
-                r->headers_in.content_length_n + 1;
+    if (tlcf->stats_zone == NULL) {
+        return;
+    }
 
-        for (body = r->upstream->request_bufs; body; body = body->next) {
+    node = ngx_http_tnt_stats_location(r, tlcf);
+    if (node != NULL) {
+        (void) ngx_atomic_fetch_add(&node->limited, 1);
+    }
+}
 
-            b = body->buf;
 
-            if (b->in_file) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "in-file buffer found. aborted. "
-                    "consider increasing your 'client_body_buffer_size' "
-                    "setting");
-                return NGX_ERROR;
-            }
+/** The request doesn't fit tnt_max_request_memory, it's rejected before
+ *  the buffer is allocated. Tarantool is woken up by an event like for the
+ *  other errors of the input.
+ */
+static ngx_int_t
+ngx_http_tnt_request_limited(ngx_http_request_t *r, ngx_http_tnt_ctx_t *ctx,
+        ngx_chain_t *out_chain)
+{
+    const ngx_http_tnt_error_t  *e;
 
-            unparsed_body.last = ngx_copy(unparsed_body.last,
-                        b->pos, b->last - b->pos);
-        }
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "tnt: the request exceeds tnt_max_request_memory");
 
-        /** Actually this is an array not a map, I used this variable
-         * since it's avaliable in this scope
-         */
-        map_items = 0;
+    e = ngx_http_tnt_get_error_text(REQUEST_MEMORY_LIMIT);
+    if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        if (ngx_http_tnt_encode_urlencoded_body(r, tlcf, tp,
-                    &unparsed_body, &map_items) != NGX_OK)
-        {
-            goto oom_cant_encode_body;
-        }
+    ctx->state = INPUT_TO_LARGE;
 
-        *(map_place++) = 0xdd;
-        *(uint32_t *) map_place = mp_bswap_u32(map_items);
+    ngx_http_tnt_stats_limited(r);
+
+    if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
+        return NGX_ERROR;
     }
-    
-    /** Unknown body type - encode as mp string
-     */
-    if ((tlcf->pass_http_request & NGX_TNT_CONF_PASS_BODY) &&
-            r->headers_in.content_length_n > 0 &&
-            r->upstream->request_bufs)
-    {
-        ++root_items;
 
-        if (tp_encode_str(tp, "body", sizeof("body") - 1) == NULL) {
-            goto oom_cant_encode_body;
-        }
+    r->upstream->request_bufs = out_chain;
 
+    return NGX_OK;
+}
 
-        int sz = mp_sizeof_str(r->headers_in.content_length_n);
-        if (tp_ensure(tp, sz) == -1) {
-            goto oom_cant_encode_body;
-        }
 
-        p = mp_encode_strl(tp->p, r->headers_in.content_length_n);
+/** Checks the reply of ctx->payload_size bytes before tp_cache is allocated,
+ *  the reply needs tp_cache and the output of ngx_http_tnt_send_reply().
+ *
+ *  Returns NGX_DECLINED if the reply should be skipped, b is the rest of
+ *  the input, it's used to read the sync of the reply.
+ */
+static ngx_int_t
+ngx_http_tnt_reply_limited(ngx_http_request_t *r,
+        ngx_http_tnt_loc_conf_t *tlcf, ngx_http_tnt_ctx_t *ctx, ngx_buf_t *b)
+{
+    size_t  size, memory;
 
-        for (body = r->upstream->request_bufs; body; body = body->next) {
+    /** The merged reply is replaced by the error already */
+    if (ctx->reply_limited) {
+        return NGX_DECLINED;
+    }
 
-            b = body->buf;
+    /** The transaction is committed, the merged reply is sent anyway */
+    if (ctx->tx.commit) {
+        return NGX_OK;
+    }
 
-            if (b->in_file) {
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "in-file buffer found. aborted. "
-                    "consider increasing your 'client_body_buffer_size' "
-                    "setting");
-                return NGX_ERROR;
-            }
+    if (tlcf->max_reply_size == 0 && tlcf->max_request_memory == 0) {
+        return NGX_OK;
+    }
 
-            p = (char *) ngx_copy(p, b->pos, b->last - b->pos);
-        }
+    size = (size_t) ctx->payload_size;
+    memory = size + (size + ngx_http_tnt_overhead()) * tlcf->out_multiplier;
 
-        if (tp_add(tp, sz) == NULL) {
-            goto oom_cant_encode_body;
-        }
+    if ((tlcf->max_reply_size == 0 || size <= tlcf->max_reply_size)
+        && (tlcf->max_request_memory == 0
+            || ctx->stats.memory + memory <= tlcf->max_request_memory))
+    {
+        return NGX_OK;
     }
 
-    *(root_map_place++) = 0xdf;
-    *(uint32_t *) root_map_place = mp_bswap_u32(root_items);
+    ngx_http_tnt_stats_limited(r);
 
-    return NGX_OK;
+    /** These replies are merged into one, so the error is sent instead of
+     *  the merged reply, see ngx_http_tnt_merged_limited()
+     */
+    if (ctx->tx.n > 0 || ctx->in_list.n > 0 || ctx->bulk.n > 0) {
+        ctx->reply_limited = 1;
+    }
 
-oom_cant_encode:
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "can't encode uri, schema etc. "
-            "aborted. consider increasing your "
-            "'tnt_pass_http_request_buffer_size' setting");
-    return NGX_ERROR;
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "tnt: the reply of %uz bytes exceeds tnt_max_reply_size "
+            "or tnt_max_request_memory, it's skipped", size);
 
-oom_cant_encode_headers:
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "can't encode HTTP headers. "
-            "aborted. consider increasing your "
-            "'tnt_pass_http_request_buffer_size' setting");
-    return NGX_ERROR;
+    /** The header of the reply could be split, then the id is null */
+    ctx->stats.has_sync = 0;
 
-oom_cant_encode_body:
+    ngx_http_tnt_read_sync(ctx, (const char *) b->pos,
+            (const char *) b->pos + ngx_min(ctx->rest, b->last - b->pos));
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "can't encode body. aborted. consider increasing your "
-            "'tnt_pass_http_request_buffer_size' setting");
-    return NGX_ERROR;
+    return NGX_DECLINED;
 }
 
 
-static ngx_buf_t *
-ngx_http_tnt_get_request_data_map(ngx_http_request_t *r,
-        ngx_http_tnt_loc_conf_t *tlcf)
+/** Sends an error instead of the skipped reply, it's a JSON-RPC error like
+ *  an error of Tarantool
+ */
+static ngx_int_t
+ngx_http_tnt_send_limited(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
 {
-    ngx_int_t rc;
-    struct tp tp;
-    ngx_buf_t *b;
+    size_t                      size;
+    u_char                      *p;
+    ngx_buf_t                   *b;
+    const ngx_http_tnt_error_t  *e;
+
+    e = ngx_http_tnt_get_error_text(REPLY_SIZE_LIMIT);
+
+    size = e->msg.len + NGX_INT64_LEN + sizeof("[{"
+                "'id':,"
+                "'error':{"
+                    "'message':'',"
+                    "'code':-XXXXX"
+                "}"
+            "}]");
 
-    b = ngx_create_temp_buf(r->pool, tlcf->pass_http_request_buffer_size);
+    b = ngx_http_tnt_create_mem_buf(r, u, size);
     if (b == NULL) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-            "ngx_http_tnt_get_request_data_map can't allocate "
-            "output buffer with size = %d",
-            (int) tlcf->pass_http_request_buffer_size);
-        return NULL;
+        return NGX_ERROR;
     }
 
-    b->memory = 1;
-    b->flush = 1;
-
-    b->pos = b->start;
+    ctx->stats.memory += size;
 
-    tp_init(&tp, (char *) b->start, b->end - b->start, NULL, NULL);
-    tp.size = tp.p;
+    p = b->pos;
 
-    rc = ngx_http_tnt_get_request_data(r, tlcf, &tp);
-    if (rc != NGX_OK) {
-        return NULL;
+    if (ctx->batch_size > 0 && ctx->rest_batch_size == ctx->batch_size) {
+        *p++ = '[';
     }
 
-    b->last = (u_char *) tp.p;
-
-    return b;
-}
+    if (ctx->stats.has_sync) {
+        p = ngx_sprintf(p, "{\"id\":%uL,", ctx->stats.sync);
 
+    } else {
+        p = ngx_cpymem(p, "{\"id\":null,", sizeof("{\"id\":null,") - 1);
+    }
 
-static ngx_http_tnt_ctx_t *
-ngx_http_tnt_create_ctx(ngx_http_request_t *r)
-{
-    ngx_http_tnt_ctx_t      *ctx;
+    p = ngx_sprintf(p, "\"error\":{\"message\":\"%V\",\"code\":%i}}",
+                    &e->msg, (ngx_int_t) e->code);
 
-    ctx = ngx_palloc(r->pool, sizeof(ngx_http_tnt_ctx_t));
-    if (ctx == NULL) {
-        return NULL;
+    if (ctx->batch_size > 0) {
+        *p++ = ctx->rest_batch_size == 1 ? ']' : ',';
     }
 
-    ngx_http_tnt_reset_ctx(ctx);
+    b->last = p;
 
-    ngx_http_set_ctx(r, ctx, ngx_http_tnt_module);
+    ctx->stats.error_code = e->code;
+    ctx->stats.has_error = 1;
 
-    ctx->state = OK;
+    TNT_PROBE2(error__reply, r, e->code);
 
-    return ctx;
+    ngx_http_tnt_stats_error(r, e->code);
+
+    return ngx_http_tnt_output(r, u, b);
 }
 
 
-static void
-ngx_http_tnt_reset_ctx(ngx_http_tnt_ctx_t *ctx)
+/** Called instead of ngx_http_tnt_tx_reply(), ngx_http_tnt_in_list_reply()
+ *  and ngx_http_tnt_bulk_reply() for a skipped reply. The error is sent as
+ *  the reply of one request, when the last reply is received. COMMIT isn't
+ *  sent, so the transaction is rolled back.
+ */
+static ngx_int_t
+ngx_http_tnt_merged_limited(ngx_http_request_t *r, ngx_http_upstream_t *u,
+        ngx_http_tnt_ctx_t *ctx)
 {
-    ctx->payload.p = &ctx->payload.mem[0];
-    ctx->payload.e = &ctx->payload.mem[sizeof(ctx->payload.mem) - 1];
+    int        batch_size;
+    ngx_int_t  rc;
 
-    ctx->state = OK;
+    if (ctx->tx.n > 0) {
 
-    ctx->in_err = ctx->tp_cache = NULL;
+        /** The reply of COMMIT is never skipped */
+        if (++ctx->tx.received <= ctx->tx.n) {
+            return NGX_OK;
+        }
 
-    ctx->rest = 0;
-    ctx->payload_size = 0;
+    } else if (ctx->in_list.n > 0) {
 
-    ctx->rest_batch_size = 0;
+        if (++ctx->in_list.received < ctx->in_list.n) {
+            return NGX_OK;
+        }
+
+    } else if (++ctx->bulk.received < ctx->bulk.n) {
+        return NGX_OK;
+    }
+
+    /** The sync of a merged reply is 0 */
+    ctx->stats.has_sync = 1;
+    ctx->stats.sync = 0;
+
+    batch_size = ctx->batch_size;
     ctx->batch_size = 0;
 
-    ctx->greeting = 0;
+    rc = ngx_http_tnt_send_limited(r, u, ctx);
 
-    ctx->preset_method[0] = 0;
-    ctx->preset_method_len = 0;
+    ctx->batch_size = batch_size;
+
+    return rc;
 }
+/** }}}
+ */
 
 
+/** Rate limits {{{
+ */
 static ngx_int_t
-ngx_http_tnt_init_handlers(ngx_http_request_t *r, ngx_http_upstream_t *u,
-        ngx_http_tnt_loc_conf_t *tlcf)
+ngx_http_tnt_rate_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_http_tnt_ctx_t  *ctx;
+    ngx_http_tnt_rate_conf_t  *orc = data;
 
-    ctx = ngx_http_tnt_create_ctx(r);
-    if (ctx == NULL) {
-        return NGX_ERROR;
+    size_t                    len;
+    ngx_uint_t                n;
+    ngx_http_tnt_rate_conf_t  *rc;
+
+    rc = shm_zone->data;
+
+    if (orc) {
+        rc->shpool = orc->shpool;
+        rc->sh = orc->sh;
+        return NGX_OK;
     }
 
-    if (ngx_http_tnt_set_method(ctx, r, tlcf) == NGX_ERROR) {
-        return NGX_HTTP_BAD_REQUEST;
+    rc->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        rc->sh = rc->shpool->data;
+        return NGX_OK;
     }
 
-    u->reinit_request = ngx_http_tnt_reinit_request;
-    u->process_header = ngx_http_tnt_process_header;
-    u->abort_request = ngx_http_tnt_abort_request;
-    u->finalize_request = ngx_http_tnt_finalize_request;
+    len = sizeof(" in tnt_limit_zone \"\"") + shm_zone->shm.name.len;
 
-    u->create_request = ngx_http_tnt_query_handler;
+    rc->shpool->log_ctx = ngx_slab_alloc(rc->shpool, len);
+    if (rc->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (tlcf->req_type > 0) {
+    ngx_sprintf(rc->shpool->log_ctx, " in tnt_limit_zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-        if (r->headers_in.content_type != NULL &&
-            r->headers_in.content_type->value.len > 0)
-        {
+    /** The nodes take the rest of the zone */
+    n = shm_zone->shm.size / sizeof(ngx_http_tnt_rate_node_t);
 
-            if (!ngx_http_tnt_str_match(&r->headers_in.content_type->value,
-                        "application/x-www-form-urlencoded",
-                        sizeof("application/x-www-form-urlencoded") - 1) ||
-                !ngx_http_tnt_str_match(&r->headers_in.content_type->value,
-                        "application/x-www-form-urlencoded",
-                        sizeof("application/x-www-form-urlencoded") - 1))
-            {
-                return NGX_HTTP_NOT_ALLOWED;
-            }
+    rc->shpool->log_nomem = 0;
+
+    for ( ;; ) {
+
+        if (n < NGX_HTTP_TNT_RATE_PROBES) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                    "tnt_limit_zone \"%V\" is too small",
+                    &shm_zone->shm.name);
+            return NGX_ERROR;
         }
 
-        u->create_request = ngx_http_tnt_dml_handler;
-        return NGX_OK;
-    }
+        rc->sh = ngx_slab_calloc(rc->shpool,
+                offsetof(ngx_http_tnt_rate_shctx_t, nodes)
+                + n * sizeof(ngx_http_tnt_rate_node_t));
+        if (rc->sh != NULL) {
+            break;
+        }
 
-    if (tlcf->pass_http_request & NGX_TNT_CONF_PASS_BODY) {
-        /* This is default and already set */
-        return NGX_OK;
+        n -= n / 8 + 1;
     }
 
-    if (r->headers_in.content_length_n > 0) {
-        u->create_request = ngx_http_tnt_body_handler;
-    }
+    rc->shpool->log_nomem = 1;
+
+    rc->sh->n = n;
+    rc->shpool->data = rc->sh;
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_body_handler(ngx_http_request_t *r)
+static char *
+ngx_http_tnt_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_buf_t                   *b, *request_b = NULL;
-    ngx_chain_t                 *body;
-    size_t                      complete_msg_size;
-    tp_transcode_t              tc;
-    ngx_http_tnt_ctx_t          *ctx;
-    ngx_chain_t                 *out_chain;
-    ngx_http_tnt_loc_conf_t     *tlcf;
-    const ngx_http_tnt_error_t  *e;
+    u_char                    *p;
+    ssize_t                   size;
+    ngx_int_t                 rate, scale;
+    ngx_str_t                 *value, name, s;
+    ngx_http_tnt_rate_conf_t  *rc;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    value = cf->args->elts;
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p == NULL) {
+        goto invalid;
+    }
 
-    out_chain = ngx_alloc_chain_link(r->pool);
+    name.data = value[1].data;
+    name.len = p - name.data;
 
-    if (out_chain == NULL) {
-        return NGX_ERROR;
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR || name.len == 0) {
+        goto invalid;
     }
 
-    if (tlcf->pass_http_request & NGX_TNT_CONF_ON) {
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-        request_b = ngx_http_tnt_get_request_data_map(r, tlcf);
-        if (request_b == NULL) {
-            return NGX_ERROR;
-        }
+    /** rate=Nr/s or rate=Nr/m like limit_req_zone */
+    if (ngx_strncmp(value[2].data, "rate=", sizeof("rate=") - 1) != 0
+        || value[2].len <= sizeof("rate=r/s") - 1)
+    {
+        goto invalid_rate;
     }
 
-    out_chain->buf = ngx_create_temp_buf(r->pool,
-                        ngx_http_tnt_get_output_size(r, ctx, tlcf, request_b));
+    p = value[2].data + value[2].len - (sizeof("r/s") - 1);
 
-    if (out_chain->buf == NULL) {
+    if (ngx_strncmp(p, "r/s", sizeof("r/s") - 1) == 0) {
+        scale = 1;
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                "ngx_http_tnt_body_handler "
-                "failed to allocate output buffer, size %ui",
-                (r->headers_in.content_length_n + 1) * tlcf->in_multiplier);
-        return NGX_ERROR;
+    } else if (ngx_strncmp(p, "r/m", sizeof("r/m") - 1) == 0) {
+        scale = 60;
+
+    } else {
+        goto invalid_rate;
     }
 
-    out_chain->next = NULL;
-    out_chain->buf->memory = 1;
-    out_chain->buf->flush = 1;
+    rate = ngx_atoi(value[2].data + sizeof("rate=") - 1,
+                    value[2].len - (sizeof("rate=r/s") - 1));
+    if (rate == NGX_ERROR || rate == 0) {
+        goto invalid_rate;
+    }
 
-    out_chain->buf->pos = out_chain->buf->start;
-    out_chain->buf->last = out_chain->buf->pos;
-    out_chain->buf->last_in_chain = 1;
+    rc = ngx_pcalloc(cf->pool, sizeof(ngx_http_tnt_rate_conf_t));
+    if (rc == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    /**  Conv. input (json, x-url-encoded) into upstream format message {{{
-     */
-    tp_transcode_init_args_t args = {
-        .output = (char *) out_chain->buf->start,
-        .output_size = out_chain->buf->end - out_chain->buf->start,
-        .method = (char *) ctx->preset_method,
-        .method_len = ctx->preset_method_len,
-        .codec = YAJL_JSON_TO_TP,
-        .mf = NULL
-    };
+    rc->rate = (ngx_uint_t) (rate * 1000 / scale);
 
-    if (tp_transcode_init(&tc, &args) == TP_TRANSCODE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                "[BUG] failed to call tp_transcode_init(input)");
-        return NGX_ERROR;
+    rc->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                         &ngx_http_tnt_module);
+    if (rc->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    rc->shm_zone->init = ngx_http_tnt_rate_init_zone;
+    rc->shm_zone->data = rc;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid zone \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+
+invalid_rate:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid rate \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
+}
+
+
+/** The zone of tnt_limit can be defined later, it's checked by
+ *  ngx_http_tnt_rate_get_conf()
+ */
+static char *
+ngx_http_tnt_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_tnt_loc_conf_t *tlcf = conf;
+
+    u_char                             *p, *last, *q;
+    ngx_int_t                          n;
+    ngx_str_t                          *value, v, *method;
+    ngx_uint_t                         i;
+    ngx_http_tnt_rate_t                *rate;
+    ngx_http_compile_complex_value_t   ccv;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (tlcf->rates != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        if (cf->args->nelts > 2) {
+            return "has parameters with \"off\"";
+        }
+
+        tlcf->rates = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (tlcf->rates == NULL) {
+        return "is duplicate";
+    }
+
+    if (tlcf->rates == NGX_CONF_UNSET_PTR) {
+        tlcf->rates = ngx_array_create(cf->pool, 2,
+                                       sizeof(ngx_http_tnt_rate_t));
+        if (tlcf->rates == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    rate = ngx_array_push(tlcf->rates);
+    if (rate == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(rate, sizeof(ngx_http_tnt_rate_t));
+
+    rate->shm_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                           &ngx_http_tnt_module);
+    if (rate->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    /** Bind extra data e.g. http headers, uri etc */
-    if (request_b != NULL) {
-        tp_transcode_bind_data(&tc, (const char *) request_b->start,
-                (const char *) request_b->last);
+    if (rate->shm_zone->init != NULL
+        && rate->shm_zone->init != ngx_http_tnt_rate_init_zone)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" isn't a tnt_limit_zone", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    /** Parse url-encoded.
-     *
-     * urlencoded data saved into the first argument. The following code is
-     * making a trancoder happy :)
-     */
-    if (tlcf->pass_http_request & NGX_TNT_CONF_PARSE_URLENCODED) {
+    for (i = 2; i < cf->args->nelts; i++) {
 
-        if (tp_transcode(&tc, "{\"params\":[]}", sizeof("{\"params\":[]}") - 1)
-                == TP_TRANSCODE_ERROR)
+        if (ngx_strncmp(value[i].data, "method=", sizeof("method=") - 1)
+                == 0)
         {
-            ctx->state = INPUT_JSON_PARSE_FAILED;
-            goto read_input_done;
-        }
-    }
-
-    /** Parse JSON*/
-    else {
+            rate->methods = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+            if (rate->methods == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-        for (body = r->upstream->request_bufs; body; body = body->next) {
+            p = value[i].data + sizeof("method=") - 1;
+            last = value[i].data + value[i].len;
 
+            while (p < last) {
 
-            if (body->buf->in_file) {
+                q = ngx_strlchr(p, last, ',');
+                if (q == NULL) {
+                    q = last;
+                }
 
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "in-file buffer found. aborted. "
-                    "consider increasing your 'client_body_buffer_size' "
-                    "setting");
+                if (q == p) {
+                    goto invalid;
+                }
 
-                e = ngx_http_tnt_get_error_text(REQUEST_TOO_LARGE);
-                if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
-                    goto error_exit;
+                method = ngx_array_push(rate->methods);
+                if (method == NULL) {
+                    return NGX_CONF_ERROR;
                 }
 
-                ctx->state = INPUT_TO_LARGE;
-                goto read_input_done;
+                method->data = p;
+                method->len = q - p;
 
-            } else {
-                b = body->buf;
+                p = q + 1;
             }
 
-            if (tp_transcode(&tc, (char *) b->pos, b->last - b->pos)
-                    == TP_TRANSCODE_ERROR)
-            {
-                ctx->state = INPUT_JSON_PARSE_FAILED;
-                goto read_input_done;
+            if (rate->methods->nelts == 0) {
+                goto invalid;
             }
+
+            continue;
         }
-    }
 
-    if (tp_transcode_complete(&tc, &complete_msg_size) == TP_TRANSCODE_OK) {
+        if (ngx_strncmp(value[i].data, "burst=", sizeof("burst=") - 1) == 0) {
 
-        out_chain->buf->last = out_chain->buf->start + complete_msg_size;
+            n = ngx_atoi(value[i].data + sizeof("burst=") - 1,
+                         value[i].len - (sizeof("burst=") - 1));
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
 
-        if (tc.batch_size > 1) {
-            ctx->rest_batch_size = ctx->batch_size = tc.batch_size;
+            rate->burst = (ngx_uint_t) n * 1000;
+            continue;
         }
 
-        dd("ctx->batch_size:%i, tc.batch_size:%i, complete_msg_size:%i",
-            ctx->batch_size, tc.batch_size, (int) complete_msg_size);
+        if (ngx_strncmp(value[i].data, "key=", sizeof("key=") - 1) == 0) {
 
-    } else {
-        ctx->state = INPUT_JSON_PARSE_FAILED;
-        goto read_input_done;
-    }
-    /** }}} */
-read_input_done:
+            v.data = value[i].data + sizeof("key=") - 1;
+            v.len = value[i].len - (sizeof("key=") - 1);
 
-    if (ctx->state != OK) {
+            rate->key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (rate->key == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-        if (ctx->in_err == NULL &&
-                ngx_http_tnt_set_err(r, tc.errcode, (u_char *) tc.errmsg,
-                        ngx_strlen(tc.errmsg)) != NGX_OK)
-        {
-            goto error_exit;
-        }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
 
-        if (ngx_http_tnt_wakeup_dying_upstream(r, out_chain) != NGX_OK) {
-            goto error_exit;
+            ccv.cf = cf;
+            ccv.value = &v;
+            ccv.complex_value = rate->key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
         }
+
+        goto invalid;
     }
 
-    /** Hooking output chain*/
-    r->upstream->request_bufs = out_chain;
+    return NGX_CONF_OK;
 
-    tp_transcode_free(&tc);
+invalid:
 
-    return NGX_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
 
-error_exit:
 
-    tp_transcode_free(&tc);
+static ngx_http_tnt_rate_conf_t *
+ngx_http_tnt_rate_get_conf(ngx_log_t *log, ngx_shm_zone_t *shm_zone)
+{
+    if (shm_zone->init != ngx_http_tnt_rate_init_zone) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "zone \"%V\" isn't a tnt_limit_zone", &shm_zone->shm.name);
+        return NULL;
+    }
 
-    return NGX_ERROR;
+    return shm_zone->data;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_query_handler(ngx_http_request_t *r)
+/** Reads the function of the call at p, it's NULL for the other requests.
+ *
+ *  Returns the next call of a batch, NULL if the call is broken.
+ */
+static const char *
+ngx_http_tnt_rate_method(const char *p, const char *end, const char **name,
+        uint32_t *len)
 {
-    ngx_int_t                  rc;
-    ngx_buf_t                  *buf;
-    ngx_http_tnt_ctx_t         *ctx;
-    ngx_chain_t                *out_chain;
-    ngx_http_tnt_loc_conf_t    *tlcf;
-    struct tp                  tp;
-    const ngx_http_tnt_error_t *err = NULL;
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    uint32_t    n;
+    uint64_t    size;
+    const char  *h, *next;
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    *name = NULL;
 
-    out_chain = ngx_alloc_chain_link(r->pool);
-    if (out_chain == NULL) {
-        return NGX_ERROR;
+    if (end - p <= 5 || mp_typeof(*p) != MP_UINT) {
+        return NULL;
     }
 
-    out_chain->buf = ngx_create_temp_buf(r->pool,
-                                         tlcf->pass_http_request_buffer_size);
-    if (out_chain->buf == NULL) {
-        return NGX_ERROR;
+    size = mp_decode_uint(&p);
+    if (size > (uint64_t) (end - p)) {
+        return NULL;
     }
 
-    out_chain->next = NULL;
-    out_chain->buf->memory = 1;
-    out_chain->buf->flush = 1;
+    next = p + size;
 
-    out_chain->buf->pos = out_chain->buf->start;
-    out_chain->buf->last = out_chain->buf->pos;
-    out_chain->buf->last_in_chain = 1;
+    /** Header */
+    h = p;
+    if (mp_typeof(*p) != MP_MAP || mp_check(&h, next) != 0) {
+        return NULL;
+    }
 
-    /**
-     *  Conv. GET/PUT/PATCH/DELETE to Tarantool message [
-     */
-    buf = out_chain->buf;
-    tp_init(&tp, (char *) buf->start, buf->end - buf->start, NULL, NULL);
+    p = h;
 
-    if (!tp_call_nargs(&tp, (const char *) ctx->preset_method,
-                            (size_t) ctx->preset_method_len, 1))
-    {
-        err = ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "ngx_http_tnt_query_handler - %s",
-                get_str_safe(err->msg.data));
-        return NGX_ERROR;
+    /** Body */
+    h = p;
+    if (p >= next || mp_typeof(*p) != MP_MAP || mp_check(&h, next) != 0) {
+        return NULL;
     }
 
-    rc = ngx_http_tnt_get_request_data(r, tlcf, &tp);
-    if (rc != NGX_OK) {
-        err = ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "ngx_http_tnt_query_handler - %s",
-                get_str_safe(err->msg.data));
-        return rc;
-    }
+    for (n = mp_decode_map(&p); n > 0; n--) {
 
-    out_chain->buf->last = (u_char *) tp.p;
-    /** ]
-     */
+        if (mp_typeof(*p) != MP_UINT) {
+            mp_next(&p);
+            mp_next(&p);
+            continue;
+        }
 
-    /**
-     * Hooking output chain
-     */
-    r->upstream->request_bufs = out_chain;
+        if (mp_decode_uint(&p) == TP_FUNCTION && mp_typeof(*p) == MP_STR) {
+            *name = mp_decode_str(&p, len);
+            break;
+        }
 
-    return NGX_OK;
+        mp_next(&p);
+    }
+
+    return next;
 }
 
 
-static ngx_int_t
-ngx_http_tnt_dml_handler(ngx_http_request_t *r)
+/** Finds the bucket of the key, a new key takes a free node or the oldest
+ *  one of NGX_HTTP_TNT_RATE_PROBES nodes if create is 1, otherwise NULL is
+ *  returned. It's called under the mutex.
+ */
+static ngx_http_tnt_rate_node_t *
+ngx_http_tnt_rate_lookup(ngx_http_tnt_rate_shctx_t *sh, u_char *key,
+        size_t len, ngx_msec_t now, ngx_uint_t create)
 {
-    ngx_int_t                       rc;
-    ngx_buf_t                       *buf;
-    ngx_http_tnt_ctx_t              *ctx;
-    ngx_chain_t                     *out_chain;
-    ngx_http_tnt_loc_conf_t         *tlcf;
-    struct tp                       tp;
-    ngx_http_tnt_prepared_result_t   prepared_result;
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    uint32_t                  hash;
+    ngx_uint_t                i;
+    ngx_http_tnt_rate_node_t  *node, *oldest;
 
-    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
+    hash = ngx_crc32_short(key, len);
+    oldest = NULL;
 
-    rc = ngx_http_tnt_format_init(tlcf, r, &prepared_result);
-    if (rc != NGX_OK) {
-        return rc;
-    }
+    for (i = 0; i < NGX_HTTP_TNT_RATE_PROBES; i++) {
 
-    out_chain = ngx_alloc_chain_link(r->pool);
-    if (out_chain == NULL) {
-        return NGX_ERROR;
-    }
+        node = &sh->nodes[(hash + i) % sh->n];
 
-    /** Preapre */
-    rc = ngx_http_tnt_format_prepare(tlcf, r, &prepared_result);
+        if (node->used && node->hash == hash && node->len == len
+            && ngx_memcmp(node->key, key,
+                          ngx_min(len, NGX_HTTP_TNT_RATE_KEY_LEN)) == 0)
+        {
+            return node;
+        }
 
-    if (rc != NGX_OK) {
+        if (oldest == NULL || !node->used
+            || (oldest->used
+                && (ngx_msec_int_t) (node->last - oldest->last) < 0))
+        {
+            oldest = node;
+        }
+    }
 
-        if (rc == NGX_HTTP_BAD_REQUEST || rc == NGX_HTTP_NOT_ALLOWED) {
+    if (!create) {
+        return NULL;
+    }
 
-            rc = ngx_http_tnt_wakeup_dying_upstream(r, out_chain);
-            if (rc != NGX_OK) {
-                return rc;
-            }
+    oldest->used = 1;
+    oldest->hash = hash;
+    oldest->last = now;
+    oldest->excess = 0;
+    oldest->len = len;
+    ngx_memcpy(oldest->key, key, ngx_min(len, NGX_HTTP_TNT_RATE_KEY_LEN));
 
-            ctx->state = INPUT_FMT_CANT_READ_INPUT;
+    return oldest;
+}
 
-            /** Hooking output chain */
-            r->upstream->request_bufs = out_chain;
 
-            return NGX_OK;
-        }
+/** Adds a call of the method to the buckets of the request, the calls of
+ *  the same bucket are accounted together.
+ */
+static ngx_int_t
+ngx_http_tnt_rate_add(ngx_http_request_t *r, ngx_array_t *accounts,
+        ngx_http_tnt_rate_t *rate, const char *name, size_t name_len)
+{
+    u_char                       *key, *p;
+    size_t                       len;
+    ngx_str_t                    client;
+    ngx_uint_t                   i;
+    ngx_http_tnt_rate_account_t  *a;
 
-        return rc;
-    }
+    ngx_str_null(&client);
 
-    /** Init output chain */
-    out_chain->buf = ngx_create_temp_buf(r->pool,
-                                         tlcf->pass_http_request_buffer_size);
-    if (out_chain->buf == NULL) {
+    if (rate->key != NULL
+        && ngx_http_complex_value(r, rate->key, &client) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
-    out_chain->next = NULL;
-    out_chain->buf->memory = 1;
-    out_chain->buf->flush = 1;
-
-    out_chain->buf->pos = out_chain->buf->start;
-    out_chain->buf->last = out_chain->buf->pos;
-    out_chain->buf->last_in_chain = 1;
+    /** A key is the method and the key of the client */
+    len = name_len + 1 + client.len;
 
-    buf = out_chain->buf;
+    a = accounts->elts;
 
-    /** Here is starting a convertation from an HTTP request
-     *  to a Tarantool request
-     */
-    tp_init(&tp, (char *) buf->start, buf->end - buf->start, NULL, NULL);
+    for (i = 0; i < accounts->nelts; i++) {
 
-    /** Handle request type */
-    switch (tlcf->req_type) {
-    case TP_INSERT:
-        if (tp_insert(&tp, (uint32_t) prepared_result.space_id) == NULL ||
-            tp_tuple(&tp, prepared_result.tuples_count) == NULL)
+        if (a[i].rate == rate && a[i].len == len
+            && ngx_memcmp(a[i].key, name, name_len) == 0
+            && a[i].key[name_len] == '\0'
+            && ngx_memcmp(a[i].key + name_len + 1, client.data, client.len)
+               == 0)
         {
-            goto cant_issue_request;
+            ++a[i].calls;
+            return NGX_OK;
         }
-        break;
-    case TP_DELETE:
+    }
 
-        if (tp_delete(&tp, (uint32_t) prepared_result.space_id,
-                    (uint32_t) prepared_result.index_id) == NULL ||
-            tp_key(&tp, prepared_result.tuples_count) == NULL)
-        {
-            goto cant_issue_request;
-        }
-        break;
-    case TP_REPLACE:
-        if (tp_replace(&tp, (uint32_t) prepared_result.space_id) == NULL ||
-                tp_tuple(&tp, prepared_result.tuples_count) == NULL)
-        {
-            goto cant_issue_request;
-        }
-        break;
-    case TP_SELECT:
-        if (tp_select(&tp, (uint32_t) prepared_result.space_id,
-                    (uint32_t) prepared_result.index_id,
-                    prepared_result.offset, prepared_result.iter_type,
-                    prepared_result.limit) == NULL ||
-                tp_key(&tp, prepared_result.tuples_count) == NULL)
-        {
-            goto cant_issue_request;
-        }
-        break;
-    case TP_UPDATE:
-        if (tp_update(&tp, (uint32_t) prepared_result.space_id,
-                    (uint32_t) prepared_result.index_id) == NULL ||
-            tp_key(&tp, (uint32_t) prepared_result.update_keys_count) == NULL)
-        {
-            goto cant_issue_request;
-        }
-        break;
-    case TP_UPSERT:
-        if (tp_upsert(&tp, (uint32_t) prepared_result.space_id) == NULL ||
-                tp_tuple(&tp, (uint32_t) prepared_result.tuples_count)
-                    == NULL)
-        {
-            goto cant_issue_request;
-        }
-        break;
-    default:
-        goto cant_issue_request;
+    key = ngx_pnalloc(r->pool, len);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key, name, name_len);
+    *p++ = '\0';
+    ngx_memcpy(p, client.data, client.len);
+
+    a = ngx_array_push(accounts);
+    if (a == NULL) {
+        return NGX_ERROR;
     }
 
-    /** Bind values */
-    rc = ngx_http_tnt_format_bind(r, &prepared_result, &tp);
+    a->rate = rate;
+    a->key = key;
+    a->len = len;
+    a->calls = 1;
+    a->excess = 0;
 
-    if (rc != NGX_OK) {
+    return NGX_OK;
+}
 
-        if (rc == NGX_HTTP_BAD_REQUEST) {
 
-            rc = ngx_http_tnt_wakeup_dying_upstream(r, out_chain);
-            if (rc != NGX_OK) {
-                return rc;
-            }
+/** Accounts the calls of the bucket, it's the leaky bucket of limit_req.
+ *  The bucket isn't changed, see ngx_http_tnt_rate_commit().
+ *
+ *  Returns NGX_BUSY if the bucket is full.
+ */
+static ngx_int_t
+ngx_http_tnt_rate_account(ngx_http_request_t *r,
+        ngx_http_tnt_rate_account_t *a)
+{
+    ngx_int_t                 excess;
+    ngx_msec_int_t            ms;
+    ngx_http_tnt_rate_conf_t  *rc;
+    ngx_http_tnt_rate_node_t  *node;
 
-            ctx->state = INPUT_FMT_CANT_READ_INPUT;
+    rc = ngx_http_tnt_rate_get_conf(r->connection->log, a->rate->shm_zone);
+    if (rc == NULL) {
+        return NGX_ERROR;
+    }
 
-            /** Hooking output chain */
-            r->upstream->request_bufs = out_chain;
+    ngx_shmtx_lock(&rc->shpool->mutex);
 
-            return NGX_OK;
+    node = ngx_http_tnt_rate_lookup(rc->sh, a->key, a->len, 0, 0);
+
+    /** The first call of a key is free like in limit_req */
+    if (node == NULL) {
+        excess = 0;
+
+    } else {
+
+        ms = (ngx_msec_int_t) (ngx_current_msec - node->last);
+        if (ms < 0) {
+            ms = 0;
         }
 
-        return rc;
+        excess = (ngx_int_t) node->excess
+                 - (ngx_int_t) (rc->rate * ms / 1000) + 1000;
+        if (excess < 0) {
+            excess = 0;
+        }
     }
 
-    out_chain->buf->last = (u_char *) tp.p;
+    ngx_shmtx_unlock(&rc->shpool->mutex);
 
-    /** Hooking output chain */
-    r->upstream->request_bufs = out_chain;
+    excess += (ngx_int_t) (a->calls - 1) * 1000;
 
-    return NGX_OK;
+    if ((ngx_uint_t) excess > a->rate->burst) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "tnt: limiting calls of \"%s\" by zone \"%V\"",
+                a->key, &a->rate->shm_zone->shm.name);
+        return NGX_BUSY;
+    }
 
-cant_issue_request:
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "Can't issue the query; It could be one of the following errors: "
-            "1) %V; "
-            "2) unknown request type.",
-            &ngx_http_tnt_get_error_text(HTTP_REQUEST_TOO_LARGE)->msg);
-    return NGX_ERROR;
+    a->excess = (ngx_uint_t) excess;
+
+    return NGX_OK;
 }
 
 
+/** Takes the accounted calls from the bucket */
 static ngx_int_t
-ngx_http_tnt_reinit_request(ngx_http_request_t *r)
+ngx_http_tnt_rate_commit(ngx_http_request_t *r,
+        ngx_http_tnt_rate_account_t *a)
 {
-    dd("reinit request");
+    ngx_msec_t                now;
+    ngx_http_tnt_rate_conf_t  *rc;
+    ngx_http_tnt_rate_node_t  *node;
 
-    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
-    if (ctx == NULL) {
-        return NGX_OK;
+    rc = ngx_http_tnt_rate_get_conf(r->connection->log, a->rate->shm_zone);
+    if (rc == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_http_tnt_cleanup(r, ctx);
-    ngx_http_tnt_reset_ctx(ctx);
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&rc->shpool->mutex);
+
+    node = ngx_http_tnt_rate_lookup(rc->sh, a->key, a->len, now, 1);
+
+    node->excess = a->excess;
+    node->last = now;
+
+    ngx_shmtx_unlock(&rc->shpool->mutex);
 
     return NGX_OK;
 }
 
 
+/** Checks the calls of the request in b by tnt_limit before it's sent to
+ *  Tarantool, the request is rejected if one of its calls is limited. All
+ *  calls are accounted first, so the buckets are changed only if the
+ *  request isn't rejected.
+ *
+ *  Returns NGX_HTTP_TNT_TOO_MANY_REQUESTS and sets the error if the request
+ *  is limited.
+ */
 static ngx_int_t
-ngx_http_tnt_process_header(ngx_http_request_t *r)
+ngx_http_tnt_rate_check(ngx_http_request_t *r, ngx_http_tnt_loc_conf_t *tlcf,
+        ngx_buf_t *b)
 {
-    ngx_http_upstream_t *u = r->upstream;
-    ngx_buf_t           *b = &r->upstream->buffer;
-    ngx_http_tnt_ctx_t  *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    uint32_t                     len;
+    ngx_int_t                    rc;
+    ngx_str_t                    *methods;
+    ngx_uint_t                   i, j;
+    ngx_array_t                  accounts;
+    const char                   *p, *end, *name;
+    ngx_http_tnt_rate_t          *rates;
+    ngx_http_tnt_rate_account_t  *a;
+    const ngx_http_tnt_error_t   *e;
+
+    if (tlcf->rates == NULL) {
+        return NGX_OK;
+    }
 
-    ngx_int_t rc;
+    if (ngx_array_init(&accounts, r->pool, 4,
+                sizeof(ngx_http_tnt_rate_account_t)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    dd("process_header-> greeting:%s, recv:%i",
-            ctx->greeting ? "yes" : "no", (int) (b->last - b->pos));
+    rates = tlcf->rates->elts;
 
-    if (!ctx->greeting) {
+    p = (const char *) b->pos;
+    end = (const char *) b->last;
 
-        rc = ngx_http_tnt_read_greeting(r, ctx, b);
-        if (rc == NGX_ERROR) {
-            return rc;
+    while (p < end) {
 
-        /** If ctx->state is not OK, then we did'nt sent a request,
-         *  and we should stop work with this upstream.
-         *
-         *  So I found that the most good what we can is stop work.
-         */
-        } else if (rc == NGX_AGAIN && ctx->state == OK) {
-            return rc;
+        p = ngx_http_tnt_rate_method(p, end, &name, &len);
+        if (p == NULL) {
+            break;
         }
-    }
 
-    switch (ctx->state) {
-    case OK:
-        break;
-    case INPUT_TO_LARGE:
-    case INPUT_JSON_PARSE_FAILED:
-    case INPUT_EMPTY:
-    case INPUT_FMT_CANT_READ_INPUT:
-        return ngx_http_tnt_output_err(r, ctx, NGX_HTTP_BAD_REQUEST);
-    default:
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "[BUG] unexpected ctx->stage(%i)", ctx->state);
-        return NGX_ERROR;
-    }
+        if (name == NULL) {
+            continue;
+        }
 
-   /*
-    *   At this stage we can't get full upstream size,
-    *   since Tarantool could send to us 1 upto N messages
-    *   where each of messages could have X size.
-    *
-    *   As fix -- just set each upstream mode to chunked.
-    */
-    u->headers_in.chunked = 1;
-    u->headers_in.status_n = 200;
-    u->state->status = 200;
+        for (i = 0; i < tlcf->rates->nelts; i++) {
 
-    return NGX_OK;
-}
+            if (rates[i].methods != NULL) {
 
+                methods = rates[i].methods->elts;
 
-static void
-ngx_http_tnt_abort_request(ngx_http_request_t *r)
-{
-    dd("abort request");
-    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
-    ngx_http_tnt_cleanup(r, ctx);
-}
+                for (j = 0; j < rates[i].methods->nelts; j++) {
+                    if (methods[j].len == len
+                        && ngx_strncmp(methods[j].data, name, len) == 0)
+                    {
+                        break;
+                    }
+                }
 
+                if (j == rates[i].methods->nelts) {
+                    continue;
+                }
+            }
 
-static void
-ngx_http_tnt_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
-{
-    dd("finalize request");
-    ngx_http_tnt_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
-    ngx_http_tnt_cleanup(r, ctx);
-}
+            if (ngx_http_tnt_rate_add(r, &accounts, &rates[i], name, len)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
 
+    a = accounts.elts;
 
-static ngx_int_t
-ngx_http_tnt_str_match(ngx_str_t *a, const char *b,
-        size_t len)
-{
-    if (a->len != len) {
-        return 0;
-    }
-    if (ngx_strncmp(a->data, (const u_char *) b, len) == 0) {
-        return 1;
-    }
-    return 0;
-}
+    for (i = 0; i < accounts.nelts; i++) {
 
+        rc = ngx_http_tnt_rate_account(r, &a[i]);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-static ngx_int_t
-ngx_http_tnt_set_err(ngx_http_request_t *r, int errcode, const u_char *msg,
-        size_t len)
-{
-    const size_t msglen = len + sizeof("{"
-                        "'error':{"
-                            "'message':'',"
-                            "'code':-XXXXX"
-                        "}"
-                    "}");
+        if (rc == NGX_BUSY) {
 
-    u_char              escaped_msg[len * 2];
-    u_char              *p;
-    ngx_http_tnt_ctx_t  *ctx;
-    ngx_buf_t           *b;
+            e = ngx_http_tnt_get_error_text(RATE_LIMITED);
+            if (ngx_http_tnt_set_err_str(r, e->code, e->msg) != NGX_OK) {
+                return NGX_ERROR;
+            }
 
-    b = ngx_create_temp_buf(r->pool, msglen);
+            return NGX_HTTP_TNT_TOO_MANY_REQUESTS;
+        }
+    }
 
-    if (b == NULL) {
-        return NGX_ERROR;
+    for (i = 0; i < accounts.nelts; i++) {
+        if (ngx_http_tnt_rate_commit(r, &a[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
+    return NGX_OK;
+}
 
-    b->memory = 1;
-    b->pos = b->start;
 
-    p = &escaped_msg[0];
-    memset(escaped_msg, 0, sizeof(escaped_msg));
-    const char *x;
-    if ((x = json_encode_string((char **) &p, sizeof(escaped_msg) - 1,
-                (const char *) msg, (size_t) len, true))
-                    != NULL)
-    {
-        escaped_msg[0] = 0;
-    }
+/** The request is encoded already, see ngx_http_tnt_rate_init() */
+static ngx_int_t
+ngx_http_tnt_rate_create_request(ngx_http_request_t *r)
+{
+    ngx_http_tnt_ctx_t  *ctx;
 
-    b->last = ngx_snprintf(b->start, msglen, "{"
-                        "\"error\":{"
-                            "\"code\":%d,"
-                            "\"message\":%s"
-                        "}"
-                    "}",
-                     errcode,
-                     (escaped_msg[0] == 0 ? (u_char *) "\"\"" : escaped_msg));
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-    ctx->in_err = b;
+    r->upstream->request_bufs = ctx->rate_bufs;
 
     return NGX_OK;
 }
 
 
-static const ngx_http_tnt_error_t *
-ngx_http_tnt_get_error_text(ngx_uint_t type)
+/** Encodes the request by u->create_request before the upstream is
+ *  initialized, so a limited request is replied with HTTP code 429 and
+ *  isn't sent to Tarantool.
+ */
+static void
+ngx_http_tnt_rate_init(ngx_http_request_t *r)
 {
-    static const ngx_http_tnt_error_t errors[] = {
+    ngx_http_upstream_t      *u;
+    ngx_http_tnt_ctx_t       *ctx;
+    ngx_http_tnt_loc_conf_t  *tlcf;
 
-        {   ngx_string(
-                "Request is too large, consider increasing your "
-                "server's setting 'client_body_buffer_size'"),
-            -32001
-        },
+    u = r->upstream;
 
-        {   ngx_string("Unknown parse error"),
-            -32002
-        },
+    ctx = ngx_http_get_module_ctx(r, ngx_http_tnt_module);
 
-        {   ngx_string(
-                "Request is too large, consider increasing your "
-                "server's setting 'tnt_pass_http_request_buffer_size'"),
-            -32001
-        },
+    tlcf = ngx_http_get_module_loc_conf(r, ngx_http_tnt_module);
 
-        {   ngx_string("The input has been mismatched by the format"),
-            400
-        },
+    if (r->request_body != NULL) {
+        u->request_bufs = r->request_body->bufs;
+    }
 
-        {   ngx_string(
-                "The input has been reached limits, consider increasing "
-                "server's settings 'tnt_select_limit_max', "
-                "'tnt_allowed_spaces', 'tnt_allowed_indexes'"),
-            405
-        }
+    if (u->create_request(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-    };
+    if (ctx->state == INPUT_RATE_LIMITED) {
+        ngx_http_finalize_request(r,
+                ngx_http_tnt_direct_output(r, NGX_HTTP_TNT_TOO_MANY_REQUESTS,
+                                           ctx->in_err));
+        return;
+    }
 
-    return &errors[type];
-}
+    /** nginx calls u->create_request again, the start of the upstream
+     *  is still timed by tnt_stats, see ngx_http_tnt_stats_hook()
+     */
+    ctx->rate_bufs = u->request_bufs;
 
-static size_t
-ngx_http_tnt_overhead(void)
-{
-    return sizeof("[{"
-        "'error': {"
-            "'code':-XXXXX,"
-            "'message':''"
-        "},"
-        "{ 'result': [[]],"
-        "'id': 1867996680 }"
-    "}");
-}
+    if (ctx->stats.create_request != NULL) {
+        ctx->stats.create_request = ngx_http_tnt_rate_create_request;
+
+    } else {
+        u->create_request = ngx_http_tnt_rate_create_request;
+    }
+
+    if (ngx_http_tnt_limit_get_conf(tlcf->upstream.upstream) != NULL) {
+        ngx_http_tnt_limit_init(r);
+        return;
+    }
 
+    ngx_http_upstream_init(r);
+}
+/** }}}
+ */
@@ -0,0 +1,66 @@
+
+/*
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Copyright (C) 2015-2019 Tarantool AUTHORS:
+ * please see AUTHORS file.
+ */
+
+#ifndef TP_PROBES_H_INCLUDED
+#define TP_PROBES_H_INCLUDED 1
+
+/** USDT probes of the provider 'tnt', see misc/tnt_latency.bt.
+ *
+ *  The probes are compiled out by default, build with
+ *  --with-cc-opt='-DTNT_PROBES' and systemtap-sdt-dev to get them. A probe
+ *  is a nop until a tracer attaches to it, its arguments aren't evaluated
+ *  in the default build.
+ */
+#if defined(TNT_PROBES)
+
+#include <sys/sdt.h>
+
+#   define TNT_PROBE1(name, a1) \
+        DTRACE_PROBE1(tnt, name, a1)
+#   define TNT_PROBE2(name, a1, a2) \
+        DTRACE_PROBE2(tnt, name, a1, a2)
+#   define TNT_PROBE3(name, a1, a2, a3) \
+        DTRACE_PROBE3(tnt, name, a1, a2, a3)
+#   define TNT_PROBE4(name, a1, a2, a3, a4) \
+        DTRACE_PROBE4(tnt, name, a1, a2, a3, a4)
+
+#else
+
+#   define TNT_PROBE1(name, a1)
+#   define TNT_PROBE2(name, a1, a2)
+#   define TNT_PROBE3(name, a1, a2, a3)
+#   define TNT_PROBE4(name, a1, a2, a3, a4)
+
+#endif /* TNT_PROBES */
+
+#endif /* TP_PROBES_H_INCLUDED */
@@ -41,6 +41,7 @@
 
 #include "tp_ext.h"
 #include "tp_transcode.h"
+#include "tp_probes.h"
 #include "json_encoders.h"
 
 #include <stdio.h>
@@ -228,10 +229,26 @@ stack_grow(yajl_ctx_t *s, int cond)
 #define stack_grow_array(s) stack_grow((s), TYPE_ARRAY)
 #define stack_grow_map(s) stack_grow((s), TYPE_MAP)
 
+static inline bool
+has_data(tp_transcode_t *tc)
+{
+    return (tc->data.pos && tc->data.len) || tc->data.encode;
+}
+
 static inline bool
 bind_data(yajl_ctx_t *s_ctx)
 {
     tp_transcode_t *tc = s_ctx->tc;
+    if (tc->data.encode && !tc->data.pos) {
+        char *end = tc->data.encode(tc->data.arg, s_ctx->tp.p, s_ctx->tp.e);
+        if (end == NULL)
+            return false;
+        tc->data.pos = s_ctx->tp.p;
+        tc->data.end = end;
+        tc->data.len = end - s_ctx->tp.p;
+        tp_add(&s_ctx->tp, tc->data.len);
+        return true;
+    }
     if (tc->data.pos && tc->data.len) {
         if (s_ctx->tp.e - s_ctx->tp.p < (ptrdiff_t)tc->data.len)
             return false;
@@ -241,6 +258,40 @@ bind_data(yajl_ctx_t *s_ctx)
     return true;
 }
 
+static inline bool
+capture_wanted(yajl_ctx_t *s_ctx)
+{
+    tp_transcode_t *tc = s_ctx->tc;
+
+    if (likely(tc->capture.index < 0 || tc->capture.value != NULL))
+        return false;
+
+    /* The stack is [call, params] while params of the first call are read
+     */
+    stack_item_t *item = stack_top(s_ctx);
+    return s_ctx->size == 2 && tc->batch_size == 1
+        && item->type == TYPE_ARRAY
+        && item->count == (uint32_t) tc->capture.index + 1;
+}
+
+static bool
+capture_param(yajl_ctx_t *s_ctx, const char *str, size_t len)
+{
+    tp_transcode_t *tc = s_ctx->tc;
+
+    tc->capture.value = ALLOC(s_ctx, len + 1);
+    if (unlikely(tc->capture.value == NULL)) {
+        say_error(s_ctx, -32603, "[BUG?] can't capture a parameter, OOM");
+        return false;
+    }
+
+    memcpy(tc->capture.value, str, len);
+    tc->capture.value[len] = '\0';
+    tc->capture.len = len;
+
+    return true;
+}
+
 static int
 yajl_null(void *ctx)
 {
@@ -269,6 +320,12 @@ yajl_boolean(void * ctx, int v)
     dd("bool: %s\n", v ? "true" : "false");
 
     stack_grow_array(s_ctx);
+
+    if (unlikely(capture_wanted(s_ctx))
+        && !capture_param(s_ctx, v ? "true" : "false", v ? 4 : 5))
+    {
+        return 0;
+    }
     if (unlikely(!tp_encode_bool(&s_ctx->tp, v)))
         say_overflow_r_2(s_ctx);
 
@@ -286,6 +343,13 @@ yajl_integer(void *ctx, long long v)
 
         stack_grow_array(s_ctx);
 
+        if (unlikely(capture_wanted(s_ctx))) {
+            char num[sizeof("-9223372036854775808")];
+            int num_len = snprintf(num, sizeof(num), "%lld", v);
+            if (!capture_param(s_ctx, num, num_len))
+                return 0;
+        }
+
         char *r = NULL;
         if (v < 0)
             r = tp_encode_int(&s_ctx->tp, (int64_t)v);
@@ -324,6 +388,14 @@ yajl_double(void *ctx, double v)
 
     stack_grow_array(s_ctx);
 
+    /* LuaJIT's tostring() uses "%.14g" */
+    if (unlikely(capture_wanted(s_ctx))) {
+        char num[32];
+        int num_len = snprintf(num, sizeof(num), "%.14g", v);
+        if (!capture_param(s_ctx, num, num_len))
+            return 0;
+    }
+
     if (unlikely(!tp_encode_double(&s_ctx->tp, v)))
         say_overflow_r_2(s_ctx);
 
@@ -342,6 +414,12 @@ yajl_string(void *ctx, const unsigned char * str, size_t len)
 
         stack_grow_array(s_ctx);
 
+        if (unlikely(capture_wanted(s_ctx))
+            && !capture_param(s_ctx, (const char *)str, len))
+        {
+            return 0;
+        }
+
         if (len > 0) {
             if (unlikely(!tp_encode_str(&s_ctx->tp, (const char *)str, len)))
                 say_overflow_r_2(s_ctx);
@@ -500,8 +578,7 @@ yajl_end_map(void *ctx)
             if (unlikely(!tp_call_wof_add_params(&s_ctx->tp)))
                 say_overflow_r_2(s_ctx);
 
-            if (s_ctx->tc->data.pos && s_ctx->tc->data.len
-                    /*has data to bind*/) {
+            if (has_data(s_ctx->tc)) {
                 tp_encode_array(&s_ctx->tp, 1);
                 if (unlikely(!bind_data(s_ctx)))
                     say_overflow_r_2(s_ctx);
@@ -619,7 +696,7 @@ yajl_end_array(void *ctx)
             s_ctx->been_stages |= PARAMS;
             // Increase number of args for binded data [
             tp_transcode_t *tc = s_ctx->tc;
-            if (tc->data.pos && tc->data.len)
+            if (has_data(tc))
               ++item_count;
             // ]
         }
@@ -836,6 +913,27 @@ typedef struct tp2json {
     size_t multireturn_skip_count;
     size_t multireturn_skiped;
 
+    /* Drop the leading 'true' and the trailing nils of the reply data,
+     * see tp_reply_to_json_set_unwrap_status()
+     */
+    bool unwrap_status;
+
+    /* The cursor of the next page, see tp_reply_to_json_set_cursor()
+     */
+    const char *cursor;
+    size_t cursor_len;
+
+    /* Only the rows of the reply separated by rows_sep, see
+     * tp_reply_to_json_set_rows()
+     */
+    char rows_sep;
+
+    /* Tuples are objects of the fields, see tp_reply_to_json_set_fields()
+     */
+    const tp_transcode_field_t *fields;
+    size_t fields_count;
+    bool fields_rest;
+
 } tp2json_t;
 
 static inline int
@@ -900,6 +998,43 @@ tp2json_free(void *ctx_)
             OOM_TP2JSON; \
     } while (0)
 
+static enum tt_result
+tp2json_transcode_internal(tp2json_t *ctx, const char **beg, const char *end);
+
+static enum tt_result
+tp2json_transcode_array(tp2json_t *ctx, const char **beg, const char *end,
+                        uint32_t size)
+{
+    enum tt_result rc;
+    size_t len = ctx->end - ctx->pos;
+
+    if (ctx->multireturn_skiped > 0) {
+
+        --ctx->multireturn_skiped;
+         rc = tp2json_transcode_internal(ctx, beg, end);
+         if (rc != TP_TRANSCODE_OK)
+             return rc;
+
+    } else {
+
+        if (unlikely(len < size + 2 /*,[]*/))
+            OOM_TP2JSON;
+
+        APPEND_CH('[');
+        uint32_t i = 0;
+        for (i = 0; i < size; i++) {
+            if (i)
+                APPEND_CH(',');
+            rc = tp2json_transcode_internal(ctx, beg, end);
+            if (rc != TP_TRANSCODE_OK)
+                return rc;
+        }
+        APPEND_CH(']');
+    }
+
+    return TP_TRANSCODE_OK;
+}
+
 static enum tt_result
 tp2json_transcode_internal(tp2json_t *ctx, const char **beg, const char *end)
 {
@@ -970,29 +1105,9 @@ tp2json_transcode_internal(tp2json_t *ctx, const char **beg, const char *end)
     {
         const uint32_t size = mp_decode_array(beg);
 
-        if (ctx->multireturn_skiped > 0) {
-
-            --ctx->multireturn_skiped;
-             rc = tp2json_transcode_internal(ctx, beg, end);
-             if (rc != TP_TRANSCODE_OK)
-                 return rc;
-
-        } else {
-
-            if (unlikely(len < size + 2 /*,[]*/))
-                OOM_TP2JSON;
-
-            APPEND_CH('[');
-            uint32_t i = 0;
-            for (i = 0; i < size; i++) {
-                if (i)
-                    APPEND_CH(',');
-                rc = tp2json_transcode_internal(ctx, beg, end);
-                if (rc != TP_TRANSCODE_OK)
-                    return rc;
-            }
-            APPEND_CH(']');
-        }
+        rc = tp2json_transcode_array(ctx, beg, end, size);
+        if (rc != TP_TRANSCODE_OK)
+            return rc;
         break;
     }
     case MP_MAP:
@@ -1058,6 +1173,168 @@ tp2json_transcode_internal(tp2json_t *ctx, const char **beg, const char *end)
 #undef PUT_CHAR
 }
 
+static enum tt_result
+tp2json_transcode_key(tp2json_t *ctx, const char *name, size_t name_len,
+                      uint32_t fieldno)
+{
+    size_t len = ctx->end - ctx->pos;
+
+    if (name_len == 0) {
+        if (unlikely(len < sizeof("\"4294967295\":") - 1))
+            OOM_TP2JSON;
+        ctx->pos += snprintf(ctx->pos, len, "\"%" PRIu32 "\"",
+                             fieldno + 1);
+    } else {
+        const char *emsg = json_encode_string_ns(&ctx->pos, len, name,
+                                                 name_len);
+        if (emsg) {
+            say_error_(ctx->tc, -32603, emsg, strlen(emsg));
+            return TP_TRANSCODE_ERROR;
+        }
+    }
+
+    len = ctx->end - ctx->pos;
+    APPEND_CH(':');
+
+    return TP_TRANSCODE_OK;
+}
+
+/* A tuple as an object, the fields are found by moving forward from the
+ * previous one, so the fields in the order of the tuple cost one pass.
+ */
+static enum tt_result
+tp2json_transcode_object(tp2json_t *ctx, const char **beg, const char *end)
+{
+    enum tt_result rc;
+    const char *tuple, *it;
+    uint32_t size, total, i, no, n = 0;
+    size_t len = ctx->end - ctx->pos;
+
+    if (mp_typeof(**beg) != MP_ARRAY)
+        return tp2json_transcode_internal(ctx, beg, end);
+
+    size = mp_decode_array(beg);
+    it = tuple = *beg;
+    no = 0;
+
+    APPEND_CH('{');
+
+    total = ctx->fields_count;
+    if (ctx->fields_rest && size > total)
+        total = size;
+
+    for (i = 0; i < total; i++) {
+
+        const tp_transcode_field_t *f = NULL;
+        uint32_t fieldno = i;
+
+        if (i < ctx->fields_count) {
+            f = &ctx->fields[i];
+            fieldno = f->fieldno;
+        }
+
+        len = ctx->end - ctx->pos;
+        if (n++)
+            APPEND_CH(',');
+
+        rc = tp2json_transcode_key(ctx, f ? f->name : NULL, f ? f->len : 0,
+                                   fieldno);
+        if (rc != TP_TRANSCODE_OK)
+            return rc;
+
+        if (fieldno >= size) {
+            len = ctx->end - ctx->pos;
+            APPEND_STR("null");
+            continue;
+        }
+
+        if (fieldno < no) {
+            it = tuple;
+            no = 0;
+        }
+
+        for (; no < fieldno; no++)
+            mp_next(&it);
+
+        rc = tp2json_transcode_internal(ctx, &it, end);
+        if (rc != TP_TRANSCODE_OK)
+            return rc;
+
+        ++no;
+    }
+
+    len = ctx->end - ctx->pos;
+    APPEND_CH('}');
+
+    /* Skip the rest of the tuple */
+    for (; no < size; no++)
+        mp_next(&it);
+
+    *beg = it;
+
+    return TP_TRANSCODE_OK;
+}
+
+static enum tt_result
+tp2json_transcode_objects(tp2json_t *ctx, const char **beg, const char *end)
+{
+    enum tt_result rc;
+    uint32_t size, i;
+    size_t len = ctx->end - ctx->pos;
+
+    if (mp_typeof(**beg) != MP_ARRAY)
+        return tp2json_transcode_internal(ctx, beg, end);
+
+    size = mp_decode_array(beg);
+
+    APPEND_CH('[');
+
+    for (i = 0; i < size; i++) {
+
+        if (i) {
+            len = ctx->end - ctx->pos;
+            APPEND_CH(',');
+        }
+
+        rc = tp2json_transcode_object(ctx, beg, end);
+        if (rc != TP_TRANSCODE_OK)
+            return rc;
+    }
+
+    len = ctx->end - ctx->pos;
+    APPEND_CH(']');
+
+    return TP_TRANSCODE_OK;
+}
+
+static enum tt_result
+tp2json_transcode_unwrapped(tp2json_t *ctx, const char **beg, const char *end)
+{
+    const char *it = *beg, *results;
+    uint32_t size, i, n;
+
+    if (mp_typeof(*it) != MP_ARRAY)
+        return tp2json_transcode_internal(ctx, beg, end);
+
+    size = mp_decode_array(&it);
+
+    /* [false|nil, error] is passed as is */
+    if (size == 0 || mp_typeof(*it) != MP_BOOL || !mp_decode_bool(&it))
+        return tp2json_transcode_internal(ctx, beg, end);
+
+    results = it;
+    for (i = 1, n = 0; i < size; i++) {
+        if (mp_typeof(*it) != MP_NIL)
+            n = i;
+        mp_next(&it);
+    }
+
+    *beg = results;
+    enum tt_result rc = tp2json_transcode_array(ctx, beg, end, n);
+    *beg = it;
+    return rc;
+}
+
 static enum tt_result
 tp_reply2json_transcode(void *ctx_, const char *in, size_t in_size)
 {
@@ -1086,6 +1363,34 @@ tp_reply2json_transcode(void *ctx_, const char *in, size_t in_size)
 
         rc = TP_TNT_ERROR;
 
+    } else if (ctx->rows_sep) {
+
+        const char *it = ctx->r.data;
+        uint32_t i, size = 0;
+
+        if (it != NULL && mp_typeof(*it) == MP_ARRAY)
+            size = mp_decode_array(&it);
+
+        for (i = 0; i < size; i++) {
+
+            if (i) {
+                if (unlikely(ctx->pos == ctx->end)) {
+                    say_error(ctx, -32603, "json formatter: not enoght memory");
+                    goto error_exit;
+                }
+                *ctx->pos++ = ctx->rows_sep;
+            }
+
+            if (ctx->fields != NULL)
+                rc = tp2json_transcode_object(ctx, &it, ctx->r.data_end);
+            else
+                rc = tp2json_transcode_internal(ctx, &it, ctx->r.data_end);
+            if (unlikely(rc == TP_TRANSCODE_ERROR))
+                goto error_exit;
+        }
+
+        return TP_TRANSCODE_OK;
+
     } else {
 
         if (!ctx->pure_result) {
@@ -1095,10 +1400,28 @@ tp_reply2json_transcode(void *ctx_, const char *in, size_t in_size)
 
 
         const char *it = ctx->r.data;
-        rc = tp2json_transcode_internal(ctx, &it, ctx->r.data_end);
+        if (ctx->unwrap_status)
+            rc = tp2json_transcode_unwrapped(ctx, &it, ctx->r.data_end);
+        else if (ctx->fields != NULL)
+            rc = tp2json_transcode_objects(ctx, &it, ctx->r.data_end);
+        else
+            rc = tp2json_transcode_internal(ctx, &it, ctx->r.data_end);
         if (unlikely(rc == TP_TRANSCODE_ERROR))
             goto error_exit;
 
+        if (!ctx->pure_result && ctx->cursor != NULL) {
+
+            if (unlikely((size_t) (ctx->end - ctx->pos)
+                        < ctx->cursor_len + sizeof(",\"cursor\":\"\"}")))
+            {
+                say_error(ctx, -32603, "json formatter: not enoght memory");
+                goto error_exit;
+            }
+
+            ctx->pos += snprintf(ctx->pos, ctx->end - ctx->pos,
+                    ",\"cursor\":\"%.*s\"", (int) ctx->cursor_len,
+                    ctx->cursor);
+        }
     }
 
     if (!ctx->pure_result ||
@@ -1156,7 +1479,8 @@ tp2json_complete(void *ctx_, size_t *complete_msg_size)
 {
     tp2json_t *ctx = ctx_;
 
-    if (unlikely(ctx->pos == ctx->output)) {
+    /* A reply without rows is empty, see tp_reply_to_json_set_rows() */
+    if (unlikely(ctx->pos == ctx->output) && !ctx->rows_sep) {
         *complete_msg_size = 0;
         return TP_TRANSCODE_ERROR;
     }
@@ -1164,6 +1488,253 @@ tp2json_complete(void *ctx_, size_t *complete_msg_size)
     return TP_TRANSCODE_OK;
 }
 
+/**
+ * CODEC - JSON to MsgPack
+ */
+
+enum { JSON2MP_MAX_DEPTH = 64 };
+
+typedef struct {
+    yajl_handle hand;
+
+    yajl_alloc_funcs *yaf;
+
+    /* The containers which are open, the header of a container is
+     * written, when the container is closed.
+     */
+    stack_item_t stack[JSON2MP_MAX_DEPTH];
+    uint32_t size;
+
+    char *output;
+    char *pos;
+    char *end;
+
+    tp_transcode_t *tc;
+} json2mp_t;
+
+#define json2mp_ensure(ctx, sz) do { \
+        if (unlikely((size_t) ((ctx)->end - (ctx)->pos) < (size_t) (sz))) \
+            say_overflow_r_2(ctx); \
+    } while (0)
+
+static inline void
+json2mp_grow(json2mp_t *ctx)
+{
+    if (ctx->size > 0 && ctx->stack[ctx->size - 1].type == TYPE_ARRAY)
+        ++ctx->stack[ctx->size - 1].count;
+}
+
+static int
+json2mp_null(void *ctx_)
+{
+    json2mp_t *ctx = ctx_;
+    json2mp_grow(ctx);
+    json2mp_ensure(ctx, mp_sizeof_nil());
+    ctx->pos = mp_encode_nil(ctx->pos);
+    return 1;
+}
+
+static int
+json2mp_boolean(void *ctx_, int v)
+{
+    json2mp_t *ctx = ctx_;
+    json2mp_grow(ctx);
+    json2mp_ensure(ctx, mp_sizeof_bool(v));
+    ctx->pos = mp_encode_bool(ctx->pos, v);
+    return 1;
+}
+
+static int
+json2mp_integer(void *ctx_, long long v)
+{
+    json2mp_t *ctx = ctx_;
+    json2mp_grow(ctx);
+    if (v < 0) {
+        json2mp_ensure(ctx, mp_sizeof_int(v));
+        ctx->pos = mp_encode_int(ctx->pos, v);
+    } else {
+        json2mp_ensure(ctx, mp_sizeof_uint(v));
+        ctx->pos = mp_encode_uint(ctx->pos, v);
+    }
+    return 1;
+}
+
+static int
+json2mp_double(void *ctx_, double v)
+{
+    json2mp_t *ctx = ctx_;
+    json2mp_grow(ctx);
+    json2mp_ensure(ctx, mp_sizeof_double(v));
+    ctx->pos = mp_encode_double(ctx->pos, v);
+    return 1;
+}
+
+static int
+json2mp_string(void *ctx_, const unsigned char *str, size_t len)
+{
+    json2mp_t *ctx = ctx_;
+    json2mp_grow(ctx);
+    json2mp_ensure(ctx, mp_sizeof_str(len));
+    ctx->pos = mp_encode_str(ctx->pos, (const char *) str, len);
+    return 1;
+}
+
+static int
+json2mp_map_key(void *ctx_, const unsigned char *key, size_t len)
+{
+    json2mp_t *ctx = ctx_;
+    ++ctx->stack[ctx->size - 1].count;
+    json2mp_ensure(ctx, mp_sizeof_str(len));
+    ctx->pos = mp_encode_str(ctx->pos, (const char *) key, len);
+    return 1;
+}
+
+static int
+json2mp_start(json2mp_t *ctx, int type)
+{
+    json2mp_grow(ctx);
+
+    if (unlikely(ctx->size == JSON2MP_MAX_DEPTH)) {
+        say_error(ctx, -32603, "[BUG?] 'stack' overflow");
+        return 0;
+    }
+
+    json2mp_ensure(ctx, 1 + sizeof(uint32_t));
+
+    ctx->stack[ctx->size].ptr = ctx->pos;
+    ctx->stack[ctx->size].count = 0;
+    ctx->stack[ctx->size].type = type;
+    ++ctx->size;
+
+    ctx->pos += 1 + sizeof(uint32_t);
+    return 1;
+}
+
+static int
+json2mp_start_map(void *ctx)
+{
+    return json2mp_start(ctx, TYPE_MAP);
+}
+
+static int
+json2mp_start_array(void *ctx)
+{
+    return json2mp_start(ctx, TYPE_ARRAY);
+}
+
+static int
+json2mp_end(void *ctx_)
+{
+    json2mp_t *ctx = ctx_;
+    stack_item_t *item = &ctx->stack[--ctx->size];
+    *item->ptr = item->type == TYPE_MAP ? 0xdf : 0xdd;
+    *(uint32_t *) (item->ptr + 1) = mp_bswap_u32(item->count);
+    return 1;
+}
+
+#undef json2mp_ensure
+
+static void json2mp_free(void *ctx);
+
+static void *
+json2mp_create(tp_transcode_t *tc, char *output, size_t output_size)
+{
+    static yajl_callbacks callbacks = {
+        json2mp_null,
+        json2mp_boolean,
+        json2mp_integer,
+        json2mp_double,
+        NULL,
+        json2mp_string,
+        json2mp_start_map,
+        json2mp_map_key,
+        json2mp_end,
+        json2mp_start_array,
+        json2mp_end
+    };
+
+    json2mp_t *ctx = tc->mf.alloc(tc->mf.ctx, sizeof(json2mp_t));
+    if (unlikely(!ctx))
+        return NULL;
+
+    memset(ctx, 0, sizeof(json2mp_t));
+
+    ctx->tc = tc;
+    ctx->pos = ctx->output = output;
+    ctx->end = output + output_size;
+
+    ctx->yaf = tc->mf.alloc(tc->mf.ctx, sizeof(yajl_alloc_funcs));
+    if (unlikely(!ctx->yaf))
+        goto error_exit;
+
+    *ctx->yaf = (yajl_alloc_funcs) {
+        tc->mf.alloc,
+        tc->mf.realloc,
+        tc->mf.free,
+        tc->mf.ctx
+    };
+
+    ctx->hand = yajl_alloc(&callbacks, ctx->yaf, (void *) ctx);
+    if (unlikely(!ctx->hand))
+        goto error_exit;
+
+    return ctx;
+
+error_exit:
+    json2mp_free(ctx);
+    return NULL;
+}
+
+static void
+json2mp_free(void *ctx_)
+{
+    json2mp_t *ctx = ctx_;
+    if (unlikely(!ctx))
+        return;
+
+    tp_transcode_t *tc = ctx->tc;
+
+    if (likely(ctx->hand != NULL))
+        yajl_free(ctx->hand);
+
+    if (likely(ctx->yaf != NULL))
+        FREE(ctx, ctx->yaf);
+
+    tc->mf.free(tc->mf.ctx, ctx);
+}
+
+static enum tt_result
+json2mp_transcode(void *ctx_, const char *input, size_t input_size)
+{
+    json2mp_t *ctx = ctx_;
+
+    yajl_status stat = yajl_parse(ctx->hand, (const unsigned char *) input,
+                                  input_size);
+    if (unlikely(stat != yajl_status_ok)) {
+        if (ctx->tc->errmsg == NULL)
+            say_invalid_json(ctx);
+        return TP_TRANSCODE_ERROR;
+    }
+
+    return TP_TRANSCODE_OK;
+}
+
+static enum tt_result
+json2mp_complete(void *ctx_, size_t *complete_msg_size)
+{
+    json2mp_t *ctx = ctx_;
+
+    const yajl_status stat = yajl_complete_parse(ctx->hand);
+    if (unlikely(stat != yajl_status_ok || ctx->size != 0)) {
+        if (ctx->tc->errmsg == NULL)
+            say_invalid_json(ctx);
+        return TP_TRANSCODE_ERROR;
+    }
+
+    *complete_msg_size = ctx->pos - ctx->output;
+    return TP_TRANSCODE_OK;
+}
+
 /**
  * List of codecs
  */
@@ -1192,6 +1763,11 @@ tp_codec_t codecs[TP_CODEC_MAX] = {
             &tp2json_complete,
             &tp2json_free),
 
+    CODEC(&json2mp_create,
+            &json2mp_transcode,
+            &json2mp_complete,
+            &json2mp_free),
+
 };
 #undef CODEC
 
@@ -1242,12 +1818,16 @@ tp_transcode_init(tp_transcode_t *t, const tp_transcode_init_args_t *args)
     t->method = args->method;
     t->method_len = args->method_len;
 
+    t->capture.index = -1;
+
     t->codec.ctx = t->codec.create(t, args->output, args->output_size);
     if (unlikely(!t->codec.ctx))
         return TP_TRANSCODE_ERROR;
 
     t->errcode = -32700;
 
+    TNT_PROBE2(transcode__init, t, args->codec);
+
     return TP_TRANSCODE_OK;
 }
 
@@ -1262,6 +1842,12 @@ tp_transcode_free(tp_transcode_t *t)
         t->errmsg = NULL;
     }
 
+    if (t->capture.value != NULL) {
+        t->mf.free(t->mf.ctx, t->capture.value);
+        t->capture.value = NULL;
+        t->capture.len = 0;
+    }
+
     t->codec.free(t->codec.ctx);
     t->codec.ctx = NULL;
 
@@ -1272,18 +1858,30 @@ tp_transcode_free(tp_transcode_t *t)
 enum tt_result
 tp_transcode_complete(tp_transcode_t *t, size_t *complete_msg_size)
 {
+    enum tt_result rc;
+
     assert(t);
     assert(t->codec.ctx);
     *complete_msg_size = 0;
-    return t->codec.complete(t->codec.ctx, complete_msg_size);
+    rc = t->codec.complete(t->codec.ctx, complete_msg_size);
+
+    TNT_PROBE3(transcode__complete, t, rc, *complete_msg_size);
+
+    return rc;
 }
 
 enum tt_result
 tp_transcode(tp_transcode_t *t, const char *b, size_t s)
 {
+    enum tt_result rc;
+
     assert(t);
     assert(t->codec.ctx);
-    return t->codec.transcode(t->codec.ctx, b, s);
+    rc = t->codec.transcode(t->codec.ctx, b, s);
+
+    TNT_PROBE3(transcode__chunk, t, s, rc);
+
+    return rc;
 }
 
 void
@@ -1297,6 +1895,25 @@ tp_transcode_bind_data(tp_transcode_t *t,
     t->data.len = data_end - data_beg;
 }
 
+void
+tp_transcode_bind_encoder(tp_transcode_t *t,
+                          tp_transcode_encode_data encode,
+                          void *arg)
+{
+    assert(t);
+    t->data.pos = t->data.end = NULL;
+    t->data.len = 0;
+    t->data.encode = encode;
+    t->data.arg = arg;
+}
+
+void
+tp_transcode_capture_param(tp_transcode_t *t, int index)
+{
+    assert(t);
+    t->capture.index = index;
+}
+
 void
 tp_reply_to_json_set_options(tp_transcode_t *t,
                              bool pure_result,
@@ -1309,6 +1926,56 @@ tp_reply_to_json_set_options(tp_transcode_t *t,
     ctx->multireturn_skip_count = multireturn_skip_count;
 }
 
+void
+tp_reply_to_json_set_unwrap_status(tp_transcode_t *t, bool unwrap_status)
+{
+    assert(t);
+    assert(t->codec.ctx);
+    tp2json_t *ctx = t->codec.ctx;
+    ctx->unwrap_status = unwrap_status;
+}
+
+void
+tp_reply_to_json_set_cursor(tp_transcode_t *t, const char *cursor,
+                            size_t cursor_len)
+{
+    assert(t);
+    assert(t->codec.ctx);
+    tp2json_t *ctx = t->codec.ctx;
+    ctx->cursor = cursor;
+    ctx->cursor_len = cursor_len;
+}
+
+void
+tp_reply_to_json_set_rows(tp_transcode_t *t, char rows_sep)
+{
+    assert(t);
+    assert(t->codec.ctx);
+    tp2json_t *ctx = t->codec.ctx;
+    ctx->rows_sep = rows_sep;
+}
+
+void
+tp_reply_to_json_set_fields(tp_transcode_t *t,
+    const tp_transcode_field_t *fields, size_t count, bool rest)
+{
+    assert(t);
+    assert(t->codec.ctx);
+    tp2json_t *ctx = t->codec.ctx;
+    ctx->fields = fields;
+    ctx->fields_count = count;
+    ctx->fields_rest = rest;
+}
+
+void
+tp_json_to_mp_allow_multiple_values(tp_transcode_t *t)
+{
+    assert(t);
+    assert(t->codec.ctx);
+    json2mp_t *ctx = t->codec.ctx;
+    yajl_config(ctx->hand, yajl_allow_multiple_values, 1);
+}
+
 bool
 tp_dump(char *output, size_t output_size,
         const char *input, size_t input_size)
@@ -52,6 +52,7 @@ enum tt_result;
 
 /** Underlying codec functions
  */
+typedef char *(*tp_transcode_encode_data)(void *, char *, char *);
 typedef void *(*tp_codec_create)(struct tp_transcode*, char *, size_t);
 typedef void (*tp_codec_free)(void *);
 typedef enum tt_result (*tp_do_transcode)(void *, const char *, size_t);
@@ -88,6 +89,10 @@ enum tp_codec_type {
    */
   TP_TO_JSON,
 
+  /** Any JSON document to one MsgPack value (Yajl engine)
+   */
+  YAJL_JSON_TO_MP,
+
   TP_CODEC_MAX
 };
 
@@ -117,7 +122,21 @@ typedef struct tp_transcode {
     const char *pos;
     const char *end;
     size_t len;
+
+    /* Encodes the data straight into the output, see
+     * tp_transcode_bind_encoder()
+     */
+    tp_transcode_encode_data encode;
+    void *arg;
   } data;
+
+  /* A scalar from 'params' of the first call, see tp_transcode_capture_param()
+   */
+  struct {
+    int index;
+    char *value;
+    size_t len;
+  } capture;
 } tp_transcode_t;
 
 /**
@@ -177,12 +196,75 @@ tp_transcode_complete(tp_transcode_t *t, size_t *complete_msg_size);
 void tp_transcode_bind_data(tp_transcode_t *t,
     const char *data_beg, const char *data_end);
 
+/** Bind extra data, which is encoded by 'encode' into the output instead of
+ * being copied there (YAJL_JSON_TO_TP).
+ *
+ * encode(arg, p, end) writes the data from 'p' and returns the end of it or
+ * NULL if there is no space. It's called once, the data is copied from the
+ * output for the next calls of a batch.
+ */
+void tp_transcode_bind_encoder(tp_transcode_t *t,
+    tp_transcode_encode_data encode, void *arg);
+
+/** Capture params[index] of the first call as a string (YAJL_JSON_TO_TP).
+ *
+ * Strings are captured as is, numbers and booleans are captured as their
+ * Lua's tostring() representation. The result is stored in t->capture.
+ */
+void tp_transcode_capture_param(tp_transcode_t *t, int index);
+
 /**
  */
 void
 tp_reply_to_json_set_options(tp_transcode_t *t, bool pure_result,
     size_t multireturn_skip_count);
 
+/** The reply is a result of the call wrapped by a function which returns
+ *  'true, result...' on success (e.g. vshard.storage.call()). If it is set,
+ *  then the leading 'true' and the trailing nils are dropped from the reply.
+ */
+void
+tp_reply_to_json_set_unwrap_status(tp_transcode_t *t, bool unwrap_status);
+
+/** Add the "cursor" field to the reply, it's the position of the last tuple
+ *  of a select, encoded by a caller. The cursor isn't added if the result is
+ *  pure, see tp_reply_to_json_set_options().
+ */
+void
+tp_reply_to_json_set_cursor(tp_transcode_t *t, const char *cursor,
+    size_t cursor_len);
+
+/** Transcode only the rows of a reply, i.e. the elements of its data,
+ *  separated by rows_sep, e.g. '\n' for NDJSON. An error reply is
+ *  transcoded as usual.
+ */
+void
+tp_reply_to_json_set_rows(tp_transcode_t *t, char rows_sep);
+
+/** A field of tuples, see tp_reply_to_json_set_fields()
+ */
+typedef struct tp_transcode_field {
+    const char *name;
+    size_t len;
+    /* From 0, a field which the tuple doesn't have is null */
+    uint32_t fieldno;
+} tp_transcode_field_t;
+
+/** Transcode the tuples of a reply into objects of the fields. If rest is
+ *  true, then the fields of a tuple after the last one are transcoded as
+ *  well, their names are their numbers (from 1). Unnamed fields are named
+ *  the same way.
+ */
+void
+tp_reply_to_json_set_fields(tp_transcode_t *t,
+    const tp_transcode_field_t *fields, size_t count, bool rest);
+
+/** Allow a stream of JSON values, e.g. NDJSON. The values are transcoded
+ *  one by one, so the output is a sequence of MsgPack values.
+ */
+void
+tp_json_to_mp_allow_multiple_values(tp_transcode_t *t);
+
 /**
  * WARNING! tp_dump() is for debug!
  *
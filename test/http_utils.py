@@ -109,6 +109,49 @@ def request_raw(url, data, headers):
         print(traceback.format_exc())
         return (False, e)
 
+def post_raw(url, data, content_type):
+    out = '{}'
+    try:
+        req = urllib2.Request(url)
+        req.add_header('Content-Type', content_type)
+
+        res = urllib2.urlopen(req, data.encode('utf8'))
+        out = res.read()
+        rc = res.getcode()
+
+        if VERBOSE:
+            print("code: ", rc, " recv: '", out, "'")
+
+        return (rc, json.loads(out))
+    except urllib2.HTTPError as e:
+        out = e.read();
+
+        if VERBOSE:
+            print("code: ", e.code, " recv: '", out, "'")
+
+        return (e.code, json.loads(out))
+    except Exception as e:
+        print(traceback.format_exc())
+        return (False, e)
+
+def get_text(url):
+    try:
+        res = urllib2.urlopen(urllib2.Request(url))
+        out = res.read().decode('utf8')
+        rc = res.getcode()
+
+        if VERBOSE:
+            print("code: ", rc, " recv: '", out, "'")
+
+        return (rc, out, res.info().get('Content-Type'))
+    except urllib2.HTTPError as e:
+        out = e.read().decode('utf8')
+
+        if VERBOSE:
+            print("code: ", e.code, " recv: '", out, "'")
+
+        return (e.code, out, e.info().get('Content-Type'))
+
 def request(url, data, headers = None):
     return request_raw(url, json.dumps(data), headers)
 
@@ -10,7 +10,7 @@ LOG_PATH=$NGINX_PREFIX/logs
 # v24_features and v26_features fail now. They should be added
 # into this array with gh-144 fix.
 declare -a test_files=("basic_features" "v20_features" "v23_features"
-                       "v25_features" "v27_features")
+                       "v25_features" "v27_features" "v28_features")
 
 echo "[+] Logs saved into $LOG_PATH."
 
@@ -200,11 +200,111 @@ function issue_120(request)
   return request
 end
 
+-- tnt_fanout, rows are sorted by the first field
+function fanout_rows(req)
+  return {{1, 'a'}, {3, 'c'}, {5, 'e'}}
+end
+
+function fanout_error(req)
+  error('fanout error')
+end
+
+-- tnt_concurrency
+function sleep_echo(t, a)
+  fiber.sleep(t)
+  return {a}
+end
+
+-- tnt_limit, the calls are counted by a client
+rate_calls = {}
+function rate_echo(client, a)
+  rate_calls[client] = (rate_calls[client] or 0) + 1
+  return {a}
+end
+
+-- The same call, but a bucket of its own
+rate_other = rate_echo
+
+function rate_count(client)
+  return rate_calls[client] or 0
+end
+
+-- tnt_prewarm, each accepted connection has its own session, the time of
+-- its connect is kept
+sessions = {}
+box.session.on_connect(function()
+  sessions[box.session.id()] = fiber.time()
+end)
+box.session.on_disconnect(function()
+  sessions[box.session.id()] = nil
+end)
+
+function session_id()
+  return box.session.id()
+end
+
+function session_connected(id)
+  return sessions[id]
+end
+
+function sessions_count()
+  local n = 0
+  for _ in pairs(sessions) do
+    n = n + 1
+  end
+  return n
+end
+
+-- tnt_vshard, a fake vshard: this instance is the router and the storage
+-- of all buckets. The calls return where they were executed.
+vshard_wrong_buckets = {}
+
+function vshard_set_wrong_bucket(bucket_id, wrong)
+  vshard_wrong_buckets[bucket_id] = wrong or nil
+  return true
+end
+
+function vshard_bucket_id(key)
+  return require('digest').crc32(tostring(key)) % 3000 + 1
+end
+
+function nginx_vshard_bucket_map()
+  return {{1, 3000, '127.0.0.1:9999'}}
+end
+
+local function vshard_call(via, bucket_id, mode, func, args)
+  return {via = via, bucket_id = bucket_id, mode = mode,
+          result = _G[func](unpack(args or {}))}
+end
+
+vshard = {
+  storage = {
+    call = function(bucket_id, mode, func, args)
+      if vshard_wrong_buckets[bucket_id] then
+        return nil, {type = 'ShardingError', code = 1,
+                     name = 'WRONG_BUCKET', bucket_id = bucket_id}
+      end
+      return true, vshard_call('storage', bucket_id, mode, func, args)
+    end,
+  },
+  router = {
+    call = function(bucket_id, mode, func, args)
+      return vshard_call('router', bucket_id, mode, func, args)
+    end,
+  },
+}
+
 -- CFG
+-- Transactions of streams require MVCC, see tnt_transaction
+local major, minor = _TARANTOOL:match('^(%d+)%.(%d+)')
+local mvcc = tonumber(major) > 2
+    or (tonumber(major) == 2 and tonumber(minor) >= 10)
+
 box.cfg {
     log_level = 5,
     listen = 9999,
     wal_mode = 'none',
+    memtx_use_mvcc_engine = mvcc or nil,
 }
 
 -- FOR TESTING ONLY!!!
@@ -228,3 +328,8 @@ t:create_index('pk', {if_not_exists=true})
 
 t = box.schema.space.create('t5', {if_not_exists=true})
 t:create_index('pk', {if_not_exists=true, parts={1, 'str'}})
+
+-- See tnt_objects
+t = box.schema.space.create('t6', {if_not_exists=true, format={
+    {name='id', type='unsigned'}, {name='name', type='string'}}})
+t:create_index('pk', {if_not_exists=true})
@@ -0,0 +1,565 @@
+#!/usr/bin/env python
+# -_- encoding: utf8 -_-
+
+import os
+import sys
+import time
+import base64
+import threading
+import urllib2
+sys.path.append('./t')
+from http_utils import *
+
+print('[+] tnt_fanout')
+rows = [[1, 'a'], [3, 'c'], [5, 'e']]
+result = get_success(BASE_URL + '/fanout', None, {})
+assert(result == rows + rows), 'expected rows of both peers'
+
+result = get_success(BASE_URL + '/fanout_top', None, {})
+assert(result == [[5, 'e'], [5, 'e'], [3, 'c'], [3, 'c']]), \
+    'expected sorted and limited rows'
+
+(code, msg) = get(BASE_URL + '/fanout_error', None, {})
+assert(code == 200), 'expected 200'
+assert_if_not_error(msg)
+print('[+] OK')
+
+print('[+] tnt_vshard')
+def vshard_call(key):
+    return post_success(BASE_URL + '/vshard',
+        {'method': 'echo_1', 'params': [key], 'id': 1}, None)
+
+def vshard_wait_storage(key):
+    for i in range(0, 50):
+        result = vshard_call(key)
+        if result['via'] == 'storage':
+            break
+        time.sleep(0.1)
+    return result
+
+# The bucket map is refreshed by workers on start
+result = vshard_wait_storage('user-1')
+assert(result['via'] == 'storage'), 'expected the call on the storage'
+assert(result['mode'] == 'read'), 'expected the mode'
+assert(result['result'] == ['user-1']), 'expected result'
+bucket_id = post_success(BASE_URL + '/tnt',
+    {'method': 'vshard_bucket_id', 'params': ['user-1'], 'id': 1}, None)
+assert(result['bucket_id'] == bucket_id), 'expected bucket_id of vshard'
+result = vshard_call(12345)
+assert(result['bucket_id'] == post_success(BASE_URL + '/tnt',
+    {'method': 'vshard_bucket_id', 'params': [12345], 'id': 1}, None)), \
+    'expected bucket_id of a number'
+# WRONG_BUCKET, the call is retried through the router
+key = 'wrong-%d' % os.getpid()
+bucket_id = post_success(BASE_URL + '/tnt',
+    {'method': 'vshard_bucket_id', 'params': [key], 'id': 1}, None)
+post_success(BASE_URL + '/tnt',
+    {'method': 'vshard_set_wrong_bucket', 'params': [bucket_id, True],
+     'id': 1}, None)
+result = vshard_call(key)
+assert(result['via'] == 'router'), 'expected the call on the router'
+assert(result['bucket_id'] == bucket_id), 'expected the same bucket_id'
+assert(result['result'] == [key]), 'expected result'
+post_success(BASE_URL + '/tnt',
+    {'method': 'vshard_set_wrong_bucket', 'params': [bucket_id, False],
+     'id': 1}, None)
+# The map is refreshed after WRONG_BUCKET
+result = vshard_wait_storage(key)
+assert(result['via'] == 'storage'), 'expected the call on the storage'
+print('[+] OK')
+
+# The params are the same for all requests or a function of the id
+def concurrent_posts(url, n, method, params):
+    replies = [None] * n
+    def run(i):
+        p = params(i) if callable(params) else params
+        replies[i] = post_raw(url,
+            json.dumps({'method': method, 'params': p, 'id': i}),
+            'application/json')
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(n)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return replies
+
+print('[+] tnt_multiplex')
+for i in range(1, 10):
+    (code, msg) = post(BASE_URL + '/mux',
+        {'method': 'echo_1', 'params': [i, 'a'], 'id': i}, None)
+    assert(code == 200), 'expected 200'
+    assert(msg['id'] == i), 'expected the id of the client'
+    assert(get_result(msg) == [i]), 'expected result'
+# The requests share the connections and the later ones are replied first
+replies = concurrent_posts(BASE_URL + '/mux', 8, 'sleep_echo',
+    lambda i: [(8 - i) * 0.05, i])
+for i in range(0, 8):
+    (code, msg) = replies[i]
+    assert(code == 200), 'expected 200'
+    assert(msg['id'] == i), 'expected the id of the client'
+    assert(get_result(msg) == [i]), 'expected result of the client'
+print('[+] OK')
+
+print('[+] tnt_prewarm')
+# The connections are opened on start, before the first request
+start = time.time()
+count = post_success(BASE_URL + '/tnt',
+    {'method': 'sessions_count', 'params': [], 'id': 1}, None)
+assert(count >= 2 + 1), 'expected the pre-warmed sessions'
+session = post_success(BASE_URL + '/prewarm',
+    {'method': 'session_id', 'params': [], 'id': 1}, None)
+connected = post_success(BASE_URL + '/tnt',
+    {'method': 'session_connected', 'params': [session], 'id': 1}, None)
+assert(connected is not None and connected < start), \
+    'expected the first request on a pre-warmed session'
+for i in range(1, 10):
+    (code, msg) = post(BASE_URL + '/prewarm',
+        {'method': 'echo_1', 'params': [i], 'id': i}, None)
+    assert(code == 200), 'expected 200'
+    assert(get_result(msg) == [i]), 'expected result'
+# Used connections are taken from the keepalive cache, so Tarantool
+# doesn't accept a new connection per request
+sessions = set()
+for i in range(0, 30):
+    sessions.add(post_success(BASE_URL + '/prewarm',
+        {'method': 'session_id', 'params': [], 'id': i}, None))
+assert(len(sessions) <= 10), 'expected cached connections'
+print('[+] OK')
+
+print('[+] tnt_concurrency')
+def count_accepted(replies):
+    accepted = 0
+    for (code, msg) in replies:
+        if code == 200:
+            accepted += 1
+            continue
+        assert(code == 503), 'expected 503'
+        assert(msg['error']['code'] == 503), 'expected JSON-RPC error'
+    return accepted
+
+for i in range(1, 10):
+    (code, msg) = post(BASE_URL + '/limited',
+        {'method': 'echo_1', 'params': [i], 'id': i}, None)
+    assert(code == 200), 'expected 200'
+    assert(get_result(msg) == [i]), 'expected result'
+# The excess requests wait for a slot
+for (code, msg) in concurrent_posts(BASE_URL + '/limited', 12, 'sleep_echo',
+                                    [0.1, 1]):
+    assert(code == 200), 'expected queued requests to succeed'
+    assert(get_result(msg) == [1]), 'expected result'
+# There is no queue, the excess requests are rejected
+for i in range(0, 5):
+    post_success(BASE_URL + '/limited_aimd',
+        {'method': 'sleep_echo', 'params': [0.02, i], 'id': i}, None)
+accepted = count_accepted(concurrent_posts(BASE_URL + '/limited_aimd', 16,
+                                           'sleep_echo', [0.3, 1]))
+assert(accepted <= 8), 'expected at most max requests'
+assert(accepted > 0), 'expected accepted requests'
+# Slow replies decrease the limit
+accepted = count_accepted(concurrent_posts(BASE_URL + '/limited_aimd', 8,
+                                           'sleep_echo', [0.3, 1]))
+assert(accepted < 8), 'expected the limit to be decreased'
+# Fast replies increase it back to max while it's used
+for i in range(0, 200):
+    accepted = count_accepted(concurrent_posts(BASE_URL + '/limited_aimd', 8,
+                                               'sleep_echo', [0.02, 1]))
+    if accepted == 8:
+        break
+assert(accepted == 8), 'expected the limit to be increased'
+print('[+] OK')
+
+print('[+] IN-list select')
+for i in [21, 22, 23]:
+    post_form_success(BASE_URL + '/insert_post', {'id': i}, None)
+(code, msg) = get(BASE_URL + '/in_list', [{'id': '23,21,99'}, {'id': 22}],
+    None)
+assert(code == 200), 'expected 200'
+assert([t[0] for t in msg['result']] == [23, 21, 22]), \
+    'expected tuples in the order of keys'
+result = get_success(BASE_URL + '/in_list', {'id': 21}, None)
+assert([t[0] for t in result] == [21]), 'expected one tuple'
+print('[+] OK')
+
+print('[+] Keyset pagination')
+(code, msg) = get(BASE_URL + '/select_page', {'id': 21}, None)
+assert(code == 200), 'expected 200'
+assert([t[0] for t in msg['result']] == [21, 22]), 'expected the first page'
+# Tarantool < 2.11 doesn't return the position
+if 'cursor' in msg:
+    (code, msg) = get(BASE_URL + '/select_page',
+        {'id': 21, 'after': msg['cursor']}, None)
+    assert(code == 200), 'expected 200'
+    assert(msg['result'][0][0] == 23), 'expected the next page'
+(code, msg) = get(BASE_URL + '/select_page', {'id': 21, 'after': '!'}, None)
+assert(code == 400), 'expected 400'
+print('[+] OK')
+
+print('[+] Typed format')
+result = post_form_success(BASE_URL + '/insert_typed',
+    {'id': 31, 'note': 'null', 'tags': 'a,b'}, None)
+assert(result['result'] == [[31, None, ['a', 'b']]]), 'expected typed tuple'
+(code, msg) = post_form(BASE_URL + '/insert_typed',
+    {'id': -1, 'note': 'x', 'tags': ''}, None)
+assert(code == 400), 'expected 400'
+post_form_success(BASE_URL + '/insert_514', {'a': 41, 'b': 'x'}, None)
+result = get_success(BASE_URL + '/select_composite', {'a': 41, 'b': 'x'},
+    None)
+assert(result == [[41, 'x']]), 'expected tuple by composite key'
+print('[+] OK')
+
+print('[+] JSON body')
+(code, msg) = post(BASE_URL + '/insert_typed',
+    {'id': 32, 'note': None, 'tags': ['a', 'b']}, None)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == [[32, None, ['a', 'b']]]), 'expected typed tuple'
+(code, msg) = post(BASE_URL + '/insert_typed', [33, 'x', []], None)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == [[33, 'x', []]]), 'expected tuple by positions'
+(code, msg) = post(BASE_URL + '/insert_typed',
+    {'id': 'x', 'note': None, 'tags': []}, None)
+assert(code == 400), 'expected 400'
+(code, msg) = post(BASE_URL + '/insert_typed', 1, None)
+assert(code == 400), 'expected 400'
+print('[+] OK')
+
+print('[+] Bulk NDJSON')
+ndjson = 'application/x-ndjson'
+(code, msg) = post_raw(BASE_URL + '/bulk_insert',
+    '{"id": 51, "note": null, "tags": []}\n[52, "x", ["a"]]\n', ndjson)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == [{'rows': 2, 'ok': 2, 'errors': []}]), \
+    'expected two rows'
+(code, msg) = post_raw(BASE_URL + '/bulk_insert',
+    '{"id": 52}\n{"id": 53}\n', ndjson)
+assert(code == 200), 'expected 200'
+summary = msg['result'][0]
+assert(summary['rows'] == 2 and summary['ok'] == 1), 'expected one row'
+assert(summary['errors'][0]['row'] == 1), 'expected the duplicate row'
+result = get_success(BASE_URL + '/in_list', {'id': '51,52,53'}, None)
+assert([t[0] for t in result] == [51, 52, 53]), 'expected bulk rows'
+(code, msg) = post_raw(BASE_URL + '/bulk_insert', '[1]\n[2]\n[3]\n[4]\n',
+    ndjson)
+assert(code == 400), 'expected 400'
+(code, msg) = post_raw(BASE_URL + '/in_list', '[1]\n', ndjson)
+assert(code == 405), 'expected 405'
+print('[+] OK')
+
+print('[+] tnt_export')
+result = get_success(BASE_URL + '/in_list', {'id': '51,52,53'}, None)
+(code, out, ctype) = get_text(BASE_URL + '/export')
+assert(code == 200), 'expected 200'
+assert(ctype == 'application/x-ndjson'), 'expected NDJSON'
+rows = [json.loads(line) for line in out.split('\n') if line]
+ids = [t[0] for t in rows]
+assert(ids == sorted(ids)), 'expected rows in the index order'
+# Tarantool < 2.11 doesn't return the position, i.e. it's one page
+if len(ids) > 2:
+    for t in result:
+        assert(t in rows), 'expected all rows'
+(code, out, ctype) = get_text(BASE_URL + '/export_json?id=51')
+assert(code == 200), 'expected 200'
+assert(ctype == 'application/json'), 'expected JSON'
+rows = json.loads(out)
+assert(rows[0] == result[0]), 'expected rows from id 51'
+if len(rows) > 2:
+    assert(rows[:3] == result), 'expected rows of all pages'
+(code, out, ctype) = get_text(BASE_URL + '/export_json?id=x')
+assert(code == 400), 'expected 400'
+print('[+] OK')
+
+print('[+] tnt_schema')
+result = get_success(BASE_URL + '/in_list', {'id': '51'}, None)
+# The schema is selected by workers on start
+for i in range(0, 20):
+    (code, msg) = get(BASE_URL + '/select_by_name', {'id': 51}, None)
+    if code != 503:
+        break
+    time.sleep(0.1)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == result), 'expected the tuple by names'
+(code, msg) = get(BASE_URL + '/select_unknown_name', {'id': 51}, None)
+assert(code == 503), 'expected 503'
+print('[+] OK')
+
+print('[+] tnt_objects')
+(code, msg) = post_form(BASE_URL + '/insert_objects', {'id': 1, 'name': 'a'},
+    None)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == [{'id': 1, 'name': 'a'}]), 'expected an object'
+post_form_success(BASE_URL + '/insert_objects', {'id': 2, 'name': 'b'}, None)
+result = get_success(BASE_URL + '/select_objects', {'id': 1}, None)
+assert(result == [{'name': 'a', 'id': 1, 'missing': None},
+                  {'name': 'b', 'id': 2, 'missing': None}]), \
+    'expected the projection'
+print('[+] OK')
+
+print('[+] tnt_transaction')
+ops = [{'op': 'insert', 'space': 't6', 'tuple': [10, 'x']},
+       {'op': 'update', 'space': 't6', 'index': 'pk', 'key': [10],
+        'ops': [['=', 1, 'y']]},
+       {'op': 'select', 'space': 't6', 'key': [10]}]
+# IPROTO_ID is sent by workers on start
+for i in range(0, 20):
+    (code, msg) = post_raw(BASE_URL + '/tx', json.dumps(ops),
+        'application/json')
+    if code != 503 or 'negotiated' not in msg['error']['message']:
+        break
+    time.sleep(0.1)
+# Tarantool < 2.10 doesn't support streams
+if code == 503:
+    print('[-] streams are not supported, skipped')
+else:
+    assert(code == 200), 'expected 200'
+    assert(msg['result'] == [[[10, 'x']], [[10, 'y']], [[10, 'y']]]), \
+        'expected results of all operations'
+    ops = [{'op': 'insert', 'space': 't6', 'tuple': [11, 'z']},
+           {'op': 'insert', 'space': 't6', 'tuple': [10, 'dup']}]
+    (code, msg) = post_raw(BASE_URL + '/tx', json.dumps(ops),
+        'application/json')
+    assert('operation #2' in msg['error']['message']), \
+        'expected the failed operation'
+    result = get_success(BASE_URL + '/select_objects', {'id': 10}, None)
+    assert([t['id'] for t in result] == [10]), 'expected the rollback'
+    (code, msg) = post_raw(BASE_URL + '/tx', '{"op": "insert"}',
+        'application/json')
+    assert(code == 400), 'expected 400'
+print('[+] OK')
+
+print('[+] tnt_pass_http_request_headers')
+headers_in = {'my-header': '1', 'My-Second-Header': '2'}
+result = get_success(BASE_URL + '/pass_headers', {'a': 1}, headers_in)
+assert(result[0]['headers'] == {'My-Header': '1'}), \
+    'expected only the listed headers'
+result = post_success(BASE_URL + '/pass_headers', {'params': [], 'id': 1},
+    headers_in)
+assert(result[0]['headers'] == {'My-Header': '1'}), \
+    'expected only the listed headers'
+print('[+] OK')
+
+print('[+] Unescape of long args')
+query = ('a=' + 'x' * 20 + '%41%62+c%zz' + 'y' * 15 + '%' +
+         '&b=' + 'clean' * 10 + '&c=%7C')
+result = get_success(BASE_URL + '/unescape?' + query, None, {})
+args = result[0]['args']
+assert(args['a'] == 'x' * 20 + 'Ab c%zz' + 'y' * 15 + '%'), 'expected a'
+assert(args['b'] == 'clean' * 10), 'expected b'
+assert(args['c'] == '|'), 'expected c'
+# DML without a query string, there are no args to unescape
+(code, msg) = post(BASE_URL + '/insert_typed',
+    {'id': 34, 'note': None, 'tags': []}, None)
+assert(code == 200), 'expected 200'
+assert(msg['result'] == [[34, None, []]]), 'expected typed tuple'
+(code, out, ctype) = get_text(BASE_URL + '/export')
+assert(code == 200), 'expected 200'
+print('[+] OK')
+
+print('[+] tnt_stats, tnt_status')
+for i in range(0, 3):
+    post_success(BASE_URL + '/stats/echo_2', {'params': [i], 'id': 1})
+(code, msg) = post_raw(BASE_URL + '/stats/echo_2', '{"params": [',
+    'application/json')
+assert(code == 400), 'expected 400'
+# A request is counted after its response
+for i in range(0, 10):
+    (code, msg, content_type) = get_text(BASE_URL + '/tnt_status')
+    assert(code == 200), 'expected 200'
+    stats = json.loads(msg)
+    location = stats['locations']['/stats/echo_2']
+    if location['requests'] == 4:
+        break
+    time.sleep(0.1)
+assert(content_type == 'application/json'), 'expected json'
+assert(location['requests'] == 4), 'expected 4 requests'
+assert(location['responses']['2xx'] == 3), 'expected 3 replies'
+assert(location['errors']['-32700'] == 1), 'expected the parse error'
+# The parse error is replied by the upstream too
+assert(location['latency']['upstream']['count'] == 4), \
+    'expected upstream latency'
+# The latency is in usec, a local request is faster than 1 msec
+assert(location['latency']['upstream']['sum'] > 0), \
+    'expected upstream latency in usec'
+assert(location['latency']['transcode']['count'] == 4), \
+    'expected transcode latency'
+assert(stats['peers']['127.0.0.1:9999']['requests'] >= 4), \
+    'expected the peer'
+(code, msg, content_type) = get_text(BASE_URL + '/tnt_status?format=prometheus')
+assert(code == 200), 'expected 200'
+assert('tnt_location_requests_total{location="/stats/echo_2"} 4' in msg), \
+    'expected the requests'
+assert('phase="upstream",le="+Inf"} 4' in msg), 'expected the histogram'
+print('[+] OK')
+
+print('[+] $tnt_* variables')
+def post_body(url, body):
+    req = urllib2.Request(url, body, {'Content-Type': 'application/json'})
+    try:
+        res = urllib2.urlopen(req)
+        return (res.getcode(), res.read())
+    except urllib2.HTTPError as e:
+        return (e.code, e.read())
+
+# The variables are written to logs/tnt_vars.log, a line is found by args
+def logged_vars(args):
+    for i in range(0, 20):
+        with open('test-root/logs/tnt_vars.log') as f:
+            for line in f:
+                if line.startswith('args:' + args + ' '):
+                    return dict(v.split(':', 1) for v in line.split())
+        time.sleep(0.1)
+    assert(False), 'expected the logged line'
+
+run = 'run=%d-%d' % (os.getpid(), int(time.time() * 1000))
+(code, body) = post_body(BASE_URL + '/vars/echo_2?' + run + '-ok',
+    '{"params": [1], "id": 1}')
+assert(code == 200), 'expected 200'
+v = logged_vars(run + '-ok')
+assert(v['status'] == '200'), 'expected the status'
+assert(int(v['payload']) > 0), 'expected the payload size'
+assert(int(v['json']) == len(body)), 'expected the size of the reply'
+assert(v['batch'] == '1'), 'expected one reply'
+assert(v['sync'].isdigit()), 'expected the sync'
+assert(v['error'] == '-'), 'expected no error'
+assert(float(v['in']) >= 0 and float(v['out']) >= 0), \
+    'expected the transcode times'
+(code, body) = post_body(BASE_URL + '/vars/echo_2?' + run + '-batch',
+    '[{"params": [1], "id": 1}, {"params": [2], "id": 2}]')
+assert(code == 200), 'expected 200'
+v = logged_vars(run + '-batch')
+assert(v['batch'] == '2'), 'expected two replies'
+assert(int(v['json']) == len(body)), 'expected the size of the reply'
+(code, body) = post_body(BASE_URL + '/vars/echo_2?' + run + '-error',
+    '{"params": [')
+assert(code == 400), 'expected 400'
+v = logged_vars(run + '-error')
+assert(v['status'] == '400'), 'expected the status'
+assert(v['error'] == '-32700'), 'expected the error code'
+assert(int(v['json']) == len(body)), 'expected the size of the error'
+print('[+] OK')
+
+print('[+] tnt_slowlog')
+post_success(BASE_URL + '/slowlog/echo_2', {'params': ['slow'], 'id': 1})
+# A request is logged after its response
+for i in range(0, 10):
+    (code, msg, content_type) = get_text(BASE_URL + '/tnt_slowlog')
+    assert(code == 200), 'expected 200'
+    entries = json.loads(msg)['entries']
+    if len(entries) > 0:
+        break
+    time.sleep(0.1)
+assert(content_type == 'application/json'), 'expected json'
+assert(len(entries) == 1), 'expected an entry'
+entry = entries[0]
+assert(entry['uri'] == '/slowlog/echo_2'), 'expected the uri'
+assert(entry['tnt_method'] == 'echo_2'), 'expected the method'
+assert(entry['status'] == 200), 'expected 200'
+assert(entry['peer'] == '127.0.0.1:9999'), 'expected the peer'
+assert('"slow"' in entry['body']), 'expected the body'
+assert(entry['batch_size'] == 1), 'expected a reply'
+assert(entry['payload_size'] > 0 and entry['json_size'] > 0), \
+    'expected the sizes'
+# The reply is a MsgPack message, it starts with its size (0xce)
+assert(base64.b64decode(entry['reply'])[0:1] == b'\xce'), \
+    'expected the reply'
+print('[+] OK')
+
+print('[+] tnt_hot_keys')
+for i in range(0, 5):
+    post_success(BASE_URL + '/hot/echo_2', {'params': ['hot', i], 'id': 1})
+post_success(BASE_URL + '/hot/echo_2', {'params': [42], 'id': 1})
+# A request is counted after its response
+for i in range(0, 10):
+    (code, msg, content_type) = get_text(BASE_URL + '/tnt_status')
+    assert(code == 200), 'expected 200'
+    location = json.loads(msg)['locations']['/hot/echo_2']
+    if location['requests'] == 6:
+        break
+    time.sleep(0.1)
+hot_keys = location['hot_keys']
+assert(len(hot_keys) == 2), 'expected 2 keys'
+assert(hot_keys[0]['key'] == 'echo_2 hot'), 'expected the hottest key'
+assert(hot_keys[0]['count'] >= 5), 'expected the count'
+assert(hot_keys[1]['key'] == 'echo_2 42'), 'expected the number key'
+(code, msg, content_type) = get_text(BASE_URL + '/tnt_status?format=prometheus')
+assert('tnt_location_hot_key_requests{location="/hot/echo_2",' \
+    'key="echo_2 hot"}' in msg), 'expected the hot key'
+print('[+] OK')
+
+print('[+] tnt_max_reply_size, tnt_max_request_memory')
+result = post_success(BASE_URL + '/limits/echo_2', {'params': [1], 'id': 1})
+(code, msg) = post(BASE_URL + '/limits/echo_2',
+    {'params': ['x' * 1024], 'id': 2}, None)
+assert(code == 200), 'expected 200'
+assert(msg['id'] == 2), 'expected the id'
+assert(msg['error']['code'] == -32003), 'expected the reply limit'
+# The rest of the batch is replied
+(code, msg) = post(BASE_URL + '/limits/echo_2',
+    [{'params': ['x' * 1024], 'id': 3}, {'params': [1], 'id': 4}], None)
+assert(code == 200), 'expected 200'
+assert(msg[0]['error']['code'] == -32003), 'expected the reply limit'
+assert(msg[1]['id'] == 4 and 'result' in msg[1]), 'expected the result'
+(code, msg) = post_raw(BASE_URL + '/limits/echo_2',
+    json.dumps({'params': ['x' * 8192], 'id': 5}), 'application/json')
+assert(code == 400), 'expected 400'
+assert(msg['error']['code'] == -32001), 'expected the request limit'
+# The rows of a bulk are counted too, they aren't written
+(code, msg) = post_raw(BASE_URL + '/limits/bulk_replace',
+    ''.join('[%d, "%s", []]\n' % (i, 'x' * 20000) for i in [71, 72, 73]),
+    ndjson)
+assert(code == 400), 'expected 400'
+assert(msg['error']['code'] == -32001), 'expected the request limit'
+(code, msg) = get(BASE_URL + '/in_list', {'id': '71,72,73'}, None)
+assert(code == 200), 'expected 200'
+assert(msg['result'] in ([], [[]])), 'expected no rows'
+for i in range(0, 10):
+    (code, msg, content_type) = get_text(BASE_URL + '/tnt_status')
+    location = json.loads(msg)['locations']['/limits/echo_2']
+    if location['limited'] == 3:
+        break
+    time.sleep(0.1)
+assert(location['limited'] == 3), 'expected 3 limited requests'
+# The replies of a bulk or an IN-list are merged, the error replaces them
+(code, msg) = post_raw(BASE_URL + '/limits/bulk_replace',
+    '[61, "%s", []]\n[62, "x", []]\n' % ('x' * 1024), ndjson)
+assert(code == 200), 'expected 200'
+assert(msg['error']['code'] == -32003), 'expected the reply limit'
+(code, msg) = get(BASE_URL + '/limits/in_list', {'id': '21,61'}, None)
+assert(code == 200), 'expected 200'
+assert(msg['error']['code'] == -32003), 'expected the reply limit'
+result = get_success(BASE_URL + '/limits/in_list', {'id': '21,62'}, None)
+assert([t[0] for t in result] == [21, 62]), 'expected tuples of the rows'
+print('[+] OK')
+
+print('[+] tnt_limit')
+# A client of its own for each run, the rate is 1r/m
+client = '%d-%d' % (os.getpid(), int(time.time() * 1000))
+url = BASE_URL + '/limit?client=' + client
+post_success(url, {'method': 'rate_echo', 'params': [client, 1], 'id': 1})
+(code, msg) = post_raw(url,
+    json.dumps({'method': 'rate_echo', 'params': [client, 2], 'id': 2}),
+    'application/json')
+assert(code == 429), 'expected 429'
+assert(msg['error']['code'] == 429), 'expected the rate limit'
+# The limited request isn't sent to Tarantool
+result = post_success(url,
+    {'method': 'rate_count', 'params': [client], 'id': 3})
+assert(result == 1), 'expected one call in Tarantool'
+# A batch is rejected if one of its calls is limited, the buckets of the
+# other calls are untouched
+(code, msg) = post(url,
+    [{'method': 'rate_other', 'params': [client, 3], 'id': 3},
+     {'method': 'rate_echo', 'params': [client, 4], 'id': 4}], None)
+assert(code == 429), 'expected 429'
+result = post_success(url,
+    {'method': 'rate_count', 'params': [client], 'id': 5})
+assert(result == 1), 'expected one call in Tarantool'
+post_success(url, {'method': 'rate_other', 'params': [client, 5], 'id': 5})
+(code, msg) = post(url,
+    {'method': 'rate_other', 'params': [client, 6], 'id': 6}, None)
+assert(code == 429), 'expected 429'
+result = post_success(url,
+    {'method': 'rate_count', 'params': [client], 'id': 7})
+assert(result == 2), 'expected two calls in Tarantool'
+# The other methods aren't limited
+for i in range(0, 3):
+    post_success(url, {'method': 'echo_1', 'params': [i], 'id': 6})
+print('[+] OK')
@@ -65,7 +65,8 @@ enum tp_header_key_t {
 	TP_SERVER_ID = 0x02,
 	TP_LSN       = 0x03,
 	TP_TIMESTAMP = 0x04,
-	TP_SCHEMA_ID = 0x05
+	TP_SCHEMA_ID = 0x05,
+	TP_STREAM_ID = 0x0a
 };
 
 /* request body */
@@ -76,6 +77,7 @@ enum tp_body_key_t {
 	TP_OFFSET = 0x13,
 	TP_ITERATOR = 0x14,
 	TP_INDEX_BASE = 0x15,
+	TP_FETCH_POSITION = 0x1f,
 	TP_KEY = 0x20,
 	TP_TUPLE = 0x21,
 	TP_FUNCTION = 0x22,
@@ -84,13 +86,17 @@ enum tp_body_key_t {
 	TP_CLUSTER_UUID = 0x25,
 	TP_VCLOCK = 0x26,
 	TP_EXPRESSION = 0x27,
-	TP_OPS = 0x28
+	TP_OPS = 0x28,
+	TP_AFTER_POSITION = 0x2e,
+	TP_VERSION = 0x54,
+	TP_FEATURES = 0x55
 };
 
 /* response body */
 enum tp_response_key_t {
 	TP_DATA = 0x30,
-	TP_ERROR = 0x31
+	TP_ERROR = 0x31,
+	TP_POSITION = 0x35
 };
 
 /* request types */
@@ -104,6 +110,10 @@ enum tp_request_type {
 	TP_CALL = 10,
 	TP_AUTH = 7,
 	TP_EVAL = 8,
+	TP_BEGIN = 14,
+	TP_COMMIT = 15,
+	TP_ROLLBACK = 16,
+	TP_ID = 73,
 	TP_PING = 64,
 	TP_JOIN = 65,
 	TP_SUBSCRIBE = 66
@@ -205,6 +215,9 @@ struct tpresponse {
 	const char *error_end;         /* end of error message (NULL if not present) */
 	const char *data;              /* tuple data (NULL if not present) */
 	const char *data_end;          /* end if tuple data (NULL if not present) */
+	const char *position;          /* position of the last tuple (NULL if not present) */
+	const char *position_end;      /* end of the position (NULL if not present) */
+	uint64_t features;             /* bitmap of features of an ID response */
 	struct tp_array_itr tuple_itr; /* internal iterator over tuples */
 	struct tp_array_itr field_itr; /* internal iterator over tuple fields */
 };
@@ -327,6 +340,14 @@ static inline char *
 tp_select(struct tp *p, uint32_t space, uint32_t index,
 	  uint32_t offset, enum tp_iterator_type iterator, uint32_t limit);
 
+/**
+ * Append a select request with the position of the last tuple.
+ */
+static inline char *
+tp_select_after(struct tp *p, uint32_t space, uint32_t index,
+	  uint32_t offset, enum tp_iterator_type iterator, uint32_t limit,
+	  const char *after, uint32_t after_len);
+
 /**
  * Create an insert request.
  *
@@ -499,6 +520,12 @@ tp_sz(struct tp *p, const char *str);
 static inline char *
 tp_encode_nil(struct tp *p);
 
+/**
+ * Add an encoded msgpack value to the request as is.
+ */
+static inline char *
+tp_encode_raw(struct tp *p, const char *data, size_t size);
+
 /**
  * Add binary data to the request.
  */
@@ -1019,6 +1046,62 @@ tp_select(struct tp *p, uint32_t space, uint32_t index,
 	return tp_add(p, sz + hsz);
 }
 
+/**
+ * Append a select request, which asks for the position of the last
+ * tuple and starts after the given position (Tarantool 2.11+).
+ * The position is NULL for the first page.
+ *
+ * tp_select_after(&req, 0, 0, 0, TP_ITERATOR_GE, 100, pos, pos_len);
+ * tp_key(&req, 1);
+ * tp_sz(&req, "key");
+ */
+static inline char *
+tp_select_after(struct tp *p, uint32_t space, uint32_t index,
+	  uint32_t offset, enum tp_iterator_type iterator, uint32_t limit,
+	  const char *after, uint32_t after_len)
+{
+	int hsz = tpi_sizeof_header(TP_SELECT);
+	int  sz = mp_sizeof_map(8) +
+		mp_sizeof_uint(TP_SPACE) +
+		mp_sizeof_uint(space) +
+		mp_sizeof_uint(TP_INDEX) +
+		mp_sizeof_uint(index) +
+		mp_sizeof_uint(TP_OFFSET) +
+		mp_sizeof_uint(offset) +
+		mp_sizeof_uint(TP_LIMIT) +
+		mp_sizeof_uint(limit) +
+		mp_sizeof_uint(TP_ITERATOR) +
+		mp_sizeof_uint(iterator) +
+		mp_sizeof_uint(TP_FETCH_POSITION) +
+		mp_sizeof_bool(true) +
+		mp_sizeof_uint(TP_KEY);
+	if (after != NULL)
+		sz += mp_sizeof_uint(TP_AFTER_POSITION) +
+			mp_sizeof_str(after_len);
+	if (tpunlikely(tp_ensure(p, sz + hsz) == -1))
+		return NULL;
+	char *h = tpi_encode_header(p, TP_SELECT);
+	h = mp_encode_map(h, after != NULL ? 8 : 7);
+	h = mp_encode_uint(h, TP_SPACE);
+	h = mp_encode_uint(h, space);
+	h = mp_encode_uint(h, TP_INDEX);
+	h = mp_encode_uint(h, index);
+	h = mp_encode_uint(h, TP_OFFSET);
+	h = mp_encode_uint(h, offset);
+	h = mp_encode_uint(h, TP_LIMIT);
+	h = mp_encode_uint(h, limit);
+	h = mp_encode_uint(h, TP_ITERATOR);
+	h = mp_encode_uint(h, iterator);
+	h = mp_encode_uint(h, TP_FETCH_POSITION);
+	h = mp_encode_bool(h, true);
+	if (after != NULL) {
+		h = mp_encode_uint(h, TP_AFTER_POSITION);
+		h = mp_encode_str(h, after, after_len);
+	}
+	h = mp_encode_uint(h, TP_KEY);
+	return tp_add(p, sz + hsz);
+}
+
 /**
  * Internal
  * Function for encoding insert or replace request
@@ -1450,6 +1533,18 @@ tp_encode_nil(struct tp *p)
 	return tp_add(p, sz);
 }
 
+/**
+ * Add an encoded msgpack value to the request as is
+ */
+static inline char *
+tp_encode_raw(struct tp *p, const char *data, size_t size)
+{
+	if (tpunlikely(tp_ensure(p, size) == -1))
+		return NULL;
+	memcpy(p->p, data, size);
+	return tp_add(p, size);
+}
+
 /**
  * Add an uint value to the request
  */
@@ -1842,8 +1937,33 @@ tp_reply(struct tpresponse *r, const char * const buf, size_t size)
 			r->data_end = p;
 			break;
 		}
+		case TP_POSITION: {
+			if (mp_typeof(*p) != MP_STR)
+				return -1;
+			uint32_t plen = 0;
+			r->position = mp_decode_str(&p, &plen);
+			r->position_end = r->position + plen;
+			break;
 		}
-		r->bitmap |= (1ULL << key);
+		case TP_FEATURES: {
+			if (mp_typeof(*p) != MP_ARRAY)
+				return -1;
+			uint32_t fn = mp_decode_array(&p);
+			while (fn-- > 0) {
+				if (mp_typeof(*p) != MP_UINT)
+					return -1;
+				uint64_t f = mp_decode_uint(&p);
+				if (f < 64)
+					r->features |= (1ULL << f);
+			}
+			break;
+		}
+		default:
+			mp_next(&p);
+			break;
+		}
+		if (key < 64)
+			r->bitmap |= (1ULL << key);
 	}
 	if (r->data) {
 		if (tp_array_itr_init(&r->tuple_itr, r->data, r->data_end - r->data))